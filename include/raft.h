@@ -5,6 +5,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <sys/uio.h>
 
 /**
  * Error codes.
@@ -23,6 +24,10 @@ enum {
     RAFT_ERR_IO_BUSY,
     RAFT_ERR_NOT_LEADER,
     RAFT_ERR_SHUTDOWN,
+    RAFT_ERR_IO,
+    RAFT_ERR_CHECKSUM,
+    RAFT_ERR_LEADERSHIP_TRANSFER,
+    RAFT_ERR_CONFIGURATION_BUSY,
 };
 
 /**
@@ -38,7 +43,11 @@ enum {
     X(RAFT_ERR_MALFORMED, "encoded data is malformed")                    \
     X(RAFT_ERR_NO_SPACE, "no space left on device")                       \
     X(RAFT_ERR_BUSY, "an append entries request is already in progress")  \
-    X(RAFT_ERR_IO_BUSY, "a log write request is already in progress")
+    X(RAFT_ERR_IO_BUSY, "a log write request is already in progress")     \
+    X(RAFT_ERR_IO, "I/O error")                                           \
+    X(RAFT_ERR_CHECKSUM, "checksum mismatch")                             \
+    X(RAFT_ERR_LEADERSHIP_TRANSFER, "leadership transfer in progress")    \
+    X(RAFT_ERR_CONFIGURATION_BUSY, "a configuration change is in progress")
 
 /**
  * Return the error message describing the given error code.
@@ -47,6 +56,16 @@ const char *raft_strerror(int errnum);
 
 /**
  * User-definable dynamic memory allocation routines.
+ *
+ * The aligned_alloc routine is optional: if it's NULL, raft_aligned_alloc()
+ * over-allocates memory with malloc and aligns the returned address, which
+ * raft_free() will still release correctly. Such addresses are tracked in a
+ * global table, so with these heaps raft_free() looks up every address it's
+ * given, under a lock shared by all threads: heaps meant for busy servers
+ * should provide aligned_alloc.
+ *
+ * The current heap is global and not protected by any lock: it must only be
+ * changed when no raft instance is running.
  */
 struct raft_heap
 {
@@ -55,6 +74,7 @@ struct raft_heap
     void (*free)(void *data, void *ptr);
     void *(*calloc)(void *data, size_t nmemb, size_t size);
     void *(*realloc)(void *data, void *ptr, size_t size);
+    void *(*aligned_alloc)(void *data, size_t alignment, size_t size);
 };
 
 void *raft_malloc(size_t size);
@@ -62,6 +82,12 @@ void raft_free(void *ptr);
 void *raft_calloc(size_t nmemb, size_t size);
 void *raft_realloc(void *ptr, size_t size);
 
+/**
+ * Allocate @size bytes whose address is a multiple of @alignment, which must be
+ * a power of two. The memory must be released with raft_free().
+ */
+void *raft_aligned_alloc(size_t alignment, size_t size);
+
 /**
  * Use a custom dynamic memory allocator.
  */
@@ -89,6 +115,17 @@ typedef unsigned long long raft_term;
  */
 typedef unsigned long long raft_index;
 
+/**
+ * Hold a point in time, in milliseconds. Guaranteed to be at least 64-bit long.
+ */
+typedef unsigned long long raft_time;
+
+/**
+ * Hold the ID of an asynchronous I/O request. Guaranteed to be at least 64-bit
+ * long.
+ */
+typedef unsigned long long raft_request_id;
+
 /**
  * Hold contextual information about current raft's state. This information is
  * meant to be included in log and error messages.
@@ -147,6 +184,7 @@ struct raft_server
     unsigned id;         /* Server ID, must be greater than zero. */
     const char *address; /* Server address. User defined. */
     bool voting;         /* Whether this is a voting server. */
+    uint8_t priority;    /* Preference for leadership, higher wins. */
 };
 
 /**
@@ -156,6 +194,13 @@ struct raft_configuration
 {
     struct raft_server *servers; /* Array of servers member of the cluster. */
     unsigned n;                  /* Number of servers in the array. */
+
+    /* Lookup data maintained by the functions below, so servers must not be
+     * added, removed or have their voting flag changed directly. */
+    unsigned n_voting; /* Number of voting servers. */
+    unsigned *slots;   /* Hash table of server positions plus one, by ID,
+                          followed by the voting index of each server. */
+    unsigned n_slots;  /* Size of the hash table, a power of two. */
 };
 
 void raft_configuration_init(struct raft_configuration *c);
@@ -171,6 +216,22 @@ int raft_configuration_add(struct raft_configuration *c,
                            const char *address,
                            const bool voting);
 
+/**
+ * Set the leadership priority of the server with the given ID (default 0).
+ *
+ * Voting servers with a lower priority than the highest one in the
+ * configuration wait half an election timeout longer before starting an
+ * election, and a leader transfers leadership to any voting server with a
+ * higher priority than its own as soon as it has caught up with the committed
+ * entries (see raft_transfer_leadership()).
+ *
+ * Configurations using priorities can't be decoded by servers running older
+ * versions of this library.
+ */
+int raft_configuration_set_priority(struct raft_configuration *c,
+                                    unsigned id,
+                                    uint8_t priority);
+
 /**
  * Log entry types.
  */
@@ -198,8 +259,8 @@ enum { RAFT_LOG_COMMAND, RAFT_LOG_CONFIGURATION };
  * data within the batch.
  *
  * When the @batch attribute is not #NULL the raft library will take care of
- * releasing that memory only once there are no more references to the
- * associated entries.
+ * releasing that memory with raft_release_entries_batch() only once there are
+ * no more references to the associated entries.
  *
  * This arrangement makes it possible to perform "zero copy" I/O in most cases.
  */
@@ -211,6 +272,14 @@ struct raft_entry
     void *batch;            /* Batch that buf's memory points to, if any. */
 };
 
+/**
+ * Release the @batch shared by some entries, once none of them is in use
+ * anymore. Batches allocated with raft_malloc() or raft_aligned_alloc() are
+ * just passed to raft_free(), while the ones of entries loaded from disk may
+ * need more than that (see raft_io_file_load()).
+ */
+void raft_release_entries_batch(void *batch);
+
 /**
  * Counter for outstanding references to a log entry. When an entry is first
  * appended to the log, its refcount is set to one (the log itself is the only
@@ -253,6 +322,13 @@ struct raft_log
  * Hold the arguments of a RequestVote RPC (figure 3.1).
  *
  * The RequestVote RPC is invoked by candidates to gather votes (figure 3.1).
+ *
+ * If @pre_vote is true, this is a non-binding request from the Pre-Vote phase
+ * (§9.6): @term is the term the candidate would start an election with, and
+ * the receiver neither updates its term nor records its vote.
+ *
+ * If @disrupt_leader is true, the candidate was asked by the current leader to
+ * take over, so the request is processed even if the receiver has a leader.
  */
 struct raft_request_vote_args
 {
@@ -260,6 +336,8 @@ struct raft_request_vote_args
     unsigned candidate_id;     /* ID of the server requesting the vote. */
     raft_index last_log_index; /* Index of candidate's last log entry. */
     raft_index last_log_term;  /* Term of log entry at last_log_index. */
+    bool pre_vote;             /* True for a Pre-Vote request. */
+    bool disrupt_leader;       /* True if started by a TimeoutNow request. */
 };
 
 /**
@@ -269,6 +347,38 @@ struct raft_request_vote_result
 {
     raft_term term;    /* Receiver's current_term (candidate updates itself). */
     bool vote_granted; /* True means candidate received vote. */
+    bool pre_vote;     /* True if replying to a Pre-Vote request. */
+};
+
+/**
+ * Hold the arguments of a TimeoutNow RPC, sent by a leader transferring
+ * leadership to the receiver, which should start an election right away
+ * (§3.10).
+ */
+struct raft_timeout_now_args
+{
+    raft_term term;            /* Leader's term. */
+    unsigned leader_id;        /* ID of the leader. */
+    raft_index last_log_index; /* Index of leader's last log entry. */
+    raft_term last_log_term;   /* Term of log entry at last_log_index. */
+};
+
+/**
+ * Entries sent by the leader in AppendEntries RPCs, along with their encoded
+ * batch header.
+ *
+ * The batch header is encoded once and shared by all the requests sent to
+ * followers with the same next index in a replication round, so the entries
+ * data gets checksummed only once regardless of the number of followers.
+ */
+struct raft_append_entries_batch
+{
+    unsigned refs;              /* Number of in-flight requests using it. */
+    raft_index index;           /* Index of the first entry. */
+    struct raft_entry *entries; /* Entries acquired from the log. */
+    unsigned n;                 /* Number of entries. */
+    struct iovec *iov;          /* Batch header, then entries data. */
+    unsigned n_iov;             /* Number of elements in the iov array. */
 };
 
 /**
@@ -286,6 +396,12 @@ struct raft_append_entries_args
     raft_index leader_commit;   /* Leader's commit_index. */
     struct raft_entry *entries; /* Log entries to append. */
     unsigned n;                 /* Size of the log entries array. */
+    uint32_t checksum;          /* CRC32C of the entries data, when decoded. */
+    bool has_checksum;          /* False if decoded from an older server. */
+    size_t compressed;          /* Size of the compressed data, or 0. */
+
+    /* Entries with their batch header already encoded, if not NULL. */
+    const struct raft_append_entries_batch *batch;
 };
 
 /**
@@ -303,7 +419,7 @@ struct raft_append_entries_result
  */
 struct raft_io
 {
-    int version; /* API version implemented by this instance. Currently %1. */
+    int version; /* API version implemented by this instance. Currently %4. */
     void *data;  /* Custom user data. */
 
     /**
@@ -323,16 +439,18 @@ struct raft_io
     /**
      * Asynchronously append the given entries to the log.
      *
-     * At most one write log request can be in flight at any given time. The
-     * implementation must return @RAFT_ERR_IO_BUSY if a new request is
-     * submitted before the previous one is completed.
+     * An implementation that does not support more than one write log request
+     * in flight at any given time must return @RAFT_ERR_IO_BUSY if a new
+     * request is submitted before the previous one is completed. An
+     * implementation that does support it must notify completions in the same
+     * order the requests were submitted.
      *
      * The implementation is guaranteed that the memory holding the given
      * entries will not be released until a notification is fired by invoking
      * the raft_handle_io() callback with the given request ID.
      */
     int (*write_log)(struct raft_io *io,
-                     const unsigned request_id,
+                     const raft_request_id request_id,
                      const struct raft_entry entries[],
                      const unsigned n);
 
@@ -369,7 +487,7 @@ struct raft_io
      * request has been completed unsuccessfully.
      */
     int (*send_append_entries_request)(struct raft_io *io,
-                                       const unsigned request_id,
+                                       const raft_request_id request_id,
                                        const struct raft_server *server,
                                        const struct raft_append_entries_args *);
 
@@ -382,6 +500,40 @@ struct raft_io
         struct raft_io *io,
         const struct raft_server *server,
         const struct raft_append_entries_result *);
+
+    /**
+     * Synchronously persist both the current term and who we voted for in it,
+     * with a single durable write. Available since version %2: with older
+     * versions write_term() and write_vote() are invoked in a row instead.
+     */
+    int (*write_term_and_vote)(struct raft_io *io,
+                               const raft_term term,
+                               const unsigned server_id);
+
+    /**
+     * Asynchronously persist both the current term and who we voted for in it.
+     * Available since version %3: with older versions write_term_and_vote() is
+     * used instead, blocking the caller.
+     *
+     * Completion must be notified by invoking the raft_handle_io() callback
+     * with the given request ID, once the change is durable. Writes of the term
+     * and vote requested after this call, including synchronous ones, must
+     * take effect after it.
+     */
+    int (*write_metadata)(struct raft_io *io,
+                          const raft_request_id request_id,
+                          const raft_term term,
+                          const unsigned server_id);
+
+    /**
+     * Asynchronously invoke a TimeoutNow RPC on the given @server. Available
+     * since version %4: with older versions leadership can't be transferred.
+     * The implementation can ignore transport errors happening after this
+     * function has returned.
+     */
+    int (*send_timeout_now)(struct raft_io *io,
+                            const struct raft_server *server,
+                            const struct raft_timeout_now_args *args);
 };
 
 /**
@@ -393,7 +545,9 @@ enum {
     RAFT_IO_APPEND_ENTRIES,
     RAFT_IO_APPEND_ENTRIES_RESULT,
     RAFT_IO_REQUEST_VOTE,
-    RAFT_IO_REQUEST_VOTE_RESULT
+    RAFT_IO_REQUEST_VOTE_RESULT,
+    RAFT_IO_WRITE_METADATA,
+    RAFT_IO_TIMEOUT_NOW
 };
 
 /**
@@ -408,6 +562,14 @@ struct raft_io_request
     unsigned n;                 /* Length of the entries array. */
     unsigned leader_id;         /* Leader that generated this entry. */
     raft_index leader_commit;   /* Last known leader commit index. */
+    raft_term term;             /* Term being persisted, for metadata. */
+    unsigned voted_for;         /* Vote being persisted, for metadata. */
+
+    /* Batch holding the entries, shared with other requests, if not NULL. */
+    struct raft_append_entries_batch *batch;
+
+    raft_request_id generation; /* Times this request slot was released. */
+    unsigned next;              /* Next free slot, if this one is free. */
 };
 
 /**
@@ -436,6 +598,21 @@ enum {
  */
 #define RAFT_EVENT_N (RAFT_EVENT_STATE_CHANGE + 1)
 
+/**
+ * Round-trip time of the AppendEntries RPCs sent by a leader to a server.
+ *
+ * At most one request at a time is timed, and only if it carries entries past
+ * the ones of every request sent to the server before. A successful result
+ * covering its last entry can then only answer it or a later request.
+ */
+struct raft_rtt
+{
+    raft_index sent_index;  /* Highest last index of the requests sent */
+    raft_index probe_index; /* Last index of the timed request, or 0 if none */
+    raft_time probe_start;  /* When the timed request was sent */
+    unsigned rtt8;          /* Smoothed round-trip time scaled by 8, or 0 */
+};
+
 /**
  * Hold and drive the state of a single raft server in a cluster.
  */
@@ -470,6 +647,14 @@ struct raft
      */
     struct raft_configuration configuration;
 
+    /**
+     * Configuration in use before the last one taken from a configuration
+     * entry, and the index of that entry (0 if none). The previous
+     * configuration is used if that entry gets truncated.
+     */
+    struct raft_configuration configuration_prev;
+    raft_index configuration_index;
+
     /**
      * Election timeout in milliseconds (default 1000).
      *
@@ -504,6 +689,33 @@ struct raft
      */
     unsigned heartbeat_timeout;
 
+    /**
+     * Whether the data of the entries sent in AppendEntries RPCs gets
+     * compressed (default false). See raft_set_compression().
+     */
+    bool compression;
+
+    /**
+     * Whether elections are preceded by a Pre-Vote phase (default false). See
+     * raft_set_pre_vote().
+     */
+    bool pre_vote;
+
+    /**
+     * Whether a leader steps down when it doesn't hear from a majority of the
+     * cluster within an election timeout (default false). See
+     * raft_set_check_quorum().
+     */
+    bool check_quorum;
+
+    /**
+     * Bounds of the election timeout when it's adapted to the measured
+     * round-trip time of RPCs (both 0 if disabled, the default). See
+     * raft_set_adaptive_timeouts().
+     */
+    unsigned election_timeout_min;
+    unsigned election_timeout_max;
+
     /**
      * Logger to use to emit messages (default stdout);
      */
@@ -531,6 +743,7 @@ struct raft
              * which is specific to followers.
              */
             const struct raft_server *current_leader;
+            raft_time heartbeat; /* Last heartbeat of the leader, or 0 */
         } follower_state;
 
         struct
@@ -540,8 +753,17 @@ struct raft
              * which is specific to leaders (Figure 3.1). This state is
              * reinitialized after the server gets elected.
              */
-            raft_index *next_index;  /* For each server, next entry to send */
-            raft_index *match_index; /* For each server, highest applied idx */
+            raft_index *next_index;   /* For each server, next entry to send */
+            raft_index *match_index;  /* For each server, highest applied idx */
+            raft_time *last_contact;  /* For each server, last result time */
+            struct raft_rtt *rtt;     /* For each server, round-trip time */
+            unsigned transferee;      /* Leadership transfer target, or 0 */
+            raft_time transfer_start; /* When the last transfer began/ended */
+            bool timeout_now_sent;    /* TimeoutNow sent to the transferee */
+            unsigned promotee;        /* Learner being promoted, or 0 */
+            unsigned round_number;    /* Current catch-up round, from 1 */
+            raft_index round_index;   /* Last log index when round began */
+            raft_time round_start;    /* When the current round began */
         } leader_state;
 
         struct
@@ -551,7 +773,9 @@ struct raft
              * which is specific to candidates. This state is reinitialized
              * after the server starts a new election round.
              */
-            bool *votes; /* For each server, whether vote was granted */
+            bool *votes;         /* For each server, whether vote granted */
+            bool in_pre_vote;    /* Whether this is the Pre-Vote phase */
+            bool disrupt_leader; /* Whether a leader asked us to take over */
         } candidate_state;
     };
 
@@ -579,6 +803,12 @@ struct raft
      */
     unsigned timer;
 
+    /**
+     * Time elapsed since the raft instance was initialized, in milliseconds,
+     * as advanced by raft_tick().
+     */
+    raft_time now;
+
     /**
      * Registered watchers.
      */
@@ -597,6 +827,7 @@ struct raft
     {
         struct raft_io_request *requests;
         unsigned size;
+        unsigned free; /* First free request slot, or size if none. */
     } io_queue;
 };
 
@@ -639,6 +870,82 @@ void raft_set_rand(struct raft *r, int (*rand)());
 void raft_set_election_timeout_(struct raft *r,
                                 const unsigned election_timeout);
 
+/**
+ * Enable or disable the compression of the entries data sent to followers.
+ *
+ * The data of a batch of entries is compressed once by the leader and shared by
+ * all the AppendEntries requests carrying it, saving network bandwidth when
+ * commands are compressible (e.g. text formats). Small batches, and batches
+ * which don't shrink, are sent uncompressed.
+ *
+ * Compression only applies to the network. Receivers inflate the data as soon
+ * as a request is received: raft_decoder_feed() does it on its own, other
+ * transports must call raft_inflate_entries_batch(). Followers then append,
+ * persist and apply plain entries, like the leader does. The write_log method
+ * of raft_io, including the one of raft_io_file_init(), never sees compressed
+ * data, so disk usage doesn't shrink.
+ */
+void raft_set_compression(struct raft *r, bool enabled);
+
+/**
+ * Enable or disable the Pre-Vote phase of elections.
+ *
+ * From Section §9.6:
+ *
+ *   In the Pre-Vote algorithm, a candidate only increments its term if it first
+ *   learns from a majority of the cluster that they would be willing to grant
+ *   the candidate their votes (if the candidate's log is sufficiently
+ *   up-to-date, and the voters have not received heartbeats from a valid
+ *   leader for at least a baseline election timeout).
+ *
+ * This way a server rejoining the cluster after a network partition doesn't
+ * disrupt the current leader by forcing it to step down. Since servers running
+ * older versions of this library would take Pre-Vote requests for regular
+ * ones, it should be enabled only once all servers have been upgraded.
+ */
+void raft_set_pre_vote(struct raft *r, bool enabled);
+
+/**
+ * Enable or disable the CheckQuorum check of leaders.
+ *
+ * From Section §6.2:
+ *
+ *   A leader in Raft steps down if an election timeout elapses without a
+ *   successful round of heartbeats to a majority of its cluster; this allows
+ *   clients to retry their requests with another server.
+ *
+ * A leader cut off from the majority of the cluster thus stops accepting new
+ * entries with raft_accept() after at most an election timeout.
+ */
+void raft_set_check_quorum(struct raft *r, bool enabled);
+
+/**
+ * Adapt the election and heartbeat timeouts to the round-trip time of RPCs,
+ * keeping the election timeout between @min_election_timeout and
+ * @max_election_timeout milliseconds. When enabled, the current election
+ * timeout is immediately clamped into those bounds. Passing 0 for both disables
+ * adaptation, leaving the timeouts at their current values.
+ *
+ * Leaders time the AppendEntries requests sent to each server and keep a
+ * smoothed round-trip time per server (see struct raft_rtt). The election
+ * timeout is set to 10 times the largest one among voting servers, that is 20
+ * times the one-way latency, and the heartbeat timeout to a tenth of it.
+ *
+ * From Chapter 9:
+ *
+ *   We recommend a range that is 10–20 times the one-way network latency, which
+ *   keeps split votes rates under 40% in all cases for reasonably sized
+ *   clusters, and typically results in much lower rates.
+ *
+ * Followers can't time round trips, so they follow the leader instead: the
+ * interval between two heartbeats with no entries sent in between is the
+ * leader's heartbeat timeout, and their election timeout is set to 10 times
+ * it. The bounds should be the same across the cluster.
+ */
+void raft_set_adaptive_timeouts(struct raft *r,
+                                unsigned min_election_timeout,
+                                unsigned max_election_timeout);
+
 /**
  * Human readable version of the current state.
  */
@@ -671,6 +978,68 @@ int raft_accept(struct raft *r,
                 const struct raft_buffer bufs[],
                 const unsigned n);
 
+/**
+ * Transfer leadership to the voting server with the given ID.
+ *
+ * From Section §3.10:
+ *
+ *   1. The prior leader stops accepting client requests.
+ *
+ *   2. The prior leader fully updates the target server's log to match its
+ *      own, using the normal log replication mechanism.
+ *
+ *   3. The prior leader sends a TimeoutNow request to the target server. This
+ *      request has the same effect as the target server's election timer
+ *      firing: the target server starts a new election (incrementing its term
+ *      and becoming a candidate).
+ *
+ * Until the transfer completes raft_accept() returns
+ * #RAFT_ERR_LEADERSHIP_TRANSFER. If the target server doesn't take over within
+ * an election timeout, the transfer is aborted and client requests are
+ * accepted again.
+ */
+int raft_transfer_leadership(struct raft *r, unsigned id);
+
+/**
+ * Add a non-voting server (learner) with the given ID and address to the
+ * cluster.
+ *
+ * The leader appends a configuration entry including the new server and starts
+ * replicating its log to it right away, without waiting for the entry to be
+ * committed. Learners don't count towards majorities, so they can't stall
+ * commits no matter how far behind they are.
+ *
+ * Only one configuration change can be in progress at any given time: until
+ * the entry of the previous one is committed, or while a promotion is in
+ * progress, this returns #RAFT_ERR_CONFIGURATION_BUSY.
+ */
+int raft_add_learner(struct raft *r, unsigned id, const char *address);
+
+/**
+ * Turn the learner with the given ID into a voting server, once it has caught
+ * up with the leader.
+ *
+ * From Section §4.2.1:
+ *
+ *   The replication of entries to the new server is split into rounds. Each
+ *   round replicates all the log entries present in the leader's log at the
+ *   start of the round to the new server's log.
+ *
+ * The configuration entry promoting the learner is appended as soon as a round
+ * lasts less than an election timeout. The promotion is aborted if that
+ * doesn't happen within 10 rounds, or if the learner doesn't reply for an
+ * election timeout, in which case it stays a learner.
+ */
+int raft_promote(struct raft *r, unsigned id);
+
+/**
+ * Remove the server with the given ID from the cluster.
+ *
+ * The leader can't remove itself: transfer leadership to another server first
+ * (see raft_transfer_leadership()).
+ */
+int raft_remove(struct raft *r, unsigned id);
+
 /**
  * Register a callback to be fired upon the given event.
  *
@@ -692,9 +1061,23 @@ void raft_watch(struct raft *r, int event, void (*cb)(void *, int));
  * set to zero if the write was successful, or non-zero otherwise.
  */
 void raft_handle_io(struct raft *r,
-                    const unsigned request_id,
+                    const raft_request_id request_id,
                     const int status);
 
+/**
+ * Process the results of @n asynchronous I/O requests at once, as if
+ * raft_handle_io() was called for each of them in order, typically after
+ * harvesting all the completions available upon an event loop wakeup.
+ *
+ * Writes to our own log completed while being leader are accounted for with a
+ * single commit index update, and writes completed while being follower are
+ * acknowledged to the leader with a single AppendEntries result.
+ */
+void raft_handle_io_batch(struct raft *r,
+                          const raft_request_id request_ids[],
+                          const int statuses[],
+                          unsigned n);
+
 /**
  * Process a RequestVote RPC from the given server.
  *
@@ -716,11 +1099,26 @@ int raft_handle_request_vote_response(
     const struct raft_server *server,
     const struct raft_request_vote_result *result);
 
+/**
+ * Process a TimeoutNow RPC from the given server.
+ *
+ * This function must be invoked whenever the user's transport implementation
+ * receives a TimeoutNow RPC request from another server.
+ */
+int raft_handle_timeout_now(struct raft *r,
+                            const struct raft_server *server,
+                            const struct raft_timeout_now_args *args);
+
 /**
  * Process an AppendEntries RPC from the given server.
  *
  * This function must be invoked whenever the user's transport implementation
  * receives an AppendEntries RPC request from another server.
+ *
+ * Ownership of the entries array and of the batch memory of its entries passes
+ * to the raft instance. The array may live at the start of the batch memory
+ * itself (i.e. its address is the batch pointer of the entries), in which case
+ * it's released along with the batch.
  */
 int raft_handle_append_entries(struct raft *r,
                                const struct raft_server *server,
@@ -737,6 +1135,85 @@ int raft_handle_append_entries_response(
     const struct raft_server *server,
     const struct raft_append_entries_result *result);
 
+/**
+ * Flags for raft_io_file_init().
+ */
+enum {
+    /* Never use io_uring, always perform disk writes using worker threads. */
+    RAFT_IO_FILE_THREADS = 1 << 0,
+
+    /* Write log entries with O_DIRECT, bypassing the page cache. Batches are
+     * stored on disk with the RAFT_BATCH_ALIGNED layout. Entries whose @batch
+     * is aligned to RAFT_BATCH_ALIGNMENT and that fill it from its beginning
+     * are written straight from the batch memory, without copying them: such
+     * batches must have been allocated with at least the size returned by
+     * raft_entries_batch_size() with the RAFT_BATCH_ALIGNED flag. */
+    RAFT_IO_FILE_DIRECT = 1 << 1
+};
+
+/**
+ * Initialize a raft_io instance that persists the term, the vote and the log
+ * entries as files in the given @dir, and that forwards all network requests to
+ * the given @transport.
+ *
+ * The log is stored as a sequence of segment files, each holding a sequence of
+ * entry batches encoded in the same format used by AppendEntries RPCs (see
+ * raft_decode_entries_batch()).
+ *
+ * Log writes are submitted via io_uring, with the write and the fdatasync()
+ * being linked so the kernel executes them back-to-back without a round trip
+ * to user space. If io_uring is not available on the running kernel (or the
+ * RAFT_IO_FILE_THREADS flag is given), writes are performed by a small pool of
+ * worker threads instead. More than one write log request can be in flight at
+ * any given time.
+ *
+ * Completed writes are signaled via the file descriptor returned by
+ * raft_io_file_fd(), which should be watched for readability by the event
+ * loop, and must be processed by calling raft_io_file_poll().
+ */
+int raft_io_file_init(struct raft_io *io,
+                      struct raft_io *transport,
+                      const char *dir,
+                      int flags);
+
+/**
+ * Release all resources used by a raft_io instance initialized with
+ * raft_io_file_init(), waiting for any in-flight write to complete.
+ */
+void raft_io_file_close(struct raft_io *io);
+
+/**
+ * Return a file descriptor that becomes readable when there are completed log
+ * writes to process.
+ */
+int raft_io_file_fd(struct raft_io *io);
+
+/**
+ * Process all completed log writes, notifying the given raft instance of all
+ * the ones ready in submission order with a single raft_handle_io_batch() call.
+ */
+void raft_io_file_poll(struct raft_io *io, struct raft *r);
+
+/**
+ * Load the persisted term, vote and log entries.
+ *
+ * The returned @entries array is allocated with raft_malloc() and must be
+ * released by the caller, while the memory holding entry data is referenced by
+ * the @batch attribute of each entry, so entries can be appended to the log
+ * without copying them.
+ *
+ * Closed segments are mapped in memory and decoded in parallel. The data of
+ * their entries points into read-only mappings, and their @batch refers to a
+ * small descriptor of the mapping of their segment: it must be released with
+ * raft_release_entries_batch(), which also unmaps the segment, rather than
+ * with raft_free().
+ */
+int raft_io_file_load(struct raft_io *io,
+                      raft_term *term,
+                      unsigned *voted_for,
+                      struct raft_entry *entries[],
+                      size_t *n);
+
 /**
  * Encode a raft configuration object. The memory of the returned buffer is
  * allocated using raft_malloc(), and client code is responsible for releasing
@@ -752,19 +1229,64 @@ int raft_encode_configuration(const struct raft_configuration *c,
 int raft_decode_configuration(const struct raft_buffer *buf,
                               struct raft_configuration *c);
 
+/**
+ * Encode the header of an AppendEntries request, including the header of its
+ * entries batch. The memory of the returned buffer is allocated with
+ * raft_malloc(), and client code is responsible for releasing it.
+ *
+ * The functions below encoding other messages follow the same conventions.
+ * Each of them comes with a variant that encodes into a buffer provided by
+ * client code, whose size must be at least the one returned by the relevant
+ * _size() function.
+ */
 int raft_encode_append_entries(const struct raft_append_entries_args *args,
                                struct raft_buffer *buf);
 
+size_t raft_encode_append_entries_size(
+    const struct raft_append_entries_args *args);
+
+void raft_encode_append_entries_to(const struct raft_append_entries_args *args,
+                                   void *buf);
+
+/**
+ * Return the number of elements of the iovec array that
+ * raft_encode_append_entries_iov() needs for the given request.
+ */
+unsigned raft_encode_append_entries_iov_count(
+    const struct raft_append_entries_args *args);
+
+/**
+ * Encode the header of the given AppendEntries request into @header, which must
+ * be at least raft_encode_append_entries_size() bytes long, and fill @iov with
+ * the buffers making up the whole message: the header followed by the data of
+ * each entry and its padding. The number of buffers filled is returned.
+ *
+ * No memory is allocated and no entry data is copied, so the message can be
+ * sent with a single writev() or sendmsg() call. The entries data must stay
+ * valid until then.
+ */
+unsigned raft_encode_append_entries_iov(
+    const struct raft_append_entries_args *args,
+    void *header,
+    struct iovec iov[]);
+
 int raft_decode_append_entries(const struct raft_buffer *buf,
                                struct raft_append_entries_args *args);
 
 /**
  * The layout of the memory pointed at by a @batch pointer is the following:
  *
- * [8 bytes] Number of entries in the batch, little endian.
+ * [4 bytes] Number of entries in the batch, little endian.
+ * [1 byte ] Batch format version, currently 1 (see below for version 0).
+ * [1 byte ] Flags, 1 if the payload data is compressed, 0 otherwise.
+ * [2 bytes] Currently unused.
  * [header1] Header data of the first entry of the batch.
  * [  ...  ] More headers
  * [headerN] Header data of the last entry of the batch.
+ * [4 bytes] Size of the compressed payload data, only if compressed.
+ * [4 bytes] Currently unused, only if compressed.
+ * [4 bytes] CRC32C checksum of the payload data, little endian.
+ * [4 bytes] CRC32C checksum of all the above, little endian.
  * [data1  ] Payload data of the first entry of the batch.
  * [  ...  ] More data
  * [dataN  ] Payload data of the last entry of the batch.
@@ -777,17 +1299,103 @@ int raft_decode_append_entries(const struct raft_buffer *buf,
  * [4 bytes] Size of the log entry data, little endian.
  *
  * A payload data section for an entry is simply a sequence of bytes of
- * arbitrary lengths, possibly padded with extra bytes to reach 8-byte boundary
+ * arbitrary lengths, possibly padded with zeros to reach 8-byte boundary
  * (which means that all entry data pointers are 8-byte aligned).
+ *
+ * A compressed payload data section holds the data sections of all entries,
+ * including their padding, compressed in a single block and padded with zeros
+ * to 8-byte boundary. The payload checksum covers the compressed form. Use
+ * raft_inflate_entries_batch() to turn it into the uncompressed form expected
+ * by raft_decode_entries_batch().
+ *
+ * Batches of format version 0, encoded by older versions of this library, have
+ * a 64-bit number of entries in place of the first 8 bytes, and no checksums:
+ * they are still decoded, with has_checksum set to false.
+ *
+ * The header checksum is verified by raft_decode_append_entries(), which
+ * returns RAFT_ERR_CHECKSUM on mismatch, while the payload data is not checked
+ * by raft_decode_entries_batch(): use raft_verify_entries_batch() for that.
  */
 int raft_decode_entries_batch(const struct raft_buffer *buf,
                               struct raft_entry *entries,
                               unsigned n);
 
+/**
+ * Check that the payload data section received along with an AppendEntries
+ * request decoded by raft_decode_append_entries() matches the checksum in its
+ * header, returning RAFT_ERR_CHECKSUM if it doesn't.
+ */
+int raft_verify_entries_batch(const struct raft_append_entries_args *args,
+                              const struct raft_buffer *buf);
+
+/**
+ * Decompress the payload data section received along with an AppendEntries
+ * request, if the @compressed field of @args is not zero.
+ *
+ * The memory of the decompressed data is allocated with raft_malloc() (or
+ * raft_aligned_alloc() if RAFT_BATCH_ALIGNED is given, see
+ * raft_entries_batch_size()), @buf is released and replaced with it, and the
+ * @compressed field of @args is reset. If an error is returned, @buf is left
+ * untouched.
+ *
+ * The payload data should be verified with raft_verify_entries_batch() first.
+ */
+int raft_inflate_entries_batch(struct raft_append_entries_args *args,
+                               struct raft_buffer *buf,
+                               int flags);
+
+/**
+ * Block size that batches laid out with RAFT_BATCH_ALIGNED are padded to. It
+ * matches the logical block size of common storage devices and the page size,
+ * which is what O_DIRECT requires for buffer addresses, sizes and offsets.
+ */
+#define RAFT_BATCH_ALIGNMENT 4096
+
+/**
+ * Flags for raft_entries_batch_size(), raft_encode_entries_batch() and
+ * raft_inflate_entries_batch().
+ */
+enum {
+    /* Pad the data section of the batch with zeros to a multiple of
+     * RAFT_BATCH_ALIGNMENT and allocate it at an aligned address. */
+    RAFT_BATCH_ALIGNED = 1 << 0
+};
+
+/**
+ * Return the size of the payload data section of a batch holding the given
+ * entries, as decoded by raft_decode_entries_batch().
+ *
+ * Receivers of AppendEntries RPCs that want disk backends to be able to write
+ * the payload data directly can pass the RAFT_BATCH_ALIGNED flag, and read the
+ * payload into a buffer of the returned size allocated with
+ * raft_aligned_alloc(RAFT_BATCH_ALIGNMENT, ...).
+ */
+size_t raft_entries_batch_size(const struct raft_entry entries[],
+                               unsigned n,
+                               int flags);
+
+/**
+ * Encode the payload data section of a batch holding the given entries. The
+ * memory of the returned buffer is allocated using raft_malloc() (or
+ * raft_aligned_alloc() if RAFT_BATCH_ALIGNED is given), and client code is
+ * responsible for releasing it with raft_free().
+ */
+int raft_encode_entries_batch(const struct raft_entry entries[],
+                              unsigned n,
+                              int flags,
+                              struct raft_buffer *buf);
+
 int raft_encode_append_entries_result(
     const struct raft_append_entries_result *result,
     struct raft_buffer *buf);
 
+size_t raft_encode_append_entries_result_size(
+    const struct raft_append_entries_result *result);
+
+void raft_encode_append_entries_result_to(
+    const struct raft_append_entries_result *result,
+    void *buf);
+
 int raft_decode_append_entries_result(
     const struct raft_buffer *buf,
     struct raft_append_entries_result *result);
@@ -795,6 +1403,11 @@ int raft_decode_append_entries_result(
 int raft_encode_request_vote(const struct raft_request_vote_args *args,
                              struct raft_buffer *buf);
 
+size_t raft_encode_request_vote_size(const struct raft_request_vote_args *args);
+
+void raft_encode_request_vote_to(const struct raft_request_vote_args *args,
+                                 void *buf);
+
 int raft_decode_request_vote(const struct raft_buffer *buf,
                              struct raft_request_vote_args *args);
 
@@ -802,7 +1415,275 @@ int raft_encode_request_vote_result(
     const struct raft_request_vote_result *result,
     struct raft_buffer *buf);
 
+size_t raft_encode_request_vote_result_size(
+    const struct raft_request_vote_result *result);
+
+void raft_encode_request_vote_result_to(
+    const struct raft_request_vote_result *result,
+    void *buf);
+
 int raft_decode_request_vote_result(const struct raft_buffer *buf,
                                     struct raft_request_vote_result *result);
 
+int raft_encode_timeout_now(const struct raft_timeout_now_args *args,
+                            struct raft_buffer *buf);
+
+size_t raft_encode_timeout_now_size(const struct raft_timeout_now_args *args);
+
+void raft_encode_timeout_now_to(const struct raft_timeout_now_args *args,
+                                void *buf);
+
+int raft_decode_timeout_now(const struct raft_buffer *buf,
+                            struct raft_timeout_now_args *args);
+
+/**
+ * Versions of the wire protocol, stored in the header of each message.
+ *
+ * Version 1 encodes all integers as fixed-size 8-byte fields and each entry
+ * header in the batch of an AppendEntries request as 16 bytes. Version 2 uses
+ * varints instead, and encodes entry terms as runs, so that a batch of small
+ * commands created in the same term takes a couple of bytes per entry. The
+ * payload data section of AppendEntries requests is the same in both versions.
+ *
+ * Version 2 is opt-in: the per-message functions above always encode version 1,
+ * while raft_encode_message() encodes the version set in the message. All
+ * decoding functions taking a whole message accept both, and report the version
+ * of the decoded message: a transport can start talking version 1 to a peer and
+ * switch to version 2 once it receives a version 2 message from it.
+ *
+ * Version 1 AppendEntries requests are sent with RAFT_ENCODING_APPEND_ENTRIES
+ * as message type in their header, since servers running older versions of
+ * this library would misread their checksummed batch. Requests with type
+ * RAFT_IO_APPEND_ENTRIES, sent by such servers, are still decoded, and so are
+ * their batches, whatever their format version. The decoded message has type
+ * RAFT_IO_APPEND_ENTRIES in both cases. Transports dispatching messages to the
+ * per-message functions above must treat both types as AppendEntries.
+ */
+enum { RAFT_ENCODING_V1 = 1, RAFT_ENCODING_V2 };
+
+#define RAFT_ENCODING_APPEND_ENTRIES (0x100 | RAFT_IO_APPEND_ENTRIES)
+
+/**
+ * A message exchanged with another server.
+ */
+struct raft_message
+{
+    unsigned short type;    /* RAFT_IO_APPEND_ENTRIES, RAFT_IO_REQUEST_VOTE */
+    unsigned short version; /* Wire protocol version, RAFT_ENCODING_V1 or V2 */
+    union {
+        struct raft_append_entries_args append_entries;
+        struct raft_append_entries_result append_entries_result;
+        struct raft_request_vote_args request_vote;
+        struct raft_request_vote_result request_vote_result;
+        struct raft_timeout_now_args timeout_now;
+    };
+};
+
+/**
+ * Encode a message of any type with the wire protocol version set in it. The
+ * same conventions as the per-message functions above apply. When encoding an
+ * AppendEntries request with version 2, its pre-encoded batch (if any) is not
+ * used, since it holds a version 1 batch header.
+ */
+int raft_encode_message(const struct raft_message *message,
+                        struct raft_buffer *buf);
+
+size_t raft_encode_message_size(const struct raft_message *message);
+
+void raft_encode_message_to(const struct raft_message *message, void *buf);
+
+/**
+ * Decode a whole message, including its header, with either version of the
+ * wire protocol. The entries of an AppendEntries request are decoded as with
+ * raft_decode_append_entries().
+ */
+int raft_decode_message(const struct raft_buffer *buf,
+                        struct raft_message *message);
+
+/**
+ * Incremental decoder of a stream of messages encoded with the functions above,
+ * such as the one received over a TCP connection with another server.
+ *
+ * The decoder can be fed chunks of the stream of arbitrary sizes as they are
+ * received, for example straight from the receive ring of a transport, without
+ * staging them into a contiguous buffer first. The header and body of each
+ * message are accumulated into a small buffer owned by the decoder and reused
+ * across messages, while the entries data of an AppendEntries request is copied
+ * directly into a buffer allocated once per message, whose size is known as
+ * soon as the batch header has been received.
+ */
+struct raft_decoder
+{
+    int flags;                   /* Flags passed to raft_decoder_init() */
+    size_t max_size;             /* Maximum size of a message */
+    unsigned short state;        /* Section of the message being received */
+    size_t offset;               /* Bytes received of the current section */
+    uint8_t header[16];          /* Header of the current message */
+    struct raft_buffer body;     /* Body of the current message */
+    size_t cap;                  /* Allocated size of the body buffer */
+    struct raft_buffer payload;  /* Entries data of the current message */
+    size_t payload_len;          /* Entries data sent over the wire */
+    uint32_t crc;                /* Checksum of the entries data received */
+    struct raft_entry *scratch;  /* Array entry headers are decoded into */
+    unsigned n_scratch;          /* Number of entries fitting in scratch */
+    struct raft_message message; /* Message being decoded */
+};
+
+/**
+ * Initialize a decoder. The only supported flag is RAFT_BATCH_ALIGNED, which
+ * makes the decoder allocate the buffers for the entries data of AppendEntries
+ * requests with the aligned layout, see raft_entries_batch_size().
+ *
+ * Messages whose body, plus the entries data of AppendEntries requests, is
+ * larger than @max_size bytes are rejected with RAFT_ERR_MALFORMED before any
+ * memory is allocated for them, so a misbehaving peer can't exhaust memory by
+ * announcing huge sizes.
+ */
+void raft_decoder_init(struct raft_decoder *d, int flags, size_t max_size);
+
+/**
+ * Release all memory used by the decoder, including the one of a partially
+ * received message.
+ */
+void raft_decoder_close(struct raft_decoder *d);
+
+/**
+ * Feed the decoder with the next @len bytes of the stream at @buf.
+ *
+ * Bytes are consumed until either all of them are or the current message is
+ * complete, and the number of bytes consumed is stored in @n. If a message was
+ * completed, it's stored in @message, otherwise the type of @message is set to
+ * RAFT_IO_NULL. The remaining bytes should then be fed again.
+ *
+ * A completed AppendEntries request carries the entries data allocated by the
+ * decoder and can be passed directly to raft_handle_append_entries(), which
+ * takes ownership of it. Both the checksum of the batch header and the one of
+ * the entries data are verified.
+ *
+ * Unless RAFT_BATCH_ALIGNED is used, the entries array and the entries data
+ * are laid out in a single allocation, with the array first and acting as the
+ * batch of the entries, so receiving a request costs just that allocation.
+ *
+ * If an error is returned the stream can't be decoded any further and the
+ * decoder can only be closed.
+ */
+int raft_decoder_feed(struct raft_decoder *d,
+                      const void *buf,
+                      size_t len,
+                      size_t *n,
+                      struct raft_message *message);
+
+/**
+ * Process the @n messages received from the network in one go (e.g. all the
+ * ones completed by raft_decoder_feed() upon an event loop wakeup), each from
+ * the server at the same position in @servers, as if the raft_handle_*()
+ * function matching its type was called for each of them in order.
+ *
+ * Consecutive AppendEntries requests from the same leader, each picking up
+ * where the previous one leaves off, are merged and their entries written to
+ * the log with a single write. The AppendEntries results that are sent right
+ * away are held back until the end of a run of messages from the same server,
+ * so that only the last one is sent, and consecutive successful AppendEntries
+ * results from the same server are handled as a single one.
+ *
+ * Ownership of the entries of the AppendEntries requests passes to the raft
+ * instance, even if an error is returned: in that case the entries of the
+ * request that failed and of the ones following it are released.
+ */
+int raft_handle_messages(struct raft *r,
+                         const struct raft_server *servers[],
+                         struct raft_message messages[],
+                         unsigned n);
+
+/**
+ * Log write to be performed by the user as part of a raft_ready object.
+ *
+ * If @truncate is not zero, all entries from that index onwards must be deleted
+ * before appending the new ones. A write may carry no entries at all, if it
+ * only deletes some.
+ */
+struct raft_ready_write
+{
+    raft_index truncate;              /* First index to delete, or 0. */
+    const struct raft_entry *entries; /* Entries to append. */
+    unsigned n;                       /* Number of entries to append. */
+    raft_request_id request_id;       /* ID of the write, if any entries. */
+};
+
+/**
+ * Message to be sent by the user as part of a raft_ready object.
+ */
+struct raft_ready_message
+{
+    const struct raft_server *server; /* Recipient of the message. */
+    raft_request_id request_id;       /* ID of an AppendEntries request. */
+    struct raft_message message;      /* Message to send. */
+};
+
+/**
+ * Work accumulated by a raft instance since the last time it was collected
+ * with raft_io_outbox_ready().
+ *
+ * All of it must be carried out in the order the fields are declared, before
+ * calling raft_io_outbox_advance(): first the term and vote are saved (if
+ * needed) and the log writes performed, both durably and so typically with a
+ * single fsync, then the messages are sent and finally the committed entries
+ * are applied to the FSM.
+ */
+struct raft_ready
+{
+    bool save_term_and_vote;                   /* Term or vote changed. */
+    raft_term term;                            /* Current term to persist. */
+    unsigned voted_for;                        /* Current vote to persist. */
+    const struct raft_ready_write *writes;     /* Log writes to perform. */
+    unsigned n_writes;                         /* Number of log writes. */
+    const struct raft_ready_message *messages; /* Messages to send. */
+    unsigned n_messages;                       /* Number of messages. */
+    const struct raft_entry *committed;        /* Entries to apply. */
+    unsigned n_committed;                      /* Number of entries to apply. */
+};
+
+/**
+ * Initialize a raft_io instance that doesn't perform any I/O by itself, but
+ * queues all the operations requested by the raft instance (term and vote
+ * updates, log writes and outgoing messages) into an outbox, which the user
+ * collects with raft_io_outbox_ready() once per event loop iteration, after
+ * having processed all the events of the iteration (ticks, received messages,
+ * client requests).
+ *
+ * This lets the user amortize a single fsync and a single send per peer over
+ * everything that happened during an iteration.
+ *
+ * The persistent state must be loaded by the user from its own storage.
+ */
+int raft_io_outbox_init(struct raft_io *io);
+
+/**
+ * Release all resources used by a raft_io instance initialized with
+ * raft_io_outbox_init().
+ */
+void raft_io_outbox_close(struct raft_io *io);
+
+/**
+ * Collect the work queued so far by the given raft instance, along with its
+ * entries committed and not applied yet, and start a new outbox.
+ *
+ * The memory referenced by @ready stays valid until raft_io_outbox_advance() is
+ * called, which must happen before collecting again.
+ */
+void raft_io_outbox_ready(struct raft_io *io,
+                          struct raft *r,
+                          struct raft_ready *ready);
+
+/**
+ * Acknowledge that the work last collected with raft_io_outbox_ready() was
+ * carried out. The @status parameter must be zero if the writes of term, vote
+ * and log entries were successful, or non-zero otherwise.
+ *
+ * Work triggered by the acknowledgment itself (for example replies to the
+ * leader for the entries just persisted, or to a candidate for the vote just
+ * persisted) lands in the new outbox.
+ */
+void raft_io_outbox_advance(struct raft_io *io, struct raft *r, int status);
+
 #endif /* RAFT_H_ */
@@ -0,0 +1,639 @@
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#if defined(RAFT_IO_URING)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include "aio.h"
+
+/**
+ * Number of worker threads used when io_uring is not available.
+ */
+#define RAFT_AIO__N_WORKERS 2
+
+/**
+ * Convert an errno value into a raft error code.
+ */
+static int raft_aio__errno(int error)
+{
+    switch (error) {
+        case ENOSPC:
+        case EDQUOT:
+            return RAFT_ERR_NO_SPACE;
+        case ENOMEM:
+            return RAFT_ERR_NOMEM;
+        default:
+            return RAFT_ERR_IO;
+    }
+}
+
+void raft_aio__signal(struct raft_aio *a)
+{
+    uint64_t value = 1;
+    ssize_t rv;
+
+    rv = write(a->event_fd, &value, sizeof value);
+    (void)rv; /* Can only fail if the counter overflows, which is harmless. */
+}
+
+/**
+ * Reset the eventfd counter.
+ */
+static void raft_aio__drain(struct raft_aio *a)
+{
+    uint64_t value;
+    ssize_t rv;
+
+    rv = read(a->event_fd, &value, sizeof value);
+    (void)rv; /* EAGAIN just means that the counter was already zero. */
+}
+
+#if defined(RAFT_IO_URING)
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register 427
+#endif
+
+/**
+ * The user_data field of fdatasync() completions is tagged with this bit, to
+ * tell them apart from write completions.
+ */
+#define RAFT_AIO__SYNC_TAG ((uint64_t)1)
+
+static int raft_aio__uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int raft_aio__uring_enter(int fd,
+                                 unsigned to_submit,
+                                 unsigned min_complete,
+                                 unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                        NULL, 0);
+}
+
+static int raft_aio__uring_register(int fd,
+                                    unsigned opcode,
+                                    void *arg,
+                                    unsigned n)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, n);
+}
+
+static void raft_aio__uring_unmap(struct raft_aio *a)
+{
+    if (a->uring.sqes != NULL) {
+        munmap(a->uring.sqes, a->uring.sqes_size);
+    }
+    if (a->uring.cq_ring != NULL && a->uring.cq_ring != a->uring.sq_ring) {
+        munmap(a->uring.cq_ring, a->uring.cq_ring_size);
+    }
+    if (a->uring.sq_ring != NULL) {
+        munmap(a->uring.sq_ring, a->uring.sq_ring_size);
+    }
+}
+
+/**
+ * Try to setup an io_uring instance. Any failure means that io_uring can't be
+ * used on this kernel, and we'll fall back to the thread pool.
+ */
+static int raft_aio__uring_init(struct raft_aio *a, unsigned depth)
+{
+    struct io_uring_params p;
+    uint8_t *sq;
+    uint8_t *cq;
+    int rv;
+
+    memset(&p, 0, sizeof p);
+
+    /* Each request uses two submission entries: the write and the sync. */
+    a->uring.fd = raft_aio__uring_setup(depth * 2, &p);
+    if (a->uring.fd < 0) {
+        return RAFT_ERR_IO;
+    }
+
+    a->uring.sq_ring = NULL;
+    a->uring.cq_ring = NULL;
+    a->uring.sqes = NULL;
+
+    /* We rely on linked requests and on the kernel never dropping completion
+     * events: both are guaranteed by kernels advertising IORING_FEAT_NODROP
+     * (5.5 and later). */
+    if (!(p.features & IORING_FEAT_NODROP)) {
+        goto err;
+    }
+
+    a->uring.sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    a->uring.cq_ring_size =
+        p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (a->uring.cq_ring_size > a->uring.sq_ring_size) {
+            a->uring.sq_ring_size = a->uring.cq_ring_size;
+        }
+        a->uring.cq_ring_size = a->uring.sq_ring_size;
+    }
+
+    a->uring.sq_ring =
+        mmap(NULL, a->uring.sq_ring_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, a->uring.fd, IORING_OFF_SQ_RING);
+    if (a->uring.sq_ring == MAP_FAILED) {
+        a->uring.sq_ring = NULL;
+        goto err;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        a->uring.cq_ring = a->uring.sq_ring;
+    } else {
+        a->uring.cq_ring =
+            mmap(NULL, a->uring.cq_ring_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, a->uring.fd, IORING_OFF_CQ_RING);
+        if (a->uring.cq_ring == MAP_FAILED) {
+            a->uring.cq_ring = NULL;
+            goto err;
+        }
+    }
+
+    a->uring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    a->uring.sqes = mmap(NULL, a->uring.sqes_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, a->uring.fd, IORING_OFF_SQES);
+    if (a->uring.sqes == MAP_FAILED) {
+        a->uring.sqes = NULL;
+        goto err;
+    }
+
+    sq = a->uring.sq_ring;
+    cq = a->uring.cq_ring;
+
+    a->uring.sq_head = (unsigned *)(sq + p.sq_off.head);
+    a->uring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    a->uring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    a->uring.sq_entries = (unsigned *)(sq + p.sq_off.ring_entries);
+    a->uring.sq_array = (unsigned *)(sq + p.sq_off.array);
+
+    a->uring.cq_head = (unsigned *)(cq + p.cq_off.head);
+    a->uring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    a->uring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    a->uring.cqes = cq + p.cq_off.cqes;
+
+    /* Have the kernel signal our eventfd whenever a completion is posted. */
+    rv = raft_aio__uring_register(a->uring.fd, IORING_REGISTER_EVENTFD,
+                                  &a->event_fd, 1);
+    if (rv != 0) {
+        goto err;
+    }
+
+    a->type = RAFT_AIO_URING;
+
+    return 0;
+
+err:
+    raft_aio__uring_unmap(a);
+    close(a->uring.fd);
+    return RAFT_ERR_IO;
+}
+
+static void raft_aio__uring_close(struct raft_aio *a)
+{
+    raft_aio__uring_unmap(a);
+    close(a->uring.fd);
+}
+
+/**
+ * Have the kernel consume the submission queue entries published so far.
+ *
+ * Published entries can't be taken back, since the kernel might read them at
+ * any later enter: if it fails to consume all of them now, they are retried at
+ * the next harvest, and the eventfd is signaled to make sure there is one.
+ */
+static void raft_aio__uring_flush(struct raft_aio *a)
+{
+    unsigned head;
+    unsigned tail;
+    int rv;
+
+    head = __atomic_load_n(a->uring.sq_head, __ATOMIC_ACQUIRE);
+    tail = *a->uring.sq_tail;
+
+    if (head == tail) {
+        return;
+    }
+
+    rv = raft_aio__uring_enter(a->uring.fd, tail - head, 0, 0);
+    if (rv < 0 || (unsigned)rv != tail - head) {
+        raft_aio__signal(a);
+    }
+}
+
+/**
+ * Submit a write and a datasync linked to it, so the latter is started by the
+ * kernel only once the former has successfully completed.
+ *
+ * Once its entries are published the request is owned by the ring, even if the
+ * kernel doesn't consume them right away, and is completed as usual.
+ */
+static int raft_aio__uring_submit(struct raft_aio *a, struct raft_aio_write *w)
+{
+    struct io_uring_sqe *sqes = a->uring.sqes;
+    struct io_uring_sqe *sqe;
+    unsigned head;
+    unsigned tail;
+    unsigned mask = *a->uring.sq_mask;
+    unsigned i;
+
+    head = __atomic_load_n(a->uring.sq_head, __ATOMIC_ACQUIRE);
+    tail = *a->uring.sq_tail;
+
+    if (tail - head + 2 > *a->uring.sq_entries) {
+        return RAFT_ERR_IO_BUSY;
+    }
+
+    i = tail & mask;
+    sqe = &sqes[i];
+    memset(sqe, 0, sizeof *sqe);
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->fd = w->fd;
+    sqe->addr = (uintptr_t)w->iov;
+    sqe->len = w->n;
+    sqe->off = w->offset;
+    sqe->user_data = (uintptr_t)w;
+    a->uring.sq_array[i] = i;
+    tail++;
+
+    i = tail & mask;
+    sqe = &sqes[i];
+    memset(sqe, 0, sizeof *sqe);
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = w->fd;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    sqe->user_data = (uintptr_t)w | RAFT_AIO__SYNC_TAG;
+    a->uring.sq_array[i] = i;
+    tail++;
+
+    w->pending = 2;
+
+    __atomic_store_n(a->uring.sq_tail, tail, __ATOMIC_RELEASE);
+
+    raft_aio__uring_flush(a);
+
+    return 0;
+}
+
+static unsigned raft_aio__uring_harvest(struct raft_aio *a,
+                                        struct raft_aio_write *done[],
+                                        unsigned n)
+{
+    struct io_uring_cqe *cqes = a->uring.cqes;
+    unsigned mask = *a->uring.cq_mask;
+    unsigned head;
+    unsigned tail;
+    unsigned i = 0;
+
+    head = *a->uring.cq_head;
+    tail = __atomic_load_n(a->uring.cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail && i < n) {
+        struct io_uring_cqe *cqe = &cqes[head & mask];
+        uint64_t user_data = cqe->user_data;
+        struct raft_aio_write *w;
+
+        w = (struct raft_aio_write *)(uintptr_t)(user_data &
+                                                 ~RAFT_AIO__SYNC_TAG);
+
+        if (user_data & RAFT_AIO__SYNC_TAG) {
+            /* A sync canceled because of a failed write has already been
+             * accounted for by the write completion. */
+            if (cqe->res < 0 && w->status == 0) {
+                w->status = raft_aio__errno(-cqe->res);
+            }
+        } else {
+            if (cqe->res < 0) {
+                w->status = raft_aio__errno(-cqe->res);
+            } else if ((size_t)cqe->res != w->len) {
+                /* Short writes are not retried. */
+                w->status = RAFT_ERR_IO;
+            }
+        }
+
+        head++;
+
+        assert(w->pending > 0);
+        w->pending--;
+        if (w->pending == 0) {
+            done[i] = w;
+            i++;
+        }
+    }
+
+    __atomic_store_n(a->uring.cq_head, head, __ATOMIC_RELEASE);
+
+    /* Retry submitting entries that the kernel failed to consume, now that
+     * some room in the completion queue might have been freed. */
+    raft_aio__uring_flush(a);
+
+    return i;
+}
+
+#endif /* RAFT_IO_URING */
+
+/**
+ * Synchronously write the given request and flush it.
+ */
+static int raft_aio__write_sync(struct raft_aio_write *w)
+{
+    size_t written; /* Number of bytes written so far */
+    size_t pos = 0; /* Position of the current buffer within the request */
+    unsigned i;
+    ssize_t rv;
+
+    rv = pwritev(w->fd, w->iov, w->n, w->offset);
+    if (rv < 0) {
+        return raft_aio__errno(errno);
+    }
+
+    written = rv;
+
+    /* In the rare event of a short write, write the rest buffer by buffer. */
+    for (i = 0; i < w->n && written < w->len; i++) {
+        const struct iovec *iov = &w->iov[i];
+        size_t done = written > pos ? written - pos : 0;
+
+        while (done < iov->iov_len) {
+            rv = pwrite(w->fd, (uint8_t *)iov->iov_base + done,
+                        iov->iov_len - done, w->offset + pos + done);
+            if (rv < 0) {
+                return raft_aio__errno(errno);
+            }
+            done += rv;
+            written += rv;
+        }
+
+        pos += iov->iov_len;
+    }
+
+    if (fdatasync(w->fd) != 0) {
+        return raft_aio__errno(errno);
+    }
+
+    return 0;
+}
+
+static void *raft_aio__worker(void *arg)
+{
+    struct raft_aio *a = arg;
+
+    while (1) {
+        struct raft_aio_write *w;
+
+        pthread_mutex_lock(&a->threads.mutex);
+        while (!a->threads.stop && a->threads.head == NULL) {
+            pthread_cond_wait(&a->threads.cond, &a->threads.mutex);
+        }
+        if (a->threads.head == NULL) {
+            assert(a->threads.stop);
+            pthread_mutex_unlock(&a->threads.mutex);
+            break;
+        }
+        w = a->threads.head;
+        a->threads.head = w->next;
+        if (a->threads.head == NULL) {
+            a->threads.tail = NULL;
+        }
+        pthread_mutex_unlock(&a->threads.mutex);
+
+        w->status = raft_aio__write_sync(w);
+
+        pthread_mutex_lock(&a->threads.mutex);
+        w->pending = 0;
+        w->next = a->threads.done;
+        a->threads.done = w;
+        pthread_mutex_unlock(&a->threads.mutex);
+
+        raft_aio__signal(a);
+    }
+
+    return NULL;
+}
+
+static int raft_aio__threads_init(struct raft_aio *a)
+{
+    unsigned i;
+    int rv;
+
+    a->threads.n_workers = RAFT_AIO__N_WORKERS;
+    a->threads.workers =
+        raft_malloc(a->threads.n_workers * sizeof *a->threads.workers);
+    if (a->threads.workers == NULL) {
+        return RAFT_ERR_NOMEM;
+    }
+
+    pthread_mutex_init(&a->threads.mutex, NULL);
+    pthread_cond_init(&a->threads.cond, NULL);
+
+    a->threads.head = NULL;
+    a->threads.tail = NULL;
+    a->threads.done = NULL;
+    a->threads.stop = false;
+
+    for (i = 0; i < a->threads.n_workers; i++) {
+        rv = pthread_create(&a->threads.workers[i], NULL, raft_aio__worker, a);
+        if (rv != 0) {
+            a->threads.n_workers = i;
+            a->type = RAFT_AIO_THREADS;
+            raft_aio__close(a);
+            return raft_aio__errno(rv);
+        }
+    }
+
+    a->type = RAFT_AIO_THREADS;
+
+    return 0;
+}
+
+static void raft_aio__threads_close(struct raft_aio *a)
+{
+    unsigned i;
+
+    pthread_mutex_lock(&a->threads.mutex);
+    a->threads.stop = true;
+    pthread_cond_broadcast(&a->threads.cond);
+    pthread_mutex_unlock(&a->threads.mutex);
+
+    for (i = 0; i < a->threads.n_workers; i++) {
+        pthread_join(a->threads.workers[i], NULL);
+    }
+
+    pthread_cond_destroy(&a->threads.cond);
+    pthread_mutex_destroy(&a->threads.mutex);
+
+    raft_free(a->threads.workers);
+}
+
+static int raft_aio__threads_submit(struct raft_aio *a,
+                                    struct raft_aio_write *w)
+{
+    w->pending = 1;
+    w->next = NULL;
+
+    pthread_mutex_lock(&a->threads.mutex);
+    if (a->threads.tail == NULL) {
+        a->threads.head = w;
+    } else {
+        a->threads.tail->next = w;
+    }
+    a->threads.tail = w;
+    pthread_cond_signal(&a->threads.cond);
+    pthread_mutex_unlock(&a->threads.mutex);
+
+    return 0;
+}
+
+static unsigned raft_aio__threads_harvest(struct raft_aio *a,
+                                          struct raft_aio_write *done[],
+                                          unsigned n)
+{
+    unsigned i = 0;
+
+    pthread_mutex_lock(&a->threads.mutex);
+    while (a->threads.done != NULL && i < n) {
+        done[i] = a->threads.done;
+        a->threads.done = done[i]->next;
+        i++;
+    }
+    pthread_mutex_unlock(&a->threads.mutex);
+
+    return i;
+}
+
+int raft_aio__init(struct raft_aio *a, unsigned depth, bool threads)
+{
+    int rv;
+
+    assert(a != NULL);
+    assert(depth > 0);
+
+    a->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (a->event_fd < 0) {
+        return raft_aio__errno(errno);
+    }
+
+#if defined(RAFT_IO_URING)
+    if (!threads) {
+        rv = raft_aio__uring_init(a, depth);
+        if (rv == 0) {
+            return 0;
+        }
+    }
+#else
+    (void)depth;
+    (void)threads;
+#endif
+
+    rv = raft_aio__threads_init(a);
+    if (rv != 0) {
+        close(a->event_fd);
+        return rv;
+    }
+
+    return 0;
+}
+
+void raft_aio__close(struct raft_aio *a)
+{
+    assert(a != NULL);
+
+    switch (a->type) {
+#if defined(RAFT_IO_URING)
+        case RAFT_AIO_URING:
+            raft_aio__uring_close(a);
+            break;
+#endif
+        case RAFT_AIO_THREADS:
+            raft_aio__threads_close(a);
+            break;
+    }
+
+    close(a->event_fd);
+}
+
+int raft_aio__submit(struct raft_aio *a, struct raft_aio_write *w)
+{
+    assert(a != NULL);
+    assert(w != NULL);
+    assert(w->n > 0);
+
+    w->status = 0;
+    w->next = NULL;
+
+    switch (a->type) {
+#if defined(RAFT_IO_URING)
+        case RAFT_AIO_URING:
+            return raft_aio__uring_submit(a, w);
+#endif
+        case RAFT_AIO_THREADS:
+            return raft_aio__threads_submit(a, w);
+    }
+
+    return RAFT_ERR_INTERNAL;
+}
+
+unsigned raft_aio__harvest(struct raft_aio *a,
+                           struct raft_aio_write *done[],
+                           unsigned n,
+                           bool wait)
+{
+    unsigned i;
+
+    assert(a != NULL);
+    assert(n > 0);
+
+    while (1) {
+        /* Reset the eventfd counter before looking at the completions, so we
+         * don't miss any signal posted after we looked. */
+        raft_aio__drain(a);
+
+        switch (a->type) {
+#if defined(RAFT_IO_URING)
+            case RAFT_AIO_URING:
+                i = raft_aio__uring_harvest(a, done, n);
+                break;
+#endif
+            case RAFT_AIO_THREADS:
+                i = raft_aio__threads_harvest(a, done, n);
+                break;
+            default:
+                i = 0;
+                break;
+        }
+
+        if (i > 0 || !wait) {
+            break;
+        }
+
+        {
+            struct pollfd pfd = {a->event_fd, POLLIN, 0};
+            poll(&pfd, 1, -1);
+        }
+    }
+
+    return i;
+}
@@ -0,0 +1,121 @@
+/**
+ * Asynchronous disk writes.
+ *
+ * Writes are submitted to the kernel via io_uring when the running kernel
+ * supports it, otherwise they are handed to a small pool of worker threads
+ * performing blocking pwritev() and fdatasync() calls.
+ *
+ * In both cases completions are signaled through an eventfd, which can be
+ * watched by the event loop of the calling thread.
+ */
+
+#ifndef RAFT_AIO_H
+#define RAFT_AIO_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "../include/raft.h"
+
+/**
+ * Types of engines that can back a raft_aio object.
+ */
+enum { RAFT_AIO_URING = 1, RAFT_AIO_THREADS };
+
+/**
+ * A single write request, followed by a flush of the file data.
+ *
+ * The memory of the request object, of the iovec array and of the buffers it
+ * references must remain valid until the request is returned by
+ * raft_aio__harvest().
+ */
+struct raft_aio_write
+{
+    int fd;                      /* File descriptor to write to */
+    const struct iovec *iov;     /* Buffers to write */
+    unsigned n;                  /* Number of buffers */
+    off_t offset;                /* File offset to write at */
+    size_t len;                  /* Total number of bytes to write */
+    void *data;                  /* User data */
+    int status;                  /* Result of the request, set on completion */
+    unsigned pending;            /* Number of in-flight kernel operations */
+    struct raft_aio_write *next; /* Next request in the engine queues */
+};
+
+/**
+ * Asynchronous write engine.
+ */
+struct raft_aio
+{
+    int type;     /* Engine type, either RAFT_AIO_URING or RAFT_AIO_THREADS */
+    int event_fd; /* Signaled whenever there are completed requests */
+    union {
+        struct
+        {
+            int fd;                 /* Ring file descriptor */
+            unsigned *sq_head;      /* Submission queue head */
+            unsigned *sq_tail;      /* Submission queue tail */
+            unsigned *sq_mask;      /* Submission queue ring mask */
+            unsigned *sq_entries;   /* Submission queue size */
+            unsigned *sq_array;     /* Submission queue indirection array */
+            void *sqes;             /* Submission queue entries */
+            unsigned *cq_head;      /* Completion queue head */
+            unsigned *cq_tail;      /* Completion queue tail */
+            unsigned *cq_mask;      /* Completion queue ring mask */
+            void *cqes;             /* Completion queue entries */
+            void *sq_ring;          /* Mapped submission ring */
+            size_t sq_ring_size;    /* Size of the submission ring mapping */
+            void *cq_ring;          /* Mapped completion ring */
+            size_t cq_ring_size;    /* Size of the completion ring mapping */
+            size_t sqes_size;       /* Size of the entries mapping */
+        } uring;
+        struct
+        {
+            pthread_t *workers;          /* Worker threads */
+            unsigned n_workers;          /* Number of worker threads */
+            pthread_mutex_t mutex;       /* Serialize access to the queues */
+            pthread_cond_t cond;         /* Signal new work to do */
+            struct raft_aio_write *head; /* Head of the pending queue */
+            struct raft_aio_write *tail; /* Tail of the pending queue */
+            struct raft_aio_write *done; /* Completed requests (LIFO) */
+            bool stop;                   /* Whether workers should exit */
+        } threads;
+    };
+};
+
+/**
+ * Initialize an engine able to handle at least @depth concurrent requests.
+ *
+ * If @threads is false, an io_uring engine is tried first, and the thread pool
+ * is used only if io_uring is not available on the running kernel.
+ */
+int raft_aio__init(struct raft_aio *a, unsigned depth, bool threads);
+
+/**
+ * Stop the engine. There must be no request in flight.
+ */
+void raft_aio__close(struct raft_aio *a);
+
+/**
+ * Submit a write request followed by a data flush (i.e. fdatasync()).
+ */
+int raft_aio__submit(struct raft_aio *a, struct raft_aio_write *w);
+
+/**
+ * Notify the event loop that there are completed requests, making the eventfd
+ * readable.
+ */
+void raft_aio__signal(struct raft_aio *a);
+
+/**
+ * Fill @done with up to @n completed requests and return how many they are. If
+ * @wait is true, block until at least one request is completed.
+ */
+unsigned raft_aio__harvest(struct raft_aio *a,
+                           struct raft_aio_write *done[],
+                           unsigned n,
+                           bool wait);
+
+#endif /* RAFT_AIO_H */
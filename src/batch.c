@@ -0,0 +1,107 @@
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "batch.h"
+#include "binary.h"
+
+static inline size_t raft_batch__pad(size_t len)
+{
+    return (len + 7) & ~(size_t)7;
+}
+
+void raft_batch__encode_headers(const struct raft_entry *entries,
+                                size_t n,
+                                void *headers)
+{
+    uint8_t *cursor = headers;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        const struct raft_entry *entry = &entries[i];
+        uint64_t term = raft__flip64(entry->term);
+        uint32_t len = raft__flip32(entry->buf.len);
+
+        memcpy(cursor, &term, sizeof term);
+        cursor[8] = (uint8_t)entry->type;
+        memset(cursor + 9, 0, 3); /* Unused */
+        memcpy(cursor + 12, &len, sizeof len);
+
+        cursor += 16;
+    }
+}
+
+int raft_batch__decode_headers(const void *headers,
+                               struct raft_entry *entries,
+                               size_t n,
+                               void *batch)
+{
+    const uint8_t *cursor = headers;
+    unsigned unknown = 0; /* Non-zero if some type is unknown */
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        struct raft_entry *entry = &entries[i];
+        uint64_t term;
+        uint32_t len;
+
+        memcpy(&term, cursor, sizeof term);
+        memcpy(&len, cursor + 12, sizeof len);
+
+        entry->term = raft__flip64(term);
+        entry->type = cursor[8];
+        entry->buf.len = raft__flip32(len);
+        entry->batch = batch;
+
+        /* Check the types once, after the loop. */
+        unknown |= cursor[8] > RAFT_LOG_CONFIGURATION;
+
+        cursor += 16;
+    }
+
+    return unknown ? RAFT_ERR_MALFORMED : 0;
+}
+
+size_t raft_batch__data_size(const struct raft_entry *entries, size_t n)
+{
+    size_t size = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        size += raft_batch__pad(entries[i].buf.len);
+    }
+
+    return size;
+}
+
+void raft_batch__point(struct raft_entry *entries, size_t n, void *data)
+{
+    uint8_t *cursor = data;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        entries[i].buf.base = cursor;
+        entries[i].batch = data;
+        cursor += raft_batch__pad(entries[i].buf.len);
+    }
+}
+
+void *raft_batch__tag(struct raft_batch__owner *owner)
+{
+    assert(((uintptr_t)owner & 1) == 0);
+
+    return (void *)((uintptr_t)owner | 1);
+}
+
+void raft_release_entries_batch(void *batch)
+{
+    if ((uintptr_t)batch & 1) {
+        struct raft_batch__owner *owner;
+
+        owner = (struct raft_batch__owner *)((uintptr_t)batch & ~(uintptr_t)1);
+        owner->release(owner);
+        return;
+    }
+
+    raft_free(batch);
+}
@@ -0,0 +1,66 @@
+/**
+ * Loops packing and unpacking the entry headers of batches, and laying out
+ * their data sections.
+ *
+ * Batches with many small entries spend most of their encoding and decoding
+ * time here, so the loops avoid branching on each entry.
+ */
+
+#ifndef RAFT_BATCH_H
+#define RAFT_BATCH_H
+
+#include "../include/raft.h"
+
+/**
+ * Encode the 16-byte headers of the given entries into @headers.
+ */
+void raft_batch__encode_headers(const struct raft_entry *entries,
+                                size_t n,
+                                void *headers);
+
+/**
+ * Decode the @n 16-byte entry headers at @headers, filling term, type and data
+ * length of the given entries and setting their batch to @batch.
+ *
+ * Return RAFT_ERR_MALFORMED if an entry has an unknown type, in which case the
+ * given entries are all filled anyway.
+ */
+int raft_batch__decode_headers(const void *headers,
+                               struct raft_entry *entries,
+                               size_t n,
+                               void *batch);
+
+/**
+ * Return the size of the data section of a batch with the given entries, each
+ * padded to 8-byte boundary.
+ */
+size_t raft_batch__data_size(const struct raft_entry *entries, size_t n);
+
+/**
+ * Point the data buffers of the given entries, whose length is set, into the
+ * data section at @data, and set their batch to @data. Entries without data
+ * point where the next entry's data starts.
+ */
+void raft_batch__point(struct raft_entry *entries, size_t n, void *data);
+
+/**
+ * A batch that raft_release_entries_batch() releases with a custom function
+ * instead of raft_free(), such as the mapping of a closed segment. It's meant
+ * to be the first member of a larger descriptor.
+ */
+struct raft_batch__owner
+{
+    void (*release)(struct raft_batch__owner *owner);
+};
+
+/**
+ * Return the batch pointer that entries sharing the given owner must use.
+ *
+ * It's the address of @owner with its lowest bit set, which batches allocated
+ * on the heap never have. That tells raft_release_entries_batch() apart from
+ * the others without any lookup, and keeps code that writes a batch memory
+ * directly, such as the aligned format of raft_io_file, away from it.
+ */
+void *raft_batch__tag(struct raft_batch__owner *owner);
+
+#endif /* RAFT_BATCH_H */
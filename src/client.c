@@ -2,20 +2,18 @@
 
 #include "../include/raft.h"
 
+#include "configuration.h"
 #include "io.h"
 #include "log.h"
 #include "logger.h"
+#include "membership.h"
 #include "replication.h"
 
 int raft_accept(struct raft *r,
                 const struct raft_buffer bufs[],
                 const unsigned n)
 {
-    struct raft_io_request *request;
     uint64_t index;
-    struct raft_entry *entries;
-    unsigned m;
-    size_t request_id;
     unsigned i;
     int rv;
 
@@ -27,6 +25,14 @@ int raft_accept(struct raft *r,
         return RAFT_ERR_NOT_LEADER;
     }
 
+    /* From Section §3.10:
+     *
+     *   The prior leader stops accepting client requests.
+     */
+    if (r->leader_state.transferee != 0) {
+        return RAFT_ERR_LEADERSHIP_TRANSFER;
+    }
+
     raft__debugf(r, "client request");
 
     /* Index of the first entry being appended. */
@@ -42,58 +48,207 @@ int raft_accept(struct raft *r,
         }
     }
 
-    /* Acquire all the entries we just appended. */
-    rv = raft_log__acquire(&r->log, index, &entries, &m);
+    rv = raft_replication__trigger(r, index);
     if (rv != 0) {
         goto err_after_log_append;
     }
-    assert(m == n);
 
-    /* Allocate a new raft_io_request slot in the queue of inflight I/O
-     * operations and fill the request fields. */
-    rv = raft_io__queue_push(r, &request_id);
-    if (rv != 0) {
-        goto err_after_entries_acquired;
+    return 0;
+
+err_after_log_append:
+    raft_log__truncate(&r->log, index);
+
+    assert(rv != 0);
+
+    return rv;
+}
+
+int raft_transfer_leadership(struct raft *r, unsigned id)
+{
+    const struct raft_server *server;
+    size_t i;
+    int rv;
+
+    assert(r != NULL);
+
+    if (r->state != RAFT_STATE_LEADER) {
+        return RAFT_ERR_NOT_LEADER;
+    }
+
+    if (!raft_io__timeout_now(r)) {
+        raft__errorf(r, "I/O implementation can't send TimeoutNow requests");
+        return RAFT_ERR_INTERNAL;
+    }
+
+    if (r->leader_state.transferee != 0) {
+        return RAFT_ERR_LEADERSHIP_TRANSFER;
     }
 
-    request = raft_io__queue_get(r, request_id);
-    request->index = index;
-    request->type = RAFT_IO_WRITE_LOG;
-    request->entries = entries;
-    request->n = n;
-    request->leader_id = r->id;
+    server = raft_configuration__get(&r->configuration, id);
+    if (server == NULL || !server->voting || id == r->id) {
+        return RAFT_ERR_BAD_SERVER_ID;
+    }
+
+    i = raft_configuration__index(&r->configuration, id);
+    assert(i < r->configuration.n);
+
+    r->leader_state.transferee = id;
+    r->leader_state.transfer_start = r->now;
+    r->leader_state.timeout_now_sent = false;
+
+    raft__infof(r, "transfer leadership to server %ld", id);
 
-    rv = r->io->write_log(r->io, request_id, entries, n);
+    /* If the target's log is already up to date, ask it to take over right
+     * away. Otherwise send it the missing entries: TimeoutNow will be sent
+     * once it acknowledges them. */
+    if (r->leader_state.match_index[i] == raft_log__last_index(&r->log)) {
+        rv = raft_replication__maybe_send_timeout_now(r, i);
+    } else {
+        rv = raft_replication__send_append_entries(r, i);
+    }
     if (rv != 0) {
-        goto err_after_io_queue_push;
+        r->leader_state.transferee = 0;
+        return rv;
     }
 
-    /* Reset the heartbeat timer: for a full request_timeout period we'll be
-     * good and we won't need to contact followers again, since this was not an
-     * idle period.
-     *
-     * From Figure 3.1:
-     *
-     *   [Rules for Servers] Leaders: Upon election: send initial empty
-     *   AppendEntries RPCs (heartbeat) to each server; repeat during idle
-     *   periods to prevent election timeouts
+    return 0;
+}
+
+/**
+ * Check that a new configuration change can be started.
+ */
+static int raft_client__can_change(struct raft *r)
+{
+    if (r->state != RAFT_STATE_LEADER) {
+        return RAFT_ERR_NOT_LEADER;
+    }
+
+    if (r->leader_state.transferee != 0) {
+        return RAFT_ERR_LEADERSHIP_TRANSFER;
+    }
+
+    /* Changes are applied one server at a time, so a new one can't begin until
+     * the configuration entry of the previous one is committed (Section §4.1).
      */
-    r->timer = 0;
+    if (r->configuration_index > r->commit_index ||
+        r->leader_state.promotee != 0) {
+        return RAFT_ERR_CONFIGURATION_BUSY;
+    }
+
+    return 0;
+}
+
+int raft_add_learner(struct raft *r, unsigned id, const char *address)
+{
+    struct raft_configuration configuration;
+    int rv;
+
+    assert(r != NULL);
 
-    raft_replication__send_heartbeat(r);
+    rv = raft_client__can_change(r);
+    if (rv != 0) {
+        return rv;
+    }
+
+    raft_configuration_init(&configuration);
+
+    rv = raft_configuration__copy(&r->configuration, &configuration);
+    if (rv != 0) {
+        goto out;
+    }
+
+    rv = raft_configuration_add(&configuration, id, address, false);
+    if (rv != 0) {
+        goto out;
+    }
+
+    raft__infof(r, "add learner %ld", id);
+
+    rv = raft_membership__append(r, &configuration);
+
+out:
+    raft_configuration_close(&configuration);
+
+    return rv;
+}
+
+int raft_promote(struct raft *r, unsigned id)
+{
+    const struct raft_server *server;
+    size_t i;
+    int rv;
+
+    assert(r != NULL);
+
+    rv = raft_client__can_change(r);
+    if (rv != 0) {
+        return rv;
+    }
+
+    server = raft_configuration__get(&r->configuration, id);
+    if (server == NULL || server->voting) {
+        return RAFT_ERR_BAD_SERVER_ID;
+    }
+
+    i = raft_configuration__index(&r->configuration, id);
+    assert(i < r->configuration.n);
+
+    raft__infof(r, "promote learner %ld", id);
+
+    r->leader_state.promotee = id;
+    r->leader_state.round_number = 1;
+    r->leader_state.round_index = raft_log__last_index(&r->log);
+    r->leader_state.round_start = r->now;
+
+    /* If the learner is already up to date it gets promoted right away,
+     * otherwise send it the missing entries. */
+    if (r->leader_state.match_index[i] == r->leader_state.round_index) {
+        rv = raft_membership__catch_up(r, i);
+    } else {
+        rv = raft_replication__send_append_entries(r, i);
+    }
+    if (rv != 0) {
+        r->leader_state.promotee = 0;
+        return rv;
+    }
 
     return 0;
+}
 
-err_after_io_queue_push:
-    raft_io__queue_pop(r, request_id);
+int raft_remove(struct raft *r, unsigned id)
+{
+    struct raft_configuration configuration;
+    int rv;
 
-err_after_entries_acquired:
-    raft_log__release(&r->log, index, entries, m);
+    assert(r != NULL);
 
-err_after_log_append:
-    raft_log__truncate(&r->log, index);
+    rv = raft_client__can_change(r);
+    if (rv != 0) {
+        return rv;
+    }
 
-    assert(rv != 0);
+    if (id == r->id) {
+        return RAFT_ERR_BAD_SERVER_ID;
+    }
+
+    raft_configuration_init(&configuration);
+
+    rv = raft_configuration__copy(&r->configuration, &configuration);
+    if (rv != 0) {
+        goto out;
+    }
+
+    rv = raft_configuration__remove(&configuration, id);
+    if (rv != 0) {
+        goto out;
+    }
+
+    raft__infof(r, "remove server %ld", id);
+
+    rv = raft_membership__append(r, &configuration);
+
+out:
+    raft_configuration_close(&configuration);
 
     return rv;
 }
@@ -11,10 +11,16 @@
 static_assert(sizeof(char) == sizeof(uint8_t), "Size of 'char' is not 8 bits");
 #endif
 
+/* Minimum size of the hash table of server positions. */
+#define RAFT_CONFIGURATION__MIN_SLOTS 8
+
 void raft_configuration_init(struct raft_configuration *c)
 {
     c->servers = NULL;
     c->n = 0;
+    c->n_voting = 0;
+    c->slots = NULL;
+    c->n_slots = 0;
 }
 
 void raft_configuration_close(struct raft_configuration *c)
@@ -24,6 +30,105 @@ void raft_configuration_close(struct raft_configuration *c)
     if (c->servers != NULL) {
         raft_free(c->servers);
     }
+
+    if (c->slots != NULL) {
+        raft_free(c->slots);
+    }
+}
+
+/**
+ * Return the hash table slot where the lookup for the given ID starts.
+ */
+static size_t raft_configuration__hash(struct raft_configuration *c,
+                                       const unsigned id)
+{
+    uint32_t h = id;
+
+    /* Mix the bits, since IDs are often small and sequential. */
+    h ^= h >> 16;
+    h *= 0x45d9f3b;
+    h ^= h >> 16;
+
+    return h & (c->n_slots - 1);
+}
+
+/**
+ * Insert the server at the given position in the hash table, and record its
+ * voting index. Servers must be inserted in order.
+ */
+static void raft_configuration__insert(struct raft_configuration *c, size_t i)
+{
+    unsigned *voting_indexes = c->slots + c->n_slots;
+    size_t slot = raft_configuration__hash(c, c->servers[i].id);
+
+    while (c->slots[slot] != 0) {
+        slot = (slot + 1) & (c->n_slots - 1);
+    }
+
+    c->slots[slot] = i + 1;
+    voting_indexes[i] = c->n_voting;
+
+    if (c->servers[i].voting) {
+        c->n_voting++;
+    }
+}
+
+/**
+ * Rebuild the hash table and voting counts from scratch.
+ */
+static void raft_configuration__fill(struct raft_configuration *c)
+{
+    size_t i;
+
+    memset(c->slots, 0, c->n_slots * sizeof *c->slots);
+    c->n_voting = 0;
+
+    for (i = 0; i < c->n; i++) {
+        raft_configuration__insert(c, i);
+    }
+}
+
+/**
+ * Make sure that the hash table can hold @n servers while staying at most half
+ * full, growing it if needed.
+ */
+static int raft_configuration__reserve(struct raft_configuration *c, size_t n)
+{
+    unsigned *slots;
+    size_t n_slots = RAFT_CONFIGURATION__MIN_SLOTS;
+
+    while (n_slots < 2 * n) {
+        n_slots *= 2;
+    }
+
+    if (c->slots != NULL && n_slots <= c->n_slots) {
+        return 0;
+    }
+
+    /* Each server can take up to two slots, plus one for its voting index. */
+    slots = raft_malloc((n_slots + n_slots / 2) * sizeof *slots);
+    if (slots == NULL) {
+        return RAFT_ERR_NOMEM;
+    }
+
+    if (c->slots != NULL) {
+        raft_free(c->slots);
+    }
+
+    c->slots = slots;
+    c->n_slots = n_slots;
+
+    raft_configuration__fill(c);
+
+    return 0;
+}
+
+int raft_configuration__build(struct raft_configuration *c)
+{
+    assert(c != NULL);
+    assert(c->slots == NULL);
+
+    return raft_configuration__reserve(c, c->n);
 }
 
 const struct raft_server *raft_configuration__get(struct raft_configuration *c,
@@ -33,14 +138,12 @@ const struct raft_server *raft_configuration__get(struct raft_configuration *c,
 
     assert(c != NULL);
 
-    for (i = 0; i < c->n; i++) {
-        struct raft_server *server = &c->servers[i];
-        if (server->id == id) {
-            return server;
-        }
+    i = raft_configuration__index(c, id);
+    if (i == c->n) {
+        return NULL;
     }
 
-    return NULL;
+    return &c->servers[i];
 }
 
 int raft_configuration_add(struct raft_configuration *c,
@@ -50,6 +153,7 @@ int raft_configuration_add(struct raft_configuration *c,
 {
     struct raft_server *servers;
     struct raft_server *server;
+    int rv;
 
     assert(c != NULL);
 
@@ -65,6 +169,11 @@ int raft_configuration_add(struct raft_configuration *c,
         return RAFT_ERR_DUP_SERVER_ID;
     }
 
+    rv = raft_configuration__reserve(c, c->n + 1);
+    if (rv != 0) {
+        return rv;
+    }
+
     servers = raft_realloc(c->servers, (c->n + 1) * sizeof *server);
     if (servers == NULL) {
         return RAFT_ERR_NOMEM;
@@ -75,40 +184,144 @@ int raft_configuration_add(struct raft_configuration *c,
     server->id = id;
     server->address = address;
     server->voting = voting;
+    server->priority = 0;
 
     c->n++;
     c->servers = servers;
 
+    raft_configuration__insert(c, c->n - 1);
+
     return 0;
 }
 
-size_t raft_configuration__n_voting(struct raft_configuration *c)
+int raft_configuration__copy(struct raft_configuration *src,
+                             struct raft_configuration *dst)
+{
+    size_t i;
+    int rv;
+
+    assert(src != NULL);
+    assert(dst != NULL);
+
+    for (i = 0; i < src->n; i++) {
+        struct raft_server *server = &src->servers[i];
+
+        rv = raft_configuration_add(dst, server->id, server->address,
+                                    server->voting);
+        if (rv != 0) {
+            return rv;
+        }
+
+        dst->servers[dst->n - 1].priority = server->priority;
+    }
+
+    return 0;
+}
+
+int raft_configuration__remove(struct raft_configuration *c, const unsigned id)
+{
+    size_t i;
+
+    assert(c != NULL);
+
+    i = raft_configuration__index(c, id);
+    if (i == c->n) {
+        return RAFT_ERR_BAD_SERVER_ID;
+    }
+
+    memmove(&c->servers[i], &c->servers[i + 1],
+            (c->n - i - 1) * sizeof *c->servers);
+    c->n--;
+
+    /* The positions of the following servers have changed. */
+    raft_configuration__fill(c);
+
+    return 0;
+}
+
+int raft_configuration__set_voting(struct raft_configuration *c,
+                                   const unsigned id,
+                                   const bool voting)
+{
+    size_t i;
+
+    assert(c != NULL);
+
+    i = raft_configuration__index(c, id);
+    if (i == c->n) {
+        return RAFT_ERR_BAD_SERVER_ID;
+    }
+
+    c->servers[i].voting = voting;
+
+    /* The voting indexes of the following servers have changed. */
+    raft_configuration__fill(c);
+
+    return 0;
+}
+
+int raft_configuration_set_priority(struct raft_configuration *c,
+                                    unsigned id,
+                                    uint8_t priority)
+{
+    size_t i;
+
+    assert(c != NULL);
+
+    i = raft_configuration__index(c, id);
+    if (i == c->n) {
+        return RAFT_ERR_BAD_SERVER_ID;
+    }
+
+    c->servers[i].priority = priority;
+
+    return 0;
+}
+
+uint8_t raft_configuration__max_priority(struct raft_configuration *c)
 {
+    uint8_t priority = 0;
     size_t i;
-    size_t n = 0;
 
     assert(c != NULL);
 
     for (i = 0; i < c->n; i++) {
-        if (c->servers[i].voting) {
-            n++;
+        if (c->servers[i].voting && c->servers[i].priority > priority) {
+            priority = c->servers[i].priority;
         }
     }
 
-    return n;
+    return priority;
+}
+
+size_t raft_configuration__n_voting(struct raft_configuration *c)
+{
+    assert(c != NULL);
+
+    return c->n_voting;
 }
 
 size_t raft_configuration__index(struct raft_configuration *c,
                                  const unsigned id)
 {
-    size_t i;
+    size_t slot;
 
     assert(c != NULL);
 
-    for (i = 0; i < c->n; i++) {
+    if (c->n == 0) {
+        return c->n;
+    }
+
+    slot = raft_configuration__hash(c, id);
+
+    while (c->slots[slot] != 0) {
+        size_t i = c->slots[slot] - 1;
+
         if (c->servers[i].id == id) {
             return i;
         }
+
+        slot = (slot + 1) & (c->n_slots - 1);
     }
 
     return c->n;
@@ -118,20 +331,13 @@ size_t raft_configuration__voting_index(struct raft_configuration *c,
                                         const unsigned id)
 {
     size_t i;
-    size_t index = 0;
 
     assert(c != NULL);
 
-    for (i = 0; i < c->n; i++) {
-        if (c->servers[i].id == id) {
-            if (c->servers[i].voting) {
-                return index;
-            }
-            return c->n;
-        }
-        if (c->servers[i].voting) {
-            index++;
-        }
+    i = raft_configuration__index(c, id);
+    if (i == c->n || !c->servers[i].voting) {
+        return c->n;
     }
-    return c->n;
+
+    return c->slots[c->n_slots + i];
 }
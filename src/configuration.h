@@ -7,17 +7,47 @@
 
 #include "../include/raft.h"
 
+/**
+ * Build the lookup data of a configuration whose servers array was filled
+ * directly, as when decoding it.
+ */
+int raft_configuration__build(struct raft_configuration *c);
+
 /**
  * Get the server with the given ID, if any.
  */
 const struct raft_server *raft_configuration__get(struct raft_configuration *c,
                                                   const unsigned id);
 
+/**
+ * Append to @dst a copy of all servers in @src. The addresses of the copies
+ * point to the ones in @src, which must outlive @dst.
+ */
+int raft_configuration__copy(struct raft_configuration *src,
+                             struct raft_configuration *dst);
+
+/**
+ * Remove the server with the given ID.
+ */
+int raft_configuration__remove(struct raft_configuration *c, const unsigned id);
+
+/**
+ * Set the voting flag of the server with the given ID.
+ */
+int raft_configuration__set_voting(struct raft_configuration *c,
+                                   const unsigned id,
+                                   const bool voting);
+
 /**
  * Return the number of voting servers.
  */
 size_t raft_configuration__n_voting(struct raft_configuration *c);
 
+/**
+ * Return the highest priority of the voting servers.
+ */
+uint8_t raft_configuration__max_priority(struct raft_configuration *c);
+
 /**
  * Return the index of the server with the given ID (relative to the c->servers
  * array). If there's no server with the given ID, return the number of servers.
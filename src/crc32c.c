@@ -0,0 +1,165 @@
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define RAFT_CRC32C__SSE42
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define RAFT_CRC32C__ARMV8
+#include <arm_acle.h>
+#endif
+
+#include "binary.h"
+#include "crc32c.h"
+
+/**
+ * CRC32C polynomial, in reversed bit order.
+ */
+#define RAFT_CRC32C__POLY 0x82f63b78
+
+/**
+ * Lookup tables for the slicing-by-8 implementation. The first one is the
+ * classic byte-at-a-time table, the k-th one gives the CRC of a byte followed
+ * by k zero bytes.
+ */
+static uint32_t raft_crc32c__table[8][256];
+
+/**
+ * Implementation selected at first use.
+ */
+static uint32_t (*raft_crc32c__update)(uint32_t crc,
+                                       const uint8_t *buf,
+                                       size_t len);
+
+static pthread_once_t raft_crc32c__once = PTHREAD_ONCE_INIT;
+
+static uint32_t raft_crc32c__sw(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    const uint32_t(*t)[256] = (const uint32_t(*)[256])raft_crc32c__table;
+
+    /* Process leading bytes until the buffer is 8-byte aligned. */
+    while (len > 0 && ((uintptr_t)buf & 7) != 0) {
+        crc = t[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+
+    while (len >= 8) {
+        uint64_t word;
+
+        memcpy(&word, buf, sizeof word);
+        word = raft__flip64(word) ^ crc;
+
+        crc = t[7][word & 0xff] ^ t[6][(word >> 8) & 0xff] ^
+              t[5][(word >> 16) & 0xff] ^ t[4][(word >> 24) & 0xff] ^
+              t[3][(word >> 32) & 0xff] ^ t[2][(word >> 40) & 0xff] ^
+              t[1][(word >> 48) & 0xff] ^ t[0][word >> 56];
+
+        buf += 8;
+        len -= 8;
+    }
+
+    while (len > 0) {
+        crc = t[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+
+    return crc;
+}
+
+#if defined(RAFT_CRC32C__SSE42)
+__attribute__((target("sse4.2"))) static uint32_t
+raft_crc32c__sse42(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    uint64_t crc64;
+
+    while (len > 0 && ((uintptr_t)buf & 7) != 0) {
+        crc = _mm_crc32_u8(crc, *buf++);
+        len--;
+    }
+
+    crc64 = crc;
+    while (len >= 8) {
+        uint64_t word;
+
+        memcpy(&word, buf, sizeof word);
+        crc64 = _mm_crc32_u64(crc64, word);
+
+        buf += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)crc64;
+
+    while (len > 0) {
+        crc = _mm_crc32_u8(crc, *buf++);
+        len--;
+    }
+
+    return crc;
+}
+#endif
+
+#if defined(RAFT_CRC32C__ARMV8)
+static uint32_t raft_crc32c__armv8(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    while (len > 0 && ((uintptr_t)buf & 7) != 0) {
+        crc = __crc32cb(crc, *buf++);
+        len--;
+    }
+
+    while (len >= 8) {
+        uint64_t word;
+
+        memcpy(&word, buf, sizeof word);
+        crc = __crc32cd(crc, word);
+
+        buf += 8;
+        len -= 8;
+    }
+
+    while (len > 0) {
+        crc = __crc32cb(crc, *buf++);
+        len--;
+    }
+
+    return crc;
+}
+#endif
+
+static void raft_crc32c__init(void)
+{
+    unsigned i;
+    unsigned k;
+
+    for (i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (RAFT_CRC32C__POLY & (0 - (crc & 1)));
+        }
+        raft_crc32c__table[0][i] = crc;
+    }
+
+    for (i = 0; i < 256; i++) {
+        uint32_t crc = raft_crc32c__table[0][i];
+        for (k = 1; k < 8; k++) {
+            crc = raft_crc32c__table[0][crc & 0xff] ^ (crc >> 8);
+            raft_crc32c__table[k][i] = crc;
+        }
+    }
+
+    raft_crc32c__update = raft_crc32c__sw;
+
+#if defined(RAFT_CRC32C__SSE42)
+    if (__builtin_cpu_supports("sse4.2")) {
+        raft_crc32c__update = raft_crc32c__sse42;
+    }
+#elif defined(RAFT_CRC32C__ARMV8)
+    raft_crc32c__update = raft_crc32c__armv8;
+#endif
+}
+
+uint32_t raft_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    pthread_once(&raft_crc32c__once, raft_crc32c__init);
+
+    return ~raft_crc32c__update(~crc, buf, len);
+}
@@ -0,0 +1,24 @@
+/**
+ * CRC32C (Castagnoli) checksums, used to detect corruption of entry batches.
+ *
+ * The SSE4.2 crc32 instruction is used on x86-64 processors supporting it
+ * (detected at runtime) and the ARMv8 CRC32 instructions on AArch64 builds
+ * targeting them. Everywhere else a table-driven slicing-by-8 implementation
+ * is used.
+ */
+
+#ifndef RAFT_CRC32C_H
+#define RAFT_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Extend the given @crc with the CRC32C of the @len bytes at @buf.
+ *
+ * Start with a @crc of 0: data can be fed in any number of pieces, and the
+ * result is the same as if it was checksummed in one go.
+ */
+uint32_t raft_crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif /* RAFT_CRC32C_H */
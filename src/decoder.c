@@ -0,0 +1,472 @@
+#include <assert.h>
+#include <string.h>
+
+#include "../include/raft.h"
+
+#include "binary.h"
+#include "crc32c.h"
+#include "encoding.h"
+#include "lz.h"
+
+/**
+ * Sections of a message, received in order.
+ */
+enum {
+    RAFT_DECODER__HEADER = 0, /* Version, type and size of the message */
+    RAFT_DECODER__BODY,       /* Message fields, including the batch header */
+    RAFT_DECODER__PAYLOAD,    /* Entries data of an AppendEntries request */
+    RAFT_DECODER__ERROR       /* The stream is broken */
+};
+
+void raft_decoder_init(struct raft_decoder *d, int flags, size_t max_size)
+{
+    assert(d != NULL);
+    assert(max_size > 0);
+
+    d->flags = flags;
+    d->max_size = max_size;
+    d->state = RAFT_DECODER__HEADER;
+    d->offset = 0;
+    d->body.base = NULL;
+    d->body.len = 0;
+    d->cap = 0;
+    d->payload.base = NULL;
+    d->payload.len = 0;
+    d->payload_len = 0;
+    d->crc = 0;
+    d->scratch = NULL;
+    d->n_scratch = 0;
+    d->message.type = RAFT_IO_NULL;
+    d->message.version = RAFT_ENCODING_V1;
+}
+
+/**
+ * Return true if the entries array and the entries data of the AppendEntries
+ * request being decoded share the same allocation, in which case the payload
+ * buffer is allocated separately only if the data is compressed.
+ */
+static bool raft_decoder__is_inline(struct raft_decoder *d)
+{
+    return !(d->flags & RAFT_BATCH_ALIGNED);
+}
+
+/**
+ * Release the memory of the AppendEntries request being decoded.
+ */
+static void raft_decoder__release(struct raft_decoder *d)
+{
+    struct raft_append_entries_args *args = &d->message.append_entries;
+
+    if (d->payload.base != NULL &&
+        (!raft_decoder__is_inline(d) || args->compressed != 0)) {
+        raft_free(d->payload.base);
+    }
+
+    if (args->entries != NULL) {
+        raft_free(args->entries);
+    }
+}
+
+void raft_decoder_close(struct raft_decoder *d)
+{
+    assert(d != NULL);
+
+    if (d->state == RAFT_DECODER__PAYLOAD) {
+        /* Release the partially received AppendEntries request. */
+        raft_decoder__release(d);
+    }
+
+    if (d->body.base != NULL) {
+        raft_free(d->body.base);
+    }
+
+    if (d->scratch != NULL) {
+        raft_free(d->scratch);
+    }
+}
+
+/**
+ * Copy into the @size bytes of the current section at @dst as many of the @len
+ * bytes at @src as are missing, and return how many were copied.
+ */
+static size_t raft_decoder__copy(struct raft_decoder *d,
+                                 void *dst,
+                                 size_t size,
+                                 const void *src,
+                                 size_t len)
+{
+    size_t count = size - d->offset;
+
+    if (count > len) {
+        count = len;
+    }
+
+    memcpy((uint8_t *)dst + d->offset, src, count);
+    d->offset += count;
+
+    return count;
+}
+
+/**
+ * Parse the header of a message and get ready to receive its body.
+ */
+static int raft_decoder__header(struct raft_decoder *d)
+{
+    uint32_t version;
+    uint32_t type;
+    uint64_t size;
+    size_t min;
+
+    memcpy(&version, d->header, sizeof version);
+    memcpy(&type, d->header + 4, sizeof type);
+    memcpy(&size, d->header + 8, sizeof size);
+
+    version = raft__flip32(version);
+    type = raft__flip32(type);
+    size = raft__flip64(size);
+
+    type = raft_decode__message_type(version, type);
+    min = raft_decode__message_min_size(version, type);
+    if (min == 0 || size < min) {
+        return RAFT_ERR_MALFORMED;
+    }
+
+    /* Don't let a peer make us allocate arbitrary amounts of memory. */
+    if (size > d->max_size) {
+        return RAFT_ERR_MALFORMED;
+    }
+
+    /* Grow the body buffer if needed. Its content doesn't need to be
+     * preserved. */
+    if (size > d->cap) {
+        if (d->body.base != NULL) {
+            raft_free(d->body.base);
+        }
+        d->cap = 0;
+        d->body.base = raft_malloc(size);
+        if (d->body.base == NULL) {
+            return RAFT_ERR_NOMEM;
+        }
+        d->cap = size;
+    }
+
+    d->message.type = type;
+    d->message.version = version;
+    d->body.len = size;
+    d->state = RAFT_DECODER__BODY;
+    d->offset = 0;
+
+    return 0;
+}
+
+/**
+ * Return the memory where the uncompressed entries data of the AppendEntries
+ * request being decoded is laid out, right after its entries array.
+ */
+static void *raft_decoder__inline_data(struct raft_decoder *d)
+{
+    struct raft_append_entries_args *args = &d->message.append_entries;
+
+    return args->entries + args->n;
+}
+
+/**
+ * Decompress the entries data of an AppendEntries request into the memory
+ * following its entries array, releasing the received payload buffer.
+ */
+static int raft_decoder__inflate(struct raft_decoder *d)
+{
+    struct raft_append_entries_args *args = &d->message.append_entries;
+    size_t size = raft_encode__batch_data_size(args->entries, args->n);
+    int rv;
+
+    /* Compressed batches always have some data. */
+    if (size == 0) {
+        return RAFT_ERR_MALFORMED;
+    }
+
+    rv = raft_lz__decompress(d->payload.base, args->compressed,
+                             raft_decoder__inline_data(d), size);
+    if (rv != 0) {
+        return rv;
+    }
+
+    raft_free(d->payload.base);
+    d->payload.base = NULL;
+    args->compressed = 0;
+
+    return 0;
+}
+
+/**
+ * Check the entries data of an AppendEntries request that has been received
+ * entirely, and point its entries to it.
+ */
+static int raft_decoder__payload(struct raft_decoder *d)
+{
+    struct raft_append_entries_args *args = &d->message.append_entries;
+    struct raft_buffer data;
+    unsigned i;
+    int rv;
+
+    if (args->has_checksum && d->crc != args->checksum) {
+        rv = RAFT_ERR_CHECKSUM;
+        goto err;
+    }
+
+    if (!raft_decoder__is_inline(d)) {
+        rv = raft_inflate_entries_batch(args, &d->payload, d->flags);
+        if (rv != 0) {
+            goto err;
+        }
+
+        rv = raft_decode_entries_batch(&d->payload, args->entries, args->n);
+        if (rv != 0) {
+            goto err;
+        }
+
+        return 0;
+    }
+
+    if (args->n == 0) {
+        return 0;
+    }
+
+    if (args->compressed != 0) {
+        rv = raft_decoder__inflate(d);
+        if (rv != 0) {
+            goto err;
+        }
+    }
+
+    data.base = raft_decoder__inline_data(d);
+    data.len = raft_encode__batch_data_size(args->entries, args->n);
+
+    rv = raft_decode_entries_batch(&data, args->entries, args->n);
+    if (rv != 0) {
+        goto err;
+    }
+
+    /* The entries array is at the start of the allocation, so it acts as the
+     * batch that gets released once the log is done with the entries. */
+    for (i = 0; i < args->n; i++) {
+        args->entries[i].batch = args->entries;
+    }
+
+    return 0;
+
+err:
+    raft_decoder__release(d);
+
+    return rv;
+}
+
+/**
+ * Allocate the memory holding both the entries array and the uncompressed
+ * entries data of the AppendEntries request being decoded, and move the
+ * entries there. The array the entries were decoded into is kept for decoding
+ * the next requests.
+ */
+static int raft_decoder__alloc_inline(struct raft_decoder *d)
+{
+    struct raft_append_entries_args *args = &d->message.append_entries;
+    size_t array = args->n * sizeof *args->entries;
+    size_t size = raft_encode__batch_data_size(args->entries, args->n);
+    struct raft_entry *entries;
+
+    if (args->entries != d->scratch) {
+        if (d->scratch != NULL) {
+            raft_free(d->scratch);
+        }
+        d->scratch = args->entries;
+        d->n_scratch = args->n;
+    }
+
+    entries = raft_malloc(array + size);
+    if (entries == NULL) {
+        args->entries = NULL;
+        return RAFT_ERR_NOMEM;
+    }
+
+    memcpy(entries, d->scratch, array);
+    args->entries = entries;
+
+    return 0;
+}
+
+/**
+ * Get ready to receive the entries data of an AppendEntries request, whose
+ * body has been decoded. If there's no data, the request is complete.
+ */
+static int raft_decoder__start_payload(struct raft_decoder *d, bool *done)
+{
+    struct raft_append_entries_args *args = &d->message.append_entries;
+    size_t size;
+    size_t len;
+    int rv;
+
+    d->payload.base = NULL;
+    d->payload.len = 0;
+    d->crc = 0;
+
+    if (args->n == 0) {
+        *done = true;
+        return raft_decoder__payload(d);
+    }
+
+    if (args->compressed != 0) {
+        /* The data gets laid out as requested once decompressed. */
+        d->payload_len = raft_encode__align(args->compressed, 8);
+        len = d->payload_len;
+    } else {
+        d->payload_len = raft_encode__batch_data_size(args->entries, args->n);
+        len = raft_entries_batch_size(args->entries, args->n, d->flags);
+    }
+
+    /* The entries data counts towards the maximum message size too, and is
+     * checked before allocating memory for it. */
+    size = raft_encode__batch_data_size(args->entries, args->n);
+    if (size < d->payload_len) {
+        size = d->payload_len;
+    }
+    if (size > d->max_size - d->body.len) {
+        if (args->entries != d->scratch) {
+            raft_free(args->entries);
+        }
+        return RAFT_ERR_MALFORMED;
+    }
+
+    if (raft_decoder__is_inline(d)) {
+        rv = raft_decoder__alloc_inline(d);
+        if (rv != 0) {
+            return rv;
+        }
+    }
+
+    if (d->payload_len == 0) {
+        *done = true;
+        return raft_decoder__payload(d);
+    }
+
+    if (raft_decoder__is_inline(d) && args->compressed == 0) {
+        /* Receive the data straight after the entries array. */
+        d->payload.base = raft_decoder__inline_data(d);
+    } else if ((d->flags & RAFT_BATCH_ALIGNED) && args->compressed == 0) {
+        d->payload.base = raft_aligned_alloc(RAFT_BATCH_ALIGNMENT, len);
+    } else {
+        d->payload.base = raft_malloc(len);
+    }
+
+    if (d->payload.base == NULL) {
+        raft_free(args->entries);
+        return RAFT_ERR_NOMEM;
+    }
+
+    d->payload.len = len;
+
+    /* Zero the trailing padding of the aligned layout. */
+    memset((uint8_t *)d->payload.base + d->payload_len, 0,
+           len - d->payload_len);
+
+    d->state = RAFT_DECODER__PAYLOAD;
+    d->offset = 0;
+
+    return 0;
+}
+
+/**
+ * Decode the body of a message that has been received entirely.
+ */
+static int raft_decoder__body(struct raft_decoder *d, bool *done)
+{
+    int rv;
+
+    if (raft_decoder__is_inline(d)) {
+        rv = raft_decode__message_body(&d->body, d->scratch, d->n_scratch,
+                                       &d->message);
+    } else {
+        rv = raft_decode__message_body(&d->body, NULL, 0, &d->message);
+    }
+    if (rv != 0) {
+        return rv;
+    }
+
+    if (d->message.type == RAFT_IO_APPEND_ENTRIES) {
+        return raft_decoder__start_payload(d, done);
+    }
+
+    *done = true;
+
+    return 0;
+}
+
+int raft_decoder_feed(struct raft_decoder *d,
+                      const void *buf,
+                      size_t len,
+                      size_t *n,
+                      struct raft_message *message)
+{
+    bool done = false;
+    int rv = 0;
+
+    assert(d != NULL);
+    assert(d->state != RAFT_DECODER__ERROR);
+    assert(buf != NULL || len == 0);
+    assert(n != NULL);
+    assert(message != NULL);
+
+    *n = 0;
+    message->type = RAFT_IO_NULL;
+
+    while (*n < len && !done) {
+        const uint8_t *src = (const uint8_t *)buf + *n;
+        size_t count;
+
+        switch (d->state) {
+            case RAFT_DECODER__HEADER:
+                *n += raft_decoder__copy(d, d->header, sizeof d->header, src,
+                                         len - *n);
+                if (d->offset == sizeof d->header) {
+                    rv = raft_decoder__header(d);
+                }
+                break;
+            case RAFT_DECODER__BODY:
+                *n += raft_decoder__copy(d, d->body.base, d->body.len, src,
+                                         len - *n);
+                if (d->offset == d->body.len) {
+                    rv = raft_decoder__body(d, &done);
+                }
+                break;
+            default:
+                assert(d->state == RAFT_DECODER__PAYLOAD);
+
+                /* Checksum the data as it arrives, while it's hot in cache. */
+                count = raft_decoder__copy(d, d->payload.base, d->payload_len,
+                                           src, len - *n);
+                d->crc = raft_crc32c(d->crc, src, count);
+                *n += count;
+
+                if (d->offset == d->payload_len) {
+                    done = true;
+                    rv = raft_decoder__payload(d);
+                }
+                break;
+        }
+
+        if (rv != 0) {
+            d->state = RAFT_DECODER__ERROR;
+            return rv;
+        }
+    }
+
+    if (done) {
+        /* Ownership of the entries and their data passes to the caller. */
+        *message = d->message;
+        d->state = RAFT_DECODER__HEADER;
+        d->offset = 0;
+        d->payload.base = NULL;
+        d->payload.len = 0;
+    }
+
+    return 0;
+}
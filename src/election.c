@@ -2,20 +2,188 @@
 
 #include "configuration.h"
 #include "election.h"
+#include "io.h"
 #include "log.h"
 #include "logger.h"
 
-void raft_election__reset_timer(struct raft *r)
+/**
+ * Set election_timeout_rand to a random value derived from election_timeout.
+ */
+static void raft_election__randomize_timeout(struct raft *r)
 {
-    assert(r != NULL);
+    const struct raft_server *server;
+    uint8_t max_priority;
 
     /* [election_timeout, 2 * election_timeout) */
     r->election_timeout_rand =
         r->election_timeout + (abs(r->rand()) % r->election_timeout);
 
+    /* Give servers with a higher priority a head start, so they are likely to
+     * win the election. */
+    server = raft_configuration__get(&r->configuration, r->id);
+    max_priority = raft_configuration__max_priority(&r->configuration);
+    if (server != NULL && server->priority < max_priority) {
+        r->election_timeout_rand += r->election_timeout / 2;
+    }
+}
+
+void raft_election__reset_timer(struct raft *r)
+{
+    assert(r != NULL);
+
+    raft_election__randomize_timeout(r);
+
     r->timer = 0;
 }
 
+/**
+ * Multiple of the round-trip time used as election timeout, and ratio between
+ * the election timeout and the heartbeat timeout, when adapting them.
+ */
+#define RAFT_ELECTION__RTT_FACTOR 10
+#define RAFT_ELECTION__HEARTBEAT_RATIO 10
+
+/**
+ * Set the election timeout to the given value clamped into the adaptive range,
+ * and derive the heartbeat timeout from it. The randomized election timeout is
+ * drawn again, so the new value takes effect at the current election timer.
+ */
+static void raft_election__set_timeouts(struct raft *r, raft_time timeout)
+{
+    if (timeout < r->election_timeout_min) {
+        timeout = r->election_timeout_min;
+    }
+    if (timeout > r->election_timeout_max) {
+        timeout = r->election_timeout_max;
+    }
+
+    if (timeout == r->election_timeout) {
+        return;
+    }
+
+    r->election_timeout = (unsigned)timeout;
+    r->heartbeat_timeout = r->election_timeout / RAFT_ELECTION__HEARTBEAT_RATIO;
+    if (r->heartbeat_timeout == 0) {
+        r->heartbeat_timeout = 1;
+    }
+
+    raft_election__randomize_timeout(r);
+
+    raft__debugf(r, "election timeout %u ms", r->election_timeout);
+}
+
+void raft_election__clamp_timeouts(struct raft *r)
+{
+    assert(r != NULL);
+
+    if (r->election_timeout_max == 0) {
+        return;
+    }
+
+    raft_election__set_timeouts(r, r->election_timeout);
+}
+
+void raft_election__probe_rtt(struct raft *r, size_t i, raft_index index)
+{
+    struct raft_rtt *rtt;
+
+    assert(r != NULL);
+    assert(r->state == RAFT_STATE_LEADER);
+
+    rtt = &r->leader_state.rtt[i];
+
+    /* Give up on a request whose result got lost. */
+    if (rtt->probe_index != 0 &&
+        r->now - rtt->probe_start > r->election_timeout) {
+        rtt->probe_index = 0;
+    }
+
+    /* Requests carrying no new entries could be mistaken for earlier ones. */
+    if (index <= rtt->sent_index) {
+        return;
+    }
+    rtt->sent_index = index;
+
+    if (rtt->probe_index == 0) {
+        rtt->probe_index = index;
+        rtt->probe_start = r->now;
+    }
+}
+
+void raft_election__sample_rtt(struct raft *r,
+                               size_t i,
+                               const struct raft_append_entries_result *result)
+{
+    struct raft_rtt *rtt;
+    raft_time sample;
+    unsigned rtt8 = 0;
+    size_t j;
+
+    assert(r != NULL);
+    assert(r->state == RAFT_STATE_LEADER);
+
+    rtt = &r->leader_state.rtt[i];
+
+    if (rtt->probe_index == 0) {
+        return;
+    }
+
+    /* A rejection doesn't tell which request it answers. */
+    if (!result->success) {
+        rtt->probe_index = 0;
+        return;
+    }
+
+    if (result->last_log_index < rtt->probe_index) {
+        return;
+    }
+
+    rtt->probe_index = 0;
+
+    if (r->election_timeout_max == 0) {
+        return;
+    }
+
+    /* Samples beyond the upper bound would just saturate it. */
+    sample = r->now - rtt->probe_start;
+    if (sample > r->election_timeout_max) {
+        sample = r->election_timeout_max;
+    }
+
+    /* Smooth the samples like TCP does, with a gain of 1/8 (RFC 6298). */
+    if (rtt->rtt8 == 0) {
+        rtt->rtt8 = (unsigned)sample * 8;
+    } else {
+        rtt->rtt8 = rtt->rtt8 - rtt->rtt8 / 8 + (unsigned)sample;
+    }
+
+    /* Heartbeats must reach every voter in time, so go by the slowest one. */
+    for (j = 0; j < r->configuration.n; j++) {
+        const struct raft_server *server = &r->configuration.servers[j];
+        if (server->id != r->id && server->voting &&
+            r->leader_state.rtt[j].rtt8 > rtt8) {
+            rtt8 = r->leader_state.rtt[j].rtt8;
+        }
+    }
+
+    if (rtt8 == 0) {
+        return;
+    }
+
+    raft_election__set_timeouts(r, rtt8 * RAFT_ELECTION__RTT_FACTOR / 8);
+}
+
+void raft_election__follow_heartbeats(struct raft *r, raft_time interval)
+{
+    assert(r != NULL);
+
+    if (r->election_timeout_max == 0) {
+        return;
+    }
+
+    raft_election__set_timeouts(r, interval * RAFT_ELECTION__HEARTBEAT_RATIO);
+}
+
 /**
  * Send a RequestVote RPC to the given server.
  */
@@ -34,10 +202,17 @@ static int raft_election__send_request_vote(struct raft *r,
 
     /* TODO: account for snapshots */
 
+    /* During the Pre-Vote phase we ask for votes in the term we would start an
+     * election with, without having incremented our own yet. */
     args.term = r->current_term;
+    if (r->candidate_state.in_pre_vote) {
+        args.term++;
+    }
     args.candidate_id = r->id;
     args.last_log_index = raft_log__last_index(&r->log);
     args.last_log_term = raft_log__last_term(&r->log);
+    args.pre_vote = r->candidate_state.in_pre_vote;
+    args.disrupt_leader = r->candidate_state.disrupt_leader;
 
     rv = r->io->send_request_vote_request(r->io, server, &args);
     if (rv != 0) {
@@ -47,7 +222,7 @@ static int raft_election__send_request_vote(struct raft *r,
     return 0;
 }
 
-int raft_election__start(struct raft *r)
+int raft_election__start(struct raft *r, bool pre_vote)
 {
     raft_term term;
     size_t n_voting;
@@ -72,32 +247,40 @@ int raft_election__start(struct raft *r)
     assert(n_voting <= r->configuration.n);
     assert(voting_index < n_voting);
 
-    /* Increment current term */
-    term = r->current_term + 1;
-    rv = r->io->write_term(r->io, term);
-    if (rv != 0) {
-        return rv;
+    /* If we're the only voter there's nobody to disrupt. */
+    if (n_voting == 1) {
+        pre_vote = false;
     }
 
-    /* Vote for self */
-    rv = r->io->write_vote(r->io, r->id);
-    if (rv != 0) {
-        return rv;
-    }
+    r->candidate_state.in_pre_vote = pre_vote;
 
-    /* Update our cache too. */
-    r->current_term = term;
-    r->voted_for = r->id;
+    /* Increment current term and vote for self, with a single write. If the
+     * write is asynchronous, vote requests are sent while it's in flight. None
+     * of this happens in the Pre-Vote phase, which is not binding. */
+    if (!pre_vote) {
+        term = r->current_term + 1;
+        rv = raft_io__write_term_and_vote(r, term, r->id);
+        if (rv != 0) {
+            return rv;
+        }
+
+        /* Update our cache too. */
+        r->current_term = term;
+        r->voted_for = r->id;
+    }
 
     /* Reset election timer. */
     raft_election__reset_timer(r);
 
     assert(r->candidate_state.votes != NULL);
 
-    /* Initialize the votes array and send vote requests. */
+    /* Initialize the votes array and send vote requests. Our own vote is
+     * counted only once it's durable, that is upon completion of the write if
+     * it's asynchronous. */
     for (i = 0; i < n_voting; i++) {
         if (i == voting_index) {
-            r->candidate_state.votes[i] = true; /* We vote for ourselves */
+            r->candidate_state.votes[i] =
+                pre_vote || !raft_io__async_metadata(r);
         } else {
             r->candidate_state.votes[i] = false;
         }
@@ -121,27 +304,25 @@ int raft_election__start(struct raft *r)
     return 0;
 }
 
-int raft_election__maybe_grant_vote(struct raft *r,
-                                    const struct raft_request_vote_args *args,
-                                    bool *granted)
+bool raft_election__should_grant_vote(
+    struct raft *r,
+    const struct raft_request_vote_args *args,
+    unsigned voted_for)
 {
     const struct raft_server *local_server;
     uint64_t local_last_log_index;
     uint64_t local_last_log_term;
-    int rv;
 
     local_server = raft_configuration__get(&r->configuration, r->id);
 
-    *granted = false;
-
     if (local_server == NULL || !local_server->voting) {
         raft__debugf(r, "local server is not voting -> not granting vote");
-        return 0;
+        return false;
     }
 
-    if (r->voted_for != 0 && r->voted_for != args->candidate_id) {
+    if (voted_for != 0 && voted_for != args->candidate_id) {
         raft__debugf(r, "local server already voted -> not granting vote");
-        return 0;
+        return false;
     }
 
     local_last_log_index = raft_log__last_index(&r->log);
@@ -149,7 +330,7 @@ int raft_election__maybe_grant_vote(struct raft *r,
     /* Our log is definitely not more up-to-date if it's empty! */
     if (local_last_log_index == 0) {
         raft__debugf(r, "local log is empty -> granting vote");
-        goto grant_vote;
+        return true;
     }
 
     /* TODO: account for snapshots */
@@ -159,14 +340,14 @@ int raft_election__maybe_grant_vote(struct raft *r,
         /* The requesting server has last entry's log term lower than ours. */
         raft__debugf(
             r, "local log last entry has higher last term -> not granting");
-        return 0;
+        return false;
     }
 
     if (args->last_log_term > local_last_log_term) {
         /* The requesting server has a more up-to-date log. */
         raft__debugf(r,
                      "remote log last entry has higher term -> granting vote");
-        goto grant_vote;
+        return true;
     }
 
     /* The term of the last log entry is the same, so let's compare the length
@@ -177,15 +358,27 @@ int raft_election__maybe_grant_vote(struct raft *r,
         /* Our log is shorter or equal to the one of the requester. */
         raft__debugf(r,
                      "remote log equal or longer than local -> granting vote");
-        goto grant_vote;
+        return true;
     }
 
     raft__debugf(r, "remote log shorter than local -> not granting vote");
 
-    return 0;
+    return false;
+}
+
+int raft_election__maybe_grant_vote(struct raft *r,
+                                    const struct raft_request_vote_args *args,
+                                    bool *granted)
+{
+    int rv;
 
-grant_vote:
-    rv = r->io->write_vote(r->io, args->candidate_id);
+    *granted = false;
+
+    if (!raft_election__should_grant_vote(r, args, r->voted_for)) {
+        return 0;
+    }
+
+    rv = raft_io__write_term_and_vote(r, r->current_term, args->candidate_id);
     if (rv != 0) {
         return rv;
     }
@@ -203,6 +396,7 @@ bool raft_election__maybe_win(struct raft *r, size_t votes_index)
 {
     size_t n_voting = raft_configuration__n_voting(&r->configuration);
     size_t votes = 0;
+    size_t self_index;
     size_t i;
     size_t half = n_voting / 2;
 
@@ -212,6 +406,13 @@ bool raft_election__maybe_win(struct raft *r, size_t votes_index)
 
     r->candidate_state.votes[votes_index] = true;
 
+    /* We can't win before our own vote for ourselves is durable, otherwise we
+     * might vote for someone else in the same term after a restart. */
+    self_index = raft_configuration__voting_index(&r->configuration, r->id);
+    if (!r->candidate_state.votes[self_index]) {
+        return false;
+    }
+
     for (i = 0; i < n_voting; i++) {
         if (r->candidate_state.votes[i]) {
             votes++;
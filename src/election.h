@@ -11,7 +11,8 @@
 
 /**
  * Reset the election_timer clock and set election_timeout_rand to a random
- * value between election_timeout and 2 * election_timeout.
+ * value between election_timeout and 2 * election_timeout, plus half an
+ * election timeout if another voting server has a higher priority than ours.
  *
  * From Section §3.4:
  *
@@ -37,7 +38,37 @@
 void raft_election__reset_timer(struct raft *r);
 
 /**
- * Start a new election round.
+ * Account for an AppendEntries request carrying entries up to @index that was
+ * just sent to the server at index @i in the configuration, starting to time
+ * it if no other request to that server is being timed.
+ */
+void raft_election__probe_rtt(struct raft *r, size_t i, raft_index index);
+
+/**
+ * Account for an AppendEntries result from the server at index @i in the
+ * configuration. If it answers the request being timed, update the round-trip
+ * time of the server and adapt the election and heartbeat timeouts to the
+ * largest one among voting servers, if enabled.
+ */
+void raft_election__sample_rtt(struct raft *r,
+                               size_t i,
+                               const struct raft_append_entries_result *result);
+
+/**
+ * Adapt the election timeout of a follower to the given @interval between
+ * two consecutive heartbeats of its leader, if enabled.
+ */
+void raft_election__follow_heartbeats(struct raft *r, raft_time interval);
+
+/**
+ * Clamp the current election timeout into the adaptive range, if enabled, and
+ * update the heartbeat timeout accordingly.
+ */
+void raft_election__clamp_timeouts(struct raft *r);
+
+/**
+ * Start a new election round, or its Pre-Vote phase if @pre_vote is true and
+ * there are other voting servers.
  *
  * From Figure 3.1:
  *
@@ -54,8 +85,26 @@ void raft_election__reset_timer(struct raft *r);
  *   To begin an election, a follower increments its current term and
  *   transitions to candidate state.  It then votes for itself and issues
  *   RequestVote RPCs in parallel to each of the other servers in the cluster.
+ *
+ * From Section §9.6:
+ *
+ *   Raft's solution to this is the Pre-Vote phase. In the Pre-Vote algorithm,
+ *   a candidate only increments its term if it first learns from a majority of
+ *   the cluster that they would be willing to grant the candidate their votes.
+ *
+ * In the Pre-Vote phase the server is in candidate state, but neither its term
+ * nor its vote are changed.
+ */
+int raft_election__start(struct raft *r, bool pre_vote);
+
+/**
+ * Decide whether our vote should be granted to the requesting server, given
+ * the server we have already voted for in the request's term (0 for none).
  */
-int raft_election__start(struct raft *r);
+bool raft_election__should_grant_vote(
+    struct raft *r,
+    const struct raft_request_vote_args *args,
+    unsigned voted_for);
 
 /**
  * Decide whether our vote should be granted to the requesting server and update
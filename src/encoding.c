@@ -1,11 +1,39 @@
 #include <assert.h>
+#include <limits.h>
 #include <string.h>
 
 #include "../include/raft.h"
 
+#include "batch.h"
 #include "binary.h"
-
-#define RAFT_ENCODING__VERSION 1
+#include "configuration.h"
+#include "crc32c.h"
+#include "encoding.h"
+#include "lz.h"
+
+/**
+ * Version of the batch header format. Batches of this version carry a CRC32C
+ * checksum of their header and one of their data section.
+ */
+#define RAFT_ENCODING__BATCH_VERSION 1
+
+/**
+ * Minimum size of the data section of a batch for it to get compressed.
+ */
+#define RAFT_ENCODING__COMPRESS_MIN 64
+
+/**
+ * Version of the configuration format carrying the priority of each server
+ * after its voting flag. It's used only if some server has a non-zero
+ * priority, so servers running older versions can still decode other
+ * configurations.
+ */
+#define RAFT_ENCODING__CONFIGURATION_PRIORITY 2
+
+/**
+ * Zero bytes used to checksum the padding of entries data.
+ */
+static const uint8_t raft_encoding__padding[8];
 
 static void raft_encode__uint8(void **cursor, uint8_t value)
 {
@@ -15,7 +43,7 @@ static void raft_encode__uint8(void **cursor, uint8_t value)
 
 static void raft_encode__uint32(void **cursor, uint32_t value)
 {
-    *(uint32_t *)(*cursor) = value;
+    *(uint32_t *)(*cursor) = raft__flip32(value);
     *cursor += sizeof(uint32_t);
 }
 
@@ -46,15 +74,39 @@ static uint64_t raft_decode__uint64(void **cursor)
     return value;
 }
 
-static size_t raft_encode__batch_header_size(size_t n)
+size_t raft_encode__batch_header_size(size_t n)
+{
+    return 8 +      /* Number of entries and format version */
+           16 * n + /* One header per entry */
+           8 /* Checksums of the data section and of the header */;
+}
+
+size_t raft_encode__batch_data_size(const struct raft_entry *entries, size_t n)
+{
+    return raft_batch__data_size(entries, n);
+}
+
+/**
+ * Return the format version to encode the given configuration with.
+ */
+static uint8_t raft_encode__configuration_version(
+    const struct raft_configuration *c)
 {
-    return 8 + /* Number of entries in the batch, little endian */
-           16 * n /* One header per entry */;
+    size_t i;
+
+    for (i = 0; i < c->n; i++) {
+        if (c->servers[i].priority != 0) {
+            return RAFT_ENCODING__CONFIGURATION_PRIORITY;
+        }
+    }
+
+    return RAFT_ENCODING__VERSION;
 }
 
 static size_t raft_encode__configuration_size(
     const struct raft_configuration *c)
 {
+    uint8_t version = raft_encode__configuration_version(c);
     size_t n = 0;
     size_t i;
 
@@ -73,6 +125,9 @@ static size_t raft_encode__configuration_size(
         n += sizeof(uint64_t) /* Server ID */;
         n += strlen(server->address) + 1;
         n++; /* Voting flag */
+        if (version == RAFT_ENCODING__CONFIGURATION_PRIORITY) {
+            n++; /* Priority */
+        }
     };
 
     return n;
@@ -81,6 +136,7 @@ static size_t raft_encode__configuration_size(
 int raft_encode_configuration(const struct raft_configuration *c,
                               struct raft_buffer *buf)
 {
+    uint8_t version;
     void *cursor;
     size_t i;
 
@@ -102,7 +158,8 @@ int raft_encode_configuration(const struct raft_configuration *c,
     cursor = buf->base;
 
     /* Encoding version */
-    raft_encode__uint8(&cursor, RAFT_ENCODING__VERSION);
+    version = raft_encode__configuration_version(c);
+    raft_encode__uint8(&cursor, version);
 
     /* Number of servers */
     raft_encode__uint64(&cursor, c->n);
@@ -118,6 +175,10 @@ int raft_encode_configuration(const struct raft_configuration *c,
         cursor += strlen(server->address) + 1;
 
         raft_encode__uint8(&cursor, server->voting);
+
+        if (version == RAFT_ENCODING__CONFIGURATION_PRIORITY) {
+            raft_encode__uint8(&cursor, server->priority);
+        }
     };
 
     return 0;
@@ -128,13 +189,16 @@ static size_t raft_decode__configuration_size(const struct raft_buffer *buf)
     void *cursor = buf->base;
     size_t size = 0;
     size_t n_servers;
+    uint8_t version;
     size_t i;
 
     assert(buf->base != NULL);
     assert(buf->len > 0);
 
     /* Check the encoding format version */
-    if (raft_decode__uint8(&cursor) != RAFT_ENCODING__VERSION) {
+    version = raft_decode__uint8(&cursor);
+    if (version != RAFT_ENCODING__VERSION &&
+        version != RAFT_ENCODING__CONFIGURATION_PRIORITY) {
         return 0;
     }
 
@@ -172,6 +236,11 @@ static size_t raft_decode__configuration_size(const struct raft_buffer *buf)
 
         /* Skip voting flag. */
 	raft_decode__uint8(&cursor);
+
+        /* Skip priority. */
+        if (version == RAFT_ENCODING__CONFIGURATION_PRIORITY) {
+            raft_decode__uint8(&cursor);
+        }
     };
 
     return size;
@@ -182,8 +251,10 @@ int raft_decode_configuration(const struct raft_buffer *buf,
 {
     void *cursor;
     uint8_t *addresses;
+    uint8_t version;
     size_t i;
     size_t n;
+    int rv;
 
     assert(c != NULL);
     assert(buf != NULL);
@@ -211,8 +282,8 @@ int raft_decode_configuration(const struct raft_buffer *buf,
 
     cursor = buf->base;
 
-    /* Skip the version byte */
-    raft_decode__uint8(&cursor);
+    /* Read the version byte, already checked above. */
+    version = raft_decode__uint8(&cursor);
 
     assert(cursor < buf->base + n);
 
@@ -241,345 +312,1853 @@ int raft_decode_configuration(const struct raft_buffer *buf,
 
         /* Voting flag. */
         c->servers[i].voting = raft_decode__uint8(&cursor);
+
+        /* Priority. */
+        c->servers[i].priority = 0;
+        if (version == RAFT_ENCODING__CONFIGURATION_PRIORITY) {
+            c->servers[i].priority = raft_decode__uint8(&cursor);
+        }
     };
 
+    rv = raft_configuration__build(c);
+    if (rv != 0) {
+        raft_free(c->servers);
+        raft_configuration_init(c);
+        return rv;
+    }
+
     return 0;
 }
 
-static void raft_encode__batch_header(const struct raft_entry *entries,
-                                      size_t n,
-                                      void *batch)
+uint32_t raft_encode__batch_data_crc(const struct raft_entry *entries,
+                                     size_t n)
 {
+    uint32_t crc = 0;
     size_t i;
-    void *cursor;
-
-    assert((entries == NULL && n == 0) || (entries != NULL && n != 0));
-    assert(batch != NULL);
-
-    cursor = batch;
-
-    /* Number of entries in the batch, little endian */
-    raft_encode__uint64(&cursor, n);
 
     for (i = 0; i < n; i++) {
         const struct raft_entry *entry = &entries[i];
 
-        /* Term in which the entry was created, little endian. */
-        raft_encode__uint64(&cursor, entry->term);
-
-        /* Message type (Either RAFT_LOG_COMMAND or RAFT_LOG_CONFIGURATION) */
-        raft_encode__uint8(&cursor, entry->type);
+        if (entry->buf.len == 0) {
+            continue;
+        }
 
-        cursor += 3; /* Unused */
+        crc = raft_crc32c(crc, entry->buf.base, entry->buf.len);
 
-        /* Size of the log entry data, little endian. */
-        raft_encode__uint32(&cursor, entry->buf.len);
+        if (entry->buf.len % 8 != 0) {
+            /* Add padding */
+            crc = raft_crc32c(crc, raft_encoding__padding,
+                              8 - (entry->buf.len % 8));
+        }
     }
+
+    return crc;
 }
 
-int raft_encode_append_entries(const struct raft_append_entries_args *args,
-                               struct raft_buffer *buf)
+/**
+ * Encode the header of a batch with the given entries and flags. The size of
+ * the compressed data section is only encoded if the batch is compressed.
+ */
+static void raft_encode__batch_header_(const struct raft_entry *entries,
+                                       size_t n,
+                                       unsigned flags,
+                                       size_t compressed,
+                                       uint32_t data_crc,
+                                       void *batch)
 {
     void *cursor;
 
-    assert(args != NULL);
-    assert(buf != NULL);
-
-    buf->len = 0;
+    assert((entries == NULL && n == 0) || (entries != NULL && n != 0));
+    assert(batch != NULL);
 
-    buf->len += 8; /* Slot for protocol version and message type. */
-    buf->len += 8; /* Slot for the message size. */
-    buf->len += 8; /* Leader's term. */
-    buf->len += 8; /* Leader ID. */
-    buf->len += 8; /* Previous log entry index. */
-    buf->len += 8; /* Previous log entry term. */
-    buf->len += 8; /* Leader's commit index. */
-    buf->len += raft_encode__batch_header_size(args->n);
+    cursor = batch;
 
-    buf->base = raft_malloc(buf->len);
+    /* Number of entries in the batch, little endian */
+    raft_encode__uint32(&cursor, n);
 
-    if (buf->base == NULL) {
-        return RAFT_ERR_NOMEM;
-    }
+    /* Format version */
+    raft_encode__uint8(&cursor, RAFT_ENCODING__BATCH_VERSION);
 
-    cursor = buf->base;
+    /* Flags */
+    raft_encode__uint8(&cursor, flags);
+    memset(cursor, 0, 2);
+    cursor += 2; /* Unused */
 
-    raft_encode__uint32(&cursor, RAFT_ENCODING__VERSION); /* Encode version */
-    raft_encode__uint32(&cursor, RAFT_IO_APPEND_ENTRIES); /* Message type */
+    /* One 16-byte header per entry. */
+    raft_batch__encode_headers(entries, n, cursor);
+    cursor += 16 * n;
 
-    raft_encode__uint64(&cursor,
-                        buf->len - 16); /* Exclude the message header */
+    if (flags & RAFT_ENCODING__BATCH_COMPRESSED) {
+        /* Size of the compressed data section, little endian. */
+        raft_encode__uint32(&cursor, compressed);
+        memset(cursor, 0, 4);
+        cursor += 4; /* Unused */
+    }
 
-    raft_encode__uint64(&cursor, args->term);           /* Leader's term. */
-    raft_encode__uint64(&cursor, args->leader_id);      /* Leader ID. */
-    raft_encode__uint64(&cursor, args->prev_log_index); /* Previous index. */
-    raft_encode__uint64(&cursor, args->prev_log_term);  /* Previous term. */
-    raft_encode__uint64(&cursor, args->leader_commit);  /* Commit index. */
+    /* Checksum of the data section, little endian. */
+    raft_encode__uint32(&cursor, data_crc);
 
-    raft_encode__batch_header(args->entries, args->n, cursor);
+    /* Checksum of everything above, little endian. */
+    raft_encode__uint32(&cursor, raft_crc32c(0, batch, cursor - batch));
+}
 
-    return 0;
+void raft_encode__batch_header(const struct raft_entry *entries,
+                               size_t n,
+                               void *batch)
+{
+    raft_encode__batch_header_(entries, n, 0, 0,
+                               raft_encode__batch_data_crc(entries, n), batch);
 }
 
-static int raft_decode__batch_header(void *batch,
-                                     struct raft_entry **entries,
-                                     unsigned *n)
+size_t raft_encode_append_entries_size(
+    const struct raft_append_entries_args *args)
 {
-    void *cursor = batch;
-    size_t i;
+    size_t size = 0;
 
-    *n = raft_decode__uint64(&cursor);
+    assert(args != NULL);
 
-    if (*n == 0) {
-        *entries = NULL;
-        return 0;
+    size += 8; /* Slot for protocol version and message type. */
+    size += 8; /* Slot for the message size. */
+    size += 8; /* Leader's term. */
+    size += 8; /* Leader ID. */
+    size += 8; /* Previous log entry index. */
+    size += 8; /* Previous log entry term. */
+    size += 8; /* Leader's commit index. */
+
+    if (args->batch != NULL) {
+        /* The batch header might have the compression extension. */
+        size += args->batch->iov[0].iov_len;
+    } else {
+        size += raft_encode__batch_header_size(args->n);
     }
 
-    *entries = raft_malloc((*n) * sizeof **entries);
-
-    if (*entries == NULL) {
-        return RAFT_ERR_NOMEM;
-    }
+    return size;
+}
 
-    for (i = 0; i < *n; i++) {
-        struct raft_entry *entry = &(*entries)[i];
+/**
+ * Encode the part of an AppendEntries request preceeding the batch header.
+ */
+static void raft_encode__append_entries_prefix(
+    const struct raft_append_entries_args *args,
+    size_t size,
+    void **cursor)
+{
+    raft_encode__uint32(cursor, RAFT_ENCODING__VERSION); /* Encode version */
+    raft_encode__uint32(cursor, RAFT_ENCODING_APPEND_ENTRIES); /* Type */
 
-        entry->term = raft_decode__uint64(&cursor);
-        entry->type = raft_decode__uint8(&cursor);
+    raft_encode__uint64(cursor, size - 16); /* Exclude the message header */
 
-        if (entry->type != RAFT_LOG_COMMAND &&
-            entry->type != RAFT_LOG_CONFIGURATION) {
-            goto err;
-        }
+    raft_encode__uint64(cursor, args->term);           /* Leader's term. */
+    raft_encode__uint64(cursor, args->leader_id);      /* Leader ID. */
+    raft_encode__uint64(cursor, args->prev_log_index); /* Previous index. */
+    raft_encode__uint64(cursor, args->prev_log_term);  /* Previous term. */
+    raft_encode__uint64(cursor, args->leader_commit);  /* Commit index. */
+}
 
-        cursor += 3; /* Unused */
+void raft_encode_append_entries_to(const struct raft_append_entries_args *args,
+                                   void *buf)
+{
+    size_t size = raft_encode_append_entries_size(args);
+    void *cursor = buf;
 
-        /* Size of the log entry data, little endian. */
-        entry->buf.len = raft_decode__uint32(&cursor);
-        entry->batch = batch;
-    }
+    assert(buf != NULL);
 
-    return 0;
+    raft_encode__append_entries_prefix(args, size, &cursor);
 
-err:
-    raft_free(*entries);
-    return RAFT_ERR_MALFORMED;
+    if (args->batch != NULL) {
+        /* The batch header was already encoded. */
+        assert(args->batch->n == args->n);
+        memcpy(cursor, args->batch->iov[0].iov_base,
+               args->batch->iov[0].iov_len);
+    } else {
+        raft_encode__batch_header(args->entries, args->n, cursor);
+    }
 }
 
-int raft_decode_append_entries(const struct raft_buffer *buf,
-                               struct raft_append_entries_args *args)
+int raft_encode_append_entries(const struct raft_append_entries_args *args,
+                               struct raft_buffer *buf)
 {
-    void *cursor;
-    int rv;
-
-    assert(buf != NULL);
     assert(args != NULL);
+    assert(buf != NULL);
 
-    cursor = buf->base;
-
-    args->term = raft_decode__uint64(&cursor);
-    args->leader_id = raft_decode__uint64(&cursor);
-    args->prev_log_index = raft_decode__uint64(&cursor);
-    args->prev_log_term = raft_decode__uint64(&cursor);
-    args->leader_commit = raft_decode__uint64(&cursor);
+    buf->len = raft_encode_append_entries_size(args);
+    buf->base = raft_malloc(buf->len);
 
-    rv = raft_decode__batch_header(cursor, &args->entries, &args->n);
-    if (rv != 0) {
-        return rv;
+    if (buf->base == NULL) {
+        return RAFT_ERR_NOMEM;
     }
 
+    raft_encode_append_entries_to(args, buf->base);
+
     return 0;
 }
 
-int raft_decode_entries_batch(const struct raft_buffer *buf,
-                              struct raft_entry *entries,
-                              unsigned n)
+/**
+ * Return the number of buffers needed to hold the data of the given entries,
+ * including padding.
+ */
+static unsigned raft_encode__entries_iov_count(const struct raft_entry *entries,
+                                               unsigned n)
 {
-    void *cursor;
+    unsigned count = 0;
     size_t i;
 
-    assert(buf != NULL);
+    for (i = 0; i < n; i++) {
+        size_t len = entries[i].buf.len;
+        if (len > 0) {
+            count++;
+        }
+        if (len % 8 != 0) {
+            count++; /* Padding */
+        }
+    }
 
-    cursor = buf->base;
+    return count;
+}
+
+/**
+ * Fill @iov with the data of the given entries and their padding, returning
+ * the number of buffers filled.
+ */
+static unsigned raft_encode__entries_iov(const struct raft_entry *entries,
+                                         unsigned n,
+                                         struct iovec iov[])
+{
+    unsigned count = 0;
+    size_t i;
 
     for (i = 0; i < n; i++) {
-        struct raft_entry *entry = &entries[i];
-        entry->batch = buf->base;
+        const struct raft_entry *entry = &entries[i];
 
         if (entry->buf.len == 0) {
-            entry->buf.base = NULL;
             continue;
         }
 
-        entry->buf.base = cursor;
+        iov[count].iov_base = entry->buf.base;
+        iov[count].iov_len = entry->buf.len;
+        count++;
 
-        cursor += entry->buf.len;
         if (entry->buf.len % 8 != 0) {
             /* Add padding */
-            cursor += 8 - (entry->buf.len % 8);
+            iov[count].iov_base = (void *)raft_encoding__padding;
+            iov[count].iov_len = 8 - (entry->buf.len % 8);
+            count++;
         }
     }
 
-    return 0;
+    return count;
 }
 
-int raft_encode_append_entries_result(
-    const struct raft_append_entries_result *result,
-    struct raft_buffer *buf)
+unsigned raft_encode_append_entries_iov_count(
+    const struct raft_append_entries_args *args)
 {
-    void *cursor;
+    assert(args != NULL);
 
-    assert(result != NULL);
-    assert(buf != NULL);
+    if (args->batch != NULL) {
+        return 1 + args->batch->n_iov;
+    }
 
-    buf->len = 0;
+    return 1 + raft_encode__entries_iov_count(args->entries, args->n);
+}
 
-    buf->len += 8; /* Slot for protocol version and message type. */
-    buf->len += 8; /* Slot for the message size. */
-    buf->len += 8; /* Term. */
-    buf->len += 8; /* Success. */
-    buf->len += 8; /* Last log index. */
+unsigned raft_encode_append_entries_iov(
+    const struct raft_append_entries_args *args,
+    void *header,
+    struct iovec iov[])
+{
+    const struct raft_append_entries_batch *batch = args->batch;
+    size_t size;
+    void *cursor = header;
 
-    buf->base = raft_malloc(buf->len);
+    assert(args != NULL);
+    assert(header != NULL);
+    assert(iov != NULL);
 
-    if (buf->base == NULL) {
-        return RAFT_ERR_NOMEM;
+    size = raft_encode_append_entries_size(args);
+
+    if (batch == NULL) {
+        raft_encode_append_entries_to(args, header);
+
+        iov[0].iov_base = header;
+        iov[0].iov_len = size;
+
+        return 1 + raft_encode__entries_iov(args->entries, args->n, iov + 1);
     }
 
-    cursor = buf->base;
+    /* Reuse the batch header and the data buffers of the shared batch. */
+    raft_encode__append_entries_prefix(args, size, &cursor);
 
-    raft_encode__uint32(&cursor, RAFT_ENCODING__VERSION); /* Encode version */
-    raft_encode__uint32(&cursor,
-                        RAFT_IO_APPEND_ENTRIES_RESULT); /* Message type */
-    raft_encode__uint64(&cursor,
-                        buf->len - 16); /* Exclude the message header */
+    iov[0].iov_base = header;
+    iov[0].iov_len = cursor - header;
 
-    raft_encode__uint64(&cursor, result->term);
-    raft_encode__uint64(&cursor, result->success);
-    raft_encode__uint64(&cursor, result->last_log_index);
+    memcpy(iov + 1, batch->iov, batch->n_iov * sizeof *iov);
 
-    return 0;
+    return 1 + batch->n_iov;
 }
 
-int raft_decode_append_entries_result(const struct raft_buffer *buf,
-                                      struct raft_append_entries_result *result)
+/**
+ * Create a batch holding the given entries, whose data section of @size bytes
+ * gets compressed. If the compressed data doesn't save at least 8 bytes, no
+ * batch is created and @batch is set to NULL.
+ */
+static int raft_encode__compressed_batch(
+    raft_index index,
+    struct raft_entry *entries,
+    unsigned n,
+    size_t size,
+    struct raft_append_entries_batch **batch)
 {
-    void *cursor;
+    struct raft_append_entries_batch *b;
+    size_t header_size =
+        raft_encode__batch_header_size(n) + RAFT_ENCODING__BATCH_EXTENSION_SIZE;
+    size_t compressed;
+    size_t padded;
+    void *header;
+    void *data;
+
+    *batch = NULL;
+
+    /* The compressor works on contiguous memory, while the data of the entries
+     * is scattered. */
+    data = raft_malloc(size);
+    if (data == NULL) {
+        return RAFT_ERR_NOMEM;
+    }
 
-    assert(buf != NULL);
-    assert(result != NULL);
+    raft_encode__batch_data(entries, n, data);
 
-    cursor = buf->base;
+    b = raft_malloc(sizeof *b + 2 * sizeof *b->iov + header_size + size);
+    if (b == NULL) {
+        raft_free(data);
+        return RAFT_ERR_NOMEM;
+    }
 
-    result->term = raft_decode__uint64(&cursor);
-    result->success = raft_decode__uint64(&cursor);
-    result->last_log_index = raft_decode__uint64(&cursor);
+    b->iov = (struct iovec *)(b + 1);
+    header = b->iov + 2;
 
-    return 0;
-}
+    compressed =
+        raft_lz__compress(data, size, header + header_size, size - 8);
 
-int raft_encode_request_vote(const struct raft_request_vote_args *args,
-                             struct raft_buffer *buf)
-{
-    void *cursor;
+    raft_free(data);
 
-    assert(args != NULL);
-    assert(buf != NULL);
+    if (compressed == 0) {
+        raft_free(b);
+        return 0;
+    }
 
-    buf->len = 0;
+    padded = raft_encode__align(compressed, 8);
+    memset(header + header_size + compressed, 0, padded - compressed);
 
-    buf->len += 8; /* Slot for protocol version and message type. */
-    buf->len += 8; /* Slot for the message size. */
-    buf->len += 8; /* Term. */
-    buf->len += 8; /* Candidate ID. */
-    buf->len += 8; /* Last log index. */
-    buf->len += 8; /* Last log term. */
+    b->refs = 1;
+    b->index = index;
+    b->entries = entries;
+    b->n = n;
+    b->n_iov = 2;
 
-    buf->base = raft_malloc(buf->len);
+    raft_encode__batch_header_(
+        entries, n, RAFT_ENCODING__BATCH_COMPRESSED, compressed,
+        raft_crc32c(0, header + header_size, padded), header);
 
-    if (buf->base == NULL) {
+    b->iov[0].iov_base = header;
+    b->iov[0].iov_len = header_size;
+    b->iov[1].iov_base = header + header_size;
+    b->iov[1].iov_len = padded;
+
+    *batch = b;
+
+    return 0;
+}
+
+int raft_encode__append_entries_batch(
+    raft_index index,
+    struct raft_entry *entries,
+    unsigned n,
+    bool compress,
+    struct raft_append_entries_batch **batch)
+{
+    struct raft_append_entries_batch *b;
+    size_t header_size = raft_encode__batch_header_size(n);
+    unsigned n_iov = 1 + raft_encode__entries_iov_count(entries, n);
+    size_t size = raft_encode__batch_data_size(entries, n);
+    void *header;
+    int rv;
+
+    if (compress && size >= RAFT_ENCODING__COMPRESS_MIN) {
+        rv = raft_encode__compressed_batch(index, entries, n, size, batch);
+        if (rv != 0 || *batch != NULL) {
+            return rv;
+        }
+    }
+
+    b = raft_malloc(sizeof *b + n_iov * sizeof *b->iov + header_size);
+    if (b == NULL) {
         return RAFT_ERR_NOMEM;
     }
 
-    cursor = buf->base;
+    b->refs = 1;
+    b->index = index;
+    b->entries = entries;
+    b->n = n;
+    b->iov = (struct iovec *)(b + 1);
+    b->n_iov = n_iov;
 
-    raft_encode__uint32(&cursor, RAFT_ENCODING__VERSION); /* Encode version */
-    raft_encode__uint32(&cursor, RAFT_IO_REQUEST_VOTE);   /* Message type */
-    raft_encode__uint64(&cursor,
-                        buf->len - 16); /* Exclude the message header */
+    header = b->iov + n_iov;
+    raft_encode__batch_header(entries, n, header);
 
-    raft_encode__uint64(&cursor, args->term);
-    raft_encode__uint64(&cursor, args->candidate_id);
-    raft_encode__uint64(&cursor, args->last_log_index);
-    raft_encode__uint64(&cursor, args->last_log_term);
+    b->iov[0].iov_base = header;
+    b->iov[0].iov_len = header_size;
+
+    raft_encode__entries_iov(entries, n, b->iov + 1);
+
+    *batch = b;
 
     return 0;
 }
 
-int raft_decode_request_vote(const struct raft_buffer *buf,
-                             struct raft_request_vote_args *args)
+int raft_decode__batch_count(const void *batch,
+                             unsigned *version,
+                             unsigned *n,
+                             unsigned *flags)
 {
-    void *cursor;
-
-    assert(buf != NULL);
-    assert(args != NULL);
+    const uint8_t *bytes = batch;
+    void *cursor = (void *)batch;
+
+    *n = raft_decode__uint32(&cursor);
+    *version = raft_decode__uint8(&cursor);
+    *flags = raft_decode__uint8(&cursor);
+
+    switch (*version) {
+        case 0:
+            /* Older servers encoded the number of entries as a 64-bit integer,
+             * whose upper bytes are always zero. */
+            if (*flags != 0 || bytes[6] != 0 || bytes[7] != 0) {
+                return RAFT_ERR_MALFORMED;
+            }
+            break;
+        case RAFT_ENCODING__BATCH_VERSION:
+            if ((*flags & ~RAFT_ENCODING__BATCH_COMPRESSED) != 0) {
+                return RAFT_ERR_MALFORMED;
+            }
+            break;
+        default:
+            return RAFT_ERR_MALFORMED;
+    }
 
-    cursor = buf->base;
+    return 0;
+}
 
-    args->term = raft_decode__uint64(&cursor);
-    args->candidate_id = raft_decode__uint64(&cursor);
-    args->last_log_index = raft_decode__uint64(&cursor);
-    args->last_log_term = raft_decode__uint64(&cursor);
+size_t raft_decode__batch_header_size(unsigned version, size_t n)
+{
+    if (version == 0) {
+        return 8 + 16 * n; /* No checksums */
+    }
 
-    return 0;
+    return raft_encode__batch_header_size(n);
 }
 
-int raft_encode_request_vote_result(
-    const struct raft_request_vote_result *result,
-    struct raft_buffer *buf)
+int raft_decode__batch_verify(const void *batch,
+                              unsigned n,
+                              unsigned flags,
+                              uint32_t *data_crc)
 {
+    size_t len = raft_encode__batch_header_size(n) - 4;
     void *cursor;
 
-    assert(result != NULL);
-    assert(buf != NULL);
+    if (flags & RAFT_ENCODING__BATCH_COMPRESSED) {
+        len += RAFT_ENCODING__BATCH_EXTENSION_SIZE;
+    }
+    cursor = (uint8_t *)batch + len - 4;
 
-    buf->len = 0;
+    *data_crc = raft_decode__uint32(&cursor);
 
-    buf->len += 8; /* Slot for protocol version and message type. */
-    buf->len += 8; /* Slot for the message size. */
-    buf->len += 8; /* Term. */
-    buf->len += 8; /* Vote granted. */
+    if (raft_decode__uint32(&cursor) != raft_crc32c(0, batch, len)) {
+        return RAFT_ERR_CHECKSUM;
+    }
 
-    buf->base = raft_malloc(buf->len);
+    return 0;
+}
 
-    if (buf->base == NULL) {
-        return RAFT_ERR_NOMEM;
-    }
+int raft_decode__batch_entries(void *batch,
+                               struct raft_entry *entries,
+                               unsigned n)
+{
+    /* Skip count, version and flags. */
+    return raft_batch__decode_headers((uint8_t *)batch + 8, entries, n, batch);
+}
 
-    cursor = buf->base;
+/**
+ * Get an array for decoding @n entries, using the given @scratch array if it
+ * has at least @n slots and allocating a new one otherwise.
+ */
+static int raft_decode__entries_array(unsigned n,
+                                      struct raft_entry *scratch,
+                                      unsigned cap,
+                                      struct raft_entry **entries)
+{
+    if (n == 0) {
+        *entries = NULL;
+        return 0;
+    }
 
-    raft_encode__uint32(&cursor, RAFT_ENCODING__VERSION);
-    raft_encode__uint32(&cursor, RAFT_IO_REQUEST_VOTE_RESULT);
-    raft_encode__uint64(&cursor, buf->len - 16);
+    if (n <= cap) {
+        *entries = scratch;
+        return 0;
+    }
 
-    raft_encode__uint64(&cursor, result->term);
-    raft_encode__uint64(&cursor, result->vote_granted);
+    *entries = raft_malloc(n * sizeof **entries);
+    if (*entries == NULL) {
+        return RAFT_ERR_NOMEM;
+    }
 
     return 0;
 }
 
-int raft_decode_request_vote_result(const struct raft_buffer *buf,
-                                    struct raft_request_vote_result *result)
+/**
+ * Release an array obtained with raft_decode__entries_array().
+ */
+static void raft_decode__entries_release(struct raft_entry *entries,
+                                         struct raft_entry *scratch)
 {
-    void *cursor;
+    if (entries != NULL && entries != scratch) {
+        raft_free(entries);
+    }
+}
 
-    assert(buf != NULL);
-    assert(result != NULL);
+int raft_decode__batch_header(void *batch,
+                              size_t len,
+                              struct raft_entry *scratch,
+                              unsigned cap,
+                              struct raft_entry **entries,
+                              unsigned *n,
+                              uint32_t *data_crc,
+                              bool *has_crc,
+                              size_t *compressed)
+{
+    unsigned version;
+    unsigned flags;
+    int rv;
 
-    cursor = buf->base;
+    if (len < raft_decode__batch_header_size(0, 0)) {
+        return RAFT_ERR_MALFORMED;
+    }
 
-    result->term = raft_decode__uint64(&cursor);
-    result->vote_granted = raft_decode__uint64(&cursor);
+    rv = raft_decode__batch_count(batch, &version, n, &flags);
+    if (rv != 0) {
+        return rv;
+    }
+
+    if (len < raft_decode__batch_header_size(version, 0) ||
+        (len - raft_decode__batch_header_size(version, 0)) / 16 < *n) {
+        return RAFT_ERR_MALFORMED;
+    }
+
+    *compressed = 0;
+    *has_crc = version != 0;
+
+    if (version == 0) {
+        /* Batches from older servers carry no checksum. */
+        *data_crc = 0;
+    } else if (flags & RAFT_ENCODING__BATCH_COMPRESSED) {
+        size_t size = raft_encode__batch_header_size(*n);
+        void *cursor = (uint8_t *)batch + size - 8; /* After entry headers */
+
+        if (len - size < RAFT_ENCODING__BATCH_EXTENSION_SIZE) {
+            return RAFT_ERR_MALFORMED;
+        }
+
+        rv = raft_decode__batch_verify(batch, *n, flags, data_crc);
+        if (rv != 0) {
+            return rv;
+        }
+
+        /* Batches without data are never compressed. */
+        *compressed = raft_decode__uint32(&cursor);
+        if (*n == 0 || *compressed == 0) {
+            return RAFT_ERR_MALFORMED;
+        }
+    } else {
+        rv = raft_decode__batch_verify(batch, *n, flags, data_crc);
+        if (rv != 0) {
+            return rv;
+        }
+    }
+
+    rv = raft_decode__entries_array(*n, scratch, cap, entries);
+    if (rv != 0) {
+        return rv;
+    }
+
+    if (*n == 0) {
+        return 0;
+    }
+
+    rv = raft_decode__batch_entries(batch, *entries, *n);
+    if (rv != 0) {
+        raft_decode__entries_release(*entries, scratch);
+        return rv;
+    }
+
+    return 0;
+}
+
+/**
+ * Decode an AppendEntries request, using the given @scratch array of @cap slots
+ * for its entries if they fit.
+ */
+static int raft_decode__append_entries(const struct raft_buffer *buf,
+                                       struct raft_entry *scratch,
+                                       unsigned cap,
+                                       struct raft_append_entries_args *args)
+{
+    void *cursor;
+    int rv;
+
+    assert(buf != NULL);
+    assert(args != NULL);
+
+    if (buf->len < 40) {
+        return RAFT_ERR_MALFORMED;
+    }
+
+    cursor = buf->base;
+
+    args->term = raft_decode__uint64(&cursor);
+    args->leader_id = raft_decode__uint64(&cursor);
+    args->prev_log_index = raft_decode__uint64(&cursor);
+    args->prev_log_term = raft_decode__uint64(&cursor);
+    args->leader_commit = raft_decode__uint64(&cursor);
+    args->batch = NULL;
+
+    rv = raft_decode__batch_header(cursor, buf->len - 40, scratch, cap,
+                                   &args->entries, &args->n, &args->checksum,
+                                   &args->has_checksum, &args->compressed);
+    if (rv != 0) {
+        return rv;
+    }
+
+    return 0;
+}
+
+int raft_decode_append_entries(const struct raft_buffer *buf,
+                               struct raft_append_entries_args *args)
+{
+    return raft_decode__append_entries(buf, NULL, 0, args);
+}
+
+int raft_verify_entries_batch(const struct raft_append_entries_args *args,
+                              const struct raft_buffer *buf)
+{
+    size_t size;
+
+    assert(args != NULL);
+    assert(buf != NULL);
+
+    if (args->compressed != 0) {
+        size = raft_encode__align(args->compressed, 8);
+    } else {
+        size = raft_encode__batch_data_size(args->entries, args->n);
+    }
+
+    if (buf->len < size) {
+        return RAFT_ERR_MALFORMED;
+    }
+
+    if (!args->has_checksum) {
+        return 0;
+    }
+
+    if (raft_crc32c(0, buf->base, size) != args->checksum) {
+        return RAFT_ERR_CHECKSUM;
+    }
+
+    return 0;
+}
+
+int raft_inflate_entries_batch(struct raft_append_entries_args *args,
+                               struct raft_buffer *buf,
+                               int flags)
+{
+    struct raft_buffer data;
+    size_t size;
+    int rv;
+
+    assert(args != NULL);
+    assert(buf != NULL);
+
+    if (args->compressed == 0) {
+        return 0;
+    }
+
+    if (buf->len < args->compressed) {
+        return RAFT_ERR_MALFORMED;
+    }
+
+    size = raft_encode__batch_data_size(args->entries, args->n);
+    data.len = raft_entries_batch_size(args->entries, args->n, flags);
+
+    /* Compressed batches always have some data. */
+    if (size == 0) {
+        return RAFT_ERR_MALFORMED;
+    }
+
+    if (flags & RAFT_BATCH_ALIGNED) {
+        data.base = raft_aligned_alloc(RAFT_BATCH_ALIGNMENT, data.len);
+    } else {
+        data.base = raft_malloc(data.len);
+    }
+
+    if (data.base == NULL) {
+        return RAFT_ERR_NOMEM;
+    }
+
+    rv = raft_lz__decompress(buf->base, args->compressed, data.base, size);
+    if (rv != 0) {
+        raft_free(data.base);
+        return rv;
+    }
+
+    /* Zero the trailing padding of the aligned layout. */
+    memset((uint8_t *)data.base + size, 0, data.len - size);
+
+    raft_free(buf->base);
+
+    *buf = data;
+    args->compressed = 0;
+
+    return 0;
+}
+
+int raft_decode_entries_batch(const struct raft_buffer *buf,
+                              struct raft_entry *entries,
+                              unsigned n)
+{
+    assert(buf != NULL);
+
+    raft_batch__point(entries, n, buf->base);
+
+    return 0;
+}
+
+void raft_encode__batch_data(const struct raft_entry *entries,
+                             size_t n,
+                             void *data)
+{
+    uint8_t *cursor = data;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        const struct raft_entry *entry = &entries[i];
+
+        if (entry->buf.len == 0) {
+            continue;
+        }
+
+        memcpy(cursor, entry->buf.base, entry->buf.len);
+        cursor += entry->buf.len;
+
+        if (entry->buf.len % 8 != 0) {
+            /* Add padding */
+            size_t padding = 8 - (entry->buf.len % 8);
+            memset(cursor, 0, padding);
+            cursor += padding;
+        }
+    }
+}
+
+size_t raft_entries_batch_size(const struct raft_entry entries[],
+                               unsigned n,
+                               int flags)
+{
+    size_t size = raft_encode__batch_data_size(entries, n);
+
+    if (flags & RAFT_BATCH_ALIGNED) {
+        size = raft_encode__align(size, RAFT_BATCH_ALIGNMENT);
+    }
+
+    return size;
+}
+
+int raft_encode_entries_batch(const struct raft_entry entries[],
+                              unsigned n,
+                              int flags,
+                              struct raft_buffer *buf)
+{
+    size_t size;
+
+    assert(entries != NULL || n == 0);
+    assert(buf != NULL);
+
+    size = raft_encode__batch_data_size(entries, n);
+    buf->len = raft_entries_batch_size(entries, n, flags);
+
+    if (flags & RAFT_BATCH_ALIGNED) {
+        /* Allocate at least one block, so the buffer is never empty. */
+        size_t len = buf->len > 0 ? buf->len : RAFT_BATCH_ALIGNMENT;
+        buf->base = raft_aligned_alloc(RAFT_BATCH_ALIGNMENT, len);
+    } else {
+        buf->base = raft_malloc(buf->len > 0 ? buf->len : 1);
+    }
+
+    if (buf->base == NULL) {
+        return RAFT_ERR_NOMEM;
+    }
+
+    raft_encode__batch_data(entries, n, buf->base);
+
+    /* Zero the trailing padding of the aligned layout. */
+    memset((uint8_t *)buf->base + size, 0, buf->len - size);
+
+    return 0;
+}
+
+size_t raft_encode_append_entries_result_size(
+    const struct raft_append_entries_result *result)
+{
+    size_t size = 0;
+
+    assert(result != NULL);
+    (void)result;
+
+    size += 8; /* Slot for protocol version and message type. */
+    size += 8; /* Slot for the message size. */
+    size += 8; /* Term. */
+    size += 8; /* Success. */
+    size += 8; /* Last log index. */
+
+    return size;
+}
+
+void raft_encode_append_entries_result_to(
+    const struct raft_append_entries_result *result,
+    void *buf)
+{
+    size_t size = raft_encode_append_entries_result_size(result);
+    void *cursor = buf;
+
+    assert(buf != NULL);
+
+    raft_encode__uint32(&cursor, RAFT_ENCODING__VERSION); /* Encode version */
+    raft_encode__uint32(&cursor,
+                        RAFT_IO_APPEND_ENTRIES_RESULT); /* Message type */
+    raft_encode__uint64(&cursor, size - 16); /* Exclude the message header */
+
+    raft_encode__uint64(&cursor, result->term);
+    raft_encode__uint64(&cursor, result->success);
+    raft_encode__uint64(&cursor, result->last_log_index);
+}
+
+int raft_encode_append_entries_result(
+    const struct raft_append_entries_result *result,
+    struct raft_buffer *buf)
+{
+    assert(result != NULL);
+    assert(buf != NULL);
+
+    buf->len = raft_encode_append_entries_result_size(result);
+    buf->base = raft_malloc(buf->len);
+
+    if (buf->base == NULL) {
+        return RAFT_ERR_NOMEM;
+    }
+
+    raft_encode_append_entries_result_to(result, buf->base);
+
+    return 0;
+}
+
+int raft_decode_append_entries_result(const struct raft_buffer *buf,
+                                      struct raft_append_entries_result *result)
+{
+    void *cursor;
+
+    assert(buf != NULL);
+    assert(result != NULL);
+
+    cursor = buf->base;
+
+    result->term = raft_decode__uint64(&cursor);
+    result->success = raft_decode__uint64(&cursor);
+    result->last_log_index = raft_decode__uint64(&cursor);
+
+    return 0;
+}
+
+/**
+ * Flags of a RequestVote request, encoded after its regular fields.
+ */
+#define RAFT_ENCODING__PRE_VOTE 1
+#define RAFT_ENCODING__DISRUPT_LEADER 2
+
+static uint8_t raft_encode__request_vote_flags(
+    const struct raft_request_vote_args *args)
+{
+    return (args->pre_vote ? RAFT_ENCODING__PRE_VOTE : 0) |
+           (args->disrupt_leader ? RAFT_ENCODING__DISRUPT_LEADER : 0);
+}
+
+size_t raft_encode_request_vote_size(const struct raft_request_vote_args *args)
+{
+    size_t size = 0;
+
+    assert(args != NULL);
+
+    size += 8; /* Slot for protocol version and message type. */
+    size += 8; /* Slot for the message size. */
+    size += 8; /* Term. */
+    size += 8; /* Candidate ID. */
+    size += 8; /* Last log index. */
+    size += 8; /* Last log term. */
+
+    /* Pre-Vote and disrupt-leader flags, omitted for regular requests so that
+     * servers running older versions can still decode them. */
+    if (args->pre_vote || args->disrupt_leader) {
+        size += 8;
+    }
+
+    return size;
+}
+
+void raft_encode_request_vote_to(const struct raft_request_vote_args *args,
+                                 void *buf)
+{
+    size_t size = raft_encode_request_vote_size(args);
+    void *cursor = buf;
+
+    assert(buf != NULL);
+
+    raft_encode__uint32(&cursor, RAFT_ENCODING__VERSION); /* Encode version */
+    raft_encode__uint32(&cursor, RAFT_IO_REQUEST_VOTE);   /* Message type */
+    raft_encode__uint64(&cursor, size - 16); /* Exclude the message header */
+
+    raft_encode__uint64(&cursor, args->term);
+    raft_encode__uint64(&cursor, args->candidate_id);
+    raft_encode__uint64(&cursor, args->last_log_index);
+    raft_encode__uint64(&cursor, args->last_log_term);
+
+    if (args->pre_vote || args->disrupt_leader) {
+        raft_encode__uint64(&cursor, raft_encode__request_vote_flags(args));
+    }
+}
+
+int raft_encode_request_vote(const struct raft_request_vote_args *args,
+                             struct raft_buffer *buf)
+{
+    assert(args != NULL);
+    assert(buf != NULL);
+
+    buf->len = raft_encode_request_vote_size(args);
+    buf->base = raft_malloc(buf->len);
+
+    if (buf->base == NULL) {
+        return RAFT_ERR_NOMEM;
+    }
+
+    raft_encode_request_vote_to(args, buf->base);
+
+    return 0;
+}
+
+int raft_decode_request_vote(const struct raft_buffer *buf,
+                             struct raft_request_vote_args *args)
+{
+    void *cursor;
+
+    assert(buf != NULL);
+    assert(args != NULL);
+
+    cursor = buf->base;
+
+    args->term = raft_decode__uint64(&cursor);
+    args->candidate_id = raft_decode__uint64(&cursor);
+    args->last_log_index = raft_decode__uint64(&cursor);
+    args->last_log_term = raft_decode__uint64(&cursor);
+    args->pre_vote = false;
+    args->disrupt_leader = false;
+
+    if (buf->len >= 5 * 8) {
+        uint64_t flags = raft_decode__uint64(&cursor);
+        args->pre_vote = (flags & RAFT_ENCODING__PRE_VOTE) != 0;
+        args->disrupt_leader = (flags & RAFT_ENCODING__DISRUPT_LEADER) != 0;
+    }
+
+    return 0;
+}
+
+size_t raft_encode_request_vote_result_size(
+    const struct raft_request_vote_result *result)
+{
+    size_t size = 0;
+
+    assert(result != NULL);
+
+    size += 8; /* Slot for protocol version and message type. */
+    size += 8; /* Slot for the message size. */
+    size += 8; /* Term. */
+    size += 8; /* Vote granted. */
+
+    /* Pre-Vote flag, omitted for regular results. */
+    if (result->pre_vote) {
+        size += 8;
+    }
+
+    return size;
+}
+
+void raft_encode_request_vote_result_to(
+    const struct raft_request_vote_result *result,
+    void *buf)
+{
+    size_t size = raft_encode_request_vote_result_size(result);
+    void *cursor = buf;
+
+    assert(buf != NULL);
+
+    raft_encode__uint32(&cursor, RAFT_ENCODING__VERSION);
+    raft_encode__uint32(&cursor, RAFT_IO_REQUEST_VOTE_RESULT);
+    raft_encode__uint64(&cursor, size - 16);
+
+    raft_encode__uint64(&cursor, result->term);
+    raft_encode__uint64(&cursor, result->vote_granted);
+
+    if (result->pre_vote) {
+        raft_encode__uint64(&cursor, 1);
+    }
+}
+
+int raft_encode_request_vote_result(
+    const struct raft_request_vote_result *result,
+    struct raft_buffer *buf)
+{
+    assert(result != NULL);
+    assert(buf != NULL);
+
+    buf->len = raft_encode_request_vote_result_size(result);
+    buf->base = raft_malloc(buf->len);
+
+    if (buf->base == NULL) {
+        return RAFT_ERR_NOMEM;
+    }
+
+    raft_encode_request_vote_result_to(result, buf->base);
+
+    return 0;
+}
+
+int raft_decode_request_vote_result(const struct raft_buffer *buf,
+                                    struct raft_request_vote_result *result)
+{
+    void *cursor;
+
+    assert(buf != NULL);
+    assert(result != NULL);
+
+    cursor = buf->base;
+
+    result->term = raft_decode__uint64(&cursor);
+    result->vote_granted = raft_decode__uint64(&cursor);
+    result->pre_vote = false;
+
+    if (buf->len >= 3 * 8) {
+        result->pre_vote = raft_decode__uint64(&cursor) != 0;
+    }
+
+    return 0;
+}
+
+size_t raft_encode_timeout_now_size(const struct raft_timeout_now_args *args)
+{
+    size_t size = 0;
+
+    assert(args != NULL);
+    (void)args;
+
+    size += 8; /* Slot for protocol version and message type. */
+    size += 8; /* Slot for the message size. */
+    size += 8; /* Term. */
+    size += 8; /* Leader ID. */
+    size += 8; /* Last log index. */
+    size += 8; /* Last log term. */
+
+    return size;
+}
+
+void raft_encode_timeout_now_to(const struct raft_timeout_now_args *args,
+                                void *buf)
+{
+    size_t size = raft_encode_timeout_now_size(args);
+    void *cursor = buf;
+
+    assert(buf != NULL);
+
+    raft_encode__uint32(&cursor, RAFT_ENCODING__VERSION); /* Encode version */
+    raft_encode__uint32(&cursor, RAFT_IO_TIMEOUT_NOW);    /* Message type */
+    raft_encode__uint64(&cursor, size - 16); /* Exclude the message header */
+
+    raft_encode__uint64(&cursor, args->term);
+    raft_encode__uint64(&cursor, args->leader_id);
+    raft_encode__uint64(&cursor, args->last_log_index);
+    raft_encode__uint64(&cursor, args->last_log_term);
+}
+
+int raft_encode_timeout_now(const struct raft_timeout_now_args *args,
+                            struct raft_buffer *buf)
+{
+    assert(args != NULL);
+    assert(buf != NULL);
+
+    buf->len = raft_encode_timeout_now_size(args);
+    buf->base = raft_malloc(buf->len);
+
+    if (buf->base == NULL) {
+        return RAFT_ERR_NOMEM;
+    }
+
+    raft_encode_timeout_now_to(args, buf->base);
+
+    return 0;
+}
+
+int raft_decode_timeout_now(const struct raft_buffer *buf,
+                            struct raft_timeout_now_args *args)
+{
+    void *cursor;
+
+    assert(buf != NULL);
+    assert(args != NULL);
+
+    cursor = buf->base;
+
+    args->term = raft_decode__uint64(&cursor);
+    args->leader_id = raft_decode__uint64(&cursor);
+    args->last_log_index = raft_decode__uint64(&cursor);
+    args->last_log_term = raft_decode__uint64(&cursor);
+
+    return 0;
+}
+
+/**
+ * Version 2 of the wire format.
+ *
+ * All integer fields of the message bodies are encoded as unsigned LEB128
+ * varints, and booleans as single bytes. The batch header of AppendEntries
+ * requests is laid out as follows:
+ *
+ * [varint ] Number of entries in the batch.
+ * [run1   ] First run of entries created in the same term.
+ * [  ...  ] More runs
+ * [runN   ] Last run of entries.
+ * [4 bytes] CRC32C checksum of the payload data, little endian.
+ * [4 bytes] CRC32C checksum of all the above, little endian.
+ *
+ * Each run is encoded as:
+ *
+ * [varint ] Number of entries in the run.
+ * [varint ] Difference between the term of the run and the one of the previous
+ *           run (or zero, for the first run).
+ * [varint ] Size of the data of the first entry of the run, shifted left by one
+ *           bit, with the entry type in the lowest bit.
+ * [  ...  ] Same for the other entries of the run.
+ *
+ * The payload data section is the same as in version 1.
+ */
+
+/**
+ * Return the number of bytes needed to encode @value as a varint.
+ */
+static size_t raft_encode__varint_size(uint64_t value)
+{
+    size_t size = 1;
+
+    while (value >= 0x80) {
+        value >>= 7;
+        size++;
+    }
+
+    return size;
+}
+
+static void raft_encode__varint(void **cursor, uint64_t value)
+{
+    uint8_t *p = *cursor;
+
+    while (value >= 0x80) {
+        *p++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *p++ = (uint8_t)value;
+
+    *cursor = p;
+}
+
+/**
+ * Decode a varint, without reading past @end.
+ */
+static int raft_decode__varint(void **cursor, const void *end, uint64_t *value)
+{
+    const uint8_t *p = *cursor;
+    unsigned shift = 0;
+
+    *value = 0;
+
+    for (;;) {
+        if ((const void *)p >= end || shift > 63) {
+            return RAFT_ERR_MALFORMED;
+        }
+        *value |= (uint64_t)(*p & 0x7f) << shift;
+        if ((*p++ & 0x80) == 0) {
+            break;
+        }
+        shift += 7;
+    }
+
+    *cursor = (void *)p;
+
+    return 0;
+}
+
+/**
+ * Return the number of entries starting at @entries that have the same term as
+ * the first one.
+ */
+static size_t raft_encode__run_length(const struct raft_entry *entries,
+                                      size_t n)
+{
+    size_t i;
+
+    for (i = 1; i < n; i++) {
+        if (entries[i].term != entries[0].term) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+/**
+ * Return the value encoding the size and the type of an entry.
+ */
+static uint64_t raft_encode__entry_v2(const struct raft_entry *entry)
+{
+    return ((uint64_t)entry->buf.len << 1) | (entry->type & 1);
+}
+
+static size_t raft_encode__batch_header_size_v2(
+    const struct raft_entry *entries,
+    size_t n)
+{
+    size_t size = raft_encode__varint_size(n);
+    raft_term term = 0;
+    size_t i = 0;
+
+    while (i < n) {
+        size_t len = raft_encode__run_length(&entries[i], n - i);
+        size_t j;
+
+        assert(entries[i].term >= term);
+
+        size += raft_encode__varint_size(len);
+        size += raft_encode__varint_size(entries[i].term - term);
+
+        for (j = i; j < i + len; j++) {
+            uint64_t value = raft_encode__entry_v2(&entries[j]);
+            size += raft_encode__varint_size(value);
+        }
+
+        term = entries[i].term;
+        i += len;
+    }
+
+    size += 8; /* Checksums of the data section and of the header */
+
+    return size;
+}
+
+static void raft_encode__batch_header_v2(const struct raft_entry *entries,
+                                         size_t n,
+                                         void **cursor)
+{
+    void *batch = *cursor;
+    raft_term term = 0;
+    size_t i = 0;
+
+    raft_encode__varint(cursor, n);
+
+    while (i < n) {
+        size_t len = raft_encode__run_length(&entries[i], n - i);
+        size_t j;
+
+        raft_encode__varint(cursor, len);
+        raft_encode__varint(cursor, entries[i].term - term);
+
+        for (j = i; j < i + len; j++) {
+            assert(entries[j].type == RAFT_LOG_COMMAND ||
+                   entries[j].type == RAFT_LOG_CONFIGURATION);
+            raft_encode__varint(cursor, raft_encode__entry_v2(&entries[j]));
+        }
+
+        term = entries[i].term;
+        i += len;
+    }
+
+    raft_encode__uint32(cursor, raft_encode__batch_data_crc(entries, n));
+    raft_encode__uint32(cursor, raft_crc32c(0, batch, *cursor - batch));
+}
+
+static int raft_decode__batch_header_v2(void **cursor,
+                                        const void *end,
+                                        struct raft_entry *scratch,
+                                        unsigned cap,
+                                        struct raft_entry **entries,
+                                        unsigned *n,
+                                        uint32_t *data_crc)
+{
+    void *batch = *cursor;
+    raft_term term = 0;
+    uint64_t value;
+    size_t i = 0;
+    int rv;
+
+    rv = raft_decode__varint(cursor, end, &value);
+    if (rv != 0) {
+        return rv;
+    }
+
+    /* Each entry takes at least one byte. */
+    if (value > (uint64_t)(end - *cursor) || value > UINT_MAX) {
+        return RAFT_ERR_MALFORMED;
+    }
+    *n = value;
+
+    rv = raft_decode__entries_array(*n, scratch, cap, entries);
+    if (rv != 0) {
+        return rv;
+    }
+
+    while (i < *n) {
+        uint64_t len;
+        uint64_t delta;
+        size_t j;
+
+        rv = raft_decode__varint(cursor, end, &len);
+        if (rv != 0) {
+            goto err;
+        }
+        rv = raft_decode__varint(cursor, end, &delta);
+        if (rv != 0) {
+            goto err;
+        }
+
+        if (len == 0 || len > *n - i) {
+            rv = RAFT_ERR_MALFORMED;
+            goto err;
+        }
+
+        term += delta;
+
+        for (j = i; j < i + len; j++) {
+            struct raft_entry *entry = &(*entries)[j];
+
+            rv = raft_decode__varint(cursor, end, &value);
+            if (rv != 0) {
+                goto err;
+            }
+            if ((value >> 1) > UINT32_MAX) {
+                rv = RAFT_ERR_MALFORMED;
+                goto err;
+            }
+
+            entry->term = term;
+            entry->type = value & 1;
+            entry->buf.base = NULL;
+            entry->buf.len = value >> 1;
+            entry->batch = NULL;
+        }
+
+        i += len;
+    }
+
+    if (end - *cursor < 8) {
+        rv = RAFT_ERR_MALFORMED;
+        goto err;
+    }
+
+    *data_crc = raft_decode__uint32(cursor);
+
+    if (raft_decode__uint32(cursor) !=
+        raft_crc32c(0, batch, *cursor - batch - 4)) {
+        rv = RAFT_ERR_CHECKSUM;
+        goto err;
+    }
+
+    return 0;
+
+err:
+    raft_decode__entries_release(*entries, scratch);
+
+    return rv;
+}
+
+/**
+ * Return the size of the body of the given message, encoded with version 2.
+ */
+static size_t raft_encode__body_size_v2(const struct raft_message *message)
+{
+    const struct raft_append_entries_args *ae = &message->append_entries;
+    const struct raft_append_entries_result *aer =
+        &message->append_entries_result;
+    const struct raft_request_vote_args *rv = &message->request_vote;
+    const struct raft_request_vote_result *rvr = &message->request_vote_result;
+    const struct raft_timeout_now_args *tn = &message->timeout_now;
+
+    switch (message->type) {
+        case RAFT_IO_APPEND_ENTRIES:
+            return raft_encode__varint_size(ae->term) +
+                   raft_encode__varint_size(ae->leader_id) +
+                   raft_encode__varint_size(ae->prev_log_index) +
+                   raft_encode__varint_size(ae->prev_log_term) +
+                   raft_encode__varint_size(ae->leader_commit) +
+                   raft_encode__batch_header_size_v2(ae->entries, ae->n);
+        case RAFT_IO_APPEND_ENTRIES_RESULT:
+            return raft_encode__varint_size(aer->term) + 1 +
+                   raft_encode__varint_size(aer->last_log_index);
+        case RAFT_IO_REQUEST_VOTE:
+            return raft_encode__varint_size(rv->term) +
+                   raft_encode__varint_size(rv->candidate_id) +
+                   raft_encode__varint_size(rv->last_log_index) +
+                   raft_encode__varint_size(rv->last_log_term) +
+                   (rv->pre_vote || rv->disrupt_leader ? 1 : 0);
+        case RAFT_IO_TIMEOUT_NOW:
+            return raft_encode__varint_size(tn->term) +
+                   raft_encode__varint_size(tn->leader_id) +
+                   raft_encode__varint_size(tn->last_log_index) +
+                   raft_encode__varint_size(tn->last_log_term);
+        default:
+            assert(message->type == RAFT_IO_REQUEST_VOTE_RESULT);
+            return raft_encode__varint_size(rvr->term) + 1 +
+                   (rvr->pre_vote ? 1 : 0);
+    }
+}
+
+static void raft_encode__body_v2(const struct raft_message *message,
+                                 void **cursor)
+{
+    const struct raft_append_entries_args *ae = &message->append_entries;
+    const struct raft_append_entries_result *aer =
+        &message->append_entries_result;
+    const struct raft_request_vote_args *rv = &message->request_vote;
+    const struct raft_request_vote_result *rvr = &message->request_vote_result;
+    const struct raft_timeout_now_args *tn = &message->timeout_now;
+
+    switch (message->type) {
+        case RAFT_IO_APPEND_ENTRIES:
+            raft_encode__varint(cursor, ae->term);
+            raft_encode__varint(cursor, ae->leader_id);
+            raft_encode__varint(cursor, ae->prev_log_index);
+            raft_encode__varint(cursor, ae->prev_log_term);
+            raft_encode__varint(cursor, ae->leader_commit);
+            raft_encode__batch_header_v2(ae->entries, ae->n, cursor);
+            break;
+        case RAFT_IO_APPEND_ENTRIES_RESULT:
+            raft_encode__varint(cursor, aer->term);
+            raft_encode__uint8(cursor, aer->success);
+            raft_encode__varint(cursor, aer->last_log_index);
+            break;
+        case RAFT_IO_REQUEST_VOTE:
+            raft_encode__varint(cursor, rv->term);
+            raft_encode__varint(cursor, rv->candidate_id);
+            raft_encode__varint(cursor, rv->last_log_index);
+            raft_encode__varint(cursor, rv->last_log_term);
+            if (rv->pre_vote || rv->disrupt_leader) {
+                raft_encode__uint8(cursor, raft_encode__request_vote_flags(rv));
+            }
+            break;
+        case RAFT_IO_TIMEOUT_NOW:
+            raft_encode__varint(cursor, tn->term);
+            raft_encode__varint(cursor, tn->leader_id);
+            raft_encode__varint(cursor, tn->last_log_index);
+            raft_encode__varint(cursor, tn->last_log_term);
+            break;
+        default:
+            assert(message->type == RAFT_IO_REQUEST_VOTE_RESULT);
+            raft_encode__varint(cursor, rvr->term);
+            raft_encode__uint8(cursor, rvr->vote_granted);
+            if (rvr->pre_vote) {
+                raft_encode__uint8(cursor, 1);
+            }
+            break;
+    }
+}
+
+/**
+ * Decode @n consecutive varints into @values.
+ */
+static int raft_decode__varints(void **cursor,
+                                const void *end,
+                                uint64_t *values,
+                                unsigned n)
+{
+    unsigned i;
+    int rv;
+
+    for (i = 0; i < n; i++) {
+        rv = raft_decode__varint(cursor, end, &values[i]);
+        if (rv != 0) {
+            return rv;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Decode a boolean encoded as a single byte, without reading past @end.
+ */
+static int raft_decode__bool(void **cursor, const void *end, bool *value)
+{
+    uint8_t byte;
+
+    if (*cursor >= end) {
+        return RAFT_ERR_MALFORMED;
+    }
+
+    byte = raft_decode__uint8(cursor);
+    if (byte > 1) {
+        return RAFT_ERR_MALFORMED;
+    }
+
+    *value = byte;
+
+    return 0;
+}
+
+static int raft_decode__body_v2(const struct raft_buffer *buf,
+                                struct raft_entry *scratch,
+                                unsigned cap,
+                                struct raft_message *message)
+{
+    struct raft_append_entries_args *ae = &message->append_entries;
+    struct raft_append_entries_result *aer = &message->append_entries_result;
+    struct raft_request_vote_args *rv = &message->request_vote;
+    struct raft_request_vote_result *rvr = &message->request_vote_result;
+    struct raft_timeout_now_args *tn = &message->timeout_now;
+    void *cursor = buf->base;
+    const void *end = (const uint8_t *)buf->base + buf->len;
+    uint64_t fields[5];
+    int r;
+
+    switch (message->type) {
+        case RAFT_IO_APPEND_ENTRIES:
+            r = raft_decode__varints(&cursor, end, fields, 5);
+            if (r != 0) {
+                return r;
+            }
+            if (fields[1] > UINT_MAX) {
+                return RAFT_ERR_MALFORMED;
+            }
+            ae->term = fields[0];
+            ae->leader_id = fields[1];
+            ae->prev_log_index = fields[2];
+            ae->prev_log_term = fields[3];
+            ae->leader_commit = fields[4];
+            ae->batch = NULL;
+            ae->compressed = 0;
+
+            ae->has_checksum = true;
+
+            r = raft_decode__batch_header_v2(&cursor, end, scratch, cap,
+                                             &ae->entries, &ae->n,
+                                             &ae->checksum);
+            if (r != 0) {
+                return r;
+            }
+
+            if (cursor != end) {
+                raft_decode__entries_release(ae->entries, scratch);
+                return RAFT_ERR_MALFORMED;
+            }
+
+            return 0;
+        case RAFT_IO_APPEND_ENTRIES_RESULT:
+            r = raft_decode__varints(&cursor, end, &fields[0], 1);
+            if (r != 0) {
+                return r;
+            }
+            r = raft_decode__bool(&cursor, end, &aer->success);
+            if (r != 0) {
+                return r;
+            }
+            r = raft_decode__varints(&cursor, end, &fields[1], 1);
+            if (r != 0) {
+                return r;
+            }
+            aer->term = fields[0];
+            aer->last_log_index = fields[1];
+            break;
+        case RAFT_IO_REQUEST_VOTE:
+            r = raft_decode__varints(&cursor, end, fields, 4);
+            if (r != 0) {
+                return r;
+            }
+            if (fields[1] > UINT_MAX) {
+                return RAFT_ERR_MALFORMED;
+            }
+            rv->term = fields[0];
+            rv->candidate_id = fields[1];
+            rv->last_log_index = fields[2];
+            rv->last_log_term = fields[3];
+            rv->pre_vote = false;
+            rv->disrupt_leader = false;
+            if (cursor != end) {
+                uint8_t flags = raft_decode__uint8(&cursor);
+                if (flags > (RAFT_ENCODING__PRE_VOTE |
+                             RAFT_ENCODING__DISRUPT_LEADER)) {
+                    return RAFT_ERR_MALFORMED;
+                }
+                rv->pre_vote = (flags & RAFT_ENCODING__PRE_VOTE) != 0;
+                rv->disrupt_leader =
+                    (flags & RAFT_ENCODING__DISRUPT_LEADER) != 0;
+            }
+            break;
+        case RAFT_IO_TIMEOUT_NOW:
+            r = raft_decode__varints(&cursor, end, fields, 4);
+            if (r != 0) {
+                return r;
+            }
+            if (fields[1] > UINT_MAX) {
+                return RAFT_ERR_MALFORMED;
+            }
+            tn->term = fields[0];
+            tn->leader_id = fields[1];
+            tn->last_log_index = fields[2];
+            tn->last_log_term = fields[3];
+            break;
+        default:
+            assert(message->type == RAFT_IO_REQUEST_VOTE_RESULT);
+            r = raft_decode__varints(&cursor, end, &fields[0], 1);
+            if (r != 0) {
+                return r;
+            }
+            r = raft_decode__bool(&cursor, end, &rvr->vote_granted);
+            if (r != 0) {
+                return r;
+            }
+            rvr->term = fields[0];
+            rvr->pre_vote = false;
+            if (cursor != end) {
+                r = raft_decode__bool(&cursor, end, &rvr->pre_vote);
+                if (r != 0) {
+                    return r;
+                }
+            }
+            break;
+    }
+
+    if (cursor != end) {
+        return RAFT_ERR_MALFORMED;
+    }
+
+    return 0;
+}
+
+size_t raft_encode_message_size(const struct raft_message *message)
+{
+    assert(message != NULL);
+
+    if (message->version == RAFT_ENCODING_V2) {
+        return RAFT_ENCODING__HEADER_SIZE + raft_encode__body_size_v2(message);
+    }
+
+    assert(message->version == RAFT_ENCODING_V1);
+
+    switch (message->type) {
+        case RAFT_IO_APPEND_ENTRIES:
+            return raft_encode_append_entries_size(&message->append_entries);
+        case RAFT_IO_APPEND_ENTRIES_RESULT:
+            return raft_encode_append_entries_result_size(
+                &message->append_entries_result);
+        case RAFT_IO_REQUEST_VOTE:
+            return raft_encode_request_vote_size(&message->request_vote);
+        case RAFT_IO_TIMEOUT_NOW:
+            return raft_encode_timeout_now_size(&message->timeout_now);
+        default:
+            assert(message->type == RAFT_IO_REQUEST_VOTE_RESULT);
+            return raft_encode_request_vote_result_size(
+                &message->request_vote_result);
+    }
+}
+
+void raft_encode_message_to(const struct raft_message *message, void *buf)
+{
+    void *cursor = buf;
+
+    assert(message != NULL);
+    assert(buf != NULL);
+
+    if (message->version == RAFT_ENCODING_V2) {
+        size_t size = raft_encode_message_size(message);
+
+        raft_encode__uint32(&cursor, RAFT_ENCODING_V2);
+        raft_encode__uint32(&cursor, message->type);
+        raft_encode__uint64(&cursor, size - RAFT_ENCODING__HEADER_SIZE);
+
+        raft_encode__body_v2(message, &cursor);
+
+        assert((size_t)(cursor - buf) == size);
+        return;
+    }
+
+    assert(message->version == RAFT_ENCODING_V1);
+
+    switch (message->type) {
+        case RAFT_IO_APPEND_ENTRIES:
+            raft_encode_append_entries_to(&message->append_entries, buf);
+            break;
+        case RAFT_IO_APPEND_ENTRIES_RESULT:
+            raft_encode_append_entries_result_to(
+                &message->append_entries_result, buf);
+            break;
+        case RAFT_IO_REQUEST_VOTE:
+            raft_encode_request_vote_to(&message->request_vote, buf);
+            break;
+        case RAFT_IO_TIMEOUT_NOW:
+            raft_encode_timeout_now_to(&message->timeout_now, buf);
+            break;
+        default:
+            assert(message->type == RAFT_IO_REQUEST_VOTE_RESULT);
+            raft_encode_request_vote_result_to(&message->request_vote_result,
+                                               buf);
+            break;
+    }
+}
+
+int raft_encode_message(const struct raft_message *message,
+                        struct raft_buffer *buf)
+{
+    assert(message != NULL);
+    assert(buf != NULL);
+
+    buf->len = raft_encode_message_size(message);
+    buf->base = raft_malloc(buf->len);
+
+    if (buf->base == NULL) {
+        return RAFT_ERR_NOMEM;
+    }
+
+    raft_encode_message_to(message, buf->base);
 
     return 0;
 }
+
+unsigned raft_decode__message_type(unsigned version, unsigned type)
+{
+    if (version == RAFT_ENCODING_V1 && type == RAFT_ENCODING_APPEND_ENTRIES) {
+        return RAFT_IO_APPEND_ENTRIES;
+    }
+
+    return type;
+}
+
+size_t raft_decode__message_min_size(unsigned version, unsigned type)
+{
+    struct raft_message message;
+    size_t size;
+
+    if (version != RAFT_ENCODING_V1 && version != RAFT_ENCODING_V2) {
+        return 0;
+    }
+
+    if (type != RAFT_IO_APPEND_ENTRIES &&
+        type != RAFT_IO_APPEND_ENTRIES_RESULT &&
+        type != RAFT_IO_REQUEST_VOTE && type != RAFT_IO_REQUEST_VOTE_RESULT &&
+        type != RAFT_IO_TIMEOUT_NOW) {
+        return 0;
+    }
+
+    memset(&message, 0, sizeof message);
+    message.type = type;
+    message.version = version;
+
+    size = raft_encode_message_size(&message) - RAFT_ENCODING__HEADER_SIZE;
+
+    /* The batches of older servers have no checksums. */
+    if (version == RAFT_ENCODING_V1 && type == RAFT_IO_APPEND_ENTRIES) {
+        size -= raft_encode__batch_header_size(0) -
+                raft_decode__batch_header_size(0, 0);
+    }
+
+    return size;
+}
+
+int raft_decode__message_body(const struct raft_buffer *buf,
+                              struct raft_entry *scratch,
+                              unsigned cap,
+                              struct raft_message *message)
+{
+    assert(buf != NULL);
+    assert(message != NULL);
+
+    if (buf->len < raft_decode__message_min_size(message->version,
+                                                 message->type)) {
+        return RAFT_ERR_MALFORMED;
+    }
+
+    if (message->version == RAFT_ENCODING_V2) {
+        return raft_decode__body_v2(buf, scratch, cap, message);
+    }
+
+    assert(message->version == RAFT_ENCODING_V1);
+
+    switch (message->type) {
+        case RAFT_IO_APPEND_ENTRIES:
+            return raft_decode__append_entries(buf, scratch, cap,
+                                               &message->append_entries);
+        case RAFT_IO_APPEND_ENTRIES_RESULT:
+            return raft_decode_append_entries_result(
+                buf, &message->append_entries_result);
+        case RAFT_IO_REQUEST_VOTE:
+            return raft_decode_request_vote(buf, &message->request_vote);
+        case RAFT_IO_TIMEOUT_NOW:
+            return raft_decode_timeout_now(buf, &message->timeout_now);
+        default:
+            assert(message->type == RAFT_IO_REQUEST_VOTE_RESULT);
+            return raft_decode_request_vote_result(
+                buf, &message->request_vote_result);
+    }
+}
+
+int raft_decode_message(const struct raft_buffer *buf,
+                        struct raft_message *message)
+{
+    struct raft_buffer body;
+    void *cursor;
+    uint32_t version;
+    uint32_t type;
+    uint64_t size;
+
+    assert(buf != NULL);
+    assert(message != NULL);
+
+    if (buf->len < RAFT_ENCODING__HEADER_SIZE) {
+        return RAFT_ERR_MALFORMED;
+    }
+
+    cursor = buf->base;
+
+    version = raft_decode__uint32(&cursor);
+    type = raft_decode__uint32(&cursor);
+    size = raft_decode__uint64(&cursor);
+
+    type = raft_decode__message_type(version, type);
+    if (raft_decode__message_min_size(version, type) == 0 ||
+        size != buf->len - RAFT_ENCODING__HEADER_SIZE) {
+        return RAFT_ERR_MALFORMED;
+    }
+
+    message->version = version;
+    message->type = type;
+
+    body.base = cursor;
+    body.len = size;
+
+    return raft_decode__message_body(&body, NULL, 0, message);
+}
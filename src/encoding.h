@@ -0,0 +1,170 @@
+/**
+ * Internal helpers for encoding and decoding entry batches, shared with the
+ * on-disk log format.
+ */
+
+#ifndef RAFT_ENCODING_H
+#define RAFT_ENCODING_H
+
+#include "../include/raft.h"
+
+/**
+ * Version of the configuration encoding format, and of the messages encoded by
+ * the per-message functions.
+ */
+#define RAFT_ENCODING__VERSION RAFT_ENCODING_V1
+
+/**
+ * Size of the header preceding every message: protocol version, message type
+ * and size of the message body.
+ */
+#define RAFT_ENCODING__HEADER_SIZE 16
+
+/**
+ * Flag set in the header of a batch whose data section is compressed.
+ */
+#define RAFT_ENCODING__BATCH_COMPRESSED 1
+
+/**
+ * Size of the extension of the header of a compressed batch, holding the size
+ * of the compressed data section.
+ */
+#define RAFT_ENCODING__BATCH_EXTENSION_SIZE 8
+
+/**
+ * Return the size of the header of an uncompressed batch with @n entries.
+ */
+size_t raft_encode__batch_header_size(size_t n);
+
+/**
+ * Return the size of the data section of a batch with the given entries,
+ * including padding.
+ */
+size_t raft_encode__batch_data_size(const struct raft_entry *entries, size_t n);
+
+/**
+ * Round @size up to the given @alignment, which must be a power of two.
+ */
+static inline size_t raft_encode__align(size_t size, size_t alignment)
+{
+    return (size + alignment - 1) & ~(alignment - 1);
+}
+
+/**
+ * Copy the data of the given entries into @data, which must be at least
+ * raft_encode__batch_data_size() bytes long, padding each of them with zeros
+ * to 8-byte boundary.
+ */
+void raft_encode__batch_data(const struct raft_entry *entries,
+                             size_t n,
+                             void *data);
+
+/**
+ * Return the CRC32C checksum of the data section of a batch with the given
+ * entries, including padding.
+ */
+uint32_t raft_encode__batch_data_crc(const struct raft_entry *entries,
+                                     size_t n);
+
+/**
+ * Encode the header of a batch with the given entries into @batch, which must
+ * be at least raft_encode__batch_header_size() bytes long. The checksum of the
+ * data section is computed from the given entries.
+ */
+void raft_encode__batch_header(const struct raft_entry *entries,
+                               size_t n,
+                               void *batch);
+
+/**
+ * Create a batch holding the given entries, acquired from the log starting at
+ * @index, and encode its header. The batch is allocated in a single block along
+ * with its iovec array and header, and starts with a reference count of 1.
+ *
+ * If @compress is true and the data section is big enough, it gets compressed
+ * into the same block, unless it doesn't shrink.
+ */
+int raft_encode__append_entries_batch(
+    raft_index index,
+    struct raft_entry *entries,
+    unsigned n,
+    bool compress,
+    struct raft_append_entries_batch **batch);
+
+/**
+ * Decode the format version, the number of entries and the flags of a batch,
+ * checking that the version is known (see raft_decode_entries_batch() for the
+ * versions).
+ */
+int raft_decode__batch_count(const void *batch,
+                             unsigned *version,
+                             unsigned *n,
+                             unsigned *flags);
+
+/**
+ * Return the size of the header of an uncompressed batch with @n entries and
+ * the given format version.
+ */
+size_t raft_decode__batch_header_size(unsigned version, size_t n);
+
+/**
+ * Verify the checksum of the header of a batch with @n entries and the given
+ * @flags, which must be at least raft_encode__batch_header_size() bytes long
+ * (plus RAFT_ENCODING__BATCH_EXTENSION_SIZE if compressed), and return the
+ * checksum of its data section in @data_crc.
+ */
+int raft_decode__batch_verify(const void *batch,
+                              unsigned n,
+                              unsigned flags,
+                              uint32_t *data_crc);
+
+/**
+ * Decode the headers of the @n entries of a batch into the given array, filling
+ * term, type and data length.
+ */
+int raft_decode__batch_entries(void *batch,
+                               struct raft_entry *entries,
+                               unsigned n);
+
+/**
+ * Decode and verify the header of a batch stored in the @len bytes at @batch,
+ * filling term, type and data length of an array of entries. The array is the
+ * given @scratch one if its @cap slots are enough, and is allocated otherwise.
+ * The checksum of the data section is returned in @data_crc, unless @has_crc
+ * is set to false because the batch has none, and its compressed size in
+ * @compressed (0 if not compressed).
+ */
+int raft_decode__batch_header(void *batch,
+                              size_t len,
+                              struct raft_entry *scratch,
+                              unsigned cap,
+                              struct raft_entry **entries,
+                              unsigned *n,
+                              uint32_t *data_crc,
+                              bool *has_crc,
+                              size_t *compressed);
+
+/**
+ * Return the type of a message whose header holds the given @version and
+ * @type, mapping the wire-only types to the RAFT_IO_* ones.
+ */
+unsigned raft_decode__message_type(unsigned version, unsigned type);
+
+/**
+ * Return the minimum size of the body of a message with the given version and
+ * type, or zero if the version or the type are unknown.
+ */
+size_t raft_decode__message_min_size(unsigned version, unsigned type);
+
+/**
+ * Decode the body of a message whose version and type were already decoded from
+ * its header and set in @message.
+ *
+ * The entries of an AppendEntries request are decoded into the given @scratch
+ * array if they fit in its @cap slots, otherwise a new array is allocated.
+ */
+int raft_decode__message_body(const struct raft_buffer *buf,
+                              struct raft_entry *scratch,
+                              unsigned cap,
+                              struct raft_message *message);
+
+#endif /* RAFT_ENCODING_H */
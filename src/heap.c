@@ -1,3 +1,8 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
 #include "stdlib.h"
 
 #include "../include/raft.h"
@@ -26,12 +31,196 @@ static void *raft__realloc(void *data, void *ptr, size_t size)
     return realloc(ptr, size);
 }
 
+static void *raft__aligned_alloc(void *data, size_t alignment, size_t size)
+{
+    void *ptr;
+
+    (void)data;
+
+    if (posix_memalign(&ptr, alignment, size) != 0) {
+        return NULL;
+    }
+
+    return ptr;
+}
+
 struct raft_heap raft_heap__default = {
-    NULL, raft__heap_malloc, raft__free, raft__calloc, raft__realloc,
+    NULL,          raft__heap_malloc,  raft__free, raft__calloc,
+    raft__realloc, raft__aligned_alloc,
 };
 
 struct raft_heap *raft_heap__current = &raft_heap__default;
 
+/**
+ * Addresses returned by raft_aligned_alloc() when the current heap has no
+ * aligned_alloc() routine, so raft_free() can tell them apart from the ones
+ * returned by the heap itself. Open addressing with linear probing, the number
+ * of slots is a power of two.
+ *
+ * Only heaps without aligned_alloc() use it, and raft instances may run in
+ * different threads, so it's protected by a mutex.
+ */
+static struct
+{
+    void **slots;   /* Registered addresses, NULL if the slot is free */
+    size_t n_slots; /* Number of slots */
+    size_t n;       /* Number of registered addresses */
+} raft_heap__aligned;
+
+static pthread_mutex_t raft_heap__aligned_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t raft_heap__aligned_slot(const void *ptr)
+{
+    uint64_t h = (uint64_t)(uintptr_t)ptr;
+
+    h = (h >> 4) * 0x9e3779b97f4a7c15ULL;
+
+    return (size_t)(h >> 32) & (raft_heap__aligned.n_slots - 1);
+}
+
+static int raft_heap__aligned_insert(void *ptr)
+{
+    size_t i;
+
+    /* Keep the load factor at 1/2 at most. */
+    if ((raft_heap__aligned.n + 1) * 2 > raft_heap__aligned.n_slots) {
+        void **slots = raft_heap__aligned.slots;
+        size_t n_slots = raft_heap__aligned.n_slots;
+        size_t j;
+
+        raft_heap__aligned.n_slots = n_slots == 0 ? 16 : n_slots * 2;
+        raft_heap__aligned.slots =
+            raft_heap__current->calloc(raft_heap__current->data,
+                                       raft_heap__aligned.n_slots,
+                                       sizeof *raft_heap__aligned.slots);
+        if (raft_heap__aligned.slots == NULL) {
+            raft_heap__aligned.slots = slots;
+            raft_heap__aligned.n_slots = n_slots;
+            return -1;
+        }
+
+        for (j = 0; j < n_slots; j++) {
+            if (slots[j] == NULL) {
+                continue;
+            }
+            i = raft_heap__aligned_slot(slots[j]);
+            while (raft_heap__aligned.slots[i] != NULL) {
+                i = (i + 1) & (raft_heap__aligned.n_slots - 1);
+            }
+            raft_heap__aligned.slots[i] = slots[j];
+        }
+
+        if (slots != NULL) {
+            raft_heap__current->free(raft_heap__current->data, slots);
+        }
+    }
+
+    i = raft_heap__aligned_slot(ptr);
+    while (raft_heap__aligned.slots[i] != NULL) {
+        i = (i + 1) & (raft_heap__aligned.n_slots - 1);
+    }
+    raft_heap__aligned.slots[i] = ptr;
+    raft_heap__aligned.n++;
+
+    return 0;
+}
+
+/**
+ * Unregister the given address, returning false if it was not registered.
+ */
+static bool raft_heap__aligned_remove(void *ptr)
+{
+    size_t mask = raft_heap__aligned.n_slots - 1;
+    size_t i;
+    size_t j;
+
+    if (raft_heap__aligned.n == 0) {
+        return false;
+    }
+
+    i = raft_heap__aligned_slot(ptr);
+    while (raft_heap__aligned.slots[i] != ptr) {
+        if (raft_heap__aligned.slots[i] == NULL) {
+            return false;
+        }
+        i = (i + 1) & mask;
+    }
+
+    /* Shift back the entries of the same probe run, so lookups don't stop at
+     * the freed slot. */
+    j = i;
+    while (1) {
+        size_t k;
+
+        j = (j + 1) & mask;
+        if (raft_heap__aligned.slots[j] == NULL) {
+            break;
+        }
+        k = raft_heap__aligned_slot(raft_heap__aligned.slots[j]);
+        if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+            raft_heap__aligned.slots[i] = raft_heap__aligned.slots[j];
+            i = j;
+        }
+    }
+    raft_heap__aligned.slots[i] = NULL;
+    raft_heap__aligned.n--;
+
+    if (raft_heap__aligned.n == 0) {
+        raft_heap__current->free(raft_heap__current->data,
+                                 raft_heap__aligned.slots);
+        raft_heap__aligned.slots = NULL;
+        raft_heap__aligned.n_slots = 0;
+    }
+
+    return true;
+}
+
+/**
+ * Implement raft_aligned_alloc() on top of the malloc() routine of a heap that
+ * has no aligned_alloc() one, by over-allocating and aligning the returned
+ * address. The offset of the aligned address from the allocated one is stored
+ * right before it.
+ */
+static void *raft_heap__aligned_fallback(size_t alignment, size_t size)
+{
+    uint8_t *base;
+    uint8_t *ptr;
+    size_t offset;
+    int rv;
+
+    assert(alignment > 0 && (alignment & (alignment - 1)) == 0);
+
+    if (alignment < sizeof offset) {
+        alignment = sizeof offset;
+    }
+
+    if (size > SIZE_MAX - alignment - sizeof offset) {
+        return NULL;
+    }
+
+    base = raft_heap__current->malloc(raft_heap__current->data,
+                                      size + alignment + sizeof offset);
+    if (base == NULL) {
+        return NULL;
+    }
+
+    ptr = (uint8_t *)(((uintptr_t)(base + sizeof offset) + alignment - 1) &
+                      ~(uintptr_t)(alignment - 1));
+    offset = (size_t)(ptr - base);
+    memcpy(ptr - sizeof offset, &offset, sizeof offset);
+
+    pthread_mutex_lock(&raft_heap__aligned_mutex);
+    rv = raft_heap__aligned_insert(ptr);
+    pthread_mutex_unlock(&raft_heap__aligned_mutex);
+
+    if (rv != 0) {
+        raft_heap__current->free(raft_heap__current->data, base);
+        return NULL;
+    }
+
+    return ptr;
+}
+
 void *raft_malloc(size_t size)
 {
     return raft_heap__current->malloc(raft_heap__current->data, size);
@@ -39,6 +228,22 @@ void *raft_malloc(size_t size)
 
 void raft_free(void *ptr)
 {
+    /* Heaps with an aligned_alloc() routine never look up the table. */
+    if (raft_heap__current->aligned_alloc == NULL && ptr != NULL) {
+        bool aligned;
+
+        pthread_mutex_lock(&raft_heap__aligned_mutex);
+        aligned = raft_heap__aligned_remove(ptr);
+        pthread_mutex_unlock(&raft_heap__aligned_mutex);
+
+        if (aligned) {
+            size_t offset;
+
+            memcpy(&offset, (uint8_t *)ptr - sizeof offset, sizeof offset);
+            ptr = (uint8_t *)ptr - offset;
+        }
+    }
+
     raft_heap__current->free(raft_heap__current->data, ptr);
 }
 
@@ -52,6 +257,16 @@ void *raft_realloc(void *ptr, size_t size)
     return raft_heap__current->realloc(raft_heap__current->data, ptr, size);
 }
 
+void *raft_aligned_alloc(size_t alignment, size_t size)
+{
+    if (raft_heap__current->aligned_alloc == NULL) {
+        return raft_heap__aligned_fallback(alignment, size);
+    }
+
+    return raft_heap__current->aligned_alloc(raft_heap__current->data,
+                                             alignment, size);
+}
+
 void raft_heap_set(struct raft_heap *heap)
 {
     raft_heap__current = heap;
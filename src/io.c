@@ -1,18 +1,63 @@
 #include <assert.h>
+#include <limits.h>
 #include <string.h>
 
 #include "../include/raft.h"
 
 #include "configuration.h"
+#include "election.h"
 #include "io.h"
 #include "log.h"
 #include "logger.h"
+#include "membership.h"
 #include "replication.h"
+#include "state.h"
 
 #ifndef min
 #define min(a, b) ((a) < (b) ? (a) : (b))
 #endif
 
+/**
+ * Release the log entries referenced by a request submitted by a leader.
+ */
+static void raft_io__release(struct raft *r, struct raft_io_request *request)
+{
+    if (request->batch != NULL) {
+        raft_replication__release_batch(r, request->batch);
+    } else {
+        raft_log__release(&r->log, request->index, request->entries,
+                          request->n);
+    }
+}
+
+/* Mask of the index and of the generation parts of a request ID. */
+#define RAFT_IO__INDEX_MASK (((raft_request_id)1 << RAFT_IO__INDEX_BITS) - 1)
+#define RAFT_IO__GENERATION_MASK (ULLONG_MAX >> RAFT_IO__INDEX_BITS)
+
+/**
+ * Return the ID of the request in the given slot.
+ */
+static raft_request_id raft_io__queue_id(struct raft *r, size_t i)
+{
+    raft_request_id generation = r->io_queue.requests[i].generation;
+
+    return (generation & RAFT_IO__GENERATION_MASK) << RAFT_IO__INDEX_BITS | i;
+}
+
+/**
+ * Mark the request in the given slot as free and put it at the head of the
+ * free list. Bumping its generation invalidates its current ID.
+ */
+static void raft_io__queue_release(struct raft *r, size_t i)
+{
+    struct raft_io_request *request = &r->io_queue.requests[i];
+
+    request->type = RAFT_IO_NULL;
+    request->generation++;
+    request->next = r->io_queue.free;
+    r->io_queue.free = i;
+}
+
 void raft_io__queue_close(struct raft *r)
 {
     size_t i;
@@ -20,37 +65,39 @@ void raft_io__queue_close(struct raft *r)
     for (i = 0; i < r->io_queue.size; i++) {
         struct raft_io_request *request = &r->io_queue.requests[i];
         if (request->type != RAFT_IO_NULL) {
-            if (request->leader_id == r->id) {
+            if (request->type == RAFT_IO_WRITE_METADATA) {
+                /* No memory is referenced by the request. */
+            } else if (request->leader_id == r->id) {
                 /* This request was submitted while we were in leader state. The
                  * relevant entries were acquired from the log and need to be
                  * released. */
                 assert(request->type == RAFT_IO_WRITE_LOG ||
                        request->type == RAFT_IO_APPEND_ENTRIES);
-                raft_log__release(&r->log, request->index, request->entries,
-                                  request->n);
+                raft_io__release(r, request);
             } else {
                 /* This request was submitted while we were in follower
                  * state. The relevant entries were not acquired from the log
                  * (they were received from the network), so we just need to
                  * free the relevant memory. */
                 assert(request->type == RAFT_IO_WRITE_LOG);
-                if (request->entries != NULL) {
-                    assert(request->entries[0].batch != NULL);
-                    raft_free(request->entries[0].batch);
-                    raft_free(request->entries);
-                }
+                raft_replication__free_entries(request->entries, request->n);
             }
-            raft_io__queue_pop(r, i);
+            raft_io__queue_release(r, i);
         }
     }
 
     if (r->io_queue.requests != NULL) {
         raft_free(r->io_queue.requests);
     }
+
+    r->io_queue.requests = NULL;
+    r->io_queue.size = 0;
+    r->io_queue.free = 0;
 }
 
 /**
- * Grow the queue so it has room for at least one more entry.
+ * Grow the queue so it has room for at least one more entry. The new slots are
+ * linked in the free list in order, so they get used from the lowest one.
  */
 static int raft_io__queue_grow(struct raft *r)
 {
@@ -58,7 +105,17 @@ static int raft_io__queue_grow(struct raft *r)
     size_t size;
     size_t i;
 
+    assert(r->io_queue.free == r->io_queue.size);
+
+    /* Request IDs have room only for this many slots. */
+    if (r->io_queue.size > RAFT_IO__INDEX_MASK) {
+        return RAFT_ERR_NOMEM;
+    }
+
     size = 2 * (r->io_queue.size + 1); /* New queue size */
+    if (size > RAFT_IO__INDEX_MASK + 1) {
+        size = RAFT_IO__INDEX_MASK + 1;
+    }
 
     requests = raft_realloc(r->io_queue.requests, size * sizeof *requests);
     if (requests == NULL) {
@@ -68,65 +125,97 @@ static int raft_io__queue_grow(struct raft *r)
     for (i = r->io_queue.size; i < size; i++) {
         struct raft_io_request *request = &requests[i];
         request->type = RAFT_IO_NULL;
+        request->generation = 0;
+        request->next = i + 1;
     }
 
     r->io_queue.requests = requests;
+    r->io_queue.free = r->io_queue.size;
     r->io_queue.size = size;
 
     return 0;
 }
 
-int raft_io__queue_push(struct raft *r, size_t *id)
+int raft_io__queue_push(struct raft *r, raft_request_id *id)
 {
+    struct raft_io_request *request;
     size_t i;
     int rv;
 
-    /* First try to see if we have free slot. */
-    for (i = 0; i < r->io_queue.size; i++) {
-        struct raft_io_request *request = &r->io_queue.requests[i];
-        if (request->type == RAFT_IO_NULL) {
-            *id = i;
-            return 0;
+    if (r->io_queue.free == r->io_queue.size) {
+        rv = raft_io__queue_grow(r);
+        if (rv != 0) {
+            return rv;
         }
     }
 
-    assert(i == r->io_queue.size);
+    i = r->io_queue.free;
+    request = &r->io_queue.requests[i];
 
-    /* We need to grow the queue. */
-    rv = raft_io__queue_grow(r);
-    if (rv != 0) {
-        return rv;
-    }
+    assert(request->type == RAFT_IO_NULL);
+    r->io_queue.free = request->next;
 
-    *id = i;
+    /* Requests not carrying a shared entries batch leave this unset. */
+    request->batch = NULL;
+    *id = raft_io__queue_id(r, i);
 
     return 0;
 }
 
-struct raft_io_request *raft_io__queue_get(struct raft *r, size_t id)
+struct raft_io_request *raft_io__queue_get(struct raft *r, raft_request_id id)
 {
     assert(r != NULL);
-    assert(id < r->io_queue.size);
+    assert((id & RAFT_IO__INDEX_MASK) < r->io_queue.size);
+    assert(raft_io__queue_id(r, id & RAFT_IO__INDEX_MASK) == id);
 
-    return &r->io_queue.requests[id];
+    return &r->io_queue.requests[id & RAFT_IO__INDEX_MASK];
 }
 
-void raft_io__queue_pop(struct raft *r, size_t id)
+struct raft_io_request *raft_io__queue_lookup(struct raft *r,
+                                              raft_request_id id)
 {
+    size_t i = id & RAFT_IO__INDEX_MASK;
+
     assert(r != NULL);
-    assert(id < r->io_queue.size);
-    assert(r->io_queue.requests[id].type != RAFT_IO_NULL);
 
-    r->io_queue.requests[id].type = RAFT_IO_NULL;
+    if (i >= r->io_queue.size || raft_io__queue_id(r, i) != id ||
+        r->io_queue.requests[i].type == RAFT_IO_NULL) {
+        return NULL;
+    }
+
+    return &r->io_queue.requests[i];
 }
 
+void raft_io__queue_pop(struct raft *r, raft_request_id id)
+{
+    struct raft_io_request *request = raft_io__queue_get(r, id);
+
+    assert(request->type != RAFT_IO_NULL);
+    (void)request;
+
+    raft_io__queue_release(r, id & RAFT_IO__INDEX_MASK);
+}
+
+/**
+ * State accumulated while processing a batch of I/O completions, acted upon
+ * once after all of them have been processed.
+ */
+struct raft_io__batch
+{
+    raft_index persisted;    /* Last index of the completed leader writes */
+    raft_index commit;       /* Highest commit index of the completed follower
+                                writes, 0 if none */
+    unsigned leader_id;      /* Leader owed a successful reply, 0 if none */
+};
+
 /**
  * An I/O request on the leader (such as sending an append entries request or
  * writing to the log) has been completed.
  */
 static void raft_handle_io__leader(struct raft *r,
                                    struct raft_io_request *request,
-                                   int status)
+                                   int status,
+                                   struct raft_io__batch *batch)
 {
     assert(request->type == RAFT_IO_WRITE_LOG ||
            request->type == RAFT_IO_APPEND_ENTRIES);
@@ -134,7 +223,7 @@ static void raft_handle_io__leader(struct raft *r,
     raft__debugf(r, "I/O completed on leader: status %d", status);
 
     /* Tell the log that we're done referencing these entries. */
-    raft_log__release(&r->log, request->index, request->entries, request->n);
+    raft_io__release(r, request);
 
     /* TODO: in case this is a failed disk write and we were the leader creating
      * these entries in the first place, should we truncate our log too? since
@@ -143,38 +232,93 @@ static void raft_handle_io__leader(struct raft *r,
         return;
     }
 
-    /* If this was a disk write, check if we have reached a quorum.
+    /* If this was a disk write, remember how far our log is persisted, so we
+     * can check if we have reached a quorum once the whole batch is processed.
      *
-     * TODO: handle the case where we lost leadership in the meantime and
-     * perhaps last_index changed.
-     *
-     * TODO2: think about the fact that last_index might be not be matching
-     * this request (e.g. other entries were accpeted and pre-emptively
-     * appended to the log) so essentialy we need the same min() logic as
-     * above or something similar */
+     * Since more than one write might be in flight, use the last index of this
+     * request rather than the last index of the log, which might include
+     * entries that are not yet persisted. */
     if (request->type == RAFT_IO_WRITE_LOG) {
-        uint64_t index;
-        size_t server_index;
+        raft_index index = request->index + request->n - 1;
 
-        index = raft_log__last_index(&r->log);
-        server_index = raft_configuration__index(&r->configuration, r->id);
+        if (index > batch->persisted) {
+            batch->persisted = index;
+        }
+    }
+}
+
+/**
+ * Update the commit index with the ones received from the leader, and reply to
+ * it reporting the last index of our log.
+ */
+static void raft_handle_io__reply(struct raft *r,
+                                  unsigned leader_id,
+                                  raft_index leader_commit,
+                                  bool success)
+{
+    struct raft_append_entries_result result;
+    const struct raft_server *leader;
+    int rv;
+
+    /* From Figure 3.1:
+     *
+     *   AppendEntries RPC: Receiver implementation: If leaderCommit >
+     *   commitIndex, set commitIndex = min(leaderCommit, index of last new
+     *   entry).
+     */
+    if (success && leader_commit > r->commit_index) {
+        uint64_t last_index = raft_log__last_index(&r->log);
+        r->commit_index = min(leader_commit, last_index);
+    }
+
+    /* The leader might have been removed by a configuration entry it sent. */
+    leader = raft_configuration__get(&r->configuration, leader_id);
+    if (leader == NULL) {
+        raft__infof(r, "leader %ld not in configuration -> don't reply",
+                    leader_id);
+        return;
+    }
+
+    result.term = r->current_term;
+    result.success = success;
+    result.last_log_index = raft_log__last_index(&r->log);
 
-        r->leader_state.match_index[server_index] = index;
+    rv = r->io->send_append_entries_response(r->io, leader, &result);
+    if (rv != 0) {
+        /* Just log the error. */
+        raft__errorf(
+            r, "write log: failed to send append entries response (%d)", rv);
+    }
+}
 
-        raft_replication__maybe_commit(r, index);
+/**
+ * Send the successful reply owed to the leader by the follower writes of the
+ * batch processed so far, if any.
+ */
+static void raft_handle_io__flush(struct raft *r, struct raft_io__batch *batch)
+{
+    if (batch->leader_id == 0) {
+        return;
     }
+
+    raft_handle_io__reply(r, batch->leader_id, batch->commit, true);
+
+    batch->leader_id = 0;
+    batch->commit = 0;
 }
 
 /**
  * An I/O request on the follower (such as writing to the log new entries
  * received via AppendEntries RPC) has been completed.
+ *
+ * Successful writes from the same leader are acknowledged with a single reply
+ * once the batch is processed, reporting the last index of our log.
  */
 static void raft_handle_io__follower(struct raft *r,
                                      struct raft_io_request *request,
-                                     const struct raft_server *leader,
-                                     int status)
+                                     int status,
+                                     struct raft_io__batch *batch)
 {
-    struct raft_append_entries_result result;
     size_t i;
     int rv;
 
@@ -183,17 +327,19 @@ static void raft_handle_io__follower(struct raft *r,
 
     raft__debugf(r, "I/O completed on follower: status %d", status);
 
-    if (status != 0) {
-        result.success = false;
-        goto out;
+    /* Replies must not overtake each other, nor be merged across leaders. */
+    if (status != 0 || batch->leader_id != request->leader_id) {
+        raft_handle_io__flush(r, batch);
     }
 
-    /* TODO: handle the case where the server has gone from the config? */
-    leader = raft_configuration__get(&r->configuration, request->leader_id);
-
-    result.term = r->current_term;
+    if (status != 0) {
+        /* The entries didn't make it to the log. */
+        raft_replication__free_entries(request->entries, request->n);
+        raft_handle_io__reply(r, request->leader_id, 0, false);
+        return;
+    }
 
-    /* Update the log and commit index to match the one from the leader.
+    /* Update the log to match the one from the leader.
      *
      * TODO: handle the case where we're not followers anymore? */
     for (i = 0; i < request->n; i++) {
@@ -202,58 +348,237 @@ static void raft_handle_io__follower(struct raft *r,
                               entry->batch);
         if (rv != 0) {
             /* TODO: what should we do? */
-            // raft_io__queue_pop(r, request->id);
             return;
         }
+
+        /* From Section §4.1:
+         *
+         *   The new configuration takes effect on each server as soon as it is
+         *   added to that server's log.
+         */
+        if (entry->type == RAFT_LOG_CONFIGURATION) {
+            raft_index index = raft_log__last_index(&r->log);
+
+            rv = raft_membership__apply(r, &entry->buf, index);
+            if (rv != 0) {
+                raft__errorf(r, "failed to apply configuration: %s (%d)",
+                             raft_strerror(rv), rv);
+            }
+        }
     }
 
-    /* From Figure 3.1:
-     *
-     *   AppendEntries RPC: Receiver implementation: If leaderCommit >
-     *   commitIndex, set commitIndex = min(leaderCommit, index of last new
-     *   entry).
-     */
-    if (request->leader_commit > r->commit_index) {
-        uint64_t last_index = raft_log__last_index(&r->log);
-        r->commit_index = min(request->leader_commit, last_index);
+    if (request->entries != request->entries[0].batch) {
+        /* The log now references the batch, which holds the array too if it
+         * was laid out at its start. */
+        raft_free(request->entries);
     }
 
-    result.success = true;
+    batch->leader_id = request->leader_id;
+    if (request->leader_commit > batch->commit) {
+        batch->commit = request->leader_commit;
+    }
+}
 
-out:
-    if (request->entries != NULL) {
-        raft_free(request->entries);
+/**
+ * A write of the term and vote has been completed.
+ */
+static void raft_handle_io__metadata(struct raft *r,
+                                     struct raft_io_request *request,
+                                     int status)
+{
+    struct raft_request_vote_result result;
+    const struct raft_server *server;
+    size_t votes_index;
+    int rv;
+
+    raft__debugf(r, "I/O completed on term and vote: status %d", status);
+
+    if (status != 0) {
+        /* Don't count or grant the vote: the election will just time out. */
+        raft__errorf(r, "failed to write term and vote (%d)", status);
+        return;
     }
 
-    result.last_log_index = raft_log__last_index(&r->log);
-    rv = r->io->send_append_entries_response(r->io, leader, &result);
+    /* Nothing to do if the term or the vote have changed in the meantime. */
+    if (request->term != r->current_term ||
+        request->voted_for != r->voted_for) {
+        return;
+    }
+
+    if (request->voted_for == r->id) {
+        /* Our own vote is now durable and can be counted, unless we have
+         * started a new Pre-Vote phase in the meantime. */
+        if (r->state != RAFT_STATE_CANDIDATE ||
+            r->candidate_state.in_pre_vote) {
+            return;
+        }
+
+        votes_index =
+            raft_configuration__voting_index(&r->configuration, r->id);
+        if (raft_election__maybe_win(r, votes_index)) {
+            raft__debugf(r, "votes quorum reached -> convert to leader");
+            rv = raft_state__convert_to_leader(r);
+            if (rv != 0) {
+                raft__errorf(r, "failed to convert to leader (%d)", rv);
+            }
+        }
+        return;
+    }
+
+    /* Let the candidate know that we granted our vote. */
+    server = raft_configuration__get(&r->configuration, request->voted_for);
+    if (server == NULL) {
+        return;
+    }
+
+    result.term = request->term;
+    result.vote_granted = true;
+    result.pre_vote = false;
+
+    rv = r->io->send_request_vote_response(r->io, server, &result);
     if (rv != 0) {
         /* Just log the error. */
-        raft__errorf(
-            r, "write log: failed to send append entries response (%d)", rv);
+        raft__errorf(r, "failed to send request vote response (%d)", rv);
     }
 }
 
-void raft_handle_io(struct raft *r, const unsigned request_id, const int status)
+void raft_handle_io(struct raft *r,
+                    const raft_request_id request_id,
+                    const int status)
 {
-    struct raft_io_request *request;
-    const struct raft_server *server;
+    raft_handle_io_batch(r, &request_id, &status, 1);
+}
+
+void raft_handle_io_batch(struct raft *r,
+                          const raft_request_id request_ids[],
+                          const int statuses[],
+                          unsigned n)
+{
+    struct raft_io__batch batch;
+    unsigned i;
 
     assert(r != NULL);
+    assert(request_ids != NULL || n == 0);
+    assert(statuses != NULL || n == 0);
+
+    batch.persisted = 0;
+    batch.commit = 0;
+    batch.leader_id = 0;
+
+    for (i = 0; i < n; i++) {
+        struct raft_io_request *request;
+
+        request = raft_io__queue_lookup(r, request_ids[i]);
+        if (request == NULL) {
+            /* The request was already completed, or cancelled, and its slot
+             * might have been reused since then. */
+            raft__warnf(r, "I/O completion for unknown request %llu -> ignore",
+                        request_ids[i]);
+            continue;
+        }
+
+        if (request->type == RAFT_IO_WRITE_METADATA) {
+            raft_handle_io__metadata(r, request, statuses[i]);
+        } else if (request->leader_id == r->id) {
+            /* This I/O request was pushed at a time this server was a leader,
+             * either to write entries to its own on-disk log or to replicate
+             * them to a follower. */
+            raft_handle_io__leader(r, request, statuses[i], &batch);
+        } else {
+            /* This I/O request was pushed at a time this server was a
+             * follower, to replicate entries to its own log. */
+            raft_handle_io__follower(r, request, statuses[i], &batch);
+        }
+
+        raft_io__queue_pop(r, request_ids[i]);
+    }
+
+    /* Check if the writes have brought a new quorum, once for all of them.
+     *
+     * TODO: handle the case where perhaps last_index changed. */
+    if (batch.persisted > 0 && r->state == RAFT_STATE_LEADER) {
+        size_t server_index;
+
+        server_index = raft_configuration__index(&r->configuration, r->id);
+        r->leader_state.match_index[server_index] = batch.persisted;
+
+        raft_replication__maybe_commit(r, batch.persisted);
+    }
+
+    raft_handle_io__flush(r, &batch);
+}
+
+bool raft_io__async_metadata(struct raft *r)
+{
+    return r->io->version >= 3 && r->io->write_metadata != NULL;
+}
+
+bool raft_io__timeout_now(struct raft *r)
+{
+    return r->io->version >= 4 && r->io->send_timeout_now != NULL;
+}
+
+/**
+ * Submit an asynchronous write of the given term and vote.
+ */
+static int raft_io__write_metadata(struct raft *r,
+                                   raft_term term,
+                                   unsigned server_id)
+{
+    struct raft_io_request *request;
+    raft_request_id request_id;
+    int rv;
+
+    rv = raft_io__queue_push(r, &request_id);
+    if (rv != 0) {
+        return rv;
+    }
 
     request = raft_io__queue_get(r, request_id);
-    server = raft_configuration__get(&r->configuration, request->leader_id);
+    request->type = RAFT_IO_WRITE_METADATA;
+    request->index = 0;
+    request->entries = NULL;
+    request->n = 0;
+    request->leader_id = 0;
+    request->leader_commit = 0;
+    request->batch = NULL;
+    request->term = term;
+    request->voted_for = server_id;
+
+    rv = r->io->write_metadata(r->io, request_id, term, server_id);
+    if (rv != 0) {
+        raft_io__queue_pop(r, request_id);
+        return rv;
+    }
 
-    if (server->id == r->id) {
-        /* This I/O request was pushed at a time this server was a leader,
-         * either to write entries to its own on-disk log or to replicate them
-         * to a follower. */
-        raft_handle_io__leader(r, request, status);
-    } else {
-        /* This I/O request was pushed at a time this server was a follower, to
-         * replicate entries to its own log. */
-        raft_handle_io__follower(r, request, server, status);
+    return 0;
+}
+
+int raft_io__write_term_and_vote(struct raft *r,
+                                 raft_term term,
+                                 unsigned server_id)
+{
+    int rv;
+
+    assert(r != NULL);
+
+    /* Writing the term resets the vote anyway. */
+    if (server_id == 0) {
+        return r->io->write_term(r->io, term);
+    }
+
+    if (raft_io__async_metadata(r)) {
+        return raft_io__write_metadata(r, term, server_id);
+    }
+
+    if (r->io->version >= 2 && r->io->write_term_and_vote != NULL) {
+        return r->io->write_term_and_vote(r->io, term, server_id);
+    }
+
+    rv = r->io->write_term(r->io, term);
+    if (rv != 0) {
+        return rv;
     }
 
-    raft_io__queue_pop(r, request_id);
+    return r->io->write_vote(r->io, server_id);
 }
@@ -7,24 +7,74 @@
 
 #include "../include/raft.h"
 
+/**
+ * Number of low bits of a request ID holding the index of its slot in the
+ * queue. The remaining bits hold the generation of the slot, which changes
+ * every time the slot is released, so completions for requests that are not in
+ * flight anymore can be told apart from the ones of requests reusing the slot.
+ *
+ * With 64-bit IDs the generation has 44 bits, so a stale completion could only
+ * be mistaken for a live request after its slot was reused 2^44 times, which at
+ * a million requests per second takes more than half a year.
+ */
+#define RAFT_IO__INDEX_BITS 20
+
+/**
+ * Release all pending I/O requests and the queue itself, leaving it empty.
+ */
 void raft_io__queue_close(struct raft *r);
 
 /**
  * Add a request to the list of pending I/O requests. Return the ID of the newly
  * added request object.
+ *
+ * Free request slots are kept in a list, so this takes constant time unless the
+ * queue needs to grow.
  */
-int raft_io__queue_push(struct raft *r, size_t *id);
+int raft_io__queue_push(struct raft *r, raft_request_id *id);
 
 /**
  * Fetch the request with the given ID. The ID must be a value previously
  * returned by raft_io__queue_push() and not yet passed to raft_io__queue_pop().
  */
-struct raft_io_request *raft_io__queue_get(struct raft *r, size_t id);
+struct raft_io_request *raft_io__queue_get(struct raft *r, raft_request_id id);
+
+/**
+ * Like raft_io__queue_get(), but return NULL if the given ID doesn't match a
+ * request currently in the queue, for example because it was already popped.
+ */
+struct raft_io_request *raft_io__queue_lookup(struct raft *r,
+                                              raft_request_id id);
 
 /**
  * Delete an item from the list of pending I/O requests. This must called both
  * in case the request succeeded or in case it failed.
  */
-void raft_io__queue_pop(struct raft *r, size_t id);
+void raft_io__queue_pop(struct raft *r, raft_request_id id);
+
+/**
+ * Return true if the I/O implementation can persist the term and vote
+ * asynchronously.
+ */
+bool raft_io__async_metadata(struct raft *r);
+
+/**
+ * Return true if the I/O implementation can send TimeoutNow requests, which
+ * leadership transfers rely on.
+ */
+bool raft_io__timeout_now(struct raft *r);
+
+/**
+ * Persist the given term along with the given vote (0 for none). A single
+ * write_term_and_vote() call is used if the I/O implementation supports it.
+ *
+ * If raft_io__async_metadata() returns true and the vote is not 0, the write
+ * is just submitted. Once it completes, the vote is counted if it was for
+ * ourselves and we're still candidate in that term, or the RequestVote result
+ * granting it is sent to the candidate otherwise.
+ */
+int raft_io__write_term_and_vote(struct raft *r,
+                                 raft_term term,
+                                 unsigned server_id);
 
 #endif /* RAFT_IO_H */
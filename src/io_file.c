@@ -0,0 +1,2133 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* For O_DIRECT */
+#endif
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../include/raft.h"
+
+#include "aio.h"
+#include "batch.h"
+#include "binary.h"
+#include "crc32c.h"
+#include "encoding.h"
+
+/**
+ * Version of the on-disk format.
+ */
+#define RAFT_IO_FILE__FORMAT 1
+
+/**
+ * Formats of segment files. In the packed format batches are stored back to
+ * back. In the aligned format, used with RAFT_IO_FILE_DIRECT, the segment
+ * header and the header and data sections of each batch are padded with zeros
+ * to RAFT_BATCH_ALIGNMENT, so they can be written with O_DIRECT.
+ */
+#define RAFT_IO_FILE__PACKED 1
+#define RAFT_IO_FILE__ALIGNED 2
+
+/**
+ * Name of the file holding the current term and vote.
+ */
+#define RAFT_IO_FILE__METADATA "metadata"
+
+/**
+ * The metadata file contains the format version, the term and the vote, each
+ * of them encoded as 64-bit little endian integer.
+ */
+#define RAFT_IO_FILE__METADATA_SIZE (8 * 3)
+
+/**
+ * Each segment file starts with a header containing the segment format and the
+ * index of the first entry in the segment, encoded as 64-bit little endian
+ * integers. The header is followed by a sequence of entry batches, one for
+ * each write log request.
+ */
+#define RAFT_IO_FILE__SEGMENT_HEADER_SIZE (8 * 2)
+
+/**
+ * Size after which the open segment gets closed and a new one is started.
+ */
+#define RAFT_IO_FILE__SEGMENT_SIZE (8 * 1024 * 1024)
+
+/**
+ * Segment files are named after the index of their first entry, formatted as a
+ * zero-padded decimal number.
+ */
+#define RAFT_IO_FILE__SEGMENT_NAME_LEN 20
+
+/**
+ * Maximum number of write log requests in flight.
+ */
+#define RAFT_IO_FILE__DEPTH 64
+
+/**
+ * Maximum number of buffers in a single write (IOV_MAX on Linux). Requests
+ * that would need more buffers get their entries data copied.
+ */
+#define RAFT_IO_FILE__MAX_IOV 1024
+
+/**
+ * Maximum number of threads used to recover closed segments at load time.
+ */
+#define RAFT_IO_FILE__RECOVERY_THREADS 8
+
+/**
+ * An in-flight write log request.
+ */
+struct raft_io_file__write
+{
+    struct raft_aio_write aio;        /* Engine request */
+    raft_request_id request_id;       /* Raft I/O request ID */
+    void *header;                     /* Encoded batch header */
+    void *data;                       /* Copy of the entries data, if any */
+    struct iovec *iov;                /* Buffers being written */
+    bool done;                        /* Whether the engine completed it */
+    bool metadata;                    /* Whether it writes term and vote */
+    struct raft_io_file__write *next; /* Next request in submission order */
+};
+
+/**
+ * A closed segment mapped in memory at load time, used as batch of its entries.
+ * The mapping is released along with this descriptor, when the last of them is.
+ */
+struct raft_io_file__mapping
+{
+    struct raft_batch__owner owner; /* Releases the mapping */
+    void *addr;                     /* Start of the mapping */
+    size_t size;                    /* Length of the mapping */
+};
+
+/**
+ * Release a mapping descriptor and the mapping itself. This is called by
+ * raft_release_entries_batch(), when the log releases the batch.
+ */
+static void raft_io_file__unmap(struct raft_batch__owner *owner)
+{
+    struct raft_io_file__mapping *mapping =
+        (struct raft_io_file__mapping *)owner;
+
+    munmap(mapping->addr, mapping->size);
+    raft_free(mapping);
+}
+
+/**
+ * Recovery state of a single segment at load time.
+ */
+struct raft_io_file__segment
+{
+    raft_index first_index;     /* Index of the first entry */
+    void *buf;                  /* Segment content, mapped or read */
+    size_t size;                /* Size of the segment content */
+    int status;                 /* Result of the scan */
+    int format;                 /* Format of the segment */
+    size_t start;               /* Offset of the first batch */
+    size_t count;               /* Number of entries */
+    size_t valid;               /* Length of the valid content */
+    struct raft_entry *entries; /* Where to decode the entries */
+    void *batch;                /* Batch to assign to the decoded entries */
+};
+
+/**
+ * Closed segments being recovered by a pool of threads.
+ */
+struct raft_io_file__recovery
+{
+    struct raft_io_file__segment *segments; /* Segments to recover */
+    unsigned n;                             /* Number of segments */
+    unsigned n_threads;                     /* Number of threads */
+    bool decode;                            /* Whether to scan or decode */
+};
+
+/**
+ * A thread recovering a share of the closed segments.
+ */
+struct raft_io_file__worker
+{
+    struct raft_io_file__recovery *recovery; /* Shared recovery state */
+    unsigned i;                              /* Index of the first segment */
+};
+
+/**
+ * State of a file-based raft_io instance.
+ */
+struct raft_io_file
+{
+    struct raft_io *transport;              /* Network I/O implementation */
+    int flags;                              /* Flags passed at init time */
+    int dir_fd;                             /* Data directory */
+    int metadata_fd;                        /* Term and vote */
+    raft_term term;                         /* Cached term */
+    unsigned voted_for;                     /* Cached vote */
+    struct raft_aio aio;                    /* Disk write engine */
+    raft_index last_index;                  /* Last submitted entry */
+    raft_index first_index;                 /* First index of open segment */
+    int format;                             /* Format of the open segment */
+    int segment_fd;                         /* Open segment, or -1 */
+    off_t segment_size;                     /* Size of the open segment */
+    struct raft_io_file__write *head;       /* Oldest in-flight write */
+    struct raft_io_file__write *tail;       /* Newest in-flight write */
+    unsigned n_writes;                      /* Number of in-flight writes */
+    int status;                             /* Sticky error of a failed write */
+};
+
+/**
+ * Zero bytes used to pad entries data to 8-byte boundary.
+ */
+static const uint8_t raft_io_file__padding[8];
+
+/**
+ * Convert an errno value into a raft error code.
+ */
+static int raft_io_file__errno(int error)
+{
+    switch (error) {
+        case ENOSPC:
+        case EDQUOT:
+            return RAFT_ERR_NO_SPACE;
+        case ENOMEM:
+            return RAFT_ERR_NOMEM;
+        default:
+            return RAFT_ERR_IO;
+    }
+}
+
+static void raft_io_file__segment_name(raft_index first_index, char *name)
+{
+    sprintf(name, "%0*llu", RAFT_IO_FILE__SEGMENT_NAME_LEN, first_index);
+}
+
+/**
+ * Return the alignment of the sections of a segment with the given format.
+ */
+static size_t raft_io_file__alignment(int format)
+{
+    return format == RAFT_IO_FILE__ALIGNED ? RAFT_BATCH_ALIGNMENT : 8;
+}
+
+/**
+ * Allocate a zeroed buffer suitable for writing sections of a segment with the
+ * given alignment.
+ */
+static void *raft_io_file__alloc(size_t alignment, size_t size)
+{
+    void *buf;
+
+    if (alignment <= 8) {
+        return raft_calloc(1, size);
+    }
+
+    buf = raft_aligned_alloc(alignment, size);
+    if (buf != NULL) {
+        memset(buf, 0, size);
+    }
+
+    return buf;
+}
+
+/**
+ * Open the segment file with the given name. Segments in the aligned format are
+ * opened with O_DIRECT if RAFT_IO_FILE_DIRECT was given, unless the underlying
+ * file system does not support it.
+ */
+static int raft_io_file__open_segment(struct raft_io_file *f,
+                                      const char *name,
+                                      int flags,
+                                      int format)
+{
+    int fd;
+
+    flags |= O_RDWR | O_CLOEXEC;
+
+    if (format == RAFT_IO_FILE__ALIGNED && f->flags & RAFT_IO_FILE_DIRECT) {
+        fd = openat(f->dir_fd, name, flags | O_DIRECT, 0600);
+        if (fd >= 0 || errno != EINVAL) {
+            return fd;
+        }
+    }
+
+    return openat(f->dir_fd, name, flags, 0600);
+}
+
+/**
+ * Synchronously write the given buffer at the given offset and flush it.
+ */
+static int raft_io_file__write_sync(int fd,
+                                    const void *buf,
+                                    size_t len,
+                                    off_t offset)
+{
+    size_t written = 0;
+
+    while (written < len) {
+        ssize_t rv = pwrite(fd, (const uint8_t *)buf + written, len - written,
+                            offset + written);
+        if (rv < 0) {
+            return raft_io_file__errno(errno);
+        }
+        written += rv;
+    }
+
+    if (fdatasync(fd) != 0) {
+        return raft_io_file__errno(errno);
+    }
+
+    return 0;
+}
+
+/**
+ * Read the whole content of the given file into a newly allocated buffer.
+ */
+static int raft_io_file__read(int dir_fd,
+                              const char *name,
+                              void **buf,
+                              size_t *len)
+{
+    struct stat st;
+    size_t offset = 0;
+    int fd;
+    int rv;
+
+    fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return raft_io_file__errno(errno);
+    }
+
+    if (fstat(fd, &st) != 0) {
+        rv = raft_io_file__errno(errno);
+        goto err;
+    }
+
+    *len = st.st_size;
+    *buf = raft_malloc(*len > 0 ? *len : 1);
+    if (*buf == NULL) {
+        rv = RAFT_ERR_NOMEM;
+        goto err;
+    }
+
+    while (offset < *len) {
+        ssize_t n = pread(fd, (uint8_t *)*buf + offset, *len - offset, offset);
+        if (n <= 0) {
+            rv = n < 0 ? raft_io_file__errno(errno) : RAFT_ERR_IO;
+            raft_free(*buf);
+            goto err;
+        }
+        offset += n;
+    }
+
+    close(fd);
+
+    return 0;
+
+err:
+    close(fd);
+    return rv;
+}
+
+static int raft_io_file__metadata_store(struct raft_io_file *f,
+                                        raft_term term,
+                                        unsigned voted_for)
+{
+    uint64_t buf[RAFT_IO_FILE__METADATA_SIZE / 8];
+    int rv;
+
+    buf[0] = raft__flip64(RAFT_IO_FILE__FORMAT);
+    buf[1] = raft__flip64(term);
+    buf[2] = raft__flip64(voted_for);
+
+    rv = raft_io_file__write_sync(f->metadata_fd, buf, sizeof buf, 0);
+    if (rv != 0) {
+        return rv;
+    }
+
+    f->term = term;
+    f->voted_for = voted_for;
+
+    return 0;
+}
+
+static int raft_io_file__metadata_load(struct raft_io_file *f)
+{
+    uint64_t buf[RAFT_IO_FILE__METADATA_SIZE / 8];
+    ssize_t n;
+    int rv;
+
+    f->metadata_fd = openat(f->dir_fd, RAFT_IO_FILE__METADATA,
+                            O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (f->metadata_fd < 0) {
+        return raft_io_file__errno(errno);
+    }
+
+    n = pread(f->metadata_fd, buf, sizeof buf, 0);
+    if (n < 0) {
+        rv = raft_io_file__errno(errno);
+        goto err;
+    }
+
+    /* A brand new data directory. */
+    if (n == 0) {
+        rv = raft_io_file__metadata_store(f, 0, 0);
+        if (rv != 0) {
+            goto err;
+        }
+        if (fsync(f->dir_fd) != 0) {
+            rv = raft_io_file__errno(errno);
+            goto err;
+        }
+        return 0;
+    }
+
+    if (n != sizeof buf || raft__flip64(buf[0]) != RAFT_IO_FILE__FORMAT) {
+        rv = RAFT_ERR_MALFORMED;
+        goto err;
+    }
+
+    f->term = raft__flip64(buf[1]);
+    f->voted_for = raft__flip64(buf[2]);
+
+    return 0;
+
+err:
+    close(f->metadata_fd);
+    return rv;
+}
+
+static int raft_io_file__compare_index(const void *a, const void *b)
+{
+    raft_index i1 = *(const raft_index *)a;
+    raft_index i2 = *(const raft_index *)b;
+
+    return i1 < i2 ? -1 : i1 > i2 ? 1 : 0;
+}
+
+/**
+ * Return the first indexes of all segment files, in ascending order.
+ */
+static int raft_io_file__list(struct raft_io_file *f,
+                              raft_index **indexes,
+                              size_t *n)
+{
+    struct dirent *entry;
+    DIR *dir;
+    int fd;
+    int rv = 0;
+
+    *indexes = NULL;
+    *n = 0;
+
+    fd = dup(f->dir_fd);
+    if (fd < 0) {
+        return raft_io_file__errno(errno);
+    }
+
+    dir = fdopendir(fd);
+    if (dir == NULL) {
+        close(fd);
+        return raft_io_file__errno(errno);
+    }
+    rewinddir(dir);
+
+    while ((entry = readdir(dir)) != NULL) {
+        raft_index *array;
+        size_t i;
+
+        if (strlen(entry->d_name) != RAFT_IO_FILE__SEGMENT_NAME_LEN) {
+            continue;
+        }
+        for (i = 0; i < RAFT_IO_FILE__SEGMENT_NAME_LEN; i++) {
+            if (entry->d_name[i] < '0' || entry->d_name[i] > '9') {
+                break;
+            }
+        }
+        if (i < RAFT_IO_FILE__SEGMENT_NAME_LEN) {
+            continue;
+        }
+
+        array = raft_realloc(*indexes, (*n + 1) * sizeof *array);
+        if (array == NULL) {
+            rv = RAFT_ERR_NOMEM;
+            break;
+        }
+        array[*n] = strtoull(entry->d_name, NULL, 10);
+        *indexes = array;
+        (*n)++;
+    }
+
+    closedir(dir);
+
+    if (rv != 0) {
+        raft_free(*indexes);
+        return rv;
+    }
+
+    qsort(*indexes, *n, sizeof **indexes, raft_io_file__compare_index);
+
+    return 0;
+}
+
+/**
+ * Check the batch stored in the given segment buffer at the given @offset,
+ * whose header and data sections are padded to @alignment.
+ *
+ * If a complete batch is found, set @n to the number of its entries and @len to
+ * the length of the batch. Otherwise, return RAFT_ERR_MALFORMED, or
+ * RAFT_ERR_CHECKSUM if the batch is complete but its content is corrupted. No
+ * memory is allocated, so this is safe to call from recovery threads.
+ */
+static int raft_io_file__check_batch(const void *buf,
+                                     size_t size,
+                                     size_t offset,
+                                     size_t alignment,
+                                     unsigned *n,
+                                     size_t *len)
+{
+    const uint8_t *batch = (const uint8_t *)buf + offset;
+    size_t header_size;
+    size_t data_size = 0;
+    size_t padded_size;
+    uint32_t data_crc;
+    unsigned version;
+    unsigned count;
+    unsigned flags;
+    unsigned i;
+    int rv;
+
+    if (size - offset < raft_encode__batch_header_size(0)) {
+        return RAFT_ERR_MALFORMED;
+    }
+
+    rv = raft_decode__batch_count(batch, &version, &count, &flags);
+    if (rv != 0) {
+        return rv;
+    }
+
+    /* Entries given to write_log are always plain, since compression only
+     * applies to the network (see raft_set_compression()), so a batch flagged
+     * as compressed can't have been written by us. */
+    if (flags != 0) {
+        return RAFT_ERR_MALFORMED;
+    }
+
+    if (count == 0 || count > (size - offset) / 16) {
+        return RAFT_ERR_MALFORMED;
+    }
+
+    header_size = raft_encode__align(
+        raft_decode__batch_header_size(version, count), alignment);
+    if (size - offset < header_size) {
+        return RAFT_ERR_MALFORMED;
+    }
+
+    /* Batches written by older versions have no checksums. */
+    if (version != 0) {
+        rv = raft_decode__batch_verify(batch, count, 0, &data_crc);
+        if (rv != 0) {
+            return rv;
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        const uint8_t *header = batch + 8 + 16 * i;
+        uint32_t data_len;
+
+        if (header[8] != RAFT_LOG_COMMAND &&
+            header[8] != RAFT_LOG_CONFIGURATION) {
+            return RAFT_ERR_MALFORMED;
+        }
+
+        data_len = raft__flip32(*(const uint32_t *)(header + 12));
+        data_size += raft_encode__align(data_len, 8);
+    }
+
+    padded_size = raft_encode__align(data_size, alignment);
+    if (size - offset - header_size < padded_size) {
+        return RAFT_ERR_MALFORMED;
+    }
+
+    if (version != 0 &&
+        raft_crc32c(0, batch + header_size, data_size) != data_crc) {
+        return RAFT_ERR_CHECKSUM;
+    }
+
+    *n = count;
+    *len = header_size + padded_size;
+
+    return 0;
+}
+
+/**
+ * Decode the @n entries of a batch previously validated with
+ * raft_io_file__check_batch() into the given array. The entries data points
+ * into the segment buffer.
+ */
+static void raft_io_file__decode_batch(void *buf,
+                                       size_t offset,
+                                       size_t alignment,
+                                       struct raft_entry *entries,
+                                       unsigned n)
+{
+    struct raft_buffer data;
+    size_t header_size;
+    unsigned version;
+    unsigned count;
+    unsigned flags;
+    int rv;
+
+    rv = raft_decode__batch_count((uint8_t *)buf + offset, &version, &count,
+                                  &flags);
+    assert(rv == 0 && count == n); /* Checked by raft_io_file__check_batch() */
+
+    rv = raft_decode__batch_entries((uint8_t *)buf + offset, entries, n);
+    assert(rv == 0);
+    (void)rv;
+
+    header_size = raft_encode__align(raft_decode__batch_header_size(version, n),
+                                     alignment);
+
+    data.base = (uint8_t *)buf + offset + header_size;
+    data.len = raft_encode__batch_data_size(entries, n);
+
+    raft_decode_entries_batch(&data, entries, n);
+}
+
+/**
+ * Check the header of the given segment buffer and return its format, the
+ * offset of its first batch, the number of entries it contains and the length
+ * of its valid content. A trailing incomplete batch is not considered valid
+ * content.
+ */
+static int raft_io_file__scan(const void *buf,
+                              size_t size,
+                              raft_index first_index,
+                              int *format,
+                              size_t *start,
+                              size_t *n,
+                              size_t *valid)
+{
+    const uint64_t *header = buf;
+    size_t alignment;
+    size_t offset;
+
+    if (size < RAFT_IO_FILE__SEGMENT_HEADER_SIZE) {
+        return RAFT_ERR_MALFORMED;
+    }
+
+    *format = raft__flip64(header[0]);
+    if (*format != RAFT_IO_FILE__PACKED && *format != RAFT_IO_FILE__ALIGNED) {
+        return RAFT_ERR_MALFORMED;
+    }
+
+    alignment = raft_io_file__alignment(*format);
+    offset = raft_encode__align(RAFT_IO_FILE__SEGMENT_HEADER_SIZE, alignment);
+
+    if (size < offset || raft__flip64(header[1]) != first_index) {
+        return RAFT_ERR_MALFORMED;
+    }
+
+    *start = offset;
+    *n = 0;
+
+    while (offset < size) {
+        unsigned m;
+        size_t len;
+
+        if (raft_io_file__check_batch(buf, size, offset, alignment, &m, &len) !=
+            0) {
+            break;
+        }
+
+        *n += m;
+        offset += len;
+    }
+
+    *valid = offset;
+
+    return 0;
+}
+
+/**
+ * Return the format of the segments created by this instance.
+ */
+static int raft_io_file__format(struct raft_io_file *f)
+{
+    if (f->flags & RAFT_IO_FILE_DIRECT) {
+        return RAFT_IO_FILE__ALIGNED;
+    }
+    return RAFT_IO_FILE__PACKED;
+}
+
+/**
+ * Create a new segment whose first entry will have the given index, and make
+ * it the open one.
+ */
+static int raft_io_file__create(struct raft_io_file *f, raft_index first_index)
+{
+    char name[RAFT_IO_FILE__SEGMENT_NAME_LEN + 1];
+    int format = raft_io_file__format(f);
+    uint64_t *header;
+    size_t size;
+    int fd;
+    int rv;
+
+    size = raft_encode__align(RAFT_IO_FILE__SEGMENT_HEADER_SIZE,
+                              raft_io_file__alignment(format));
+
+    header = raft_io_file__alloc(raft_io_file__alignment(format), size);
+    if (header == NULL) {
+        return RAFT_ERR_NOMEM;
+    }
+
+    raft_io_file__segment_name(first_index, name);
+
+    fd = raft_io_file__open_segment(f, name, O_CREAT | O_TRUNC, format);
+    if (fd < 0) {
+        raft_free(header);
+        return raft_io_file__errno(errno);
+    }
+
+    header[0] = raft__flip64(format);
+    header[1] = raft__flip64(first_index);
+
+    rv = raft_io_file__write_sync(fd, header, size, 0);
+    raft_free(header);
+    if (rv != 0) {
+        goto err;
+    }
+
+    if (fsync(f->dir_fd) != 0) {
+        rv = raft_io_file__errno(errno);
+        goto err;
+    }
+
+    if (f->segment_fd >= 0) {
+        close(f->segment_fd);
+    }
+
+    f->segment_fd = fd;
+    f->first_index = first_index;
+    f->format = format;
+    f->segment_size = size;
+
+    return 0;
+
+err:
+    close(fd);
+    unlinkat(f->dir_fd, name, 0);
+    return rv;
+}
+
+/**
+ * Collect completed writes from the engine and mark them as done. If @wait is
+ * true, block until all in-flight writes are completed.
+ */
+static void raft_io_file__harvest(struct raft_io_file *f, bool wait)
+{
+    struct raft_aio_write *done[16];
+    unsigned n;
+    unsigned i;
+
+    while (1) {
+        bool pending = false;
+        struct raft_io_file__write *w;
+
+        for (w = f->head; w != NULL; w = w->next) {
+            if (!w->done) {
+                pending = true;
+                break;
+            }
+        }
+
+        if (!pending) {
+            break;
+        }
+
+        n = raft_aio__harvest(&f->aio, done, 16, wait);
+        for (i = 0; i < n; i++) {
+            w = done[i]->data;
+            w->done = true;
+            if (w->aio.status != 0 && f->status == 0) {
+                f->status = w->aio.status;
+            }
+        }
+
+        if (n < 16 && !wait) {
+            break;
+        }
+    }
+
+    /* A blocking harvest consumes the eventfd notifications of the writes it
+     * waited for: if any of them is still to be reported by
+     * raft_io_file_poll(), make the eventfd readable again, or the event loop
+     * would never call it. */
+    if (wait) {
+        struct raft_io_file__write *w;
+
+        for (w = f->head; w != NULL; w = w->next) {
+            if (w->done) {
+                raft_aio__signal(&f->aio);
+                break;
+            }
+        }
+    }
+}
+
+static void raft_io_file__write_free(struct raft_io_file__write *w)
+{
+    raft_free(w->header);
+    if (w->data != NULL) {
+        raft_free(w->data);
+    }
+    raft_free(w->iov);
+    raft_free(w);
+}
+
+/**
+ * Append a buffer to the given iovec array, merging it with the last one if
+ * they are contiguous in memory.
+ */
+static void raft_io_file__iov_append(struct iovec *iov,
+                                     unsigned *n,
+                                     const void *base,
+                                     size_t len)
+{
+    if (*n > 0) {
+        struct iovec *last = &iov[*n - 1];
+        if ((uint8_t *)last->iov_base + last->iov_len == base) {
+            last->iov_len += len;
+            return;
+        }
+    }
+    iov[*n].iov_base = (void *)base;
+    iov[*n].iov_len = len;
+    (*n)++;
+}
+
+/**
+ * Fill the iovec array of the given write request with the entries data,
+ * including padding.
+ */
+static int raft_io_file__write_iov(struct raft_io_file__write *w,
+                                   const struct raft_entry entries[],
+                                   unsigned n,
+                                   size_t header_size,
+                                   size_t data_size)
+{
+    unsigned i;
+
+    w->iov = raft_malloc((2 * n + 1) * sizeof *w->iov);
+    if (w->iov == NULL) {
+        return RAFT_ERR_NOMEM;
+    }
+
+    w->aio.n = 0;
+    raft_io_file__iov_append(w->iov, &w->aio.n, w->header, header_size);
+
+    for (i = 0; i < n; i++) {
+        const struct raft_entry *entry = &entries[i];
+        size_t padding = 0;
+
+        if (entry->buf.len == 0) {
+            continue;
+        }
+
+        if (entry->buf.len % 8 != 0) {
+            padding = 8 - (entry->buf.len % 8);
+        }
+
+        raft_io_file__iov_append(w->iov, &w->aio.n, entry->buf.base,
+                                 entry->buf.len);
+        if (padding > 0) {
+            raft_io_file__iov_append(w->iov, &w->aio.n, raft_io_file__padding,
+                                     padding);
+        }
+    }
+
+    if (w->aio.n <= RAFT_IO_FILE__MAX_IOV) {
+        return 0;
+    }
+
+    /* Too many buffers, copy the entries data into a single one. */
+    w->data = raft_calloc(1, data_size);
+    if (w->data == NULL) {
+        return RAFT_ERR_NOMEM;
+    }
+
+    w->aio.n = 0;
+    raft_io_file__iov_append(w->iov, &w->aio.n, w->header, header_size);
+    raft_io_file__iov_append(w->iov, &w->aio.n, w->data, data_size);
+
+    raft_encode__batch_data(entries, n, w->data);
+
+    return 0;
+}
+
+/**
+ * Return true if the data of the given entries is laid out in their batch
+ * memory exactly as raft_decode_entries_batch() expects, starting from a
+ * RAFT_BATCH_ALIGNMENT boundary.
+ */
+static bool raft_io_file__is_aligned_batch(const struct raft_entry entries[],
+                                           unsigned n)
+{
+    const uint8_t *batch = entries[0].batch;
+    size_t offset = 0;
+    unsigned i;
+
+    if (batch == NULL || (uintptr_t)batch % RAFT_BATCH_ALIGNMENT != 0) {
+        return false;
+    }
+
+    for (i = 0; i < n; i++) {
+        const struct raft_entry *entry = &entries[i];
+
+        if (entry->batch != batch) {
+            return false;
+        }
+
+        if (entry->buf.len == 0) {
+            continue;
+        }
+
+        if (entry->buf.base != batch + offset) {
+            return false;
+        }
+
+        offset = raft_encode__align(offset + entry->buf.len, 8);
+    }
+
+    return true;
+}
+
+/**
+ * Fill the iovec array of the given write request for the aligned format. If
+ * the entries come from an aligned batch, such as the payload of an
+ * AppendEntries request, its memory is written directly, otherwise the entries
+ * data is copied into an aligned buffer.
+ */
+static int raft_io_file__write_iov_aligned(struct raft_io_file__write *w,
+                                           const struct raft_entry entries[],
+                                           unsigned n,
+                                           size_t header_size,
+                                           size_t data_size)
+{
+    const void *data;
+    int rv;
+
+    w->iov = raft_malloc(2 * sizeof *w->iov);
+    if (w->iov == NULL) {
+        return RAFT_ERR_NOMEM;
+    }
+
+    if (raft_io_file__is_aligned_batch(entries, n)) {
+        data = entries[0].batch;
+    } else {
+        struct raft_buffer buf;
+
+        rv = raft_encode_entries_batch(entries, n, RAFT_BATCH_ALIGNED, &buf);
+        if (rv != 0) {
+            return rv;
+        }
+
+        w->data = buf.base;
+        data = w->data;
+    }
+
+    w->aio.n = 0;
+    raft_io_file__iov_append(w->iov, &w->aio.n, w->header, header_size);
+    if (data_size > 0) {
+        raft_io_file__iov_append(w->iov, &w->aio.n, data, data_size);
+    }
+
+    return 0;
+}
+
+/**
+ * Wait for any in-flight metadata write to complete. Since all metadata writes
+ * target the same bytes, a new one can't be issued while another is pending,
+ * or they could hit the disk in the wrong order.
+ */
+static int raft_io_file__metadata_wait(struct raft_io_file *f)
+{
+    struct raft_io_file__write *w;
+
+    for (w = f->head; w != NULL; w = w->next) {
+        if (w->metadata && !w->done) {
+            raft_io_file__harvest(f, true);
+            break;
+        }
+    }
+
+    return f->status;
+}
+
+static int raft_io_file__write_term(struct raft_io *io, const raft_term term)
+{
+    struct raft_io_file *f = io->data;
+    int rv;
+
+    rv = raft_io_file__metadata_wait(f);
+    if (rv != 0) {
+        return rv;
+    }
+
+    return raft_io_file__metadata_store(f, term, 0);
+}
+
+static int raft_io_file__write_vote(struct raft_io *io,
+                                    const unsigned server_id)
+{
+    struct raft_io_file *f = io->data;
+    int rv;
+
+    rv = raft_io_file__metadata_wait(f);
+    if (rv != 0) {
+        return rv;
+    }
+
+    return raft_io_file__metadata_store(f, f->term, server_id);
+}
+
+static int raft_io_file__write_term_and_vote(struct raft_io *io,
+                                             const raft_term term,
+                                             const unsigned server_id)
+{
+    struct raft_io_file *f = io->data;
+    int rv;
+
+    rv = raft_io_file__metadata_wait(f);
+    if (rv != 0) {
+        return rv;
+    }
+
+    return raft_io_file__metadata_store(f, term, server_id);
+}
+
+/**
+ * Write the term and vote through the disk write engine. Its completion is
+ * notified by raft_io_file_poll() like the one of log writes, in submission
+ * order. If the engine is full, the write is performed synchronously and
+ * notified at the next poll.
+ */
+static int raft_io_file__write_metadata(struct raft_io *io,
+                                        const raft_request_id request_id,
+                                        const raft_term term,
+                                        const unsigned server_id)
+{
+    struct raft_io_file *f = io->data;
+    struct raft_io_file__write *w;
+    uint64_t *buf;
+    int rv;
+
+    rv = raft_io_file__metadata_wait(f);
+    if (rv != 0) {
+        return rv;
+    }
+
+    w = raft_malloc(sizeof *w);
+    if (w == NULL) {
+        rv = RAFT_ERR_NOMEM;
+        goto err;
+    }
+
+    w->request_id = request_id;
+    w->data = NULL;
+    w->done = false;
+    w->metadata = true;
+    w->next = NULL;
+
+    w->header = raft_malloc(RAFT_IO_FILE__METADATA_SIZE);
+    if (w->header == NULL) {
+        rv = RAFT_ERR_NOMEM;
+        goto err_after_write_alloc;
+    }
+
+    buf = w->header;
+    buf[0] = raft__flip64(RAFT_IO_FILE__FORMAT);
+    buf[1] = raft__flip64(term);
+    buf[2] = raft__flip64(server_id);
+
+    w->iov = raft_malloc(sizeof *w->iov);
+    if (w->iov == NULL) {
+        rv = RAFT_ERR_NOMEM;
+        goto err_after_header_alloc;
+    }
+
+    w->iov[0].iov_base = w->header;
+    w->iov[0].iov_len = RAFT_IO_FILE__METADATA_SIZE;
+
+    w->aio.fd = f->metadata_fd;
+    w->aio.iov = w->iov;
+    w->aio.n = 1;
+    w->aio.offset = 0;
+    w->aio.len = RAFT_IO_FILE__METADATA_SIZE;
+    w->aio.data = w;
+
+    if (f->n_writes >= RAFT_IO_FILE__DEPTH) {
+        rv = raft_io_file__write_sync(f->metadata_fd, w->header,
+                                      RAFT_IO_FILE__METADATA_SIZE, 0);
+        w->aio.status = rv;
+        w->done = true;
+    } else {
+        rv = raft_aio__submit(&f->aio, &w->aio);
+    }
+    if (rv != 0) {
+        goto err_after_iov_alloc;
+    }
+
+    f->term = term;
+    f->voted_for = server_id;
+
+    if (f->tail == NULL) {
+        f->head = w;
+    } else {
+        f->tail->next = w;
+    }
+    f->tail = w;
+    f->n_writes++;
+
+    return 0;
+
+err_after_iov_alloc:
+    raft_free(w->iov);
+
+err_after_header_alloc:
+    raft_free(w->header);
+
+err_after_write_alloc:
+    raft_free(w);
+
+err:
+    assert(rv != 0);
+    return rv;
+}
+
+static int raft_io_file__write_log(struct raft_io *io,
+                                   const raft_request_id request_id,
+                                   const struct raft_entry entries[],
+                                   const unsigned n)
+{
+    struct raft_io_file *f = io->data;
+    struct raft_io_file__write *w;
+    size_t alignment;
+    size_t header_size;
+    size_t data_size;
+    int rv;
+
+    assert(entries != NULL);
+    assert(n > 0);
+
+    if (f->status != 0) {
+        return f->status;
+    }
+
+    if (f->n_writes >= RAFT_IO_FILE__DEPTH) {
+        return RAFT_ERR_IO_BUSY;
+    }
+
+    /* Start a new segment if needed. Since the old segment file gets closed,
+     * wait for any in-flight write against it to complete. */
+    if (f->segment_fd < 0 || f->segment_size >= RAFT_IO_FILE__SEGMENT_SIZE) {
+        raft_io_file__harvest(f, true);
+        if (f->status != 0) {
+            return f->status;
+        }
+        rv = raft_io_file__create(f, f->last_index + 1);
+        if (rv != 0) {
+            return rv;
+        }
+    }
+
+    w = raft_malloc(sizeof *w);
+    if (w == NULL) {
+        rv = RAFT_ERR_NOMEM;
+        goto err;
+    }
+
+    w->request_id = request_id;
+    w->data = NULL;
+    w->iov = NULL;
+    w->done = false;
+    w->metadata = false;
+    w->next = NULL;
+
+    alignment = raft_io_file__alignment(f->format);
+    header_size =
+        raft_encode__align(raft_encode__batch_header_size(n), alignment);
+    data_size = raft_encode__align(raft_encode__batch_data_size(entries, n),
+                                   alignment);
+
+    w->header = raft_io_file__alloc(alignment, header_size);
+    if (w->header == NULL) {
+        rv = RAFT_ERR_NOMEM;
+        goto err_after_write_alloc;
+    }
+
+    raft_encode__batch_header(entries, n, w->header);
+
+    if (f->format == RAFT_IO_FILE__ALIGNED) {
+        rv = raft_io_file__write_iov_aligned(w, entries, n, header_size,
+                                             data_size);
+    } else {
+        rv = raft_io_file__write_iov(w, entries, n, header_size, data_size);
+    }
+    if (rv != 0) {
+        goto err_after_header_alloc;
+    }
+
+    w->aio.fd = f->segment_fd;
+    w->aio.iov = w->iov;
+    w->aio.offset = f->segment_size;
+    w->aio.len = header_size + data_size;
+    w->aio.data = w;
+
+    rv = raft_aio__submit(&f->aio, &w->aio);
+    if (rv != 0) {
+        goto err_after_header_alloc;
+    }
+
+    f->segment_size += w->aio.len;
+    f->last_index += n;
+
+    if (f->tail == NULL) {
+        f->head = w;
+    } else {
+        f->tail->next = w;
+    }
+    f->tail = w;
+    f->n_writes++;
+
+    return 0;
+
+err_after_header_alloc:
+    if (w->iov != NULL) {
+        raft_free(w->iov);
+    }
+    if (w->data != NULL) {
+        raft_free(w->data);
+    }
+    raft_free(w->header);
+
+err_after_write_alloc:
+    raft_free(w);
+
+err:
+    assert(rv != 0);
+    return rv;
+}
+
+/**
+ * Replace the content of the closed segment with the given name with the first
+ * @size bytes of @buf followed by @size2 bytes of @buf2.
+ *
+ * The new content is written to a temporary file which is then renamed over
+ * the segment. This way the old file stays intact for as long as it is mapped
+ * in memory by raft_io_file_load(), since entries loaded from it might still
+ * be in use.
+ */
+static int raft_io_file__replace(struct raft_io_file *f,
+                                 const char *name,
+                                 const void *buf,
+                                 size_t size,
+                                 const void *buf2,
+                                 size_t size2)
+{
+    char tmp[RAFT_IO_FILE__SEGMENT_NAME_LEN + sizeof ".tmp"];
+    int fd;
+    int rv;
+
+    sprintf(tmp, "%s.tmp", name);
+
+    fd = openat(f->dir_fd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return raft_io_file__errno(errno);
+    }
+
+    rv = raft_io_file__write_sync(fd, buf, size, 0);
+    if (rv != 0) {
+        goto err;
+    }
+
+    if (size2 > 0) {
+        rv = raft_io_file__write_sync(fd, buf2, size2, size);
+        if (rv != 0) {
+            goto err;
+        }
+    }
+
+    close(fd);
+
+    if (renameat(f->dir_fd, tmp, f->dir_fd, name) != 0) {
+        rv = raft_io_file__errno(errno);
+        unlinkat(f->dir_fd, tmp, 0);
+        return rv;
+    }
+
+    return 0;
+
+err:
+    close(fd);
+    unlinkat(f->dir_fd, tmp, 0);
+    return rv;
+}
+
+/**
+ * Truncate the segment with the given first index, so that it contains only
+ * entries before @index, and make it the open segment.
+ */
+static int raft_io_file__truncate_segment(struct raft_io_file *f,
+                                          raft_index first_index,
+                                          raft_index index)
+{
+    char name[RAFT_IO_FILE__SEGMENT_NAME_LEN + 1];
+    raft_index batch_index = first_index;
+    struct raft_entry *entries = NULL;
+    uint8_t *batch = NULL;
+    size_t batch_size = 0;
+    size_t alignment;
+    size_t offset;
+    size_t count;
+    size_t valid;
+    void *buf;
+    size_t size;
+    unsigned n = 0;
+    bool open;
+    int format;
+    int fd;
+    int rv;
+
+    raft_io_file__segment_name(first_index, name);
+
+    rv = raft_io_file__read(f->dir_fd, name, &buf, &size);
+    if (rv != 0) {
+        return rv;
+    }
+
+    rv = raft_io_file__scan(buf, size, first_index, &format, &offset, &count,
+                            &valid);
+    if (rv != 0) {
+        goto out;
+    }
+
+    alignment = raft_io_file__alignment(format);
+
+    /* Find the batch containing the entry at the given index. */
+    while (offset < valid) {
+        size_t len;
+
+        rv = raft_io_file__check_batch(buf, valid, offset, alignment, &n, &len);
+        assert(rv == 0); /* Checked by raft_io_file__scan() */
+
+        if (batch_index + n > index) {
+            break;
+        }
+
+        batch_index += n;
+        offset += len;
+        n = 0;
+    }
+
+    /* Encode the entries of that batch that precede the given index. */
+    if (n > 0 && index > batch_index) {
+        unsigned m = index - batch_index;
+        size_t header_size;
+
+        entries = raft_malloc(n * sizeof *entries);
+        if (entries == NULL) {
+            rv = RAFT_ERR_NOMEM;
+            goto out;
+        }
+
+        raft_io_file__decode_batch(buf, offset, alignment, entries, n);
+
+        header_size =
+            raft_encode__align(raft_encode__batch_header_size(m), alignment);
+        batch_size = header_size +
+                     raft_encode__align(
+                         raft_encode__batch_data_size(entries, m), alignment);
+
+        batch = raft_io_file__alloc(alignment, batch_size);
+        if (batch == NULL) {
+            rv = RAFT_ERR_NOMEM;
+            goto out;
+        }
+
+        raft_encode__batch_header(entries, m, batch);
+        raft_encode__batch_data(entries, m, batch + header_size);
+    }
+
+    open = f->segment_fd >= 0 && first_index == f->first_index;
+
+    if (open) {
+        /* The open segment is never mapped, truncate it in place. */
+        fd = f->segment_fd;
+        if (ftruncate(fd, offset) != 0) {
+            rv = raft_io_file__errno(errno);
+            goto out;
+        }
+        if (batch != NULL) {
+            rv = raft_io_file__write_sync(fd, batch, batch_size, offset);
+        } else if (fdatasync(fd) != 0) {
+            rv = raft_io_file__errno(errno);
+        }
+        if (rv != 0) {
+            goto out;
+        }
+    } else {
+        rv = raft_io_file__replace(f, name, buf, offset, batch, batch_size);
+        if (rv != 0) {
+            goto out;
+        }
+        fd = raft_io_file__open_segment(f, name, 0, format);
+        if (fd < 0) {
+            rv = raft_io_file__errno(errno);
+            goto out;
+        }
+        if (f->segment_fd >= 0) {
+            close(f->segment_fd);
+        }
+        f->segment_fd = fd;
+        f->first_index = first_index;
+    }
+
+    f->format = format;
+    f->segment_size = offset + batch_size;
+
+out:
+    if (batch != NULL) {
+        raft_free(batch);
+    }
+    if (entries != NULL) {
+        raft_free(entries);
+    }
+    raft_free(buf);
+
+    return rv;
+}
+
+static int raft_io_file__truncate_log(struct raft_io *io,
+                                      const raft_index index)
+{
+    struct raft_io_file *f = io->data;
+    raft_index *indexes;
+    size_t n;
+    size_t i;
+    int rv;
+
+    assert(index > 0);
+
+    /* Wait for in-flight writes, so the segments content is stable. Their
+     * completion will be notified as usual by raft_io_file_poll(). */
+    raft_io_file__harvest(f, true);
+    if (f->status != 0) {
+        return f->status;
+    }
+
+    if (index > f->last_index) {
+        return 0;
+    }
+
+    rv = raft_io_file__list(f, &indexes, &n);
+    if (rv != 0) {
+        return rv;
+    }
+
+    /* Delete all segments whose entries are all being truncated. */
+    for (i = n; i > 0 && indexes[i - 1] >= index; i--) {
+        char name[RAFT_IO_FILE__SEGMENT_NAME_LEN + 1];
+
+        if (f->segment_fd >= 0 && indexes[i - 1] == f->first_index) {
+            close(f->segment_fd);
+            f->segment_fd = -1;
+            f->first_index = 0;
+        }
+
+        raft_io_file__segment_name(indexes[i - 1], name);
+        if (unlinkat(f->dir_fd, name, 0) != 0) {
+            rv = raft_io_file__errno(errno);
+            goto out;
+        }
+    }
+
+    /* Truncate the segment containing the given index, if any. */
+    if (i > 0) {
+        rv = raft_io_file__truncate_segment(f, indexes[i - 1], index);
+        if (rv != 0) {
+            goto out;
+        }
+    }
+
+    if (fsync(f->dir_fd) != 0) {
+        rv = raft_io_file__errno(errno);
+        goto out;
+    }
+
+    f->last_index = index - 1;
+
+out:
+    if (indexes != NULL) {
+        raft_free(indexes);
+    }
+
+    return rv;
+}
+
+static int raft_io_file__send_request_vote_request(
+    struct raft_io *io,
+    const struct raft_server *server,
+    const struct raft_request_vote_args *args)
+{
+    struct raft_io_file *f = io->data;
+
+    return f->transport->send_request_vote_request(f->transport, server, args);
+}
+
+static int raft_io_file__send_request_vote_response(
+    struct raft_io *io,
+    const struct raft_server *server,
+    const struct raft_request_vote_result *result)
+{
+    struct raft_io_file *f = io->data;
+
+    return f->transport->send_request_vote_response(f->transport, server,
+                                                    result);
+}
+
+static int raft_io_file__send_timeout_now(
+    struct raft_io *io,
+    const struct raft_server *server,
+    const struct raft_timeout_now_args *args)
+{
+    struct raft_io_file *f = io->data;
+
+    return f->transport->send_timeout_now(f->transport, server, args);
+}
+
+static int raft_io_file__send_append_entries_request(
+    struct raft_io *io,
+    const raft_request_id request_id,
+    const struct raft_server *server,
+    const struct raft_append_entries_args *args)
+{
+    struct raft_io_file *f = io->data;
+
+    return f->transport->send_append_entries_request(f->transport, request_id,
+                                                     server, args);
+}
+
+static int raft_io_file__send_append_entries_response(
+    struct raft_io *io,
+    const struct raft_server *server,
+    const struct raft_append_entries_result *result)
+{
+    struct raft_io_file *f = io->data;
+
+    return f->transport->send_append_entries_response(f->transport, server,
+                                                      result);
+}
+
+/**
+ * Find the open segment, if any, and figure out the index of the last entry.
+ */
+static int raft_io_file__open_last_segment(struct raft_io_file *f)
+{
+    char name[RAFT_IO_FILE__SEGMENT_NAME_LEN + 1];
+    raft_index *indexes;
+    raft_index first_index;
+    void *buf;
+    size_t size;
+    size_t start;
+    size_t valid;
+    size_t count;
+    size_t n;
+    int format;
+    int fd;
+    int rv;
+
+    f->segment_fd = -1;
+    f->first_index = 0;
+    f->segment_size = 0;
+    f->last_index = 0;
+
+    rv = raft_io_file__list(f, &indexes, &n);
+    if (rv != 0) {
+        return rv;
+    }
+
+    if (n == 0) {
+        return 0;
+    }
+
+    first_index = indexes[n - 1];
+    raft_io_file__segment_name(first_index, name);
+
+    rv = raft_io_file__read(f->dir_fd, name, &buf, &size);
+    if (rv != 0) {
+        goto err;
+    }
+
+    rv = raft_io_file__scan(buf, size, first_index, &format, &start, &count,
+                            &valid);
+    raft_free(buf);
+    if (rv != 0) {
+        goto err;
+    }
+
+    fd = raft_io_file__open_segment(f, name, 0, format);
+    if (fd < 0) {
+        rv = raft_io_file__errno(errno);
+        goto err;
+    }
+
+    /* Discard any partially written batch at the end of the segment. */
+    if (valid < size) {
+        if (ftruncate(fd, valid) != 0 || fdatasync(fd) != 0) {
+            rv = raft_io_file__errno(errno);
+            close(fd);
+            goto err;
+        }
+    }
+
+    f->last_index = first_index + count - 1;
+
+    /* If the segment was written with a different format than the one in use
+     * now, leave it alone and start a new segment at the next write. */
+    if (format == raft_io_file__format(f)) {
+        f->segment_fd = fd;
+        f->first_index = first_index;
+        f->format = format;
+        f->segment_size = valid;
+    } else {
+        close(fd);
+    }
+
+    raft_free(indexes);
+
+    return 0;
+
+err:
+    raft_free(indexes);
+    return rv;
+}
+
+int raft_io_file_init(struct raft_io *io,
+                      struct raft_io *transport,
+                      const char *dir,
+                      int flags)
+{
+    struct raft_io_file *f;
+    int rv;
+
+    assert(io != NULL);
+    assert(transport != NULL);
+    assert(dir != NULL);
+
+    f = raft_malloc(sizeof *f);
+    if (f == NULL) {
+        return RAFT_ERR_NOMEM;
+    }
+
+    f->transport = transport;
+    f->flags = flags;
+    f->format = raft_io_file__format(f);
+    f->head = NULL;
+    f->tail = NULL;
+    f->n_writes = 0;
+    f->status = 0;
+
+    f->dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (f->dir_fd < 0) {
+        rv = raft_io_file__errno(errno);
+        goto err_after_alloc;
+    }
+
+    rv = raft_io_file__metadata_load(f);
+    if (rv != 0) {
+        goto err_after_dir_open;
+    }
+
+    rv = raft_io_file__open_last_segment(f);
+    if (rv != 0) {
+        goto err_after_metadata_load;
+    }
+
+    rv = raft_aio__init(&f->aio, RAFT_IO_FILE__DEPTH,
+                        flags & RAFT_IO_FILE_THREADS);
+    if (rv != 0) {
+        goto err_after_segment_open;
+    }
+
+    io->version = 4;
+    io->data = f;
+    io->write_term = raft_io_file__write_term;
+    io->write_vote = raft_io_file__write_vote;
+    io->write_log = raft_io_file__write_log;
+    io->truncate_log = raft_io_file__truncate_log;
+    io->send_request_vote_request = raft_io_file__send_request_vote_request;
+    io->send_request_vote_response = raft_io_file__send_request_vote_response;
+    io->send_append_entries_request = raft_io_file__send_append_entries_request;
+    io->send_append_entries_response =
+        raft_io_file__send_append_entries_response;
+    io->write_term_and_vote = raft_io_file__write_term_and_vote;
+    io->write_metadata = raft_io_file__write_metadata;
+
+    /* Leadership can be transferred only if the transport supports it. */
+    io->send_timeout_now = NULL;
+    if (transport->version >= 4 && transport->send_timeout_now != NULL) {
+        io->send_timeout_now = raft_io_file__send_timeout_now;
+    }
+
+    return 0;
+
+err_after_segment_open:
+    if (f->segment_fd >= 0) {
+        close(f->segment_fd);
+    }
+
+err_after_metadata_load:
+    close(f->metadata_fd);
+
+err_after_dir_open:
+    close(f->dir_fd);
+
+err_after_alloc:
+    raft_free(f);
+
+    assert(rv != 0);
+
+    return rv;
+}
+
+void raft_io_file_close(struct raft_io *io)
+{
+    struct raft_io_file *f = io->data;
+
+    raft_io_file__harvest(f, true);
+
+    while (f->head != NULL) {
+        struct raft_io_file__write *w = f->head;
+        f->head = w->next;
+        raft_io_file__write_free(w);
+    }
+
+    raft_aio__close(&f->aio);
+
+    if (f->segment_fd >= 0) {
+        close(f->segment_fd);
+    }
+    close(f->metadata_fd);
+    close(f->dir_fd);
+
+    raft_free(f);
+}
+
+int raft_io_file_fd(struct raft_io *io)
+{
+    struct raft_io_file *f = io->data;
+
+    return f->aio.event_fd;
+}
+
+void raft_io_file_poll(struct raft_io *io, struct raft *r)
+{
+    struct raft_io_file *f = io->data;
+    struct raft_io_file__write *done[RAFT_IO_FILE__DEPTH];
+    raft_request_id ids[RAFT_IO_FILE__DEPTH];
+    int statuses[RAFT_IO_FILE__DEPTH];
+    unsigned n;
+    unsigned i;
+
+    raft_io_file__harvest(f, false);
+
+    /* Notify completions in submission order, handing all the ones at the head
+     * of the list to raft at once. There can be more than the engine depth
+     * only if some term and vote writes were performed synchronously, in which
+     * case they take more than one round. */
+    while (f->head != NULL && f->head->done) {
+        n = 0;
+        while (f->head != NULL && f->head->done && n < RAFT_IO_FILE__DEPTH) {
+            struct raft_io_file__write *w = f->head;
+
+            f->head = w->next;
+            if (f->head == NULL) {
+                f->tail = NULL;
+            }
+            f->n_writes--;
+
+            done[n] = w;
+            ids[n] = w->request_id;
+            statuses[n] = w->aio.status;
+            n++;
+        }
+
+        raft_handle_io_batch(r, ids, statuses, n);
+
+        for (i = 0; i < n; i++) {
+            raft_io_file__write_free(done[i]);
+        }
+    }
+}
+
+/**
+ * Scan a closed segment, checking that it's complete.
+ */
+static void raft_io_file__recover_scan(struct raft_io_file__segment *s)
+{
+    unsigned n;
+    size_t len;
+
+    s->status = raft_io_file__scan(s->buf, s->size, s->first_index, &s->format,
+                                   &s->start, &s->count, &s->valid);
+    if (s->status == 0 && s->valid < s->size) {
+        /* Only the open segment can have a partial batch at the end, so this
+         * is corruption: check the batch again to find out what's wrong. */
+        s->status = raft_io_file__check_batch(
+            s->buf, s->size, s->valid, raft_io_file__alignment(s->format), &n,
+            &len);
+        assert(s->status != 0);
+    }
+}
+
+/**
+ * Decode the entries of a segment previously scanned.
+ */
+static void raft_io_file__recover_decode(struct raft_io_file__segment *s)
+{
+    size_t alignment = raft_io_file__alignment(s->format);
+    size_t offset = s->start;
+    size_t i = 0;
+
+    while (offset < s->valid) {
+        unsigned n;
+        unsigned j;
+        size_t len;
+        int rv;
+
+        rv = raft_io_file__check_batch(s->buf, s->valid, offset, alignment, &n,
+                                       &len);
+        assert(rv == 0); /* Checked by raft_io_file__scan() */
+        (void)rv;
+
+        raft_io_file__decode_batch(s->buf, offset, alignment, &s->entries[i],
+                                   n);
+
+        for (j = 0; j < n; j++) {
+            s->entries[i + j].batch = s->batch;
+        }
+
+        i += n;
+        offset += len;
+    }
+
+    assert(i == s->count);
+}
+
+/**
+ * Process all segments assigned to a recovery thread. Segments are assigned
+ * round-robin, so each thread reads from different files at any time.
+ */
+static void *raft_io_file__recover_work(void *arg)
+{
+    struct raft_io_file__worker *w = arg;
+    struct raft_io_file__recovery *r = w->recovery;
+    unsigned i;
+
+    for (i = w->i; i < r->n; i += r->n_threads) {
+        if (r->decode) {
+            raft_io_file__recover_decode(&r->segments[i]);
+        } else {
+            raft_io_file__recover_scan(&r->segments[i]);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Run a recovery pass over all closed segments, using up to
+ * RAFT_IO_FILE__RECOVERY_THREADS threads. If threads can't be started, their
+ * share of work is performed by the calling thread.
+ */
+static void raft_io_file__recover(struct raft_io_file__recovery *r, bool decode)
+{
+    struct raft_io_file__worker workers[RAFT_IO_FILE__RECOVERY_THREADS];
+    pthread_t threads[RAFT_IO_FILE__RECOVERY_THREADS];
+    bool started[RAFT_IO_FILE__RECOVERY_THREADS];
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned i;
+
+    r->decode = decode;
+    r->n_threads = r->n;
+    if (n_cpus > 0 && r->n_threads > (unsigned)n_cpus) {
+        r->n_threads = n_cpus;
+    }
+    if (r->n_threads > RAFT_IO_FILE__RECOVERY_THREADS) {
+        r->n_threads = RAFT_IO_FILE__RECOVERY_THREADS;
+    }
+
+    for (i = 0; i < r->n_threads; i++) {
+        workers[i].recovery = r;
+        workers[i].i = i;
+        started[i] = i > 0 && pthread_create(&threads[i], NULL,
+                                             raft_io_file__recover_work,
+                                             &workers[i]) == 0;
+    }
+
+    for (i = 0; i < r->n_threads; i++) {
+        if (!started[i]) {
+            raft_io_file__recover_work(&workers[i]);
+        }
+    }
+
+    for (i = 0; i < r->n_threads; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+}
+
+/**
+ * Map the given closed segment in memory.
+ */
+static int raft_io_file__map(struct raft_io_file *f,
+                             struct raft_io_file__segment *s)
+{
+    char name[RAFT_IO_FILE__SEGMENT_NAME_LEN + 1];
+    struct stat st;
+    int fd;
+    int rv;
+
+    raft_io_file__segment_name(s->first_index, name);
+
+    fd = openat(f->dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return raft_io_file__errno(errno);
+    }
+
+    if (fstat(fd, &st) != 0) {
+        rv = raft_io_file__errno(errno);
+        goto out;
+    }
+
+    if (st.st_size < RAFT_IO_FILE__SEGMENT_HEADER_SIZE) {
+        rv = RAFT_ERR_MALFORMED;
+        goto out;
+    }
+
+    s->size = st.st_size;
+    s->buf = mmap(NULL, s->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (s->buf == MAP_FAILED) {
+        s->buf = NULL;
+        rv = raft_io_file__errno(errno);
+        goto out;
+    }
+
+    madvise(s->buf, s->size, MADV_SEQUENTIAL);
+
+    rv = 0;
+
+out:
+    close(fd);
+    return rv;
+}
+
+int raft_io_file_load(struct raft_io *io,
+                      raft_term *term,
+                      unsigned *voted_for,
+                      struct raft_entry *entries[],
+                      size_t *n)
+{
+    struct raft_io_file *f = io->data;
+    char name[RAFT_IO_FILE__SEGMENT_NAME_LEN + 1];
+    struct raft_io_file__recovery recovery;
+    struct raft_io_file__segment *segments;
+    struct raft_io_file__segment *last;
+    raft_index *indexes;
+    raft_index next_index = 1;
+    size_t n_segments;
+    size_t i;
+    int rv;
+
+    assert(f->head == NULL);
+
+    *term = f->term;
+    *voted_for = f->voted_for;
+    *entries = NULL;
+    *n = 0;
+
+    rv = raft_io_file__list(f, &indexes, &n_segments);
+    if (rv != 0) {
+        return rv;
+    }
+
+    if (n_segments == 0) {
+        return 0;
+    }
+
+    segments = raft_calloc(n_segments, sizeof *segments);
+    if (segments == NULL) {
+        rv = RAFT_ERR_NOMEM;
+        goto err_after_list;
+    }
+
+    for (i = 0; i < n_segments; i++) {
+        segments[i].first_index = indexes[i];
+    }
+
+    /* Map all closed segments in memory and scan them in parallel. */
+    for (i = 0; i < n_segments - 1; i++) {
+        rv = raft_io_file__map(f, &segments[i]);
+        if (rv != 0) {
+            goto err_after_segments_alloc;
+        }
+    }
+
+    recovery.segments = segments;
+    recovery.n = n_segments - 1;
+
+    raft_io_file__recover(&recovery, false);
+
+    /* The open segment is still being appended to and might end with a
+     * partially written batch, so read it in memory instead. */
+    last = &segments[n_segments - 1];
+    raft_io_file__segment_name(last->first_index, name);
+
+    rv = raft_io_file__read(f->dir_fd, name, &last->buf, &last->size);
+    if (rv != 0) {
+        goto err_after_segments_alloc;
+    }
+
+    last->status =
+        raft_io_file__scan(last->buf, last->size, last->first_index,
+                           &last->format, &last->start, &last->count,
+                           &last->valid);
+
+    for (i = 0; i < n_segments; i++) {
+        struct raft_io_file__segment *s = &segments[i];
+
+        if (s->status != 0) {
+            rv = s->status;
+            goto err_after_segments_alloc;
+        }
+
+        if (s->first_index != next_index) {
+            rv = RAFT_ERR_MALFORMED;
+            goto err_after_segments_alloc;
+        }
+
+        next_index += s->count;
+        *n += s->count;
+    }
+
+    if (*n == 0) {
+        goto out;
+    }
+
+    *entries = raft_malloc(*n * sizeof **entries);
+    if (*entries == NULL) {
+        rv = RAFT_ERR_NOMEM;
+        goto err_after_segments_alloc;
+    }
+
+    /* Entries of closed segments point into the mapped memory. Give the log a
+     * small descriptor of the mapping to use as batch: releasing it with
+     * raft_release_entries_batch() also unmaps the segment. */
+    for (i = 0; i < n_segments - 1; i++) {
+        struct raft_io_file__segment *s = &segments[i];
+        struct raft_io_file__mapping *mapping;
+
+        if (s->count == 0) {
+            continue;
+        }
+
+        mapping = raft_malloc(sizeof *mapping);
+        if (mapping == NULL) {
+            rv = RAFT_ERR_NOMEM;
+            goto err_after_entries_alloc;
+        }
+        mapping->owner.release = raft_io_file__unmap;
+        mapping->addr = s->buf;
+        mapping->size = s->size;
+
+        s->batch = raft_batch__tag(&mapping->owner);
+    }
+
+    /* The whole open segment buffer acts as batch. */
+    last->batch = last->buf;
+
+    next_index = 0;
+    for (i = 0; i < n_segments; i++) {
+        segments[i].entries = *entries + next_index;
+        next_index += segments[i].count;
+    }
+
+    raft_io_file__recover(&recovery, true);
+    if (last->count > 0) {
+        raft_io_file__recover_decode(last);
+    }
+
+    /* The mappings and the open segment buffer are now owned by the batches
+     * of the loaded entries. */
+    for (i = 0; i < n_segments; i++) {
+        if (segments[i].count > 0) {
+            segments[i].buf = NULL;
+        }
+    }
+
+out:
+    for (i = 0; i < n_segments - 1; i++) {
+        if (segments[i].buf != NULL) {
+            munmap(segments[i].buf, segments[i].size);
+        }
+    }
+    if (last->buf != NULL) {
+        raft_free(last->buf);
+    }
+    raft_free(segments);
+    raft_free(indexes);
+
+    return 0;
+
+err_after_entries_alloc:
+    /* Releasing a mapping descriptor also unmaps its segment. */
+    for (i = 0; i < n_segments - 1; i++) {
+        if (segments[i].batch != NULL) {
+            raft_release_entries_batch(segments[i].batch);
+            segments[i].buf = NULL;
+        }
+    }
+    raft_free(*entries);
+    *entries = NULL;
+    *n = 0;
+
+err_after_segments_alloc:
+    for (i = 0; i < n_segments; i++) {
+        struct raft_io_file__segment *s = &segments[i];
+
+        if (s->buf == NULL) {
+            continue;
+        }
+        if (i < n_segments - 1) {
+            munmap(s->buf, s->size);
+        } else {
+            raft_free(s->buf);
+        }
+    }
+    raft_free(segments);
+
+err_after_list:
+    raft_free(indexes);
+
+    assert(rv != 0);
+
+    return rv;
+}
@@ -0,0 +1,547 @@
+#include <assert.h>
+
+#include "../include/raft.h"
+
+#include "log.h"
+
+/**
+ * Initial capacity of the arrays of an outbox.
+ */
+#define RAFT_IO_OUTBOX__INITIAL_CAP 16
+
+/**
+ * Work accumulated during an event loop iteration.
+ */
+struct raft_io_outbox__box
+{
+    bool save_term_and_vote;              /* Term or vote changed */
+    raft_request_id *metadata;            /* IDs of term and vote writes */
+    unsigned n_metadata;                  /* Number of term and vote writes */
+    unsigned cap_metadata;                /* Capacity of the metadata array */
+    struct raft_ready_write *writes;      /* Log writes */
+    unsigned n_writes;                    /* Number of log writes */
+    unsigned cap_writes;                  /* Capacity of the writes array */
+    struct raft_ready_message *messages;  /* Outgoing messages */
+    unsigned n_messages;                  /* Number of outgoing messages */
+    unsigned cap_messages;                /* Capacity of the messages array */
+    struct raft_entry *committed;         /* Committed entries to apply */
+    unsigned cap_committed;               /* Capacity of the committed array */
+    raft_index applied;                   /* Last committed entry handed out */
+    raft_request_id *ids;                 /* IDs of the requests to complete */
+    int *statuses;                        /* Completion statuses */
+    unsigned n_ids;                       /* Number of requests to complete */
+    unsigned cap_ids;                     /* Capacity of the ids array */
+    unsigned cap_statuses;                /* Capacity of the statuses array */
+};
+
+/**
+ * Two boxes are used in turn: one gets filled by the raft instance while the
+ * other one is being carried out by the user, so their memory is reused across
+ * iterations.
+ */
+struct raft_io_outbox
+{
+    struct raft_io_outbox__box boxes[2]; /* Outboxes */
+    unsigned current;                    /* Box currently being filled */
+    bool pending;                        /* Whether the other box is out */
+};
+
+/**
+ * Make sure that the given array has room for at least @n items of the given
+ * @size, doubling its capacity as needed. Return the possibly moved array, or
+ * NULL if the memory could not be allocated.
+ */
+static void *raft_io_outbox__grow(void *array,
+                                  unsigned *cap,
+                                  unsigned n,
+                                  size_t size)
+{
+    unsigned new_cap = *cap;
+
+    if (n <= *cap) {
+        return array;
+    }
+
+    if (new_cap == 0) {
+        new_cap = RAFT_IO_OUTBOX__INITIAL_CAP;
+    }
+    while (new_cap < n) {
+        new_cap *= 2;
+    }
+
+    array = raft_realloc(array, new_cap * size);
+    if (array == NULL) {
+        return NULL;
+    }
+
+    *cap = new_cap;
+
+    return array;
+}
+
+static struct raft_io_outbox__box *raft_io_outbox__current(struct raft_io *io)
+{
+    struct raft_io_outbox *o = io->data;
+
+    return &o->boxes[o->current];
+}
+
+/**
+ * Reserve room for the completion of one more request.
+ */
+static int raft_io_outbox__reserve_id(struct raft_io_outbox__box *box)
+{
+    raft_request_id *ids;
+    int *statuses;
+
+    ids = raft_io_outbox__grow(box->ids, &box->cap_ids, box->n_ids + 1,
+                               sizeof *ids);
+    if (ids == NULL) {
+        return RAFT_ERR_NOMEM;
+    }
+    box->ids = ids;
+
+    statuses = raft_io_outbox__grow(box->statuses, &box->cap_statuses,
+                                    box->n_ids + 1, sizeof *statuses);
+    if (statuses == NULL) {
+        return RAFT_ERR_NOMEM;
+    }
+    box->statuses = statuses;
+
+    box->n_ids++;
+
+    return 0;
+}
+
+/**
+ * Append a new log write to the current box.
+ */
+static struct raft_ready_write *raft_io_outbox__write(struct raft_io *io)
+{
+    struct raft_io_outbox__box *box = raft_io_outbox__current(io);
+    struct raft_ready_write *writes;
+    struct raft_ready_write *write;
+
+    writes = raft_io_outbox__grow(box->writes, &box->cap_writes,
+                                  box->n_writes + 1, sizeof *writes);
+    if (writes == NULL) {
+        return NULL;
+    }
+    box->writes = writes;
+
+    write = &box->writes[box->n_writes];
+    write->truncate = 0;
+    write->entries = NULL;
+    write->n = 0;
+    write->request_id = 0;
+
+    box->n_writes++;
+
+    return write;
+}
+
+/**
+ * Append a new message of the given @type to the current box.
+ */
+static struct raft_ready_message *raft_io_outbox__message(
+    struct raft_io *io,
+    const struct raft_server *server,
+    unsigned short type)
+{
+    struct raft_io_outbox__box *box = raft_io_outbox__current(io);
+    struct raft_ready_message *messages;
+    struct raft_ready_message *message;
+
+    messages = raft_io_outbox__grow(box->messages, &box->cap_messages,
+                                    box->n_messages + 1, sizeof *messages);
+    if (messages == NULL) {
+        return NULL;
+    }
+    box->messages = messages;
+
+    message = &box->messages[box->n_messages];
+    message->server = server;
+    message->request_id = 0;
+    message->message.type = type;
+    message->message.version = RAFT_ENCODING_V1;
+
+    box->n_messages++;
+
+    return message;
+}
+
+static int raft_io_outbox__write_term(struct raft_io *io, const raft_term term)
+{
+    (void)term;
+
+    /* The values to persist are taken from the raft instance itself when the
+     * box is collected. */
+    raft_io_outbox__current(io)->save_term_and_vote = true;
+
+    return 0;
+}
+
+static int raft_io_outbox__write_vote(struct raft_io *io,
+                                      const unsigned server_id)
+{
+    (void)server_id;
+
+    raft_io_outbox__current(io)->save_term_and_vote = true;
+
+    return 0;
+}
+
+static int raft_io_outbox__write_term_and_vote(struct raft_io *io,
+                                               const raft_term term,
+                                               const unsigned server_id)
+{
+    (void)term;
+    (void)server_id;
+
+    raft_io_outbox__current(io)->save_term_and_vote = true;
+
+    return 0;
+}
+
+static int raft_io_outbox__write_metadata(struct raft_io *io,
+                                          const raft_request_id request_id,
+                                          const raft_term term,
+                                          const unsigned server_id)
+{
+    struct raft_io_outbox__box *box = raft_io_outbox__current(io);
+    raft_request_id *metadata;
+    int rv;
+
+    (void)term;
+    (void)server_id;
+
+    rv = raft_io_outbox__reserve_id(box);
+    if (rv != 0) {
+        return rv;
+    }
+
+    metadata = raft_io_outbox__grow(box->metadata, &box->cap_metadata,
+                                    box->n_metadata + 1, sizeof *metadata);
+    if (metadata == NULL) {
+        box->n_ids--;
+        return RAFT_ERR_NOMEM;
+    }
+    box->metadata = metadata;
+
+    box->metadata[box->n_metadata] = request_id;
+    box->n_metadata++;
+    box->save_term_and_vote = true;
+
+    return 0;
+}
+
+static int raft_io_outbox__write_log(struct raft_io *io,
+                                     const raft_request_id request_id,
+                                     const struct raft_entry entries[],
+                                     const unsigned n)
+{
+    struct raft_io_outbox__box *box = raft_io_outbox__current(io);
+    struct raft_ready_write *write;
+    int rv;
+
+    assert(n > 0);
+
+    rv = raft_io_outbox__reserve_id(box);
+    if (rv != 0) {
+        return rv;
+    }
+
+    /* Complete a truncation submitted right before. */
+    if (box->n_writes > 0 && box->writes[box->n_writes - 1].n == 0) {
+        write = &box->writes[box->n_writes - 1];
+    } else {
+        write = raft_io_outbox__write(io);
+        if (write == NULL) {
+            box->n_ids--;
+            return RAFT_ERR_NOMEM;
+        }
+    }
+
+    write->entries = entries;
+    write->n = n;
+    write->request_id = request_id;
+
+    return 0;
+}
+
+static int raft_io_outbox__truncate_log(struct raft_io *io,
+                                        const raft_index index)
+{
+    struct raft_ready_write *write;
+
+    assert(index > 0);
+
+    write = raft_io_outbox__write(io);
+    if (write == NULL) {
+        return RAFT_ERR_NOMEM;
+    }
+
+    write->truncate = index;
+
+    return 0;
+}
+
+static int raft_io_outbox__send_request_vote_request(
+    struct raft_io *io,
+    const struct raft_server *server,
+    const struct raft_request_vote_args *args)
+{
+    struct raft_ready_message *message;
+
+    message = raft_io_outbox__message(io, server, RAFT_IO_REQUEST_VOTE);
+    if (message == NULL) {
+        return RAFT_ERR_NOMEM;
+    }
+
+    message->message.request_vote = *args;
+
+    return 0;
+}
+
+static int raft_io_outbox__send_request_vote_response(
+    struct raft_io *io,
+    const struct raft_server *server,
+    const struct raft_request_vote_result *result)
+{
+    struct raft_ready_message *message;
+
+    message = raft_io_outbox__message(io, server, RAFT_IO_REQUEST_VOTE_RESULT);
+    if (message == NULL) {
+        return RAFT_ERR_NOMEM;
+    }
+
+    message->message.request_vote_result = *result;
+
+    return 0;
+}
+
+static int raft_io_outbox__send_timeout_now(
+    struct raft_io *io,
+    const struct raft_server *server,
+    const struct raft_timeout_now_args *args)
+{
+    struct raft_ready_message *message;
+
+    message = raft_io_outbox__message(io, server, RAFT_IO_TIMEOUT_NOW);
+    if (message == NULL) {
+        return RAFT_ERR_NOMEM;
+    }
+
+    message->message.timeout_now = *args;
+
+    return 0;
+}
+
+static int raft_io_outbox__send_append_entries_request(
+    struct raft_io *io,
+    const raft_request_id request_id,
+    const struct raft_server *server,
+    const struct raft_append_entries_args *args)
+{
+    struct raft_io_outbox__box *box = raft_io_outbox__current(io);
+    struct raft_ready_message *message;
+    int rv;
+
+    rv = raft_io_outbox__reserve_id(box);
+    if (rv != 0) {
+        return rv;
+    }
+
+    message = raft_io_outbox__message(io, server, RAFT_IO_APPEND_ENTRIES);
+    if (message == NULL) {
+        box->n_ids--;
+        return RAFT_ERR_NOMEM;
+    }
+
+    message->request_id = request_id;
+    message->message.append_entries = *args;
+
+    return 0;
+}
+
+static int raft_io_outbox__send_append_entries_response(
+    struct raft_io *io,
+    const struct raft_server *server,
+    const struct raft_append_entries_result *result)
+{
+    struct raft_ready_message *message;
+
+    message =
+        raft_io_outbox__message(io, server, RAFT_IO_APPEND_ENTRIES_RESULT);
+    if (message == NULL) {
+        return RAFT_ERR_NOMEM;
+    }
+
+    message->message.append_entries_result = *result;
+
+    return 0;
+}
+
+int raft_io_outbox_init(struct raft_io *io)
+{
+    struct raft_io_outbox *o;
+
+    assert(io != NULL);
+
+    o = raft_calloc(1, sizeof *o);
+    if (o == NULL) {
+        return RAFT_ERR_NOMEM;
+    }
+
+    io->version = 4;
+    io->data = o;
+    io->write_term = raft_io_outbox__write_term;
+    io->write_vote = raft_io_outbox__write_vote;
+    io->write_log = raft_io_outbox__write_log;
+    io->truncate_log = raft_io_outbox__truncate_log;
+    io->send_request_vote_request = raft_io_outbox__send_request_vote_request;
+    io->send_request_vote_response = raft_io_outbox__send_request_vote_response;
+    io->send_append_entries_request =
+        raft_io_outbox__send_append_entries_request;
+    io->send_append_entries_response =
+        raft_io_outbox__send_append_entries_response;
+    io->write_term_and_vote = raft_io_outbox__write_term_and_vote;
+    io->write_metadata = raft_io_outbox__write_metadata;
+    io->send_timeout_now = raft_io_outbox__send_timeout_now;
+
+    return 0;
+}
+
+void raft_io_outbox_close(struct raft_io *io)
+{
+    struct raft_io_outbox *o = io->data;
+    unsigned i;
+
+    for (i = 0; i < 2; i++) {
+        struct raft_io_outbox__box *box = &o->boxes[i];
+
+        if (box->metadata != NULL) {
+            raft_free(box->metadata);
+        }
+        if (box->writes != NULL) {
+            raft_free(box->writes);
+        }
+        if (box->messages != NULL) {
+            raft_free(box->messages);
+        }
+        if (box->committed != NULL) {
+            raft_free(box->committed);
+        }
+        if (box->ids != NULL) {
+            raft_free(box->ids);
+        }
+        if (box->statuses != NULL) {
+            raft_free(box->statuses);
+        }
+    }
+
+    raft_free(o);
+}
+
+void raft_io_outbox_ready(struct raft_io *io,
+                          struct raft *r,
+                          struct raft_ready *ready)
+{
+    struct raft_io_outbox *o = io->data;
+    struct raft_io_outbox__box *box = &o->boxes[o->current];
+    unsigned n = 0;
+    unsigned i;
+
+    assert(r != NULL);
+    assert(ready != NULL);
+    assert(!o->pending);
+
+    if (r->commit_index > r->last_applied) {
+        struct raft_entry *committed;
+
+        n = r->commit_index - r->last_applied;
+
+        committed = raft_io_outbox__grow(box->committed, &box->cap_committed,
+                                         n, sizeof *committed);
+        if (committed != NULL) {
+            box->committed = committed;
+        } else {
+            /* Just hand these entries out next time. */
+            n = 0;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        box->committed[i] = *raft_log__get(&r->log, r->last_applied + 1 + i);
+    }
+    box->applied = r->last_applied + n;
+
+    ready->save_term_and_vote = box->save_term_and_vote;
+    ready->term = r->current_term;
+    ready->voted_for = r->voted_for;
+    ready->writes = box->writes;
+    ready->n_writes = box->n_writes;
+    ready->messages = box->messages;
+    ready->n_messages = box->n_messages;
+    ready->committed = box->committed;
+    ready->n_committed = n;
+
+    o->current ^= 1;
+    o->pending = true;
+}
+
+void raft_io_outbox_advance(struct raft_io *io, struct raft *r, int status)
+{
+    struct raft_io_outbox *o = io->data;
+    struct raft_io_outbox__box *box = &o->boxes[o->current ^ 1];
+    unsigned n = 0;
+    unsigned i;
+
+    assert(r != NULL);
+    assert(o->pending);
+
+    o->pending = false;
+
+    if (box->applied > r->last_applied) {
+        r->last_applied = box->applied;
+    }
+
+    /* Complete the writes of term and vote first, then the log writes and
+     * finally the AppendEntries requests, all in one go, in the same order the
+     * user carries them out. Anything this triggers goes to the other box. */
+    for (i = 0; i < box->n_metadata; i++) {
+        box->ids[n] = box->metadata[i];
+        box->statuses[n] = status;
+        n++;
+    }
+
+    for (i = 0; i < box->n_writes; i++) {
+        const struct raft_ready_write *write = &box->writes[i];
+
+        if (write->n > 0) {
+            box->ids[n] = write->request_id;
+            box->statuses[n] = status;
+            n++;
+        }
+    }
+
+    for (i = 0; i < box->n_messages; i++) {
+        const struct raft_ready_message *message = &box->messages[i];
+
+        if (message->message.type == RAFT_IO_APPEND_ENTRIES) {
+            box->ids[n] = message->request_id;
+            box->statuses[n] = 0;
+            n++;
+        }
+    }
+
+    assert(n == box->n_ids);
+
+    raft_handle_io_batch(r, box->ids, box->statuses, n);
+
+    box->save_term_and_vote = false;
+    box->n_metadata = 0;
+    box->n_writes = 0;
+    box->n_messages = 0;
+    box->n_ids = 0;
+}
@@ -330,7 +330,7 @@ void raft_log__close(struct raft_log *l)
                 if (entry->batch != batch) {
                     /* This batch was not released yet, so let's do it now. */
                     batch = entry->batch;
-                    raft_free(entry->batch);
+                    raft_release_entries_batch(entry->batch);
                 }
             }
         }
@@ -605,7 +605,7 @@ void raft_log__release(struct raft_log *l,
                 if (entry->batch != batch) {
                     if (!raft_log__batch_is_referenced(l, entry->batch)) {
                         batch = entry->batch;
-                        raft_free(batch);
+                        raft_release_entries_batch(batch);
                     }
                 }
             }
@@ -643,7 +643,7 @@ static void raft_log__discard_entry(struct raft_log *l,
         }
     } else {
         if (!raft_log__batch_is_referenced(l, entry->batch)) {
-            raft_free(entry->batch);
+            raft_release_entries_batch(entry->batch);
         }
     }
 }
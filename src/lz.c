@@ -0,0 +1,266 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "../include/raft.h"
+
+#include "lz.h"
+
+/* Minimum length of a match. */
+#define RAFT_LZ__MIN_MATCH 4
+
+/* Maximum distance of a match, limited by the 2-byte offset. */
+#define RAFT_LZ__MAX_OFFSET 65535
+
+/* Number of bits of the hash of the 4-byte sequences used to find matches. */
+#define RAFT_LZ__HASH_BITS 12
+
+/* Matches never cover the last bytes of the input, which are always emitted as
+ * literals. This keeps the inner loop free of end-of-input checks when reading
+ * the next 4-byte sequence. */
+#define RAFT_LZ__LAST_LITERALS 5
+
+/* Length value in a token nibble meaning that extra length bytes follow. */
+#define RAFT_LZ__EXTENDED 15
+
+static uint32_t raft_lz__read32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof value);
+    return value;
+}
+
+static unsigned raft_lz__hash(uint32_t sequence)
+{
+    return (sequence * 2654435761U) >> (32 - RAFT_LZ__HASH_BITS);
+}
+
+/**
+ * Write the extra bytes of a length, returning NULL if they don't fit.
+ */
+static uint8_t *raft_lz__put_length(uint8_t *op,
+                                    const uint8_t *oend,
+                                    size_t len)
+{
+    while (len >= 255) {
+        if (op >= oend) {
+            return NULL;
+        }
+        *op++ = 255;
+        len -= 255;
+    }
+
+    if (op >= oend) {
+        return NULL;
+    }
+    *op++ = (uint8_t)len;
+
+    return op;
+}
+
+/**
+ * Write a sequence with @n literals followed by a match of length @match at the
+ * given @offset, or no match if @match is zero. Return NULL if the sequence
+ * doesn't fit.
+ */
+static uint8_t *raft_lz__put_sequence(uint8_t *op,
+                                      const uint8_t *oend,
+                                      const uint8_t *literals,
+                                      size_t n,
+                                      size_t offset,
+                                      size_t match)
+{
+    uint8_t *token = op;
+
+    if (op >= oend) {
+        return NULL;
+    }
+    op++;
+
+    *token = (n < RAFT_LZ__EXTENDED ? n : RAFT_LZ__EXTENDED) << 4;
+    if (n >= RAFT_LZ__EXTENDED) {
+        op = raft_lz__put_length(op, oend, n - RAFT_LZ__EXTENDED);
+        if (op == NULL) {
+            return NULL;
+        }
+    }
+
+    if ((size_t)(oend - op) < n) {
+        return NULL;
+    }
+    memcpy(op, literals, n);
+    op += n;
+
+    if (match == 0) {
+        return op;
+    }
+
+    match -= RAFT_LZ__MIN_MATCH;
+    *token |= match < RAFT_LZ__EXTENDED ? match : RAFT_LZ__EXTENDED;
+
+    if (oend - op < 2) {
+        return NULL;
+    }
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+
+    if (match >= RAFT_LZ__EXTENDED) {
+        op = raft_lz__put_length(op, oend, match - RAFT_LZ__EXTENDED);
+    }
+
+    return op;
+}
+
+size_t raft_lz__compress(const void *src, size_t len, void *dst, size_t cap)
+{
+    const uint8_t *in = src;
+    uint8_t *op = dst;
+    const uint8_t *oend = op + cap;
+    uint32_t table[1 << RAFT_LZ__HASH_BITS];
+    size_t limit = 0;
+    size_t anchor = 0;
+    size_t ip = 0;
+
+    /* Positions are stored as 32-bit integers. */
+    if (len > UINT32_MAX) {
+        return 0;
+    }
+
+    memset(table, 0, sizeof table);
+
+    if (len > RAFT_LZ__LAST_LITERALS + RAFT_LZ__MIN_MATCH) {
+        limit = len - RAFT_LZ__LAST_LITERALS - RAFT_LZ__MIN_MATCH;
+    }
+
+    while (ip < limit) {
+        uint32_t sequence = raft_lz__read32(in + ip);
+        unsigned h = raft_lz__hash(sequence);
+        size_t ref = table[h];
+        size_t match;
+
+        table[h] = (uint32_t)ip;
+
+        if (ref >= ip || ip - ref > RAFT_LZ__MAX_OFFSET ||
+            raft_lz__read32(in + ref) != sequence) {
+            /* Skip faster over data that doesn't compress. */
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        match = RAFT_LZ__MIN_MATCH;
+        while (ip + match < len - RAFT_LZ__LAST_LITERALS &&
+               in[ref + match] == in[ip + match]) {
+            match++;
+        }
+
+        op = raft_lz__put_sequence(op, oend, in + anchor, ip - anchor,
+                                   ip - ref, match);
+        if (op == NULL) {
+            return 0;
+        }
+
+        ip += match;
+        anchor = ip;
+    }
+
+    op = raft_lz__put_sequence(op, oend, in + anchor, len - anchor, 0, 0);
+    if (op == NULL) {
+        return 0;
+    }
+
+    return op - (uint8_t *)dst;
+}
+
+/**
+ * Read the extra bytes of a length, adding them to @len.
+ */
+static int raft_lz__get_length(const uint8_t **ip,
+                               const uint8_t *iend,
+                               size_t *len)
+{
+    uint8_t byte;
+
+    do {
+        if (*ip >= iend) {
+            return RAFT_ERR_MALFORMED;
+        }
+        byte = *(*ip)++;
+        *len += byte;
+    } while (byte == 255);
+
+    return 0;
+}
+
+int raft_lz__decompress(const void *src, size_t len, void *dst, size_t size)
+{
+    const uint8_t *ip = src;
+    const uint8_t *iend = ip + len;
+    uint8_t *op = dst;
+    uint8_t *oend = op + size;
+    int rv;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t n = token >> 4;
+        size_t offset;
+        size_t match;
+
+        if (n == RAFT_LZ__EXTENDED) {
+            rv = raft_lz__get_length(&ip, iend, &n);
+            if (rv != 0) {
+                return rv;
+            }
+        }
+
+        if ((size_t)(iend - ip) < n || (size_t)(oend - op) < n) {
+            return RAFT_ERR_MALFORMED;
+        }
+        memcpy(op, ip, n);
+        ip += n;
+        op += n;
+
+        if (ip == iend) {
+            break; /* Last sequence */
+        }
+
+        if (iend - ip < 2) {
+            return RAFT_ERR_MALFORMED;
+        }
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        if (offset == 0 || offset > (size_t)(op - (uint8_t *)dst)) {
+            return RAFT_ERR_MALFORMED;
+        }
+
+        match = token & RAFT_LZ__EXTENDED;
+        if (match == RAFT_LZ__EXTENDED) {
+            rv = raft_lz__get_length(&ip, iend, &match);
+            if (rv != 0) {
+                return rv;
+            }
+        }
+        match += RAFT_LZ__MIN_MATCH;
+
+        if ((size_t)(oend - op) < match) {
+            return RAFT_ERR_MALFORMED;
+        }
+
+        if (offset >= match) {
+            memcpy(op, op - offset, match);
+            op += match;
+        } else {
+            /* Overlapping match, repeating the last @offset bytes. */
+            const uint8_t *ref = op - offset;
+            size_t i;
+            for (i = 0; i < match; i++) {
+                *op++ = *ref++;
+            }
+        }
+    }
+
+    if (op != oend) {
+        return RAFT_ERR_MALFORMED;
+    }
+
+    return 0;
+}
@@ -0,0 +1,40 @@
+/**
+ * Fast LZ77 block compression, used for the payload data of entry batches.
+ *
+ * A compressed block is a sequence of sequences, each made of a token byte,
+ * literals and a match:
+ *
+ * [1 byte ] Token: number of literals in the upper 4 bits, match length minus
+ *           4 in the lower 4 bits. A value of 15 means that more length bytes
+ *           follow, each adding up to 255 and the last one being less than 255.
+ * [  ...  ] Extra bytes of the literals length, if any.
+ * [  ...  ] Literals.
+ * [2 bytes] Offset of the match, backwards from the current position, little
+ *           endian.
+ * [  ...  ] Extra bytes of the match length, if any.
+ *
+ * The last sequence has no match: the block ends right after its literals.
+ */
+
+#ifndef RAFT_LZ_H
+#define RAFT_LZ_H
+
+#include <stddef.h>
+
+/**
+ * Compress the @len bytes at @src into @dst, which has room for @cap bytes.
+ *
+ * Return the size of the compressed data, or zero if it doesn't fit in @cap
+ * bytes.
+ */
+size_t raft_lz__compress(const void *src, size_t len, void *dst, size_t cap);
+
+/**
+ * Decompress the @len bytes at @src into the @size bytes at @dst.
+ *
+ * Return RAFT_ERR_MALFORMED if the compressed data is invalid or doesn't
+ * decompress to exactly @size bytes.
+ */
+int raft_lz__decompress(const void *src, size_t len, void *dst, size_t size);
+
+#endif /* RAFT_LZ_H */
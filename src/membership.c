@@ -0,0 +1,483 @@
+#include <assert.h>
+#include <string.h>
+
+#include "configuration.h"
+#include "log.h"
+#include "logger.h"
+#include "membership.h"
+#include "replication.h"
+#include "state.h"
+
+/**
+ * Maximum number of catch-up rounds before giving up a promotion.
+ *
+ * From Section §4.2.1:
+ *
+ *   The algorithm waits a fixed number of rounds (such as 10). If the last
+ *   round lasts less than an election timeout, then the leader adds the new
+ *   server to the cluster.
+ */
+#define RAFT_MEMBERSHIP__MAX_ROUNDS 10
+
+/**
+ * State arrays of a leader or candidate, indexed by the position of each server
+ * in a configuration.
+ */
+struct raft_membership__arrays
+{
+    raft_index *next_index;
+    raft_index *match_index;
+    raft_time *last_contact;
+    struct raft_rtt *rtt;
+    bool *votes;
+};
+
+/**
+ * Allocate the leader arrays for the given configuration, carrying over the
+ * progress of the servers that are also part of the current one.
+ */
+static int raft_membership__alloc_leader(struct raft *r,
+                                         struct raft_configuration *c,
+                                         struct raft_membership__arrays *a)
+{
+    raft_index last_index = raft_log__last_index(&r->log);
+    size_t i;
+
+    a->next_index = raft_malloc(c->n * sizeof *a->next_index);
+    if (a->next_index == NULL) {
+        goto err;
+    }
+    a->match_index = raft_malloc(c->n * sizeof *a->match_index);
+    if (a->match_index == NULL) {
+        goto err_after_next_index_alloc;
+    }
+    a->last_contact = raft_malloc(c->n * sizeof *a->last_contact);
+    if (a->last_contact == NULL) {
+        goto err_after_match_index_alloc;
+    }
+    a->rtt = raft_malloc(c->n * sizeof *a->rtt);
+    if (a->rtt == NULL) {
+        goto err_after_last_contact_alloc;
+    }
+
+    /* New servers get a full election timeout to reply, starting from now. */
+    for (i = 0; i < c->n; i++) {
+        unsigned id = c->servers[i].id;
+        size_t j = raft_configuration__index(&r->configuration, id);
+
+        if (j < r->configuration.n) {
+            a->next_index[i] = r->leader_state.next_index[j];
+            a->match_index[i] = r->leader_state.match_index[j];
+            a->last_contact[i] = r->leader_state.last_contact[j];
+            a->rtt[i] = r->leader_state.rtt[j];
+        } else {
+            a->next_index[i] = last_index + 1;
+            a->match_index[i] = 0;
+            a->last_contact[i] = r->now;
+            memset(&a->rtt[i], 0, sizeof a->rtt[i]);
+        }
+    }
+
+    return 0;
+
+err_after_last_contact_alloc:
+    raft_free(a->last_contact);
+
+err_after_match_index_alloc:
+    raft_free(a->match_index);
+
+err_after_next_index_alloc:
+    raft_free(a->next_index);
+
+err:
+    return RAFT_ERR_NOMEM;
+}
+
+/**
+ * Allocate the candidate votes array for the given configuration, carrying over
+ * the votes of the servers that are voting in the current one too.
+ */
+static int raft_membership__alloc_candidate(struct raft *r,
+                                            struct raft_configuration *c,
+                                            struct raft_membership__arrays *a)
+{
+    size_t n_voting = raft_configuration__n_voting(c);
+    size_t i;
+    size_t k = 0;
+
+    /* Allocate at least one slot, so the array is never NULL. */
+    a->votes = raft_malloc((n_voting > 0 ? n_voting : 1) * sizeof *a->votes);
+    if (a->votes == NULL) {
+        return RAFT_ERR_NOMEM;
+    }
+
+    for (i = 0; i < c->n; i++) {
+        unsigned id = c->servers[i].id;
+        size_t j;
+
+        if (!c->servers[i].voting) {
+            continue;
+        }
+
+        j = raft_configuration__voting_index(&r->configuration, id);
+        a->votes[k] = j < r->configuration.n && r->candidate_state.votes[j];
+        k++;
+    }
+
+    return 0;
+}
+
+/**
+ * Allocate the state arrays that the given configuration requires in our
+ * current state.
+ */
+static int raft_membership__alloc(struct raft *r,
+                                  struct raft_configuration *c,
+                                  struct raft_membership__arrays *a)
+{
+    a->next_index = NULL;
+    a->match_index = NULL;
+    a->last_contact = NULL;
+    a->rtt = NULL;
+    a->votes = NULL;
+
+    switch (r->state) {
+        case RAFT_STATE_LEADER:
+            return raft_membership__alloc_leader(r, c, a);
+        case RAFT_STATE_CANDIDATE:
+            return raft_membership__alloc_candidate(r, c, a);
+    }
+
+    return 0;
+}
+
+/**
+ * Release state arrays allocated with raft_membership__alloc().
+ */
+static void raft_membership__free(struct raft *r,
+                                  struct raft_membership__arrays *a)
+{
+    switch (r->state) {
+        case RAFT_STATE_LEADER:
+            raft_free(a->next_index);
+            raft_free(a->match_index);
+            raft_free(a->last_contact);
+            raft_free(a->rtt);
+            break;
+        case RAFT_STATE_CANDIDATE:
+            raft_free(a->votes);
+            break;
+    }
+}
+
+/**
+ * Swap the configuration and state arrays in use with the given ones. Swapping
+ * twice restores the original ones.
+ */
+static void raft_membership__swap(struct raft *r,
+                                  struct raft_configuration *c,
+                                  struct raft_membership__arrays *a)
+{
+    struct raft_configuration configuration = r->configuration;
+    struct raft_membership__arrays arrays = *a;
+
+    r->configuration = *c;
+    *c = configuration;
+
+    switch (r->state) {
+        case RAFT_STATE_LEADER:
+            a->next_index = r->leader_state.next_index;
+            a->match_index = r->leader_state.match_index;
+            a->last_contact = r->leader_state.last_contact;
+            a->rtt = r->leader_state.rtt;
+            r->leader_state.next_index = arrays.next_index;
+            r->leader_state.match_index = arrays.match_index;
+            r->leader_state.last_contact = arrays.last_contact;
+            r->leader_state.rtt = arrays.rtt;
+            break;
+        case RAFT_STATE_CANDIDATE:
+            a->votes = r->candidate_state.votes;
+            r->candidate_state.votes = arrays.votes;
+            break;
+    }
+}
+
+/**
+ * Complete a switch to a new configuration taken from the entry at the given
+ * index, given the configuration and state arrays that were in use so far.
+ */
+static void raft_membership__finish(struct raft *r,
+                                   struct raft_configuration *c,
+                                   struct raft_membership__arrays *a,
+                                   raft_index index)
+{
+    const struct raft_server *server;
+    int rv;
+
+    /* Keep the old configuration around, since pointers to its servers might
+     * still be held, and release the one before it. */
+    raft_configuration_close(&r->configuration_prev);
+    r->configuration_prev = *c;
+    r->configuration_index = index;
+
+    raft_membership__free(r, a);
+
+    if (r->state == RAFT_STATE_FOLLOWER &&
+        r->follower_state.current_leader != NULL) {
+        unsigned id = r->follower_state.current_leader->id;
+        r->follower_state.current_leader =
+            raft_configuration__get(&r->configuration, id);
+    }
+
+    /* If we are not a voting server anymore, stop leading or running for
+     * election. */
+    server = raft_configuration__get(&r->configuration, r->id);
+    if (r->state != RAFT_STATE_FOLLOWER &&
+        (server == NULL || !server->voting)) {
+        raft__infof(r, "not voting anymore -> step down");
+
+        /* Neither the term nor the vote change, so this can't fail. */
+        rv = raft_state__convert_to_follower(r, r->current_term, r->voted_for);
+        assert(rv == 0);
+        (void)rv;
+    }
+}
+
+int raft_membership__append(struct raft *r, struct raft_configuration *c)
+{
+    struct raft_configuration configuration;
+    struct raft_membership__arrays arrays;
+    struct raft_buffer buf;
+    raft_index index;
+    int rv;
+
+    assert(r != NULL);
+    assert(c != NULL);
+    assert(r->state == RAFT_STATE_LEADER);
+
+    rv = raft_encode_configuration(c, &buf);
+    if (rv != 0) {
+        goto err;
+    }
+
+    /* Decode the entry back into the configuration we'll use, so it owns the
+     * memory of the server addresses. */
+    raft_configuration_init(&configuration);
+    rv = raft_decode_configuration(&buf, &configuration);
+    if (rv != 0) {
+        goto err_after_encode;
+    }
+
+    rv = raft_membership__alloc(r, &configuration, &arrays);
+    if (rv != 0) {
+        goto err_after_decode;
+    }
+
+    index = raft_log__last_index(&r->log) + 1;
+
+    rv = raft_log__append(&r->log, r->current_term, RAFT_LOG_CONFIGURATION,
+                          &buf, NULL);
+    if (rv != 0) {
+        goto err_after_alloc;
+    }
+
+    /* Switch to the new configuration before sending the entry, so it also
+     * reaches the servers being added. */
+    raft_membership__swap(r, &configuration, &arrays);
+
+    rv = raft_replication__trigger(r, index);
+    if (rv != 0) {
+        raft_membership__swap(r, &configuration, &arrays);
+        raft_log__truncate(&r->log, index); /* Releases the buffer as well */
+        raft_membership__free(r, &arrays);
+        raft_configuration_close(&configuration);
+        return rv;
+    }
+
+    raft_membership__finish(r, &configuration, &arrays, index);
+
+    return 0;
+
+err_after_alloc:
+    raft_membership__free(r, &arrays);
+
+err_after_decode:
+    raft_configuration_close(&configuration);
+
+err_after_encode:
+    raft_free(buf.base);
+
+err:
+    assert(rv != 0);
+
+    return rv;
+}
+
+/**
+ * Switch to the given configuration, taken from the entry at the given index.
+ * On success the configuration is owned by the raft instance.
+ */
+static int raft_membership__switch(struct raft *r,
+                                   struct raft_configuration *c,
+                                   raft_index index)
+{
+    struct raft_membership__arrays arrays;
+    int rv;
+
+    rv = raft_membership__alloc(r, c, &arrays);
+    if (rv != 0) {
+        return rv;
+    }
+
+    raft_membership__swap(r, c, &arrays);
+    raft_membership__finish(r, c, &arrays, index);
+
+    return 0;
+}
+
+int raft_membership__apply(struct raft *r,
+                           const struct raft_buffer *buf,
+                           raft_index index)
+{
+    struct raft_configuration configuration;
+    int rv;
+
+    assert(r != NULL);
+    assert(buf != NULL);
+
+    raft_configuration_init(&configuration);
+
+    rv = raft_decode_configuration(buf, &configuration);
+    if (rv != 0) {
+        return rv;
+    }
+
+    raft__infof(r, "apply configuration at index %ld", index);
+
+    rv = raft_membership__switch(r, &configuration, index);
+    if (rv != 0) {
+        raft_configuration_close(&configuration);
+        return rv;
+    }
+
+    return 0;
+}
+
+int raft_membership__rollback(struct raft *r, raft_index index)
+{
+    struct raft_configuration configuration;
+    raft_index i;
+    int rv;
+
+    assert(r != NULL);
+
+    if (r->configuration_index < index) {
+        return 0;
+    }
+
+    /* Look for the last configuration entry that is still in the log. */
+    for (i = index - 1; i > 0; i--) {
+        const struct raft_entry *entry = raft_log__get(&r->log, i);
+
+        if (entry == NULL) {
+            i = 0;
+            break;
+        }
+
+        if (entry->type == RAFT_LOG_CONFIGURATION) {
+            break;
+        }
+    }
+
+    raft__infof(r, "configuration at index %ld truncated -> roll back",
+                r->configuration_index);
+
+    raft_configuration_init(&configuration);
+
+    if (i > 0) {
+        rv = raft_decode_configuration(&raft_log__get(&r->log, i)->buf,
+                                       &configuration);
+        if (rv != 0) {
+            return rv;
+        }
+    } else if (r->configuration_prev.n > 0) {
+        /* The entry holding the previous configuration is not in the log
+         * anymore, fall back to the copy we kept. */
+        configuration = r->configuration_prev;
+        raft_configuration_init(&r->configuration_prev);
+    } else {
+        raft__warnf(r, "no previous configuration -> keep current one");
+        r->configuration_index = 0;
+        return 0;
+    }
+
+    rv = raft_membership__switch(r, &configuration, i);
+    if (rv != 0) {
+        if (i == 0) {
+            r->configuration_prev = configuration;
+        } else {
+            raft_configuration_close(&configuration);
+        }
+        return rv;
+    }
+
+    return 0;
+}
+
+int raft_membership__catch_up(struct raft *r, size_t i)
+{
+    const struct raft_server *server = &r->configuration.servers[i];
+    struct raft_configuration configuration;
+    raft_time duration;
+    int rv;
+
+    assert(r->state == RAFT_STATE_LEADER);
+
+    if (server->id != r->leader_state.promotee ||
+        r->leader_state.match_index[i] < r->leader_state.round_index) {
+        return 0;
+    }
+
+    duration = r->now - r->leader_state.round_start;
+
+    /* If the round was too slow, start a new one replicating the entries
+     * appended in the meantime, unless we have run out of rounds. */
+    if (duration >= r->election_timeout) {
+        if (r->leader_state.round_number == RAFT_MEMBERSHIP__MAX_ROUNDS) {
+            raft__infof(r, "server %ld can't catch up -> abort promotion",
+                        server->id);
+            r->leader_state.promotee = 0;
+            return 0;
+        }
+
+        r->leader_state.round_number++;
+        r->leader_state.round_index = raft_log__last_index(&r->log);
+        r->leader_state.round_start = r->now;
+
+        return 0;
+    }
+
+    raft__infof(r, "server %ld caught up in round %d -> promote", server->id,
+                r->leader_state.round_number);
+
+    r->leader_state.promotee = 0;
+
+    raft_configuration_init(&configuration);
+
+    rv = raft_configuration__copy(&r->configuration, &configuration);
+    if (rv != 0) {
+        goto out;
+    }
+
+    rv = raft_configuration__set_voting(&configuration, server->id, true);
+    if (rv != 0) {
+        goto out;
+    }
+
+    rv = raft_membership__append(r, &configuration);
+
+out:
+    raft_configuration_close(&configuration);
+
+    return rv;
+}
@@ -0,0 +1,54 @@
+/**
+ *
+ * Membership changes logic and helpers.
+ *
+ */
+
+#ifndef RAFT_MEMBERSHIP_H
+#define RAFT_MEMBERSHIP_H
+
+#include "../include/raft.h"
+
+/**
+ * Append to the leader's log a configuration entry holding the given
+ * configuration, replicate it and start using it right away.
+ *
+ * From Section §4.1:
+ *
+ *   The new configuration takes effect on each server as soon as it is added
+ *   to that server's log.
+ *
+ * The configuration in use so far is kept around as the previous one, while
+ * the progress of the servers found in both is carried over to the new leader
+ * state arrays. These arrays are resized only upon configuration changes.
+ */
+int raft_membership__append(struct raft *r, struct raft_configuration *c);
+
+/**
+ * Start using the configuration encoded in the given buffer, taken from the
+ * entry at the given index that was just appended to our log.
+ */
+int raft_membership__apply(struct raft *r,
+                           const struct raft_buffer *buf,
+                           raft_index index);
+
+/**
+ * Go back to the last configuration whose entry is still in the log, if the
+ * entry of the one in use was truncated from the given index onward. The
+ * previous configuration kept in memory is used if no configuration entry is
+ * left in the log.
+ */
+int raft_membership__rollback(struct raft *r, raft_index index);
+
+/**
+ * Update the catch-up progress of the learner being promoted, if it's the
+ * server at the given index in the configuration.
+ *
+ * When the learner has received all the entries that were in our log at the
+ * start of the current round, the round ends: if it lasted less than an
+ * election timeout, append the configuration entry that makes it a voting
+ * server, otherwise start a new round, up to a maximum number of rounds.
+ */
+int raft_membership__catch_up(struct raft *r, size_t i);
+
+#endif /* RAFT_MEMBERSHIP_H */
@@ -31,9 +31,16 @@ void raft_init(struct raft *r,
     raft_log__init(&r->log);
 
     raft_configuration_init(&r->configuration);
+    raft_configuration_init(&r->configuration_prev);
+    r->configuration_index = 0;
 
     r->election_timeout = 1000;
     r->heartbeat_timeout = 100;
+    r->compression = false;
+    r->pre_vote = false;
+    r->check_quorum = false;
+    r->election_timeout_min = 0;
+    r->election_timeout_max = 0;
 
     raft_set_logger(r, &raft_default_logger);
 
@@ -46,12 +53,16 @@ void raft_init(struct raft *r,
      */
     r->state = RAFT_STATE_FOLLOWER;
     r->follower_state.current_leader = NULL;
+    r->follower_state.heartbeat = 0;
     r->leader_state.next_index = NULL;
     r->leader_state.match_index = NULL;
+    r->leader_state.last_contact = NULL;
+    r->leader_state.rtt = NULL;
     r->candidate_state.votes = NULL;
 
     r->rand = rand;
     raft_election__reset_timer(r);
+    r->now = 0;
 
     for (i = 0; i < RAFT_EVENT_N; i++) {
         r->watchers[i] = NULL;
@@ -64,6 +75,7 @@ void raft_init(struct raft *r,
 
     r->io_queue.requests = NULL;
     r->io_queue.size = 0;
+    r->io_queue.free = 0;
 }
 
 void raft_close(struct raft *r)
@@ -75,6 +87,7 @@ void raft_close(struct raft *r)
     raft_state__clear(r);
     raft_log__close(&r->log);
     raft_configuration_close(&r->configuration);
+    raft_configuration_close(&r->configuration_prev);
 }
 
 void raft_set_logger(struct raft *r, const struct raft_logger *logger)
@@ -97,6 +110,41 @@ void raft_set_election_timeout_(struct raft *r, const unsigned election_timeout)
     raft_election__reset_timer(r);
 }
 
+void raft_set_compression(struct raft *r, bool enabled)
+{
+    assert(r != NULL);
+
+    r->compression = enabled;
+}
+
+void raft_set_pre_vote(struct raft *r, bool enabled)
+{
+    assert(r != NULL);
+
+    r->pre_vote = enabled;
+}
+
+void raft_set_check_quorum(struct raft *r, bool enabled)
+{
+    assert(r != NULL);
+
+    r->check_quorum = enabled;
+}
+
+void raft_set_adaptive_timeouts(struct raft *r,
+                                unsigned min_election_timeout,
+                                unsigned max_election_timeout)
+{
+    assert(r != NULL);
+    assert(min_election_timeout <= max_election_timeout);
+    assert(min_election_timeout > 0 || max_election_timeout == 0);
+
+    r->election_timeout_min = min_election_timeout;
+    r->election_timeout_max = max_election_timeout;
+
+    raft_election__clamp_timeouts(r);
+}
+
 const char *raft_state_name(struct raft *r)
 {
     return raft_state_names[r->state];
@@ -2,9 +2,12 @@
 #include <string.h>
 
 #include "configuration.h"
+#include "election.h"
+#include "encoding.h"
 #include "io.h"
 #include "log.h"
 #include "logger.h"
+#include "membership.h"
 #include "replication.h"
 
 #ifndef max
@@ -22,13 +25,92 @@
 #define __logf(MSG, ...)
 #endif
 
-int raft_replication__send_append_entries(struct raft *r, size_t i)
+/**
+ * Maximum number of batches that can be shared in a single replication round.
+ * Followers whose next index doesn't match any of them get their own batch.
+ */
+#define RAFT_REPLICATION__ROUND_BATCHES 4
+
+/**
+ * Batches created during a replication round, which can be shared by followers
+ * with the same next index.
+ */
+struct raft_replication__round
+{
+    struct raft_append_entries_batch *batches[RAFT_REPLICATION__ROUND_BATCHES];
+    unsigned n;
+};
+
+void raft_replication__release_batch(struct raft *r,
+                                     struct raft_append_entries_batch *batch)
+{
+    assert(batch->refs > 0);
+
+    batch->refs--;
+    if (batch->refs > 0) {
+        return;
+    }
+
+    raft_log__release(&r->log, batch->index, batch->entries, batch->n);
+    raft_free(batch);
+}
+
+/**
+ * Return a batch holding all entries from @index onward. If a batch starting at
+ * the same index was already created in the given replication @round, it gets
+ * reused, otherwise a new one is created.
+ */
+static int raft_replication__get_batch(struct raft *r,
+                                       raft_index index,
+                                       struct raft_replication__round *round,
+                                       struct raft_append_entries_batch **batch)
+{
+    struct raft_entry *entries;
+    unsigned n;
+    unsigned i;
+    int rv;
+
+    if (round != NULL) {
+        for (i = 0; i < round->n; i++) {
+            if (round->batches[i]->index == index) {
+                *batch = round->batches[i];
+                (*batch)->refs++;
+                return 0;
+            }
+        }
+    }
+
+    rv = raft_log__acquire(&r->log, index, &entries, &n);
+    if (rv != 0) {
+        return rv;
+    }
+
+    rv = raft_encode__append_entries_batch(index, entries, n, r->compression,
+                                           batch);
+    if (rv != 0) {
+        raft_log__release(&r->log, index, entries, n);
+        return rv;
+    }
+
+    return 0;
+}
+
+/**
+ * Send an AppendEntries RPC to the server with the given index in the
+ * configuration, possibly sharing the entries batch with other servers in the
+ * same replication @round.
+ */
+static int raft_replication__send(struct raft *r,
+                                  size_t i,
+                                  struct raft_replication__round *round)
 {
     struct raft_server *server = &r->configuration.servers[i];
     struct raft_append_entries_args args;
+    struct raft_append_entries_batch *batch;
     uint64_t next_index;
-    size_t request_id;
+    raft_request_id request_id;
     struct raft_io_request *request;
+    bool shared;
     int rv;
 
     assert(r != NULL);
@@ -70,10 +152,15 @@ int raft_replication__send_append_entries(struct raft *r, size_t i)
         assert(args.prev_log_term > 0);
     }
 
-    rv = raft_log__acquire(&r->log, next_index, &args.entries, &args.n);
+    rv = raft_replication__get_batch(r, next_index, round, &batch);
     if (rv != 0) {
         goto err;
     }
+    shared = batch->refs > 1;
+
+    args.entries = batch->entries;
+    args.n = batch->n;
+    args.batch = batch;
 
     /* From Section §3.5:
      *
@@ -89,7 +176,7 @@ int raft_replication__send_append_entries(struct raft *r, size_t i)
      * operations and fill the request fields. */
     rv = raft_io__queue_push(r, &request_id);
     if (rv != 0) {
-        goto err_after_entries_acquired;
+        goto err_after_batch_get;
     }
 
     __logf("send %ld entries to server %ld (request ID %ld) (log size %ld)",
@@ -101,19 +188,29 @@ int raft_replication__send_append_entries(struct raft *r, size_t i)
     request->entries = args.entries;
     request->n = args.n;
     request->leader_id = r->id;
+    request->batch = batch;
 
     rv = r->io->send_append_entries_request(r->io, request_id, server, &args);
     if (rv != 0) {
         goto err_after_io_queue_push;
     }
 
+    raft_election__probe_rtt(r, i, args.prev_log_index + args.n);
+
+    /* Make the batch available to other servers in this round. */
+    if (round != NULL && !shared &&
+        round->n < RAFT_REPLICATION__ROUND_BATCHES) {
+        round->batches[round->n] = batch;
+        round->n++;
+    }
+
     return 0;
 
 err_after_io_queue_push:
     raft_io__queue_pop(r, request_id);
 
-err_after_entries_acquired:
-    raft_log__release(&r->log, next_index, args.entries, args.n);
+err_after_batch_get:
+    raft_replication__release_batch(r, batch);
 
 err:
     assert(rv != 0);
@@ -121,10 +218,18 @@ err:
     return rv;
 }
 
+int raft_replication__send_append_entries(struct raft *r, size_t i)
+{
+    return raft_replication__send(r, i, NULL);
+}
+
 void raft_replication__send_heartbeat(struct raft *r)
 {
+    struct raft_replication__round round;
     size_t i;
 
+    round.n = 0;
+
     for (i = 0; i < r->configuration.n; i++) {
         struct raft_server *server = &r->configuration.servers[i];
         int rv;
@@ -133,7 +238,7 @@ void raft_replication__send_heartbeat(struct raft *r)
             continue;
         }
 
-        rv = raft_replication__send_append_entries(r, i);
+        rv = raft_replication__send(r, i, &round);
         if (rv != 0) {
             /* This is not a critical failure, let's just log it. */
             raft__warnf(r,
@@ -143,6 +248,69 @@ void raft_replication__send_heartbeat(struct raft *r)
     }
 }
 
+int raft_replication__trigger(struct raft *r, raft_index index)
+{
+    struct raft_io_request *request;
+    struct raft_entry *entries;
+    unsigned n;
+    raft_request_id request_id;
+    int rv;
+
+    assert(r->state == RAFT_STATE_LEADER);
+
+    /* Acquire all the entries appended from the given index. */
+    rv = raft_log__acquire(&r->log, index, &entries, &n);
+    if (rv != 0) {
+        goto err;
+    }
+
+    /* Allocate a new raft_io_request slot in the queue of inflight I/O
+     * operations and fill the request fields. */
+    rv = raft_io__queue_push(r, &request_id);
+    if (rv != 0) {
+        goto err_after_entries_acquired;
+    }
+
+    request = raft_io__queue_get(r, request_id);
+    request->index = index;
+    request->type = RAFT_IO_WRITE_LOG;
+    request->entries = entries;
+    request->n = n;
+    request->leader_id = r->id;
+
+    rv = r->io->write_log(r->io, request_id, entries, n);
+    if (rv != 0) {
+        goto err_after_io_queue_push;
+    }
+
+    /* Reset the heartbeat timer: for a full request_timeout period we'll be
+     * good and we won't need to contact followers again, since this was not an
+     * idle period.
+     *
+     * From Figure 3.1:
+     *
+     *   [Rules for Servers] Leaders: Upon election: send initial empty
+     *   AppendEntries RPCs (heartbeat) to each server; repeat during idle
+     *   periods to prevent election timeouts
+     */
+    r->timer = 0;
+
+    raft_replication__send_heartbeat(r);
+
+    return 0;
+
+err_after_io_queue_push:
+    raft_io__queue_pop(r, request_id);
+
+err_after_entries_acquired:
+    raft_log__release(&r->log, index, entries, n);
+
+err:
+    assert(rv != 0);
+
+    return rv;
+}
+
 /**
  * Submit a write log request to the I/O implementation.
  */
@@ -153,7 +321,7 @@ static int raft_replication__write_log(struct raft *r,
                                        raft_index leader_commit)
 {
     struct raft_io_request *request;
-    size_t request_id;
+    raft_request_id request_id;
     int rv;
 
     assert(r != NULL);
@@ -185,6 +353,61 @@ static int raft_replication__write_log(struct raft *r,
     return 0;
 }
 
+void raft_replication__free_entries(struct raft_entry *entries, unsigned n)
+{
+    void *batch = NULL; /* Last batch that has been freed */
+    unsigned i;
+
+    if (n > 0 && (void *)entries == entries[0].batch) {
+        /* The array is part of the batch of all its entries. */
+        raft_free(entries);
+        return;
+    }
+
+    /* Entries of merged requests come from several batches, each holding a
+     * contiguous range of them. */
+    for (i = 0; i < n; i++) {
+        if (entries[i].batch != NULL && entries[i].batch != batch) {
+            batch = entries[i].batch;
+            raft_release_entries_batch(batch);
+        }
+    }
+
+    if (entries != NULL) {
+        raft_free(entries);
+    }
+}
+
+/**
+ * Reverse the order of the given @n entries.
+ */
+static void raft_replication__reverse(struct raft_entry *entries, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n / 2; i++) {
+        struct raft_entry entry = entries[i];
+        entries[i] = entries[n - 1 - i];
+        entries[n - 1 - i] = entry;
+    }
+}
+
+/**
+ * Rotate the given @n entries in place, so the one at index @k comes first and
+ * the ones before it are moved at the back.
+ */
+static void raft_replication__rotate(struct raft_entry *entries,
+                                     size_t n,
+                                     size_t k)
+{
+    if (k == 0 || k == n) {
+        return;
+    }
+    raft_replication__reverse(entries, k);
+    raft_replication__reverse(&entries[k], n - k);
+    raft_replication__reverse(entries, n);
+}
+
 int raft_replication__maybe_append(struct raft *r,
                                    const struct raft_append_entries_args *args,
                                    bool *success,
@@ -192,7 +415,9 @@ int raft_replication__maybe_append(struct raft *r,
 {
     size_t i;
     struct raft_entry *entries;
+    void *batch = NULL; /* Last batch that has been freed */
     size_t n;
+    size_t k;
     int rv;
 
     *success = false;
@@ -264,6 +489,13 @@ int raft_replication__maybe_append(struct raft *r,
             }
             raft_log__truncate(&r->log, new_entry_index);
 
+            /* If the configuration in use came from a deleted entry, go back
+             * to the previous one. */
+            rv = raft_membership__rollback(r, new_entry_index);
+            if (rv != 0) {
+                return rv;
+            }
+
             /* We want to append all entries from here on, replacing anything
              * that we had before. */
             break;
@@ -282,27 +514,33 @@ int raft_replication__maybe_append(struct raft *r,
         return 0;
     }
 
-    *async = true;
-
-    if (i == 0) {
-        entries = args->entries;
-    } else {
-        size_t size = (args->n - i) * sizeof *entries;
-        entries = raft_malloc(size);
-        if (entries == NULL) {
-            return RAFT_ERR_NOMEM;
-        }
-        memcpy(entries, &args->entries[i], size);
-        raft_free(args->entries);
-    }
+    /* Move the entries to append to the front of the array, which we own and
+     * which must stay at the same address: it might be part of the batch
+     * memory too. The ones we already have go to the back. */
+    entries = args->entries;
+    raft_replication__rotate(entries, args->n, i);
 
     rv = raft_replication__write_log(r, entries, n, args->leader_id,
                                      args->leader_commit);
     if (rv != 0) {
+        /* Give the array back to the caller as it was passed. */
+        raft_replication__rotate(entries, args->n, n);
         return rv;
     }
 
-    *success = true;
+    *async = true;
+
+    /* Entries of merged requests come from several batches: the ones holding
+     * only entries that we already have would never be released by the log,
+     * so free them now. Only the last of them can also hold entries that we
+     * append, which are now at the front. */
+    for (k = n; k < args->n; k++) {
+        if (entries[k].batch != NULL && entries[k].batch != batch &&
+            entries[k].batch != entries[0].batch) {
+            batch = entries[k].batch;
+            raft_release_entries_batch(batch);
+        }
+    }
 
     return 0;
 }
@@ -392,6 +630,67 @@ void raft_replication__update_server(
     return;
 }
 
+int raft_replication__maybe_send_timeout_now(struct raft *r, size_t i)
+{
+    const struct raft_server *server = &r->configuration.servers[i];
+    struct raft_timeout_now_args args;
+    raft_index last_log_index = raft_log__last_index(&r->log);
+    int rv;
+
+    assert(r->state == RAFT_STATE_LEADER);
+
+    if (server->id != r->leader_state.transferee ||
+        r->leader_state.timeout_now_sent ||
+        r->leader_state.match_index[i] != last_log_index) {
+        return 0;
+    }
+
+    args.term = r->current_term;
+    args.leader_id = r->id;
+    args.last_log_index = last_log_index;
+    args.last_log_term = raft_log__last_term(&r->log);
+
+    raft__infof(r, "log of server %ld up to date -> send timeout now",
+                server->id);
+
+    rv = r->io->send_timeout_now(r->io, server, &args);
+    if (rv != 0) {
+        return rv;
+    }
+
+    r->leader_state.timeout_now_sent = true;
+
+    return 0;
+}
+
+int raft_replication__maybe_yield(struct raft *r, size_t i)
+{
+    const struct raft_server *server = &r->configuration.servers[i];
+    const struct raft_server *local;
+
+    assert(r->state == RAFT_STATE_LEADER);
+
+    if (r->leader_state.transferee != 0 || !raft_io__timeout_now(r)) {
+        return 0;
+    }
+
+    local = raft_configuration__get(&r->configuration, r->id);
+    if (local == NULL || !server->voting ||
+        server->priority <= local->priority) {
+        return 0;
+    }
+
+    if (r->leader_state.match_index[i] < r->commit_index ||
+        r->now - r->leader_state.transfer_start < r->election_timeout) {
+        return 0;
+    }
+
+    raft__infof(r, "server %ld has higher priority -> transfer leadership",
+                server->id);
+
+    return raft_transfer_leadership(r, server->id);
+}
+
 void raft_replication__maybe_commit(struct raft *r, raft_index index)
 {
     size_t votes = 0;
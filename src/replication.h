@@ -21,13 +21,42 @@ int raft_replication__send_append_entries(struct raft *r, size_t i);
  * Send an AppendEntries RPC to all other servers
  *
  * If a remote server next_index is has up-to-date as ours, the RPC will carry
- * no entries.
+ * no entries. Servers with the same next_index share the same entries batch,
+ * whose header gets encoded only once.
  */
 void raft_replication__send_heartbeat(struct raft *r);
 
+/**
+ * Write to disk the entries that the leader has appended to its log starting
+ * from the given index, and send them to all other servers.
+ *
+ * In case of failure the entries are left in the log, and it's up to the
+ * caller to truncate it.
+ */
+int raft_replication__trigger(struct raft *r, raft_index index);
+
+/**
+ * Release a reference to a batch of entries sent in AppendEntries RPCs. When
+ * the batch is not used by any request anymore, its entries are released back
+ * to the log.
+ */
+void raft_replication__release_batch(struct raft *r,
+                                     struct raft_append_entries_batch *batch);
+
+/**
+ * Release an array of @n entries received from a leader along with their
+ * batches. The array might be part of the batch of its entries, if they all
+ * belong to the same one.
+ */
+void raft_replication__free_entries(struct raft_entry *entries, unsigned n);
+
 /**
  * Append the log entries in the given request if the Log Matching Property is
  * satisfied.
+ *
+ * If a log write gets submitted, @async is set to true and the entries are now
+ * owned by the write. Otherwise, including when an error is returned, the
+ * entries array is left as it was passed and the caller must release it.
  */
 int raft_replication__maybe_append(struct raft *r,
                                    const struct raft_append_entries_args *args,
@@ -43,6 +72,30 @@ void raft_replication__update_server(
     size_t server_index,
     const struct raft_append_entries_result *result);
 
+/**
+ * If leadership is being transferred to the server at the given index in the
+ * configuration and its log is up to date with ours, send it a TimeoutNow RPC
+ * so it starts an election right away. The request is sent only once per
+ * transfer, so that later results from the target don't make it start another
+ * election.
+ *
+ * From Section §3.10:
+ *
+ *   The prior leader sends a TimeoutNow request to the target server. This
+ *   request has the same effect as the target server's election timer firing.
+ */
+int raft_replication__maybe_send_timeout_now(struct raft *r, size_t i);
+
+/**
+ * Transfer leadership to the server at the given index in the configuration if
+ * it's a voting server with a higher priority than ours and it has caught up
+ * with the committed entries.
+ *
+ * To let leadership settle, this happens only if no transfer began or ended
+ * within the last election timeout.
+ */
+int raft_replication__maybe_yield(struct raft *r, size_t i);
+
 /**
  * Check if a quorum has been reached for the given log index, and update commit
  * index accordingly if so.
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <string.h>
 
 #include "../include/raft.h"
 
@@ -6,8 +7,10 @@
 #include "configuration.h"
 #include "context.h"
 #include "election.h"
+#include "io.h"
 #include "log.h"
 #include "logger.h"
+#include "membership.h"
 #include "replication.h"
 #include "state.h"
 
@@ -20,9 +23,12 @@
  * request's term, to -1 if the request's term is lower, and to 1 if the
  * request's term was higher but we have successfully bumped the local one to
  * match it (and stepped down to follower in that case, if we were not already).
+ * In that case, the vote for the server with the given @voted_for ID (if not 0)
+ * is persisted along with the new term.
  */
 static int raft__rpc_ensure_matching_terms(struct raft *r,
                                            raft_term term,
+                                           unsigned voted_for,
                                            int *match)
 {
     int rv;
@@ -53,11 +59,11 @@ static int raft__rpc_ensure_matching_terms(struct raft *r,
         if (r->state == RAFT_STATE_FOLLOWER) {
             /* Just bump the current term */
             raft__infof(r, "remote server term is higher -> bump local term");
-            rv = raft_state__update_current_term(r, term);
+            rv = raft_state__update_current_term(r, term, voted_for);
         } else {
             /* Bump current state and also convert to follower. */
             raft__infof(r, "remote server term is higher -> step down");
-            rv = raft_state__convert_to_follower(r, term);
+            rv = raft_state__convert_to_follower(r, term, voted_for);
         }
         if (rv != 0) {
             return rv;
@@ -70,11 +76,45 @@ static int raft__rpc_ensure_matching_terms(struct raft *r,
     return 0;
 }
 
+/**
+ * Decide whether to grant our vote to a candidate in the Pre-Vote phase. Since
+ * the request is not binding, neither our term nor our vote are changed.
+ *
+ * From Section §9.6:
+ *
+ *   A candidate only increments its term if it first learns from a majority of
+ *   the cluster that they would be willing to grant the candidate their votes
+ *   (if the candidate's log is sufficiently up-to-date, and the voters have not
+ *   received heartbeats from a valid leader for at least a baseline election
+ *   timeout).
+ */
+static bool raft_rpc__grant_pre_vote(struct raft *r,
+                                     const struct raft_request_vote_args *args)
+{
+    unsigned voted_for;
+
+    if (r->state == RAFT_STATE_LEADER) {
+        raft__debugf(r, "local server is leader -> reject pre-vote");
+        return false;
+    }
+
+    if (args->term < r->current_term) {
+        raft__debugf(r, "local term is higher -> reject pre-vote");
+        return false;
+    }
+
+    /* If we're already in the candidate's term, we might have voted. */
+    voted_for = args->term == r->current_term ? r->voted_for : 0;
+
+    return raft_election__should_grant_vote(r, args, voted_for);
+}
+
 int raft_handle_request_vote(struct raft *r,
                              const struct raft_server *server,
                              const struct raft_request_vote_args *args)
 {
     struct raft_request_vote_result result;
+    unsigned voted_for;
     int match;
     int rv;
 
@@ -83,6 +123,7 @@ int raft_handle_request_vote(struct raft *r,
     assert(args != NULL);
 
     result.vote_granted = false;
+    result.pre_vote = args->pre_vote;
 
     raft__debugf(r, "received vote request from server %ld", server->id);
 
@@ -96,12 +137,29 @@ int raft_handle_request_vote(struct raft *r,
      *   leader, it does not update its term or grant its vote
      */
     if (r->state == RAFT_STATE_FOLLOWER &&
-        r->follower_state.current_leader != NULL) {
+        r->follower_state.current_leader != NULL && !args->disrupt_leader) {
         raft__debugf(r, "local server has a leader -> reject ");
         goto reply;
     }
 
-    rv = raft__rpc_ensure_matching_terms(r, args->term, &match);
+    /* A granted pre-vote carries the candidate's term, so the candidate
+     * doesn't discard it as stale. */
+    if (args->pre_vote) {
+        result.vote_granted = raft_rpc__grant_pre_vote(r, args);
+        result.term = result.vote_granted ? args->term : r->current_term;
+        goto send;
+    }
+
+    /* If the request's term is higher than ours, decide right away whether our
+     * vote in that term goes to the requester, so the vote can be persisted
+     * along with the new term, with a single write. */
+    voted_for = 0;
+    if (args->term > r->current_term &&
+        raft_election__should_grant_vote(r, args, 0)) {
+        voted_for = args->candidate_id;
+    }
+
+    rv = raft__rpc_ensure_matching_terms(r, args->term, voted_for, &match);
     if (rv != 0) {
         return rv;
     }
@@ -121,14 +179,29 @@ int raft_handle_request_vote(struct raft *r,
      * (otherwise we would have reject the request */
     assert(r->current_term <= args->term);
 
-    rv = raft_election__maybe_grant_vote(r, args, &result.vote_granted);
-    if (rv != 0) {
-        return rv;
+    if (match > 0) {
+        /* The decision was already taken and persisted with the new term. */
+        if (voted_for != 0) {
+            result.vote_granted = true;
+            r->timer = 0;
+        }
+    } else {
+        rv = raft_election__maybe_grant_vote(r, args, &result.vote_granted);
+        if (rv != 0) {
+            return rv;
+        }
+    }
+
+    /* If our vote is being persisted asynchronously, the result will be sent
+     * once it's durable. */
+    if (result.vote_granted && raft_io__async_metadata(r)) {
+        return 0;
     }
 
 reply:
     result.term = r->current_term;
 
+send:
     rv = r->io->send_request_vote_response(r->io, server, &result);
     if (rv != 0) {
         return rv;
@@ -165,7 +238,37 @@ int raft_handle_request_vote_response(
         return 0;
     }
 
-    rv = raft__rpc_ensure_matching_terms(r, result->term, &match);
+    /* Ignore responses to requests of a previous phase. */
+    if (result->pre_vote != r->candidate_state.in_pre_vote) {
+        raft__debugf(r, "result from another election phase -> ignore");
+        return 0;
+    }
+
+    /* A granted pre-vote carries the term we would start an election with,
+     * while a rejection might tell us about a higher term. If a majority would
+     * grant us their vote, start the actual election.
+     *
+     * From Section §9.6:
+     *
+     *   If the Pre-Vote phase succeeds, the candidate then increments its term
+     *   and starts a normal election.
+     */
+    if (result->pre_vote) {
+        if (result->vote_granted) {
+            if (result->term != r->current_term + 1) {
+                raft__debugf(r, "pre-vote for another term -> ignore");
+                return 0;
+            }
+            if (raft_election__maybe_win(r, votes_index)) {
+                raft__infof(r, "pre-vote quorum reached -> start election");
+                return raft_election__start(r, false);
+            }
+            return 0;
+        }
+        return raft__rpc_ensure_matching_terms(r, result->term, 0, &match);
+    }
+
+    rv = raft__rpc_ensure_matching_terms(r, result->term, 0, &match);
     if (rv != 0) {
         return rv;
     }
@@ -208,11 +311,68 @@ int raft_handle_request_vote_response(
     return 0;
 }
 
-int raft_handle_append_entries(struct raft *r,
-                               const struct raft_server *server,
-                               const struct raft_append_entries_args *args)
+int raft_handle_timeout_now(struct raft *r,
+                            const struct raft_server *server,
+                            const struct raft_timeout_now_args *args)
+{
+    const struct raft_server *local_server;
+    int match;
+    int rv;
+
+    assert(r != NULL);
+    assert(server != NULL);
+    assert(args != NULL);
+
+    raft__debugf(r, "received timeout now from server %ld", server->id);
+
+    rv = raft__rpc_ensure_matching_terms(r, args->term, 0, &match);
+    if (rv != 0) {
+        return rv;
+    }
+
+    if (match < 0) {
+        raft__debugf(r, "local term is higher -> ignore ");
+        return 0;
+    }
+
+    if (r->state != RAFT_STATE_FOLLOWER) {
+        raft__debugf(r, "local server is not follower -> ignore");
+        return 0;
+    }
+
+    local_server = raft_configuration__get(&r->configuration, r->id);
+    if (local_server == NULL || !local_server->voting) {
+        raft__debugf(r, "local server is not voting -> ignore");
+        return 0;
+    }
+
+    /* The leader should have brought our log up to date before asking us to
+     * take over, if not some entries are still in flight. */
+    if (raft_log__last_index(&r->log) != args->last_log_index ||
+        raft_log__last_term(&r->log) != args->last_log_term) {
+        raft__debugf(r, "local log is not up to date -> ignore");
+        return 0;
+    }
+
+    raft__infof(r, "leader asked to take over -> start election");
+
+    return raft_state__convert_to_candidate(r, true);
+}
+
+/**
+ * Process an AppendEntries RPC, filling the @result to send back to the leader.
+ *
+ * If a log write gets submitted, @async is set to true and the result will be
+ * sent once the write completes. Otherwise the entries are released, also when
+ * an error is returned.
+ */
+static int raft_rpc__append_entries(
+    struct raft *r,
+    const struct raft_server *server,
+    const struct raft_append_entries_args *args,
+    struct raft_append_entries_result *result,
+    bool *async)
 {
-    struct raft_append_entries_result result;
     int match;
     int rv;
 
@@ -223,12 +383,14 @@ int raft_handle_append_entries(struct raft *r,
 
     raft__debugf(r, "received %d entries from server %ld", args->n, server->id);
 
-    result.success = false;
-    result.last_log_index = raft_log__last_index(&r->log);
+    *async = false;
+
+    result->success = false;
+    result->last_log_index = raft_log__last_index(&r->log);
 
-    rv = raft__rpc_ensure_matching_terms(r, args->term, &match);
+    rv = raft__rpc_ensure_matching_terms(r, args->term, 0, &match);
     if (rv != 0) {
-        return rv;
+        goto err;
     }
 
     /* From Figure 3.1:
@@ -269,14 +431,30 @@ int raft_handle_append_entries(struct raft *r,
 
     if (r->state == RAFT_STATE_CANDIDATE) {
         raft__debugf(r, "discovered leader -> step down ");
-        rv = raft_state__convert_to_follower(r, args->term);
+        /* Keep the vote we cast in this term, be it for ourselves or, in the
+         * Pre-Vote phase, for another server. */
+        rv = raft_state__convert_to_follower(r, args->term, r->voted_for);
         if (rv != 0) {
-            return rv;
+            goto err;
         }
     }
 
     assert(r->state == RAFT_STATE_FOLLOWER);
 
+    /* The leader sends heartbeats every heartbeat timeout when it has no
+     * entries to send, so the interval between two of them with nothing in
+     * between lets us follow its timeouts. */
+    if (args->n > 0) {
+        r->follower_state.heartbeat = 0;
+    } else {
+        if (r->follower_state.current_leader == server &&
+            r->follower_state.heartbeat != 0) {
+            raft_election__follow_heartbeats(
+                r, r->now - r->follower_state.heartbeat);
+        }
+        r->follower_state.heartbeat = r->now;
+    }
+
     /* Update current leader because the term in this AppendEntries RPC is up to
      * date. */
     r->follower_state.current_leader = server;
@@ -284,31 +462,51 @@ int raft_handle_append_entries(struct raft *r,
     /* Reset the election timer. */
     r->timer = 0;
 
-    bool async;
-    rv = raft_replication__maybe_append(r, args, &result.success, &async);
+    rv = raft_replication__maybe_append(r, args, &result->success, async);
     if (rv != 0) {
-        return rv;
+        goto err;
     }
 
-    if (async) {
+    if (*async) {
         return 0;
     }
 
-    if (result.success) {
+    if (result->success) {
         /* Echo back to the leader the point that we reached. */
-        result.last_log_index = args->prev_log_index + args->n;
+        result->last_log_index = args->prev_log_index + args->n;
     }
 
 reply:
-    result.term = r->current_term;
+    result->term = r->current_term;
 
-    /* Free the entries batch, if any. */
-    if (args->n > 0 && args->entries[0].batch != NULL) {
-        raft_free(args->entries[0].batch);
+    /* Free the entries and their batch, if any. */
+    raft_replication__free_entries(args->entries, args->n);
+
+    return 0;
+
+err:
+    assert(rv != 0);
+
+    raft_replication__free_entries(args->entries, args->n);
+
+    return rv;
+}
+
+int raft_handle_append_entries(struct raft *r,
+                               const struct raft_server *server,
+                               const struct raft_append_entries_args *args)
+{
+    struct raft_append_entries_result result;
+    bool async;
+    int rv;
+
+    rv = raft_rpc__append_entries(r, server, args, &result, &async);
+    if (rv != 0) {
+        return rv;
     }
 
-    if (args->entries != NULL) {
-        raft_free(args->entries);
+    if (async) {
+        return 0;
     }
 
     rv = r->io->send_append_entries_response(r->io, server, &result);
@@ -345,7 +543,7 @@ int raft_handle_append_entries_response(
         return 0;
     }
 
-    rv = raft__rpc_ensure_matching_terms(r, result->term, &match);
+    rv = raft__rpc_ensure_matching_terms(r, result->term, 0, &match);
     if (rv != 0) {
         return rv;
     }
@@ -376,11 +574,238 @@ int raft_handle_append_entries_response(
         return 0;
     }
 
+    raft_election__sample_rtt(r, server_index, result);
+
+    r->leader_state.last_contact[server_index] = r->now;
+
     /* Update the match/next indexes and possibly send further entries. */
     raft_replication__update_server(r, server_index, result);
 
+    /* If the server we're handing leadership to caught up, let it take over,
+     * or start handing leadership to it if it has a higher priority. Errors
+     * are ignored, the transfer will just time out or be retried. */
+    raft_replication__maybe_send_timeout_now(r, server_index);
+    raft_replication__maybe_yield(r, server_index);
+
+    /* If the learner being promoted has caught up, make it a voting server.
+     * Errors are ignored, the promotion can be retried. */
+    raft_membership__catch_up(r, server_index);
+
     /* Commit entries if possible */
     raft_replication__maybe_commit(r, result->last_log_index);
 
     return 0;
 }
+
+/**
+ * Return true if the AppendEntries request @next picks up exactly where @prev,
+ * coming from the same server in the same term, leaves off, so their entries
+ * can be appended with a single log write.
+ */
+static bool raft_rpc__can_merge(const struct raft_server *prev_server,
+                                const struct raft_message *prev,
+                                const struct raft_server *next_server,
+                                const struct raft_message *next)
+{
+    const struct raft_append_entries_args *a = &prev->append_entries;
+    const struct raft_append_entries_args *b = &next->append_entries;
+    raft_term last_term;
+
+    if (next->type != RAFT_IO_APPEND_ENTRIES || next_server != prev_server) {
+        return false;
+    }
+
+    if (a->compressed != 0 || b->compressed != 0) {
+        return false;
+    }
+
+    last_term = a->n > 0 ? a->entries[a->n - 1].term : a->prev_log_term;
+
+    return b->term == a->term && b->leader_id == a->leader_id &&
+           b->prev_log_index == a->prev_log_index + a->n &&
+           b->prev_log_term == last_term;
+}
+
+/**
+ * Merge the @n consecutive AppendEntries requests in the given messages into a
+ * single one, taking ownership of their entries.
+ */
+static int raft_rpc__merge(struct raft_message messages[],
+                           unsigned n,
+                           struct raft_append_entries_args *args)
+{
+    struct raft_entry *entries = NULL;
+    unsigned total = 0;
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        total += messages[i].append_entries.n;
+    }
+
+    if (total > 0) {
+        entries = raft_malloc(total * sizeof *entries);
+        if (entries == NULL) {
+            return RAFT_ERR_NOMEM;
+        }
+    }
+
+    *args = messages[0].append_entries;
+    args->leader_commit = messages[n - 1].append_entries.leader_commit;
+    args->entries = entries;
+    args->n = 0;
+    args->batch = NULL;
+
+    for (i = 0; i < n; i++) {
+        struct raft_append_entries_args *other = &messages[i].append_entries;
+
+        if (other->n == 0) {
+            continue;
+        }
+
+        memcpy(&entries[args->n], other->entries,
+               other->n * sizeof *entries);
+        args->n += other->n;
+
+        /* Arrays laid out at the start of their batch go away with it. */
+        if ((void *)other->entries != other->entries[0].batch) {
+            raft_free(other->entries);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Send the AppendEntries result held back for the given server, if any.
+ */
+static int raft_rpc__flush_result(
+    struct raft *r,
+    const struct raft_server **server,
+    const struct raft_append_entries_result *result)
+{
+    int rv;
+
+    if (*server == NULL) {
+        return 0;
+    }
+
+    rv = r->io->send_append_entries_response(r->io, *server, result);
+    *server = NULL;
+
+    return rv;
+}
+
+int raft_handle_messages(struct raft *r,
+                         const struct raft_server *servers[],
+                         struct raft_message messages[],
+                         unsigned n)
+{
+    const struct raft_server *pending = NULL; /* Server owed a result */
+    struct raft_append_entries_result result;
+    unsigned i = 0;
+    unsigned j = 0; /* First message not handled yet */
+    int rv = 0;
+
+    assert(r != NULL);
+    assert(servers != NULL || n == 0);
+    assert(messages != NULL || n == 0);
+
+    while (i < n) {
+        const struct raft_server *server = servers[i];
+        struct raft_message *message = &messages[i];
+        struct raft_append_entries_args args;
+        struct raft_append_entries_result other;
+        bool async;
+
+        /* Results for other servers don't need to wait. */
+        j = i;
+        if (pending != NULL && pending != server) {
+            rv = raft_rpc__flush_result(r, &pending, &result);
+            if (rv != 0) {
+                goto err;
+            }
+        }
+
+        j = i + 1;
+
+        switch (message->type) {
+            case RAFT_IO_APPEND_ENTRIES:
+                while (j < n && raft_rpc__can_merge(server, &messages[j - 1],
+                                                    servers[j], &messages[j])) {
+                    j++;
+                }
+
+                args = message->append_entries;
+                if (j - i > 1 && raft_rpc__merge(message, j - i, &args) != 0) {
+                    /* Just handle the first request on its own. */
+                    j = i + 1;
+                }
+
+                /* A later result for the same server supersedes the one held
+                 * back, so just replace it. */
+                rv = raft_rpc__append_entries(r, server, &args, &other, &async);
+                if (rv != 0) {
+                    goto err;
+                }
+                if (!async) {
+                    pending = server;
+                    result = other;
+                }
+                break;
+
+            case RAFT_IO_APPEND_ENTRIES_RESULT:
+                /* Successful results from the same server in the same term
+                 * are subsumed by the one reporting the highest index. */
+                other = message->append_entries_result;
+                while (other.success && j < n && servers[j] == server &&
+                       messages[j].type == RAFT_IO_APPEND_ENTRIES_RESULT &&
+                       messages[j].append_entries_result.success &&
+                       messages[j].append_entries_result.term == other.term) {
+                    if (messages[j].append_entries_result.last_log_index >
+                        other.last_log_index) {
+                        other.last_log_index =
+                            messages[j].append_entries_result.last_log_index;
+                    }
+                    j++;
+                }
+
+                rv = raft_handle_append_entries_response(r, server, &other);
+                break;
+
+            case RAFT_IO_REQUEST_VOTE:
+                rv = raft_handle_request_vote(r, server,
+                                              &message->request_vote);
+                break;
+
+            case RAFT_IO_TIMEOUT_NOW:
+                rv = raft_handle_timeout_now(r, server, &message->timeout_now);
+                break;
+
+            default:
+                assert(message->type == RAFT_IO_REQUEST_VOTE_RESULT);
+                rv = raft_handle_request_vote_response(
+                    r, server, &message->request_vote_result);
+                break;
+        }
+
+        if (rv != 0) {
+            goto err;
+        }
+
+        i = j;
+    }
+
+    return raft_rpc__flush_result(r, &pending, &result);
+
+err:
+    /* Release the entries of the requests that were not handled. The ones of
+     * the request, or of the merged run, that failed have already been. */
+    for (i = j; i < n; i++) {
+        if (messages[i].type == RAFT_IO_APPEND_ENTRIES) {
+            struct raft_append_entries_args *args = &messages[i].append_entries;
+            raft_replication__free_entries(args->entries, args->n);
+        }
+    }
+
+    return rv;
+}
@@ -1,7 +1,9 @@
 #include <assert.h>
+#include <string.h>
 
 #include "configuration.h"
 #include "election.h"
+#include "io.h"
 #include "log.h"
 #include "logger.h"
 #include "replication.h"
@@ -19,6 +21,7 @@ const char *raft_state_names[] = {
 static void raft_state__clear_follower(struct raft *r)
 {
     r->follower_state.current_leader = NULL;
+    r->follower_state.heartbeat = 0;
 }
 
 /**
@@ -37,9 +40,13 @@ static void raft_state__clear_leader(struct raft *r)
 {
     raft_free(r->leader_state.next_index);
     raft_free(r->leader_state.match_index);
+    raft_free(r->leader_state.last_contact);
+    raft_free(r->leader_state.rtt);
 
     r->leader_state.next_index = NULL;
     r->leader_state.match_index = NULL;
+    r->leader_state.last_contact = NULL;
+    r->leader_state.rtt = NULL;
 }
 
 void raft_state__clear(struct raft *r)
@@ -91,18 +98,23 @@ static void raft_state__change(struct raft *r, int state)
     r->state = state;
 }
 
-/**
- * Update the current term to the given value and reset our vote.
- */
-int raft_state__update_current_term(struct raft *r, raft_term term)
+int raft_state__update_current_term(struct raft *r,
+                                    raft_term term,
+                                    unsigned voted_for)
 {
     int rv;
 
     assert(r != NULL);
     assert(term >= r->current_term);
 
-    /* Save the new term to persistent store, resetting the vote. */
-    rv = r->io->write_term(r->io, term);
+    /* Nothing to persist if neither changes, as when a leader steps down on
+     * its own. */
+    if (term == r->current_term && voted_for == r->voted_for) {
+        return 0;
+    }
+
+    /* Save the new term and vote to persistent store. */
+    rv = raft_io__write_term_and_vote(r, term, voted_for);
     if (rv != 0) {
         raft__errorf(r, "failed to write term: %s (%d)", raft_strerror(rv), rv);
         return rv;
@@ -110,12 +122,14 @@ int raft_state__update_current_term(struct raft *r, raft_term term)
 
     /* Update our cache too. */
     r->current_term = term;
-    r->voted_for = 0;
+    r->voted_for = voted_for;
 
     return 0;
 }
 
-int raft_state__convert_to_follower(struct raft *r, raft_term term)
+int raft_state__convert_to_follower(struct raft *r,
+                                    raft_term term,
+                                    unsigned voted_for)
 {
     int rv;
 
@@ -129,7 +143,7 @@ int raft_state__convert_to_follower(struct raft *r, raft_term term)
             break;
     }
 
-    rv = raft_state__update_current_term(r, term);
+    rv = raft_state__update_current_term(r, term, voted_for);
     if (rv != 0) {
         return rv;
     }
@@ -142,11 +156,12 @@ int raft_state__convert_to_follower(struct raft *r, raft_term term)
     /* The current leader will be set next time that we receive an AppendEntries
      * RPC. */
     r->follower_state.current_leader = NULL;
+    r->follower_state.heartbeat = 0;
 
     return 0;
 }
 
-int raft_state__convert_to_candidate(struct raft *r)
+int raft_state__convert_to_candidate(struct raft *r, bool disrupt_leader)
 {
     size_t n_voting = raft_configuration__n_voting(&r->configuration);
     int rv;
@@ -164,7 +179,8 @@ int raft_state__convert_to_candidate(struct raft *r)
     raft_state__change(r, RAFT_STATE_CANDIDATE);
 
     /* Start a new election round */
-    rv = raft_election__start(r);
+    r->candidate_state.disrupt_leader = disrupt_leader;
+    rv = raft_election__start(r, r->pre_vote && !disrupt_leader);
     if (rv != 0) {
         r->state = RAFT_STATE_FOLLOWER;
         raft_free(r->candidate_state.votes);
@@ -200,13 +216,36 @@ int raft_state__convert_to_leader(struct raft *r)
         raft__errorf(r, "failed to alloc match_index array");
         return RAFT_ERR_NOMEM;
     }
+    r->leader_state.last_contact =
+        raft_malloc(n_servers * sizeof *r->leader_state.last_contact);
+    if (r->leader_state.last_contact == NULL) {
+        raft_free(r->leader_state.match_index);
+        raft_free(r->leader_state.next_index);
+        raft__errorf(r, "failed to alloc last_contact array");
+        return RAFT_ERR_NOMEM;
+    }
+    r->leader_state.rtt =
+        raft_malloc(n_servers * sizeof *r->leader_state.rtt);
+    if (r->leader_state.rtt == NULL) {
+        raft_free(r->leader_state.last_contact);
+        raft_free(r->leader_state.match_index);
+        raft_free(r->leader_state.next_index);
+        raft__errorf(r, "failed to alloc rtt array");
+        return RAFT_ERR_NOMEM;
+    }
 
-    /* Initialize the next_index and match_index arrays.
-     */
+    /* Initialize the next_index, match_index, last_contact and rtt arrays. Each
+     * server gets a full election timeout to reply, starting from now. */
     for (i = 0; i < r->configuration.n; i++) {
         r->leader_state.next_index[i] = raft_log__last_index(&r->log) + 1;
         r->leader_state.match_index[i] = 0;
+        r->leader_state.last_contact[i] = r->now;
+        memset(&r->leader_state.rtt[i], 0, sizeof r->leader_state.rtt[i]);
     }
+    r->leader_state.transferee = 0;
+    r->leader_state.transfer_start = r->now;
+    r->leader_state.timeout_now_sent = false;
+    r->leader_state.promotee = 0;
 
     raft_state__change(r, RAFT_STATE_LEADER);
 
@@ -14,21 +14,34 @@
  */
 void raft_state__clear(struct raft *r);
 
-int raft_state__update_current_term(struct raft *r, raft_term term);
+/**
+ * Update the current term to the given value, voting for the server with the
+ * given ID in it (0 for none). Both are persisted with a single write.
+ */
+int raft_state__update_current_term(struct raft *r,
+                                    raft_term term,
+                                    unsigned voted_for);
 
 /**
- * Convert from candidate or leader to follower.
+ * Convert from candidate or leader to follower, updating the current term and
+ * vote as raft_state__update_current_term() does.
  */
-int raft_state__convert_to_follower(struct raft *r, raft_term term);
+int raft_state__convert_to_follower(struct raft *r,
+                                    raft_term term,
+                                    unsigned voted_for);
 
 /**
  * Convert from follower to candidate, starting a new election.
  *
+ * If @disrupt_leader is true, the current leader asked us to take over: the
+ * Pre-Vote phase is skipped and our vote requests are processed even by
+ * servers that are hearing from the leader.
+ *
  * From Figure 3.1:
  *
  *   On conversion to candidate, start election:
  */
-int raft_state__convert_to_candidate(struct raft *r);
+int raft_state__convert_to_candidate(struct raft *r, bool disrupt_leader);
 
 /**
  * Convert from candidate to leader.
@@ -5,6 +5,7 @@
 #include "configuration.h"
 #include "context.h"
 #include "election.h"
+#include "io.h"
 #include "logger.h"
 #include "replication.h"
 #include "state.h"
@@ -28,11 +29,16 @@ static int raft_tick__follower(struct raft *r)
     if (raft_configuration__n_voting(&r->configuration) == 1) {
         if (server->voting) {
             raft__debugf(r, "tick: self elect and convert to leader");
-            rv = raft_state__convert_to_candidate(r);
+            rv = raft_state__convert_to_candidate(r, false);
             if (rv != 0) {
                 raft_context__errorf(&r->ctx, "failed to convert to candidate");
                 return rv;
             }
+            /* If our vote is being persisted asynchronously, we'll convert to
+             * leader once it's durable. */
+            if (raft_io__async_metadata(r)) {
+                return 0;
+            }
             rv = raft_state__convert_to_leader(r);
             if (rv != 0) {
                 raft_context__errorf(&r->ctx, "failed to convert to leader");
@@ -59,7 +65,7 @@ static int raft_tick__follower(struct raft *r)
      */
     if (r->timer > r->election_timeout_rand && server->voting) {
         raft__infof(r, "tick: convert to candidate and start new election");
-        return raft_state__convert_to_candidate(r);
+        return raft_state__convert_to_candidate(r, false);
     }
 
     return 0;
@@ -85,12 +91,39 @@ static int raft_tick__candidate(struct raft *r)
      */
     if (r->timer > r->election_timeout_rand) {
         raft__infof(r, "tick: start new election");
-        return raft_election__start(r);
+        r->candidate_state.disrupt_leader = false;
+        return raft_election__start(r, r->pre_vote);
     }
 
     return 0;
 }
 
+/**
+ * Return true if a majority of voting servers, including ourselves, replied to
+ * our AppendEntries requests within the last election timeout.
+ */
+static bool raft_tick__has_quorum(struct raft *r)
+{
+    size_t n_voting = raft_configuration__n_voting(&r->configuration);
+    size_t contacts = 0;
+    size_t i;
+
+    for (i = 0; i < r->configuration.n; i++) {
+        const struct raft_server *server = &r->configuration.servers[i];
+
+        if (!server->voting) {
+            continue;
+        }
+
+        if (server->id == r->id ||
+            r->now - r->leader_state.last_contact[i] <= r->election_timeout) {
+            contacts++;
+        }
+    }
+
+    return contacts >= n_voting / 2 + 1;
+}
+
 /**
  * Apply time-dependent rules for leaders (Figure 3.1).
  */
@@ -99,6 +132,51 @@ static int raft_tick__leader(struct raft *r)
     assert(r != NULL);
     assert(r->state == RAFT_STATE_LEADER);
 
+    /* Step down if we can't reach a majority of the cluster, so clients can
+     * find the new leader instead of waiting on us.
+     *
+     * From Section §6.2:
+     *
+     *   A leader in Raft steps down if an election timeout elapses without a
+     *   successful round of heartbeats to a majority of its cluster.
+     */
+    if (r->check_quorum && !raft_tick__has_quorum(r)) {
+        raft__infof(r, "tick: no contact with a majority -> step down");
+        return raft_state__convert_to_follower(r, r->current_term,
+                                               r->voted_for);
+    }
+
+    /* Give up a leadership transfer if the target didn't take over in time,
+     * and resume accepting client requests.
+     *
+     * From Section §3.10:
+     *
+     *   If the transfer does not complete after about an election timeout, the
+     *   prior leader aborts the transfer and resumes accepting client requests.
+     */
+    if (r->leader_state.transferee != 0 &&
+        r->now - r->leader_state.transfer_start > r->election_timeout) {
+        raft__infof(r, "tick: leadership transfer timed out -> abort");
+        r->leader_state.transferee = 0;
+        r->leader_state.transfer_start = r->now;
+        r->leader_state.timeout_now_sent = false;
+    }
+
+    /* Give up promoting a learner that stopped replying, leaving it a
+     * learner. */
+    if (r->leader_state.promotee != 0) {
+        unsigned id = r->leader_state.promotee;
+        size_t i = raft_configuration__index(&r->configuration, id);
+
+        assert(i < r->configuration.n);
+
+        if (r->now - r->leader_state.last_contact[i] > r->election_timeout) {
+            raft__infof(r, "tick: server %ld unreachable -> abort promotion",
+                        id);
+            r->leader_state.promotee = 0;
+        }
+    }
+
     /* Check if we need to send heartbeats.
      *
      * From Figure 3.1:
@@ -124,6 +202,7 @@ int raft_tick(struct raft *r, const unsigned msec_since_last_tick)
            r->state == RAFT_STATE_CANDIDATE || r->state == RAFT_STATE_LEADER);
 
     r->timer += msec_since_last_tick;
+    r->now += msec_since_last_tick;
 
     switch (r->state) {
         case RAFT_STATE_FOLLOWER:
@@ -21,6 +21,7 @@ struct test_io
     /* Term and vote */
     raft_term term;
     unsigned voted_for;
+    unsigned n_metadata_writes; /* Number of term and vote writes */
 
     /* Log */
     struct raft_entry *entries; /* Entries array */
@@ -47,6 +48,7 @@ static void test_io__init(struct test_io *t)
 
     t->term = 0;
     t->voted_for = 0;
+    t->n_metadata_writes = 0;
 
     t->entries = NULL;
     t->first_index = 0;
@@ -70,7 +72,7 @@ static void test_io__init(struct test_io *t)
  * Enqueue a pending I/O request.
  */
 struct test_io_request *test_io__queue_push(struct raft_io *io,
-                                            const size_t id,
+                                            const raft_request_id id,
                                             const int type)
 {
     struct test_io *t = io->data;
@@ -211,7 +213,10 @@ void test_io__append_entries_cb(struct raft_io *io,
     struct test_io *t = io->data;
     struct test_host *host;
     struct test_message message;
-    size_t i;
+    struct iovec *iov;
+    unsigned n_iov;
+    void *header;
+    unsigned i;
     int rv;
 
     if (t->network == NULL) {
@@ -227,42 +232,50 @@ void test_io__append_entries_cb(struct raft_io *io,
                                     &message.header);
     munit_assert_int(rv, ==, 0);
 
-    /* Calculate the size of the entry data payload. */
+    /* Gather the entry data payload, as it would be sent on the wire right
+     * after the message header. The data of a shared batch might be
+     * compressed. */
+    n_iov = raft_encode_append_entries_iov_count(&request->append_entries.args);
+    iov = munit_malloc(n_iov * sizeof *iov);
+    header = munit_malloc(message.header.len);
+
+    raft_encode_append_entries_iov(&request->append_entries.args, header, iov);
+
     message.payload.len = 0;
-    for (i = 0; i < request->append_entries.args.n; i++) {
-        struct raft_entry *entry = &request->append_entries.args.entries[i];
-        message.payload.len += entry->buf.len;
-        if (entry->buf.len % 8 != 0) {
-            /* Add padding */
-            message.payload.len += 8 - (entry->buf.len % 8);
-        }
+    for (i = 0; i < n_iov; i++) {
+        message.payload.len += iov[i].iov_len;
     }
+    message.payload.len -= message.header.len;
 
     /* Populate the entry data payload. */
     if (message.payload.len > 0) {
+        size_t skip = message.header.len;
+        void *cursor;
+
         message.payload.base = raft_malloc(message.payload.len);
         munit_assert_ptr_not_null(message.payload.base);
 
-        void *cursor = message.payload.base;
+        cursor = message.payload.base;
 
-        for (i = 0; i < request->append_entries.args.n - 1; i++) {
-            struct raft_entry *entry = &request->append_entries.args.entries[i];
+        for (i = 0; i < n_iov; i++) {
+            size_t len = iov[i].iov_len;
 
-            if (entry->buf.base == NULL) {
+            if (skip >= len) {
+                skip -= len;
                 continue;
             }
 
-            memcpy(cursor, entry->buf.base, entry->buf.len);
-            cursor += entry->buf.len;
-            if (entry->buf.len % 8 != 0) {
-                /* Add padding */
-                cursor += 8 - (entry->buf.len % 8);
-            }
+            memcpy(cursor, (uint8_t *)iov[i].iov_base + skip, len - skip);
+            cursor += len - skip;
+            skip = 0;
         }
     } else {
         message.payload.base = NULL;
     }
 
+    free(header);
+    free(iov);
+
     munit_assert_int(t->id, !=, 0);
     message.sender_id = t->id;
 
@@ -299,6 +312,34 @@ void test_io__append_entries_response_cb(struct raft_io *io,
     test_host_enqueue(host, &message);
 }
 
+void test_io__timeout_now_cb(struct raft_io *io,
+                             struct test_io_request *request)
+{
+    struct test_io *t = io->data;
+    struct test_host *host;
+    struct test_message message;
+    int rv;
+
+    if (t->network == NULL) {
+        return;
+    }
+
+    munit_assert_int(request->timeout_now.server.id, !=, 0);
+
+    host = test_network_host(t->network, request->timeout_now.server.id);
+    munit_assert_ptr_not_null(host);
+
+    rv = raft_encode_timeout_now(&request->timeout_now.args, &message.header);
+    munit_assert_int(rv, ==, 0);
+
+    message.payload.base = NULL;
+
+    munit_assert_int(t->id, !=, 0);
+    message.sender_id = t->id;
+
+    test_host_enqueue(host, &message);
+}
+
 /**
  * Execute all pending I/O requets.
  */
@@ -332,6 +373,9 @@ void test_io__queue_flush(struct raft_io *io)
             case RAFT_IO_APPEND_ENTRIES_RESULT:
                 test_io__append_entries_response_cb(io, request);
                 break;
+            case RAFT_IO_TIMEOUT_NOW:
+                test_io__timeout_now_cb(io, request);
+                break;
         }
 
         request->type = RAFT_IO_NULL;
@@ -357,6 +401,7 @@ static int test_io__write_term(struct raft_io *io, const raft_term term)
 
     t->term = term;
     t->voted_for = 0;
+    t->n_metadata_writes++;
 
     return 0;
 }
@@ -374,12 +419,62 @@ static int test_io__write_vote(struct raft_io *io, const unsigned node_id)
 
     __logf("io: write vote for %ld", node_id);
     t->voted_for = node_id;
+    t->n_metadata_writes++;
+
+    return 0;
+}
+
+static int test_io__write_term_and_vote(struct raft_io *io,
+                                        const raft_term term,
+                                        const unsigned node_id)
+{
+    struct test_io *t = io->data;
+
+    munit_assert_ptr_not_null(t);
+
+    if (test_fault_tick(&t->fault)) {
+        __logf("io: write term %ld and vote for %ld: error", term, node_id);
+        return RAFT_ERR_NO_SPACE;
+    }
+
+    __logf("io: write term %ld and vote for %ld", term, node_id);
+
+    t->term = term;
+    t->voted_for = node_id;
+    t->n_metadata_writes++;
+
+    return 0;
+}
+
+/**
+ * The term and vote are saved right away, so they are not overwritten by any
+ * synchronous write performed later on, and only the completion is deferred.
+ */
+static int test_io__write_metadata(struct raft_io *io,
+                                   const raft_request_id request_id,
+                                   const raft_term term,
+                                   const unsigned node_id)
+{
+    struct test_io *t = io->data;
+    struct test_io_request *request;
+    int rv;
+
+    munit_assert_ptr_not_null(t);
+
+    rv = test_io__write_term_and_vote(io, term, node_id);
+    if (rv != 0) {
+        return rv;
+    }
+
+    request = test_io__queue_push(io, request_id, RAFT_IO_WRITE_METADATA);
+    request->write_metadata.term = term;
+    request->write_metadata.voted_for = node_id;
 
     return 0;
 }
 
 static int test_io__write_log(struct raft_io *io,
-                              const unsigned request_id,
+                              const raft_request_id request_id,
                               const struct raft_entry entries[],
                               const unsigned n)
 {
@@ -497,7 +592,7 @@ int test_io__send_request_vote_response(
 
 int test_io__send_append_entries_request(
     struct raft_io *io,
-    const unsigned request_id,
+    const raft_request_id request_id,
     const struct raft_server *server,
     const struct raft_append_entries_args *args)
 {
@@ -547,6 +642,31 @@ int test_io__send_append_entries_response(
     return 0;
 }
 
+int test_io__send_timeout_now(struct raft_io *io,
+                              const struct raft_server *server,
+                              const struct raft_timeout_now_args *args)
+{
+    struct test_io *t = io->data;
+    struct test_io_request *request;
+
+    munit_assert_ptr_not_null(t);
+    munit_assert_ptr_not_null(server);
+    munit_assert_ptr_not_null(args);
+
+    if (test_fault_tick(&t->fault)) {
+        __logf("io: fail to send timeout now to %ld", server->id);
+        return RAFT_ERR_SHUTDOWN;
+    }
+
+    __logf("io: send timeout now to %ld", server->id);
+
+    request = test_io__queue_push(io, 0, RAFT_IO_TIMEOUT_NOW);
+    request->timeout_now.server = *server;
+    request->timeout_now.args = *args;
+
+    return 0;
+}
+
 void test_io_setup(const MunitParameter params[], struct raft_io *io)
 {
     struct test_io *t = munit_malloc(sizeof *t);
@@ -566,7 +686,7 @@ void test_io_setup(const MunitParameter params[], struct raft_io *io)
         t->fault.n = atoi(repeat);
     }
 
-    io->version = 1;
+    io->version = 2;
     io->data = t;
     io->write_term = test_io__write_term;
     io->write_vote = test_io__write_vote;
@@ -576,6 +696,13 @@ void test_io_setup(const MunitParameter params[], struct raft_io *io)
     io->send_request_vote_response = test_io__send_request_vote_response;
     io->send_append_entries_request = test_io__send_append_entries_request;
     io->send_append_entries_response = test_io__send_append_entries_response;
+    io->write_term_and_vote = test_io__write_term_and_vote;
+
+    /* Asynchronous writes of term and vote are supported too, but must be
+     * enabled by bumping the version to 3. Likewise leadership transfer needs
+     * version 4. */
+    io->write_metadata = test_io__write_metadata;
+    io->send_timeout_now = test_io__send_timeout_now;
 }
 
 void test_io_tear_down(struct raft_io *io)
@@ -688,6 +815,13 @@ uint64_t test_io_get_vote(struct raft_io *io)
     return t->voted_for;
 }
 
+unsigned test_io_get_n_metadata_writes(struct raft_io *io)
+{
+    struct test_io *t = io->data;
+
+    return t->n_metadata_writes;
+}
+
 void test_io_get_entries(struct raft_io *io,
                          const struct raft_entry *entries[],
                          size_t *n)
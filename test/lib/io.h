@@ -38,7 +38,7 @@ struct test_io_request
 {
     struct raft_io *io;
     int type;
-    size_t id;
+    raft_request_id id;
     union {
         struct
         {
@@ -46,6 +46,11 @@ struct test_io_request
             size_t n;
         } write_log;
         struct
+        {
+            raft_term term;
+            unsigned voted_for;
+        } write_metadata;
+        struct
         {
             struct raft_server server;
             struct raft_request_vote_args args;
@@ -65,6 +70,11 @@ struct test_io_request
             struct raft_server server;
             struct raft_append_entries_result result;
         } append_entries_response;
+        struct
+        {
+            struct raft_server server;
+            struct raft_timeout_now_args args;
+        } timeout_now;
     };
 };
 
@@ -105,6 +115,11 @@ uint64_t test_io_get_term(struct raft_io *io);
  */
 uint64_t test_io_get_vote(struct raft_io *io);
 
+/**
+ * Get the number of writes of the term and vote performed so far.
+ */
+unsigned test_io_get_n_metadata_writes(struct raft_io *io);
+
 /**
  * Get the persisted log entries.
  */
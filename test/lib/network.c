@@ -41,11 +41,20 @@ void test_network_setup(const MunitParameter params[],
 
 int test_message_type(const struct test_message *m)
 {
+    int type;
+
     if (m->header.base == NULL) {
         return RAFT_IO_NULL;
     }
 
-    return raft__flip32(*(uint32_t *)(m->header.base + 4));
+    type = raft__flip32(*(uint32_t *)(m->header.base + 4));
+
+    /* Version 1 AppendEntries requests have a wire type of their own. */
+    if (type == RAFT_ENCODING_APPEND_ENTRIES) {
+        type = RAFT_IO_APPEND_ENTRIES;
+    }
+
+    return type;
 }
 
 void test_network_tear_down(struct test_network *n)
@@ -192,7 +201,7 @@ static void test_host__request_vote_response(struct test_host *h,
 static void test_host__append_entries(struct test_host *h,
                                       struct raft_server *server,
                                       const struct raft_buffer *buf,
-                                      const struct raft_buffer *payload)
+                                      struct raft_buffer *payload)
 {
     struct raft_append_entries_args args;
     int rv;
@@ -200,6 +209,12 @@ static void test_host__append_entries(struct test_host *h,
     rv = raft_decode_append_entries(buf, &args);
     munit_assert_int(rv, ==, 0);
 
+    rv = raft_verify_entries_batch(&args, payload);
+    munit_assert_int(rv, ==, 0);
+
+    rv = raft_inflate_entries_batch(&args, payload, 0);
+    munit_assert_int(rv, ==, 0);
+
     rv = raft_decode_entries_batch(payload, args.entries, args.n);
     munit_assert_int(rv, ==, 0);
 
@@ -219,6 +234,19 @@ static void test_host__append_entries_response(struct test_host *h,
     raft_handle_append_entries_response(h->raft, server, &result);
 }
 
+static void test_host__timeout_now(struct test_host *h,
+                                   struct raft_server *server,
+                                   const struct raft_buffer *buf)
+{
+    struct raft_timeout_now_args args;
+    int rv;
+
+    rv = raft_decode_timeout_now(buf, &args);
+    munit_assert_int(rv, ==, 0);
+
+    raft_handle_timeout_now(h->raft, server, &args);
+}
+
 void test_host_receive(struct test_host *h, struct test_message *message)
 {
     struct raft_server *server;
@@ -249,6 +277,9 @@ void test_host_receive(struct test_host *h, struct test_message *message)
         case RAFT_IO_APPEND_ENTRIES_RESULT:
             test_host__append_entries_response(h, server, &buf);
             break;
+        case RAFT_IO_TIMEOUT_NOW:
+            test_host__timeout_now(h, server, &buf);
+            break;
     }
 
     raft_free(message->header.base);
@@ -75,6 +75,7 @@ void test_become_leader(struct raft *r)
 
         result.term = r->current_term;
         result.vote_granted = 1;
+        result.pre_vote = false;
 
         rv = raft_handle_request_vote_response(r, server, &result);
         munit_assert_int(rv, ==, 0);
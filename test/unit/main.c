@@ -1,27 +1,41 @@
 #include "../lib/munit.h"
 
+extern MunitSuite raft_batch_suites[];
 extern MunitSuite raft_client_suites[];
 extern MunitSuite raft_configuration_suites[];
 extern MunitSuite raft_context_suites[];
+extern MunitSuite raft_crc32c_suites[];
+extern MunitSuite raft_decoder_suites[];
 extern MunitSuite raft_election_suites[];
 extern MunitSuite raft_encoding_suites[];
+extern MunitSuite raft_heap_suites[];
 extern MunitSuite raft_io_suites[];
+extern MunitSuite raft_io_file_suites[];
+extern MunitSuite raft_io_outbox_suites[];
 extern MunitSuite raft_log_suites[];
 extern MunitSuite raft_logger_suites[];
+extern MunitSuite raft_lz_suites[];
 extern MunitSuite raft_replication_suites[];
 extern MunitSuite raft_rpc_suites[];
 extern MunitSuite raft_tick_suites[];
 extern MunitSuite raft_suites[];
 
 static MunitSuite suites[] = {
+    {"batch", NULL, raft_batch_suites, 1, 0},
     {"client", NULL, raft_client_suites, 1, 0},
     {"configuration", NULL, raft_configuration_suites, 1, 0},
     {"context", NULL, raft_context_suites, 1, 0},
+    {"crc32c", NULL, raft_crc32c_suites, 1, 0},
+    {"decoder", NULL, raft_decoder_suites, 1, 0},
     {"election", NULL, raft_election_suites, 1, 0},
     {"encoding", NULL, raft_encoding_suites, 1, 0},
+    {"heap", NULL, raft_heap_suites, 1, 0},
     {"io", NULL, raft_io_suites, 1, 0},
+    {"io-file", NULL, raft_io_file_suites, 1, 0},
+    {"io-outbox", NULL, raft_io_outbox_suites, 1, 0},
     {"log", NULL, raft_log_suites, 1, 0},
     {"logger", NULL, raft_logger_suites, 1, 0},
+    {"lz", NULL, raft_lz_suites, 1, 0},
     {"replication", NULL, raft_replication_suites, 1, 0},
     {"rpc", NULL, raft_rpc_suites, 1, 0},
     {"tick", NULL, raft_tick_suites, 1, 0},
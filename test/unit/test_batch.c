@@ -0,0 +1,214 @@
+#include <string.h>
+
+#include "../../include/raft.h"
+
+#include "../../src/batch.h"
+#include "../../src/binary.h"
+
+#include "../lib/munit.h"
+
+/**
+ * Helpers
+ */
+
+/* Maximum number of entries used by the tests. */
+#define N_MAX 11
+
+/* Fill the given entries with random terms, types and data lengths, some of
+ * them zero. */
+static void __fill_entries(struct raft_entry *entries, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        entries[i].term = munit_rand_uint32() | (uint64_t)i << 40;
+        entries[i].type = munit_rand_int_range(RAFT_LOG_COMMAND,
+                                               RAFT_LOG_CONFIGURATION);
+        entries[i].buf.base = NULL;
+        entries[i].buf.len = i % 3 == 1 ? 0 : munit_rand_int_range(1, 100);
+        entries[i].batch = NULL;
+    }
+}
+
+/**
+ *
+ * raft_batch__encode_headers
+ *
+ */
+
+/* Each header holds the term, type and data length in little endian. */
+static MunitResult test_encode_headers_layout(const MunitParameter params[],
+                                              void *data)
+{
+    struct raft_entry entries[N_MAX];
+    uint8_t headers[N_MAX * 16];
+    size_t n;
+    size_t i;
+
+    (void)params;
+    (void)data;
+
+    for (n = 1; n <= N_MAX; n++) {
+        __fill_entries(entries, n);
+        memset(headers, 0xff, sizeof headers);
+
+        raft_batch__encode_headers(entries, n, headers);
+
+        for (i = 0; i < n; i++) {
+            const uint8_t *header = headers + 16 * i;
+            uint64_t term;
+            uint32_t len;
+
+            memcpy(&term, header, sizeof term);
+            memcpy(&len, header + 12, sizeof len);
+
+            munit_assert_uint64(raft__flip64(term), ==, entries[i].term);
+            munit_assert_int(header[8], ==, entries[i].type);
+            munit_assert_int(header[9], ==, 0);
+            munit_assert_int(header[10], ==, 0);
+            munit_assert_int(header[11], ==, 0);
+            munit_assert_int(raft__flip32(len), ==, entries[i].buf.len);
+        }
+
+        /* Nothing is written past the last header. */
+        if (n < N_MAX) {
+            munit_assert_int(headers[16 * n], ==, 0xff);
+        }
+    }
+
+    return MUNIT_OK;
+}
+
+static MunitTest encode_headers_tests[] = {
+    {"/layout", test_encode_headers_layout, NULL, NULL, 0, NULL},
+    {NULL, NULL, NULL, NULL, 0, NULL},
+};
+
+/**
+ *
+ * raft_batch__decode_headers
+ *
+ */
+
+/* Decoding encoded headers gives back the original term, type and length. */
+static MunitResult test_decode_headers_roundtrip(const MunitParameter params[],
+                                                 void *data)
+{
+    struct raft_entry entries[N_MAX];
+    struct raft_entry decoded[N_MAX];
+    uint8_t headers[N_MAX * 16];
+    int batch;
+    size_t n;
+    size_t i;
+    int rv;
+
+    (void)params;
+    (void)data;
+
+    for (n = 0; n <= N_MAX; n++) {
+        __fill_entries(entries, n);
+        raft_batch__encode_headers(entries, n, headers);
+
+        rv = raft_batch__decode_headers(headers, decoded, n, &batch);
+        munit_assert_int(rv, ==, 0);
+
+        for (i = 0; i < n; i++) {
+            munit_assert_uint64(decoded[i].term, ==, entries[i].term);
+            munit_assert_int(decoded[i].type, ==, entries[i].type);
+            munit_assert_int(decoded[i].buf.len, ==, entries[i].buf.len);
+            munit_assert_ptr_equal(decoded[i].batch, &batch);
+        }
+    }
+
+    return MUNIT_OK;
+}
+
+/* An unknown entry type is detected wherever it appears. */
+static MunitResult test_decode_headers_bad_type(const MunitParameter params[],
+                                                void *data)
+{
+    struct raft_entry entries[N_MAX];
+    struct raft_entry decoded[N_MAX];
+    uint8_t headers[N_MAX * 16];
+    size_t i;
+    int rv;
+
+    (void)params;
+    (void)data;
+
+    __fill_entries(entries, N_MAX);
+
+    for (i = 0; i < N_MAX; i++) {
+        raft_batch__encode_headers(entries, N_MAX, headers);
+        headers[16 * i + 8] = i % 2 == 0 ? 2 : 255;
+
+        rv = raft_batch__decode_headers(headers, decoded, N_MAX, NULL);
+        munit_assert_int(rv, ==, RAFT_ERR_MALFORMED);
+    }
+
+    return MUNIT_OK;
+}
+
+static MunitTest decode_headers_tests[] = {
+    {"/roundtrip", test_decode_headers_roundtrip, NULL, NULL, 0, NULL},
+    {"/bad-type", test_decode_headers_bad_type, NULL, NULL, 0, NULL},
+    {NULL, NULL, NULL, NULL, 0, NULL},
+};
+
+/**
+ *
+ * raft_batch__data_size and raft_batch__point
+ *
+ */
+
+/* The data of each entry starts right after the padded data of the previous
+ * one, and the data size covers all of them. */
+static MunitResult test_point_offsets(const MunitParameter params[], void *data)
+{
+    struct raft_entry entries[N_MAX];
+    uint8_t buf[N_MAX * 104];
+    size_t n;
+    size_t i;
+
+    (void)params;
+    (void)data;
+
+    for (n = 0; n <= N_MAX; n++) {
+        size_t offset = 0;
+
+        __fill_entries(entries, n);
+
+        raft_batch__point(entries, n, buf);
+
+        for (i = 0; i < n; i++) {
+            size_t len = entries[i].buf.len;
+
+            munit_assert_ptr_equal(entries[i].batch, buf);
+            munit_assert_ptr_equal(entries[i].buf.base, buf + offset);
+
+            offset += len + (8 - len % 8) % 8;
+        }
+
+        munit_assert_int(raft_batch__data_size(entries, n), ==, offset);
+    }
+
+    return MUNIT_OK;
+}
+
+static MunitTest point_tests[] = {
+    {"/offsets", test_point_offsets, NULL, NULL, 0, NULL},
+    {NULL, NULL, NULL, NULL, 0, NULL},
+};
+
+/**
+ *
+ * Test suite
+ *
+ */
+
+MunitSuite raft_batch_suites[] = {
+    {"/encode-headers", encode_headers_tests, NULL, 1, 0},
+    {"/decode-headers", decode_headers_tests, NULL, 1, 0},
+    {"/point", point_tests, NULL, 1, 0},
+    {NULL, NULL, NULL, 0, 0},
+};
@@ -1,6 +1,7 @@
 #include "../../include/raft.h"
 
 #include "../../src/configuration.h"
+#include "../../src/io.h"
 #include "../../src/log.h"
 
 #include "../lib/heap.h"
@@ -26,6 +27,36 @@ static int __rand()
     return munit_rand_uint32();
 }
 
+/**
+ * Complete the write of the last configuration entry appended by the leader and
+ * have server 2 acknowledge it, so it gets committed.
+ */
+static void __commit_configuration(struct fixture *f)
+{
+    const struct raft_server *server;
+    struct raft_append_entries_result result;
+    struct test_io_request request;
+    int rv;
+
+    test_io_get_one_request(&f->io, RAFT_IO_WRITE_LOG, &request);
+    test_io_flush(&f->io);
+
+    raft_handle_io(&f->raft, request.id, 0);
+
+    server = raft_configuration__get(&f->raft.configuration, 2);
+
+    result.term = f->raft.current_term;
+    result.success = true;
+    result.last_log_index = f->raft.configuration_index;
+
+    rv = raft_handle_append_entries_response(&f->raft, server, &result);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->raft.commit_index, ==, f->raft.configuration_index);
+
+    test_io_flush(&f->io);
+}
+
 /**
  * Setup and tear down
  */
@@ -117,7 +148,7 @@ static MunitResult test_accept_oom(const MunitParameter params[], void *data)
 
     /* Reset the request queue, to trigger a failure when attempting to grow
      * it. */
-    raft_free(f->raft.io_queue.requests);
+    raft_io__queue_close(&f->raft);
     f->raft.io_queue.requests = NULL;
     f->raft.io_queue.size = 0;
 
@@ -193,11 +224,518 @@ static MunitTest accept_tests[] = {
     {NULL, NULL, NULL, NULL, 0, NULL},
 };
 
+/**
+ *
+ * raft_transfer_leadership
+ *
+ */
+
+/* Once the target's log is up to date it's sent a TimeoutNow request, and no
+ * client request is accepted in the meantime. */
+static MunitResult test_transfer_timeout_now(const MunitParameter params[],
+                                             void *data)
+{
+    struct fixture *f = data;
+    const struct raft_server *server;
+    struct raft_append_entries_result result;
+    struct raft_buffer buf;
+    struct test_io_request request;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+
+    f->io.version = 4;
+
+    rv = raft_transfer_leadership(&f->raft, 2);
+    munit_assert_int(rv, ==, 0);
+
+    /* The target hasn't acknowledged any entry yet, so it's first sent the
+     * missing ones. */
+    test_io_get_one_request(&f->io, RAFT_IO_APPEND_ENTRIES, &request);
+    test_io_flush(&f->io);
+
+    buf.base = NULL;
+    buf.len = 0;
+
+    rv = raft_accept(&f->raft, &buf, 1);
+    munit_assert_int(rv, ==, RAFT_ERR_LEADERSHIP_TRANSFER);
+
+    server = raft_configuration__get(&f->raft.configuration, 2);
+
+    result.term = 2;
+    result.success = true;
+    result.last_log_index = 1;
+
+    rv = raft_handle_append_entries_response(&f->raft, server, &result);
+    munit_assert_int(rv, ==, 0);
+
+    test_io_get_one_request(&f->io, RAFT_IO_TIMEOUT_NOW, &request);
+    munit_assert_int(request.timeout_now.server.id, ==, 2);
+    munit_assert_int(request.timeout_now.args.term, ==, 2);
+    munit_assert_int(request.timeout_now.args.last_log_index, ==, 1);
+    munit_assert_int(request.timeout_now.args.last_log_term, ==, 1);
+
+    test_io_flush(&f->io);
+
+    return MUNIT_OK;
+}
+
+/* TimeoutNow is sent only once per transfer, even if the target keeps
+ * acknowledging heartbeats. */
+static MunitResult test_transfer_timeout_now_once(const MunitParameter params[],
+                                                  void *data)
+{
+    struct fixture *f = data;
+    const struct raft_server *server;
+    struct raft_append_entries_result result;
+    struct test_io_request *requests;
+    size_t n;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+
+    f->io.version = 4;
+
+    server = raft_configuration__get(&f->raft.configuration, 2);
+
+    result.term = 2;
+    result.success = true;
+    result.last_log_index = 1;
+
+    rv = raft_handle_append_entries_response(&f->raft, server, &result);
+    munit_assert_int(rv, ==, 0);
+    test_io_flush(&f->io);
+
+    /* The target is up to date, so it's sent TimeoutNow right away. */
+    rv = raft_transfer_leadership(&f->raft, 2);
+    munit_assert_int(rv, ==, 0);
+
+    test_io_get_requests(&f->io, RAFT_IO_TIMEOUT_NOW, &requests, &n);
+    munit_assert_int(n, ==, 1);
+    free(requests);
+    test_io_flush(&f->io);
+
+    /* A further result doesn't trigger another request. */
+    rv = raft_tick(&f->raft, f->raft.heartbeat_timeout + 1);
+    munit_assert_int(rv, ==, 0);
+    test_io_flush(&f->io);
+
+    rv = raft_handle_append_entries_response(&f->raft, server, &result);
+    munit_assert_int(rv, ==, 0);
+
+    test_io_get_requests(&f->io, RAFT_IO_TIMEOUT_NOW, &requests, &n);
+    munit_assert_int(n, ==, 0);
+    free(requests);
+
+    return MUNIT_OK;
+}
+
+/* If the target doesn't take over within an election timeout, the transfer is
+ * aborted. */
+static MunitResult test_transfer_abort(const MunitParameter params[],
+                                       void *data)
+{
+    struct fixture *f = data;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+
+    f->io.version = 4;
+
+    rv = raft_transfer_leadership(&f->raft, 2);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(f->raft.leader_state.transferee, ==, 2);
+
+    rv = raft_tick(&f->raft, f->raft.election_timeout + 1);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->raft.state, ==, RAFT_STATE_LEADER);
+    munit_assert_int(f->raft.leader_state.transferee, ==, 0);
+
+    test_io_flush(&f->io);
+
+    return MUNIT_OK;
+}
+
+/* Leadership can only be transferred to another voting server, by an I/O
+ * implementation able to send TimeoutNow requests. */
+static MunitResult test_transfer_bad_target(const MunitParameter params[],
+                                            void *data)
+{
+    struct fixture *f = data;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 3, 1, 2);
+    test_become_leader(&f->raft);
+
+    rv = raft_transfer_leadership(&f->raft, 2);
+    munit_assert_int(rv, ==, RAFT_ERR_INTERNAL);
+
+    f->io.version = 4;
+
+    rv = raft_transfer_leadership(&f->raft, 1);
+    munit_assert_int(rv, ==, RAFT_ERR_BAD_SERVER_ID);
+
+    rv = raft_transfer_leadership(&f->raft, 3);
+    munit_assert_int(rv, ==, RAFT_ERR_BAD_SERVER_ID);
+
+    rv = raft_transfer_leadership(&f->raft, 4);
+    munit_assert_int(rv, ==, RAFT_ERR_BAD_SERVER_ID);
+
+    munit_assert_int(f->raft.leader_state.transferee, ==, 0);
+
+    return MUNIT_OK;
+}
+
+/* A leader hands leadership over to a server with a higher priority once it
+ * has caught up, but not right after being elected. */
+static MunitResult test_transfer_priority(const MunitParameter params[],
+                                          void *data)
+{
+    struct fixture *f = data;
+    const struct raft_server *server;
+    struct raft_append_entries_result result;
+    struct test_io_request request;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 2, 1, 2);
+
+    rv = raft_configuration_set_priority(&f->raft.configuration, 2, 1);
+    munit_assert_int(rv, ==, 0);
+
+    test_become_leader(&f->raft);
+
+    f->io.version = 4;
+
+    server = raft_configuration__get(&f->raft.configuration, 2);
+
+    result.term = 2;
+    result.success = true;
+    result.last_log_index = 1;
+
+    rv = raft_handle_append_entries_response(&f->raft, server, &result);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->raft.leader_state.transferee, ==, 0);
+
+    rv = raft_tick(&f->raft, f->raft.election_timeout);
+    munit_assert_int(rv, ==, 0);
+    test_io_flush(&f->io);
+
+    rv = raft_handle_append_entries_response(&f->raft, server, &result);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->raft.leader_state.transferee, ==, 2);
+
+    test_io_get_one_request(&f->io, RAFT_IO_TIMEOUT_NOW, &request);
+    munit_assert_int(request.timeout_now.server.id, ==, 2);
+
+    test_io_flush(&f->io);
+
+    return MUNIT_OK;
+}
+
+static MunitTest transfer_tests[] = {
+    {"/timeout-now", test_transfer_timeout_now, setup, tear_down, 0, NULL},
+    {"/timeout-now-once", test_transfer_timeout_now_once, setup, tear_down, 0,
+     NULL},
+    {"/abort", test_transfer_abort, setup, tear_down, 0, NULL},
+    {"/bad-target", test_transfer_bad_target, setup, tear_down, 0, NULL},
+    {"/priority", test_transfer_priority, setup, tear_down, 0, NULL},
+    {NULL, NULL, NULL, NULL, 0, NULL},
+};
+
+/**
+ *
+ * raft_add_learner
+ *
+ */
+
+/* The configuration entry adding the learner is replicated to it too, and a new
+ * change can't start until it's committed. */
+static MunitResult test_add_learner_replicate(const MunitParameter params[],
+                                              void *data)
+{
+    struct fixture *f = data;
+    struct test_io_request *requests;
+    struct test_io_request request;
+    size_t n;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+
+    rv = raft_add_learner(&f->raft, 3, "3");
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->raft.configuration.n, ==, 3);
+    munit_assert_int(f->raft.configuration.servers[2].id, ==, 3);
+    munit_assert_false(f->raft.configuration.servers[2].voting);
+    munit_assert_int(f->raft.configuration_index, ==, 2);
+
+    test_io_get_one_request(&f->io, RAFT_IO_WRITE_LOG, &request);
+    munit_assert_int(request.write_log.n, ==, 1);
+    munit_assert_int(request.write_log.entries[0].type, ==,
+                     RAFT_LOG_CONFIGURATION);
+
+    test_io_get_requests(&f->io, RAFT_IO_APPEND_ENTRIES, &requests, &n);
+    munit_assert_int(n, ==, 2);
+    munit_assert_int(requests[1].append_entries.server.id, ==, 3);
+    free(requests);
+
+    rv = raft_add_learner(&f->raft, 4, "4");
+    munit_assert_int(rv, ==, RAFT_ERR_CONFIGURATION_BUSY);
+
+    __commit_configuration(f);
+
+    rv = raft_add_learner(&f->raft, 4, "4");
+    munit_assert_int(rv, ==, 0);
+
+    test_io_flush(&f->io);
+
+    return MUNIT_OK;
+}
+
+/* A server that is already part of the configuration can't be added again. */
+static MunitResult test_add_learner_dup_id(const MunitParameter params[],
+                                           void *data)
+{
+    struct fixture *f = data;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+
+    rv = raft_add_learner(&f->raft, 2, "2");
+    munit_assert_int(rv, ==, RAFT_ERR_DUP_SERVER_ID);
+
+    munit_assert_int(f->raft.configuration.n, ==, 2);
+    munit_assert_int(f->raft.configuration_index, ==, 0);
+
+    return MUNIT_OK;
+}
+
+static MunitTest add_learner_tests[] = {
+    {"/replicate", test_add_learner_replicate, setup, tear_down, 0, NULL},
+    {"/dup-id", test_add_learner_dup_id, setup, tear_down, 0, NULL},
+    {NULL, NULL, NULL, NULL, 0, NULL},
+};
+
+/**
+ *
+ * raft_promote
+ *
+ */
+
+/* A learner is promoted once a catch-up round lasts less than an election
+ * timeout. */
+static MunitResult test_promote_catch_up(const MunitParameter params[],
+                                         void *data)
+{
+    struct fixture *f = data;
+    const struct raft_server *server;
+    struct raft_append_entries_result result;
+    struct test_io_request request;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+
+    rv = raft_add_learner(&f->raft, 3, "3");
+    munit_assert_int(rv, ==, 0);
+
+    __commit_configuration(f);
+
+    rv = raft_promote(&f->raft, 3);
+    munit_assert_int(rv, ==, 0);
+
+    /* The learner is sent the missing entries. */
+    test_io_get_one_request(&f->io, RAFT_IO_APPEND_ENTRIES, &request);
+    munit_assert_int(request.append_entries.server.id, ==, 3);
+    test_io_flush(&f->io);
+
+    rv = raft_promote(&f->raft, 3);
+    munit_assert_int(rv, ==, RAFT_ERR_CONFIGURATION_BUSY);
+
+    server = raft_configuration__get(&f->raft.configuration, 3);
+
+    result.term = 2;
+    result.success = true;
+    result.last_log_index = 1;
+
+    rv = raft_tick(&f->raft, f->raft.election_timeout / 2 + 100);
+    munit_assert_int(rv, ==, 0);
+    test_io_flush(&f->io);
+
+    rv = raft_handle_append_entries_response(&f->raft, server, &result);
+    munit_assert_int(rv, ==, 0);
+
+    rv = raft_tick(&f->raft, f->raft.election_timeout / 2 + 100);
+    munit_assert_int(rv, ==, 0);
+    test_io_flush(&f->io);
+
+    /* The first round took too long, so a second one starts. */
+    result.last_log_index = 2;
+
+    rv = raft_handle_append_entries_response(&f->raft, server, &result);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->raft.leader_state.promotee, ==, 3);
+    munit_assert_int(f->raft.leader_state.round_number, ==, 2);
+    munit_assert_false(f->raft.configuration.servers[2].voting);
+
+    /* No new entries were appended meanwhile, so the learner completes the
+     * second round with its next reply. */
+    rv = raft_handle_append_entries_response(&f->raft, server, &result);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->raft.leader_state.promotee, ==, 0);
+    munit_assert_true(f->raft.configuration.servers[2].voting);
+    munit_assert_int(f->raft.configuration_index, ==, 3);
+
+    test_io_get_one_request(&f->io, RAFT_IO_WRITE_LOG, &request);
+    munit_assert_int(request.write_log.entries[0].type, ==,
+                     RAFT_LOG_CONFIGURATION);
+
+    test_io_flush(&f->io);
+
+    return MUNIT_OK;
+}
+
+/* The promotion is aborted if the learner doesn't reply for an election
+ * timeout. */
+static MunitResult test_promote_unreachable(const MunitParameter params[],
+                                            void *data)
+{
+    struct fixture *f = data;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+
+    rv = raft_add_learner(&f->raft, 3, "3");
+    munit_assert_int(rv, ==, 0);
+
+    __commit_configuration(f);
+
+    rv = raft_promote(&f->raft, 3);
+    munit_assert_int(rv, ==, 0);
+    test_io_flush(&f->io);
+
+    rv = raft_tick(&f->raft, f->raft.election_timeout + 100);
+    munit_assert_int(rv, ==, 0);
+    test_io_flush(&f->io);
+
+    munit_assert_int(f->raft.leader_state.promotee, ==, 0);
+    munit_assert_false(f->raft.configuration.servers[2].voting);
+
+    return MUNIT_OK;
+}
+
+/* Only learners can be promoted. */
+static MunitResult test_promote_bad_id(const MunitParameter params[],
+                                       void *data)
+{
+    struct fixture *f = data;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+
+    rv = raft_promote(&f->raft, 2);
+    munit_assert_int(rv, ==, RAFT_ERR_BAD_SERVER_ID);
+
+    rv = raft_promote(&f->raft, 3);
+    munit_assert_int(rv, ==, RAFT_ERR_BAD_SERVER_ID);
+
+    return MUNIT_OK;
+}
+
+static MunitTest promote_tests[] = {
+    {"/catch-up", test_promote_catch_up, setup, tear_down, 0, NULL},
+    {"/unreachable", test_promote_unreachable, setup, tear_down, 0, NULL},
+    {"/bad-id", test_promote_bad_id, setup, tear_down, 0, NULL},
+    {NULL, NULL, NULL, NULL, 0, NULL},
+};
+
+/**
+ *
+ * raft_remove
+ *
+ */
+
+/* The removed server stops counting towards majorities right away, while the
+ * progress of the other servers is preserved. */
+static MunitResult test_remove_server(const MunitParameter params[],
+                                      void *data)
+{
+    struct fixture *f = data;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 3, 1, 3);
+    test_become_leader(&f->raft);
+
+    f->raft.leader_state.match_index[2] = 1;
+
+    rv = raft_remove(&f->raft, 1);
+    munit_assert_int(rv, ==, RAFT_ERR_BAD_SERVER_ID);
+
+    rv = raft_remove(&f->raft, 4);
+    munit_assert_int(rv, ==, RAFT_ERR_BAD_SERVER_ID);
+
+    rv = raft_remove(&f->raft, 2);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->raft.configuration.n, ==, 2);
+    munit_assert_int(f->raft.configuration.servers[1].id, ==, 3);
+    munit_assert_int(f->raft.leader_state.match_index[1], ==, 1);
+
+    munit_assert_int(f->raft.configuration_prev.n, ==, 3);
+
+    test_io_flush(&f->io);
+
+    return MUNIT_OK;
+}
+
+static MunitTest remove_tests[] = {
+    {"/server", test_remove_server, setup, tear_down, 0, NULL},
+    {NULL, NULL, NULL, NULL, 0, NULL},
+};
+
 /**
  * Test suite
  */
 
 MunitSuite raft_client_suites[] = {
     {"/accept", accept_tests, NULL, 1, 0},
+    {"/transfer", transfer_tests, NULL, 1, 0},
+    {"/add-learner", add_learner_tests, NULL, 1, 0},
+    {"/promote", promote_tests, NULL, 1, 0},
+    {"/remove", remove_tests, NULL, 1, 0},
     {NULL, NULL, NULL, 0, 0},
 };
@@ -240,8 +240,57 @@ static MunitResult test_index_no_match(const MunitParameter params[], void *data
     return MUNIT_OK;
 }
 
+/* Servers are found in large configurations with sparse IDs, also after some
+ * of them are removed or promoted. */
+static MunitResult test_index_many(const MunitParameter params[], void *data)
+{
+    struct fixture *f = data;
+    unsigned id;
+    size_t i;
+    int rv;
+
+    (void)params;
+
+    for (i = 0; i < 100; i++) {
+        id = i * 1000 + 1;
+        rv = raft_configuration_add(&f->configuration, id, "1", i % 2 == 0);
+        munit_assert_int(rv, ==, 0);
+    }
+
+    munit_assert_int(raft_configuration__n_voting(&f->configuration), ==, 50);
+
+    rv = raft_configuration__remove(&f->configuration, 1);
+    munit_assert_int(rv, ==, 0);
+
+    rv = raft_configuration__set_voting(&f->configuration, 1001, true);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(raft_configuration__n_voting(&f->configuration), ==, 50);
+
+    for (i = 1; i < 100; i++) {
+        id = i * 1000 + 1;
+
+        munit_assert_int(raft_configuration__index(&f->configuration, id), ==,
+                         i - 1);
+
+        /* The promoted server now comes first among the voting ones. */
+        if (i == 1 || i % 2 == 0) {
+            size_t voting_index = i == 1 ? 0 : i / 2;
+            munit_assert_int(
+                raft_configuration__voting_index(&f->configuration, id), ==,
+                voting_index);
+        }
+    }
+
+    i = raft_configuration__index(&f->configuration, 1);
+    munit_assert_int(i, ==, f->configuration.n);
+
+    return MUNIT_OK;
+}
+
 static MunitTest index_tests[] = {
     {"/no-match", test_index_no_match, setup, tear_down, 0, NULL},
+    {"/many", test_index_many, setup, tear_down, 0, NULL},
     {NULL, NULL, NULL, NULL, 0, NULL},
 };
 
@@ -0,0 +1,95 @@
+#include <string.h>
+
+#include "../../src/crc32c.h"
+
+#include "../lib/munit.h"
+
+/**
+ *
+ * raft_crc32c
+ *
+ */
+
+/* The checksum of the standard check string matches the reference value. */
+static MunitResult test_crc32c_check(const MunitParameter params[], void *data)
+{
+    (void)params;
+    (void)data;
+
+    munit_assert_int(raft_crc32c(0, "123456789", 9), ==, 0xe3069283);
+
+    return MUNIT_OK;
+}
+
+/* The checksum of no data is zero. */
+static MunitResult test_crc32c_empty(const MunitParameter params[], void *data)
+{
+    (void)params;
+    (void)data;
+
+    munit_assert_int(raft_crc32c(0, NULL, 0), ==, 0);
+
+    return MUNIT_OK;
+}
+
+/* Checksumming data in pieces of any size and alignment gives the same result
+ * as checksumming it in one go. */
+static MunitResult test_crc32c_pieces(const MunitParameter params[],
+                                      void *data)
+{
+    uint8_t buf[301];
+    uint32_t crc;
+    size_t i;
+
+    (void)params;
+    (void)data;
+
+    munit_rand_memory(sizeof buf, buf);
+
+    crc = raft_crc32c(0, buf, sizeof buf);
+
+    for (i = 1; i < sizeof buf; i += 13) {
+        uint32_t piecewise = raft_crc32c(0, buf, i);
+        piecewise = raft_crc32c(piecewise, buf + i, sizeof buf - i);
+        munit_assert_int(piecewise, ==, crc);
+    }
+
+    return MUNIT_OK;
+}
+
+/* A single flipped bit changes the checksum. */
+static MunitResult test_crc32c_flip(const MunitParameter params[], void *data)
+{
+    uint8_t buf[64];
+    uint32_t crc;
+
+    (void)params;
+    (void)data;
+
+    memset(buf, 0, sizeof buf);
+    crc = raft_crc32c(0, buf, sizeof buf);
+
+    buf[37] ^= 0x10;
+    munit_assert_int(raft_crc32c(0, buf, sizeof buf), !=, crc);
+
+    return MUNIT_OK;
+}
+
+static MunitTest crc32c_tests[] = {
+    {"/check", test_crc32c_check, NULL, NULL, 0, NULL},
+    {"/empty", test_crc32c_empty, NULL, NULL, 0, NULL},
+    {"/pieces", test_crc32c_pieces, NULL, NULL, 0, NULL},
+    {"/flip", test_crc32c_flip, NULL, NULL, 0, NULL},
+    {NULL, NULL, NULL, NULL, 0, NULL},
+};
+
+/**
+ *
+ * Test suite
+ *
+ */
+
+MunitSuite raft_crc32c_suites[] = {
+    {"", crc32c_tests, NULL, 1, 0},
+    {NULL, NULL, NULL, 0, 0},
+};
@@ -0,0 +1,659 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "../../include/raft.h"
+
+#include "../../src/binary.h"
+#include "../../src/encoding.h"
+
+#include "../lib/heap.h"
+#include "../lib/munit.h"
+
+/**
+ * Helpers
+ */
+
+/* Maximum message size passed to the decoder by default. */
+#define MAX_SIZE (1024 * 1024)
+
+struct fixture
+{
+    struct raft_heap heap;
+    struct raft_decoder decoder;
+    uint8_t *stream; /* Encoded messages to feed the decoder */
+    size_t len;      /* Length of the stream */
+    size_t offset;   /* Bytes of the stream fed so far */
+};
+
+/**
+ * Append the given bytes to the stream.
+ */
+static void __append(struct fixture *f, const void *buf, size_t len)
+{
+    f->stream = realloc(f->stream, f->len + len);
+    munit_assert_ptr_not_null(f->stream);
+
+    memcpy(f->stream + f->len, buf, len);
+    f->len += len;
+}
+
+/**
+ * Append to the stream a RequestVote RPC.
+ */
+static void __append_request_vote(struct fixture *f)
+{
+    struct raft_request_vote_args args;
+    struct raft_buffer buf;
+    int rv;
+
+    args.term = 3;
+    args.candidate_id = 2;
+    args.last_log_index = 123;
+    args.last_log_term = 2;
+    args.pre_vote = false;
+    args.disrupt_leader = false;
+
+    rv = raft_encode_request_vote(&args, &buf);
+    munit_assert_int(rv, ==, 0);
+
+    __append(f, buf.base, buf.len);
+    raft_free(buf.base);
+}
+
+/**
+ * Append to the stream an AppendEntries RPC with two entries encoded with the
+ * given protocol version, followed by the data of the entries.
+ */
+static void __append_append_entries_v(struct fixture *f, unsigned version)
+{
+    struct raft_message message;
+    struct raft_append_entries_args *args = &message.append_entries;
+    struct raft_entry entries[2];
+    struct raft_buffer buf;
+    int rv;
+
+    entries[0].type = RAFT_LOG_COMMAND;
+    entries[0].term = 2;
+    entries[0].buf.base = "hello";
+    entries[0].buf.len = 5;
+
+    entries[1].type = RAFT_LOG_COMMAND;
+    entries[1].term = 3;
+    entries[1].buf.base = "raft log";
+    entries[1].buf.len = 8;
+
+    message.type = RAFT_IO_APPEND_ENTRIES;
+    message.version = version;
+
+    args->term = 3;
+    args->leader_id = 1;
+    args->prev_log_index = 7;
+    args->prev_log_term = 2;
+    args->leader_commit = 5;
+    args->entries = entries;
+    args->n = 2;
+    args->batch = NULL;
+
+    rv = raft_encode_message(&message, &buf);
+    munit_assert_int(rv, ==, 0);
+
+    __append(f, buf.base, buf.len);
+    raft_free(buf.base);
+
+    rv = raft_encode_entries_batch(entries, 2, 0, &buf);
+    munit_assert_int(rv, ==, 0);
+
+    __append(f, buf.base, buf.len);
+    raft_free(buf.base);
+}
+
+static void __append_append_entries(struct fixture *f)
+{
+    __append_append_entries_v(f, RAFT_ENCODING_V1);
+}
+
+/**
+ * Feed the decoder with the rest of the stream, @chunk bytes at a time, until a
+ * message is complete or an error occurs.
+ */
+static int __feed(struct fixture *f, size_t chunk, struct raft_message *message)
+{
+    message->type = RAFT_IO_NULL;
+
+    while (f->offset < f->len) {
+        size_t len = f->len - f->offset;
+        size_t n;
+        int rv;
+
+        if (len > chunk) {
+            len = chunk;
+        }
+
+        rv = raft_decoder_feed(&f->decoder, f->stream + f->offset, len, &n,
+                               message);
+        if (rv != 0) {
+            return rv;
+        }
+
+        munit_assert_int(n, <=, len);
+        f->offset += n;
+
+        if (message->type != RAFT_IO_NULL) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Check that the given message is the AppendEntries appended by
+ * __append_append_entries, and release its entries.
+ */
+static void __assert_append_entries(struct raft_message *message)
+{
+    struct raft_append_entries_args *args = &message->append_entries;
+
+    munit_assert_int(message->type, ==, RAFT_IO_APPEND_ENTRIES);
+
+    munit_assert_int(args->term, ==, 3);
+    munit_assert_int(args->leader_id, ==, 1);
+    munit_assert_int(args->prev_log_index, ==, 7);
+    munit_assert_int(args->prev_log_term, ==, 2);
+    munit_assert_int(args->leader_commit, ==, 5);
+    munit_assert_int(args->n, ==, 2);
+
+    munit_assert_int(args->entries[0].term, ==, 2);
+    munit_assert_int(args->entries[0].buf.len, ==, 5);
+    munit_assert_int(memcmp(args->entries[0].buf.base, "hello", 5), ==, 0);
+
+    munit_assert_int(args->entries[1].term, ==, 3);
+    munit_assert_int(args->entries[1].buf.len, ==, 8);
+    munit_assert_int(memcmp(args->entries[1].buf.base, "raft log", 8), ==, 0);
+
+    /* All entries data lives in a single buffer, which starts with the entries
+     * array itself unless the aligned layout is used. */
+    munit_assert_ptr_not_null(args->entries[0].batch);
+    munit_assert_ptr_equal(args->entries[0].batch, args->entries[1].batch);
+
+    if (args->entries[0].batch == args->entries) {
+        munit_assert_ptr_equal(args->entries[0].buf.base, args->entries + 2);
+    } else {
+        munit_assert_ptr_equal(args->entries[0].buf.base,
+                               args->entries[0].batch);
+        raft_free(args->entries[0].batch);
+    }
+
+    raft_free(args->entries);
+}
+
+/**
+ * Setup and tear down
+ */
+
+static void *setup(const MunitParameter params[], void *user_data)
+{
+    struct fixture *f = munit_malloc(sizeof *f);
+
+    (void)user_data;
+
+    test_heap_setup(params, &f->heap);
+
+    raft_decoder_init(&f->decoder, 0, MAX_SIZE);
+
+    f->stream = NULL;
+    f->len = 0;
+    f->offset = 0;
+
+    return f;
+}
+
+static void tear_down(void *data)
+{
+    struct fixture *f = data;
+
+    raft_decoder_close(&f->decoder);
+
+    free(f->stream);
+
+    test_heap_tear_down(&f->heap);
+
+    free(f);
+}
+
+/**
+ * raft_decoder_feed
+ */
+
+/* Decode a RequestVote RPC fed one byte at a time. */
+static MunitResult test_feed_bytewise(const MunitParameter params[], void *data)
+{
+    struct fixture *f = data;
+    struct raft_message message;
+    int rv;
+
+    (void)params;
+
+    __append_request_vote(f);
+
+    rv = __feed(f, 1, &message);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->offset, ==, f->len);
+    munit_assert_int(message.type, ==, RAFT_IO_REQUEST_VOTE);
+    munit_assert_int(message.request_vote.term, ==, 3);
+    munit_assert_int(message.request_vote.candidate_id, ==, 2);
+    munit_assert_int(message.request_vote.last_log_index, ==, 123);
+    munit_assert_int(message.request_vote.last_log_term, ==, 2);
+
+    return MUNIT_OK;
+}
+
+/* Decode an AppendEntries RPC along with its entries data, fed in chunks that
+ * cross the boundaries of the message sections. */
+static MunitResult test_feed_append_entries(const MunitParameter params[],
+                                            void *data)
+{
+    struct fixture *f = data;
+    struct raft_message message;
+    int rv;
+
+    (void)params;
+
+    __append_append_entries(f);
+
+    rv = __feed(f, 7, &message);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->offset, ==, f->len);
+    __assert_append_entries(&message);
+
+    return MUNIT_OK;
+}
+
+/* Messages encoded with version 2 of the protocol are decoded as well. */
+static MunitResult test_feed_v2(const MunitParameter params[], void *data)
+{
+    struct fixture *f = data;
+    struct raft_message message;
+    int rv;
+
+    (void)params;
+
+    __append_append_entries_v(f, RAFT_ENCODING_V2);
+    __append_append_entries(f);
+
+    rv = __feed(f, 5, &message);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(message.version, ==, RAFT_ENCODING_V2);
+    __assert_append_entries(&message);
+
+    rv = __feed(f, 5, &message);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(message.version, ==, RAFT_ENCODING_V1);
+    __assert_append_entries(&message);
+
+    return MUNIT_OK;
+}
+
+/* A single chunk holding several messages is consumed one message at a time. */
+static MunitResult test_feed_many(const MunitParameter params[], void *data)
+{
+    struct fixture *f = data;
+    struct raft_message message;
+    int rv;
+
+    (void)params;
+
+    __append_append_entries(f);
+    __append_request_vote(f);
+    __append_append_entries(f);
+
+    rv = __feed(f, f->len, &message);
+    munit_assert_int(rv, ==, 0);
+    __assert_append_entries(&message);
+
+    rv = __feed(f, f->len, &message);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(message.type, ==, RAFT_IO_REQUEST_VOTE);
+
+    rv = __feed(f, f->len, &message);
+    munit_assert_int(rv, ==, 0);
+    __assert_append_entries(&message);
+
+    munit_assert_int(f->offset, ==, f->len);
+
+    return MUNIT_OK;
+}
+
+/* With RAFT_BATCH_ALIGNED the entries data is received into an aligned
+ * buffer. */
+static MunitResult test_feed_aligned(const MunitParameter params[], void *data)
+{
+    struct fixture *f = data;
+    struct raft_message message;
+    uintptr_t batch;
+    int rv;
+
+    (void)params;
+
+    raft_decoder_close(&f->decoder);
+    raft_decoder_init(&f->decoder, RAFT_BATCH_ALIGNED, MAX_SIZE);
+
+    __append_append_entries(f);
+
+    rv = __feed(f, 64, &message);
+    munit_assert_int(rv, ==, 0);
+
+    batch = (uintptr_t)message.append_entries.entries[0].batch;
+    munit_assert_int(batch % RAFT_BATCH_ALIGNMENT, ==, 0);
+
+    __assert_append_entries(&message);
+
+    return MUNIT_OK;
+}
+
+/* Once the decoder has warmed up, receiving an AppendEntries RPC costs a single
+ * allocation, holding both the entries array and the entries data. */
+static MunitResult test_feed_single_alloc(const MunitParameter params[],
+                                          void *data)
+{
+    struct fixture *f = data;
+    struct raft_message message;
+    int rv;
+
+    (void)params;
+
+    __append_append_entries(f);
+    __append_append_entries(f);
+
+    rv = __feed(f, 64, &message);
+    munit_assert_int(rv, ==, 0);
+    __assert_append_entries(&message);
+
+    test_heap_fault_config(&f->heap, 1, 1);
+    test_heap_fault_enable(&f->heap);
+
+    rv = __feed(f, 64, &message);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(f->offset, ==, f->len);
+
+    munit_assert_ptr_equal(message.append_entries.entries[0].batch,
+                           message.append_entries.entries);
+    __assert_append_entries(&message);
+
+    return MUNIT_OK;
+}
+
+static char *feed_compressed_aligned[] = {"0", "1", NULL};
+
+static MunitParameterEnum feed_compressed_params[] = {
+    {"aligned", feed_compressed_aligned},
+    {NULL, NULL},
+};
+
+/* The data of a batch sent compressed is decompressed once received, using the
+ * requested layout. */
+static MunitResult test_feed_compressed(const MunitParameter params[],
+                                        void *data)
+{
+    struct fixture *f = data;
+    const char *aligned = munit_parameters_get(params, "aligned");
+    struct raft_append_entries_batch *batch;
+    struct raft_message message;
+    struct raft_append_entries_args *args = &message.append_entries;
+    struct raft_entry entries[2];
+    struct iovec iov[3];
+    char text[2][200];
+    void *header;
+    unsigned n_iov;
+    unsigned i;
+    int rv;
+
+    raft_decoder_close(&f->decoder);
+    raft_decoder_init(&f->decoder,
+                      strcmp(aligned, "1") == 0 ? RAFT_BATCH_ALIGNED : 0,
+                      MAX_SIZE);
+
+    for (i = 0; i < 2; i++) {
+        memset(text[i], 'a' + i, sizeof text[i]);
+        entries[i].type = RAFT_LOG_COMMAND;
+        entries[i].term = 2;
+        entries[i].buf.base = text[i];
+        entries[i].buf.len = sizeof text[i] - i;
+    }
+
+    rv = raft_encode__append_entries_batch(1, entries, 2, true, &batch);
+    munit_assert_int(rv, ==, 0);
+
+    args->term = 3;
+    args->leader_id = 1;
+    args->prev_log_index = 0;
+    args->prev_log_term = 0;
+    args->leader_commit = 0;
+    args->entries = entries;
+    args->n = 2;
+    args->batch = batch;
+
+    n_iov = raft_encode_append_entries_iov_count(args);
+    munit_assert_int(n_iov, ==, 3);
+
+    header = munit_malloc(raft_encode_append_entries_size(args));
+    raft_encode_append_entries_iov(args, header, iov);
+
+    for (i = 0; i < n_iov; i++) {
+        __append(f, iov[i].iov_base, iov[i].iov_len);
+    }
+
+    free(header);
+    raft_free(batch);
+
+    rv = __feed(f, 16, &message);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->offset, ==, f->len);
+    munit_assert_int(message.type, ==, RAFT_IO_APPEND_ENTRIES);
+    munit_assert_int(args->n, ==, 2);
+    munit_assert_int(args->compressed, ==, 0);
+
+    for (i = 0; i < 2; i++) {
+        munit_assert_int(args->entries[i].buf.len, ==, sizeof text[i] - i);
+        munit_assert_memory_equal(args->entries[i].buf.len,
+                                  args->entries[i].buf.base, text[i]);
+    }
+
+    if (strcmp(aligned, "1") == 0) {
+        munit_assert_int(
+            (uintptr_t)args->entries[0].batch % RAFT_BATCH_ALIGNMENT, ==, 0);
+        raft_free(args->entries[0].batch);
+    } else {
+        munit_assert_ptr_equal(args->entries[0].batch, args->entries);
+    }
+
+    raft_free(args->entries);
+
+    return MUNIT_OK;
+}
+
+/* A message with an unknown protocol version is rejected. */
+static MunitResult test_feed_bad_version(const MunitParameter params[],
+                                         void *data)
+{
+    struct fixture *f = data;
+    struct raft_message message;
+    int rv;
+
+    (void)params;
+
+    __append_request_vote(f);
+    f->stream[0] = 127;
+
+    rv = __feed(f, f->len, &message);
+    munit_assert_int(rv, ==, RAFT_ERR_MALFORMED);
+
+    return MUNIT_OK;
+}
+
+/* A message of unknown type is rejected. */
+static MunitResult test_feed_bad_type(const MunitParameter params[], void *data)
+{
+    struct fixture *f = data;
+    struct raft_message message;
+    int rv;
+
+    (void)params;
+
+    __append_request_vote(f);
+    *(uint32_t *)(f->stream + 4) = raft__flip32(RAFT_IO_WRITE_LOG);
+
+    rv = __feed(f, f->len, &message);
+    munit_assert_int(rv, ==, RAFT_ERR_MALFORMED);
+
+    return MUNIT_OK;
+}
+
+/* A message whose size exceeds the maximum is rejected without allocating its
+ * body. */
+static MunitResult test_feed_too_large(const MunitParameter params[],
+                                       void *data)
+{
+    struct fixture *f = data;
+    struct raft_message message;
+    uint64_t size;
+    int rv;
+
+    (void)params;
+
+    __append_request_vote(f);
+
+    size = raft__flip64(MAX_SIZE + 1);
+    memcpy(f->stream + 8, &size, sizeof size);
+
+    test_heap_fault_config(&f->heap, 0, 1);
+    test_heap_fault_enable(&f->heap);
+
+    rv = __feed(f, f->len, &message);
+    munit_assert_int(rv, ==, RAFT_ERR_MALFORMED);
+
+    return MUNIT_OK;
+}
+
+/* The entries data of an AppendEntries RPC counts towards the maximum size. */
+static MunitResult test_feed_too_large_data(const MunitParameter params[],
+                                            void *data)
+{
+    struct fixture *f = data;
+    struct raft_message message;
+    uint64_t size;
+    int rv;
+
+    (void)params;
+
+    __append_append_entries(f);
+
+    /* The body fits, but not the 16 bytes of entries data following it. */
+    memcpy(&size, f->stream + 8, sizeof size);
+    size = raft__flip64(size);
+
+    raft_decoder_close(&f->decoder);
+    raft_decoder_init(&f->decoder, 0, size + 15);
+
+    rv = __feed(f, 16, &message);
+    munit_assert_int(rv, ==, RAFT_ERR_MALFORMED);
+
+    return MUNIT_OK;
+}
+
+/* Corrupted entries data is detected once it has been received entirely. */
+static MunitResult test_feed_corrupt_data(const MunitParameter params[],
+                                          void *data)
+{
+    struct fixture *f = data;
+    struct raft_message message;
+    int rv;
+
+    (void)params;
+
+    __append_append_entries(f);
+    f->stream[f->len - 1] ^= 0x01;
+
+    rv = __feed(f, 16, &message);
+    munit_assert_int(rv, ==, RAFT_ERR_CHECKSUM);
+
+    return MUNIT_OK;
+}
+
+/* Closing the decoder in the middle of a message releases its memory. */
+static MunitResult test_feed_partial(const MunitParameter params[], void *data)
+{
+    struct fixture *f = data;
+    struct raft_message message;
+    int rv;
+
+    (void)params;
+
+    __append_append_entries(f);
+    f->len -= 3;
+
+    rv = __feed(f, 32, &message);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(message.type, ==, RAFT_IO_NULL);
+
+    return MUNIT_OK;
+}
+
+static char *feed_oom_heap_fault_delay[] = {"0", "1", "2", NULL};
+static char *feed_oom_heap_fault_repeat[] = {"1", NULL};
+
+static MunitParameterEnum feed_oom_params[] = {
+    {TEST_HEAP_FAULT_DELAY, feed_oom_heap_fault_delay},
+    {TEST_HEAP_FAULT_REPEAT, feed_oom_heap_fault_repeat},
+    {NULL, NULL},
+};
+
+/* Out of memory conditions while decoding an AppendEntries RPC. */
+static MunitResult test_feed_oom(const MunitParameter params[], void *data)
+{
+    struct fixture *f = data;
+    struct raft_message message;
+    int rv;
+
+    (void)params;
+
+    __append_append_entries(f);
+
+    test_heap_fault_enable(&f->heap);
+
+    rv = __feed(f, f->len, &message);
+    munit_assert_int(rv, ==, RAFT_ERR_NOMEM);
+
+    return MUNIT_OK;
+}
+
+static MunitTest feed_tests[] = {
+    {"/bytewise", test_feed_bytewise, setup, tear_down, 0, NULL},
+    {"/append-entries", test_feed_append_entries, setup, tear_down, 0, NULL},
+    {"/v2", test_feed_v2, setup, tear_down, 0, NULL},
+    {"/many", test_feed_many, setup, tear_down, 0, NULL},
+    {"/aligned", test_feed_aligned, setup, tear_down, 0, NULL},
+    {"/single-alloc", test_feed_single_alloc, setup, tear_down, 0, NULL},
+    {"/compressed", test_feed_compressed, setup, tear_down, 0,
+     feed_compressed_params},
+    {"/bad-version", test_feed_bad_version, setup, tear_down, 0, NULL},
+    {"/bad-type", test_feed_bad_type, setup, tear_down, 0, NULL},
+    {"/too-large", test_feed_too_large, setup, tear_down, 0, NULL},
+    {"/too-large-data", test_feed_too_large_data, setup, tear_down, 0, NULL},
+    {"/corrupt-data", test_feed_corrupt_data, setup, tear_down, 0, NULL},
+    {"/partial", test_feed_partial, setup, tear_down, 0, NULL},
+    {"/oom", test_feed_oom, setup, tear_down, 0, feed_oom_params},
+    {NULL, NULL, NULL, NULL, 0, NULL},
+};
+
+/**
+ * Test suite
+ */
+
+MunitSuite raft_decoder_suites[] = {
+    {"/feed", feed_tests, NULL, 1, 0},
+    {NULL, NULL, NULL, 0, 0},
+};
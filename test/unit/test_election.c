@@ -1,5 +1,6 @@
 #include "../../include/raft.h"
 
+#include "../../src/configuration.h"
 #include "../../src/election.h"
 
 #include "../lib/heap.h"
@@ -74,6 +75,8 @@ static MunitResult test_maybe_grant_vote_newer_term(
     args.candidate_id = 2;
     args.last_log_index = 1;
     args.last_log_term = 1;
+    args.pre_vote = false;
+    args.disrupt_leader = false;
 
     rv = raft_election__maybe_grant_vote(&f->raft, &args, &granted);
     munit_assert_int(rv, ==, 0);
@@ -88,10 +91,279 @@ static MunitTest maybe_grant_vote_tests[] = {
     {NULL, NULL, NULL, NULL, 0, NULL},
 };
 
+/**
+ * raft_election__start
+ */
+
+/* The new term and the vote for ourselves are persisted with a single write. */
+static MunitResult test_start_single_write(const MunitParameter params[],
+                                           void *data)
+{
+    struct fixture *f = data;
+    unsigned n;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 2, 1, 2);
+
+    n = test_io_get_n_metadata_writes(&f->io);
+
+    rv = raft_tick(&f->raft, f->raft.election_timeout_rand + 100);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->raft.state, ==, RAFT_STATE_CANDIDATE);
+
+    munit_assert_int(test_io_get_n_metadata_writes(&f->io), ==, n + 1);
+    munit_assert_int(test_io_get_term(&f->io), ==, 2);
+    munit_assert_int(test_io_get_vote(&f->io), ==, 1);
+
+    return MUNIT_OK;
+}
+
+/* With I/O implementations of version 1, the term and the vote are persisted
+ * with two separate writes. */
+static MunitResult test_start_version_1(const MunitParameter params[],
+                                        void *data)
+{
+    struct fixture *f = data;
+    unsigned n;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 2, 1, 2);
+
+    f->io.version = 1;
+    n = test_io_get_n_metadata_writes(&f->io);
+
+    rv = raft_tick(&f->raft, f->raft.election_timeout_rand + 100);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(test_io_get_n_metadata_writes(&f->io), ==, n + 2);
+    munit_assert_int(test_io_get_term(&f->io), ==, 2);
+    munit_assert_int(test_io_get_vote(&f->io), ==, 1);
+
+    return MUNIT_OK;
+}
+
+/* With I/O implementations of version 3, RequestVote requests are sent while
+ * the new term and vote are being persisted, but our own vote is counted only
+ * once the write has completed. */
+static MunitResult test_start_async(const MunitParameter params[], void *data)
+{
+    struct fixture *f = data;
+    const struct raft_server *server;
+    struct raft_request_vote_result result;
+    struct test_io_request request;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 2, 1, 2);
+
+    f->io.version = 3;
+
+    rv = raft_tick(&f->raft, f->raft.election_timeout_rand + 100);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->raft.state, ==, RAFT_STATE_CANDIDATE);
+
+    test_io_get_one_request(&f->io, RAFT_IO_REQUEST_VOTE, &request);
+    munit_assert_int(request.request_vote.args.term, ==, 2);
+
+    test_io_get_one_request(&f->io, RAFT_IO_WRITE_METADATA, &request);
+    munit_assert_int(request.write_metadata.term, ==, 2);
+    munit_assert_int(request.write_metadata.voted_for, ==, 1);
+
+    test_io_flush(&f->io);
+
+    server = raft_configuration__get(&f->raft.configuration, 2);
+
+    result.term = 2;
+    result.vote_granted = true;
+    result.pre_vote = false;
+
+    rv = raft_handle_request_vote_response(&f->raft, server, &result);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->raft.state, ==, RAFT_STATE_CANDIDATE);
+
+    raft_handle_io(&f->raft, request.id, 0);
+
+    munit_assert_int(f->raft.state, ==, RAFT_STATE_LEADER);
+
+    return MUNIT_OK;
+}
+
+/* With Pre-Vote enabled, the election starts with a non-binding round in the
+ * next term, and the term is incremented only once a majority would grant us
+ * their vote. */
+static MunitResult test_start_pre_vote(const MunitParameter params[],
+                                       void *data)
+{
+    struct fixture *f = data;
+    const struct raft_server *server;
+    struct raft_request_vote_result result;
+    struct test_io_request request;
+    unsigned n;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 2, 1, 2);
+
+    raft_set_pre_vote(&f->raft, true);
+    n = test_io_get_n_metadata_writes(&f->io);
+
+    rv = raft_tick(&f->raft, f->raft.election_timeout_rand + 100);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->raft.state, ==, RAFT_STATE_CANDIDATE);
+    munit_assert_true(f->raft.candidate_state.in_pre_vote);
+    munit_assert_int(f->raft.current_term, ==, 1);
+    munit_assert_int(test_io_get_n_metadata_writes(&f->io), ==, n);
+
+    test_io_get_one_request(&f->io, RAFT_IO_REQUEST_VOTE, &request);
+    munit_assert_int(request.request_vote.args.term, ==, 2);
+    munit_assert_true(request.request_vote.args.pre_vote);
+
+    test_io_flush(&f->io);
+
+    server = raft_configuration__get(&f->raft.configuration, 2);
+
+    result.term = 2;
+    result.vote_granted = true;
+    result.pre_vote = true;
+
+    rv = raft_handle_request_vote_response(&f->raft, server, &result);
+    munit_assert_int(rv, ==, 0);
+
+    /* The actual election has started. */
+    munit_assert_int(f->raft.state, ==, RAFT_STATE_CANDIDATE);
+    munit_assert_false(f->raft.candidate_state.in_pre_vote);
+    munit_assert_int(f->raft.current_term, ==, 2);
+    munit_assert_int(test_io_get_n_metadata_writes(&f->io), ==, n + 1);
+
+    test_io_get_one_request(&f->io, RAFT_IO_REQUEST_VOTE, &request);
+    munit_assert_int(request.request_vote.args.term, ==, 2);
+    munit_assert_false(request.request_vote.args.pre_vote);
+
+    /* A late pre-vote result is ignored. */
+    rv = raft_handle_request_vote_response(&f->raft, server, &result);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(f->raft.state, ==, RAFT_STATE_CANDIDATE);
+
+    result.pre_vote = false;
+
+    rv = raft_handle_request_vote_response(&f->raft, server, &result);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(f->raft.state, ==, RAFT_STATE_LEADER);
+
+    return MUNIT_OK;
+}
+
+/* A pre-vote rejected because of a higher term makes us step down. */
+static MunitResult test_start_pre_vote_higher_term(
+    const MunitParameter params[],
+    void *data)
+{
+    struct fixture *f = data;
+    const struct raft_server *server;
+    struct raft_request_vote_result result;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 2, 1, 2);
+
+    raft_set_pre_vote(&f->raft, true);
+
+    rv = raft_tick(&f->raft, f->raft.election_timeout_rand + 100);
+    munit_assert_int(rv, ==, 0);
+
+    server = raft_configuration__get(&f->raft.configuration, 2);
+
+    result.term = 3;
+    result.vote_granted = false;
+    result.pre_vote = true;
+
+    rv = raft_handle_request_vote_response(&f->raft, server, &result);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->raft.state, ==, RAFT_STATE_FOLLOWER);
+    munit_assert_int(f->raft.current_term, ==, 3);
+
+    return MUNIT_OK;
+}
+
+static MunitTest start_tests[] = {
+    {"/single-write", test_start_single_write, setup, tear_down, 0, NULL},
+    {"/version-1", test_start_version_1, setup, tear_down, 0, NULL},
+    {"/async", test_start_async, setup, tear_down, 0, NULL},
+    {"/pre-vote", test_start_pre_vote, setup, tear_down, 0, NULL},
+    {"/pre-vote-higher-term", test_start_pre_vote_higher_term, setup,
+     tear_down, 0, NULL},
+    {NULL, NULL, NULL, NULL, 0, NULL},
+};
+
+/**
+ * raft_election__reset_timer
+ */
+
+/* Servers with a lower priority than another voting server wait half an
+ * election timeout longer. */
+static MunitResult test_reset_timer_priority(const MunitParameter params[],
+                                             void *data)
+{
+    struct fixture *f = data;
+    unsigned timeout;
+    int i;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 3, 1, 3);
+
+    timeout = f->raft.election_timeout;
+
+    for (i = 0; i < 10; i++) {
+        raft_election__reset_timer(&f->raft);
+        munit_assert_int(f->raft.election_timeout_rand, <, 2 * timeout);
+    }
+
+    rv = raft_configuration_set_priority(&f->raft.configuration, 2, 1);
+    munit_assert_int(rv, ==, 0);
+
+    for (i = 0; i < 10; i++) {
+        raft_election__reset_timer(&f->raft);
+        munit_assert_int(f->raft.election_timeout_rand, >=, timeout * 3 / 2);
+        munit_assert_int(f->raft.election_timeout_rand, <, timeout * 5 / 2);
+    }
+
+    /* Servers with the highest priority are not delayed. */
+    rv = raft_configuration_set_priority(&f->raft.configuration, 1, 1);
+    munit_assert_int(rv, ==, 0);
+
+    for (i = 0; i < 10; i++) {
+        raft_election__reset_timer(&f->raft);
+        munit_assert_int(f->raft.election_timeout_rand, <, 2 * timeout);
+    }
+
+    return MUNIT_OK;
+}
+
+static MunitTest reset_timer_tests[] = {
+    {"/priority", test_reset_timer_priority, setup, tear_down, 0, NULL},
+    {NULL, NULL, NULL, NULL, 0, NULL},
+};
+
 /**
  * Suite
  */
 MunitSuite raft_election_suites[] = {
     {"/maybe-grant-vote", maybe_grant_vote_tests, NULL, 1, 0},
+    {"/start", start_tests, NULL, 1, 0},
+    {"/reset-timer", reset_timer_tests, NULL, 1, 0},
     {NULL, NULL, NULL, 0, 0},
 };
@@ -1,6 +1,9 @@
+#include <stdio.h>
+
 #include "../../include/raft.h"
 
 #include "../../src/binary.h"
+#include "../../src/encoding.h"
 
 #include "../lib/heap.h"
 #include "../lib/munit.h"
@@ -24,6 +27,7 @@ static void __fill_append_entries_args(struct raft_append_entries_args *args)
     args->prev_log_index = 1;
     args->prev_log_term = 2;
     args->leader_commit = 0;
+    args->batch = NULL;
 }
 
 /**
@@ -93,7 +97,8 @@ static MunitResult test_encode_configuration_oom(const MunitParameter params[],
 
     raft_configuration_init(&configuration);
 
-    test_heap_fault_config(&f->heap, 1, 1);
+    /* Let through the lookup table and servers allocations of the add. */
+    test_heap_fault_config(&f->heap, 2, 1);
     test_heap_fault_enable(&f->heap);
 
     rv = raft_configuration_add(&configuration, 1, "127.0.0.1:666", true);
@@ -200,11 +205,73 @@ static MunitResult test_encode_configuration_two_servers(
     return MUNIT_OK;
 }
 
+/* Server priorities are encoded with a newer format version, only if used. */
+static MunitResult test_encode_configuration_priority(
+    const MunitParameter params[],
+    void *data)
+{
+    struct raft_configuration configuration;
+    struct raft_configuration decoded;
+    struct raft_buffer buf;
+    size_t len;
+    int rv;
+
+    (void)data;
+    (void)params;
+
+    raft_configuration_init(&configuration);
+
+    rv = raft_configuration_add(&configuration, 1, "1", true);
+    munit_assert_int(rv, ==, 0);
+
+    rv = raft_configuration_add(&configuration, 2, "2", true);
+    munit_assert_int(rv, ==, 0);
+
+    rv = raft_encode_configuration(&configuration, &buf);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(((uint8_t *)buf.base)[0], ==, 1);
+    len = buf.len;
+    raft_free(buf.base);
+
+    rv = raft_configuration_set_priority(&configuration, 2, 200);
+    munit_assert_int(rv, ==, 0);
+
+    rv = raft_configuration_set_priority(&configuration, 3, 1);
+    munit_assert_int(rv, ==, RAFT_ERR_BAD_SERVER_ID);
+
+    rv = raft_encode_configuration(&configuration, &buf);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(((uint8_t *)buf.base)[0], ==, 2);
+    munit_assert_int(buf.len, ==, len + 2);
+
+    raft_configuration_init(&decoded);
+
+    rv = raft_decode_configuration(&buf, &decoded);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(decoded.n, ==, 2);
+    munit_assert_int(decoded.servers[0].priority, ==, 0);
+    munit_assert_int(decoded.servers[1].priority, ==, 200);
+    munit_assert_string_equal(decoded.servers[1].address, "2");
+    munit_assert_true(decoded.servers[1].voting);
+
+    raft_configuration_close(&decoded);
+    raft_free(buf.base);
+
+    raft_configuration_close(&configuration);
+
+    return MUNIT_OK;
+}
+
 static MunitTest encode_configuration_tests[] = {
     {"/oom", test_encode_configuration_oom, setup, tear_down, 0, NULL},
     {"/empty", test_encode_configuration_empty, setup, tear_down, 0, NULL},
     {"/one", test_encode_configuration_one_server, setup, tear_down, 0, NULL},
     {"/two", test_encode_configuration_two_servers, setup, tear_down, 0, NULL},
+    {"/priority", test_encode_configuration_priority, setup, tear_down, 0,
+     NULL},
     {NULL, NULL, NULL, NULL, 0, NULL},
 };
 
@@ -447,10 +514,10 @@ static MunitResult test_encode_append_entries_0(const MunitParameter params[],
 
     /* Message type */
     munit_assert_int(raft__flip32(*(uint32_t *)(buf.base + 4)), ==,
-                     RAFT_IO_APPEND_ENTRIES);
+                     RAFT_ENCODING_APPEND_ENTRIES);
 
     /* Message size */
-    munit_assert_int(raft__flip64(*(uint32_t *)(buf.base + 8)), ==, 48);
+    munit_assert_int(raft__flip64(*(uint32_t *)(buf.base + 8)), ==, 56);
 
     raft_free(buf.base);
 
@@ -486,10 +553,10 @@ static MunitResult test_encode_append_entries_1(const MunitParameter params[],
 
     /* Message type */
     munit_assert_int(raft__flip32(*(uint32_t *)(buf.base + 4)), ==,
-                     RAFT_IO_APPEND_ENTRIES);
+                     RAFT_ENCODING_APPEND_ENTRIES);
 
     /* Message size */
-    munit_assert_int(raft__flip64(*(uint32_t *)(buf.base + 8)), ==, 64);
+    munit_assert_int(raft__flip64(*(uint32_t *)(buf.base + 8)), ==, 72);
 
     free(entry.buf.base);
     raft_free(buf.base);
@@ -527,10 +594,49 @@ static MunitResult test_encode_append_entries_pad(const MunitParameter params[],
 
     /* Message type */
     munit_assert_int(raft__flip32(*(uint32_t *)(buf.base + 4)), ==,
-                     RAFT_IO_APPEND_ENTRIES);
+                     RAFT_ENCODING_APPEND_ENTRIES);
 
     /* Message size */
-    munit_assert_int(raft__flip64(*(uint32_t *)(buf.base + 8)), ==, 64);
+    munit_assert_int(raft__flip64(*(uint32_t *)(buf.base + 8)), ==, 72);
+
+    free(entry.buf.base);
+    raft_free(buf.base);
+
+    return MUNIT_OK;
+}
+
+/* Encode the header of an append entries request into a buffer provided by the
+ * caller. */
+static MunitResult test_encode_append_entries_to(const MunitParameter params[],
+                                                 void *data)
+{
+    struct raft_append_entries_args args;
+    struct raft_buffer buf;
+    struct raft_entry entry;
+    uint8_t header[128];
+    int rv;
+
+    (void)data;
+    (void)params;
+
+    entry.type = RAFT_LOG_COMMAND;
+    entry.term = 2;
+    entry.buf.base = munit_malloc(8);
+    entry.buf.len = 8;
+
+    __fill_append_entries_args(&args);
+    args.entries = &entry;
+    args.n = 1;
+
+    munit_assert_int(raft_encode_append_entries_size(&args), ==, 88);
+
+    raft_encode_append_entries_to(&args, header);
+
+    rv = raft_encode_append_entries(&args, &buf);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(buf.len, ==, 88);
+    munit_assert_int(memcmp(header, buf.base, buf.len), ==, 0);
 
     free(entry.buf.base);
     raft_free(buf.base);
@@ -538,10 +644,80 @@ static MunitResult test_encode_append_entries_pad(const MunitParameter params[],
     return MUNIT_OK;
 }
 
+/* Fill an iovec array with the header of an append entries request followed
+ * by the entries data and padding. */
+static MunitResult test_encode_append_entries_iov(const MunitParameter params[],
+                                                  void *data)
+{
+    struct raft_append_entries_args args;
+    struct raft_entry entries[2];
+    struct raft_buffer buf;
+    struct raft_buffer payload;
+    struct iovec iov[4];
+    uint8_t header[128];
+    uint8_t message[256];
+    size_t len = 0;
+    unsigned n;
+    unsigned i;
+    int rv;
+
+    (void)data;
+    (void)params;
+
+    entries[0].type = RAFT_LOG_COMMAND;
+    entries[0].term = 2;
+    entries[0].buf.base = "hello";
+    entries[0].buf.len = 6;
+
+    entries[1].type = RAFT_LOG_COMMAND;
+    entries[1].term = 2;
+    entries[1].buf.base = "world!!";
+    entries[1].buf.len = 8;
+
+    __fill_append_entries_args(&args);
+    args.entries = entries;
+    args.n = 2;
+
+    munit_assert_int(raft_encode_append_entries_iov_count(&args), ==, 4);
+
+    n = raft_encode_append_entries_iov(&args, header, iov);
+    munit_assert_int(n, ==, 4);
+
+    munit_assert_ptr_equal(iov[0].iov_base, header);
+    munit_assert_ptr_equal(iov[1].iov_base, entries[0].buf.base);
+    munit_assert_int(iov[2].iov_len, ==, 2);
+    munit_assert_ptr_equal(iov[3].iov_base, entries[1].buf.base);
+
+    /* Gather the message as the kernel would, and decode it back. */
+    for (i = 0; i < n; i++) {
+        memcpy(message + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+
+    buf.base = message + 16;
+    buf.len = iov[0].iov_len - 16;
+
+    rv = raft_decode_append_entries(&buf, &args);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(args.n, ==, 2);
+
+    payload.base = message + iov[0].iov_len;
+    payload.len = len - iov[0].iov_len;
+
+    rv = raft_verify_entries_batch(&args, &payload);
+    munit_assert_int(rv, ==, 0);
+
+    raft_free(args.entries);
+
+    return MUNIT_OK;
+}
+
 static MunitTest encode_append_entries_tests[] = {
     {"/0", test_encode_append_entries_0, setup, tear_down, 0, NULL},
     {"/1", test_encode_append_entries_1, setup, tear_down, 0, NULL},
     {"/pad", test_encode_append_entries_pad, setup, tear_down, 0, NULL},
+    {"/to", test_encode_append_entries_to, setup, tear_down, 0, NULL},
+    {"/iov", test_encode_append_entries_iov, setup, tear_down, 0, NULL},
     {NULL, NULL, NULL, NULL, 0, NULL},
 };
 
@@ -639,6 +815,9 @@ static MunitResult test_decode_append_entries_1(const MunitParameter params[],
     munit_assert_ptr_not_null(args.entries);
     munit_assert_int(args.n, ==, 1);
 
+    rv = raft_verify_entries_batch(&args, &buf3);
+    munit_assert_int(rv, ==, 0);
+
     rv = raft_decode_entries_batch(&buf3, args.entries, args.n);
     munit_assert_int(rv, ==, 0);
 
@@ -780,11 +959,892 @@ static MunitResult test_decode_append_entries_2(const MunitParameter params[],
     return MUNIT_OK;
 }
 
+/* A corrupted entry header is detected. */
+static MunitResult test_decode_append_entries_corrupt_header(
+    const MunitParameter params[],
+    void *data)
+{
+    struct raft_append_entries_args args;
+    struct raft_buffer buf1;
+    struct raft_buffer buf2;
+    struct raft_entry entry;
+    int rv;
+
+    (void)data;
+    (void)params;
+
+    entry.type = RAFT_LOG_COMMAND;
+    entry.term = 2;
+    entry.buf.base = munit_malloc(8);
+    entry.buf.len = 8;
+
+    __fill_append_entries_args(&args);
+    args.entries = &entry;
+    args.n = 1;
+
+    rv = raft_encode_append_entries(&args, &buf1);
+    munit_assert_int(rv, ==, 0);
+
+    /* Skip the message header. */
+    buf2.len = buf1.len - 16;
+    buf2.base = munit_malloc(buf2.len);
+    memcpy(buf2.base, buf1.base + 16, buf2.len);
+
+    /* Flip a bit of the entry term. */
+    *((uint8_t *)buf2.base + 40 + 8) ^= 1;
+
+    rv = raft_decode_append_entries(&buf2, &args);
+    munit_assert_int(rv, ==, RAFT_ERR_CHECKSUM);
+
+    free(entry.buf.base);
+    raft_free(buf1.base);
+    free(buf2.base);
+
+    return MUNIT_OK;
+}
+
+/* Corrupted entries data is detected. */
+static MunitResult test_decode_append_entries_corrupt_data(
+    const MunitParameter params[],
+    void *data)
+{
+    struct raft_append_entries_args args;
+    struct raft_buffer buf1;
+    struct raft_buffer buf2;
+    struct raft_buffer buf3;
+    struct raft_entry entry;
+    int rv;
+
+    (void)data;
+    (void)params;
+
+    entry.type = RAFT_LOG_COMMAND;
+    entry.term = 2;
+    entry.buf.base = munit_malloc(6);
+    entry.buf.len = 6;
+
+    strcpy(entry.buf.base, "hello");
+
+    __fill_append_entries_args(&args);
+    args.entries = &entry;
+    args.n = 1;
+
+    rv = raft_encode_append_entries(&args, &buf1);
+    munit_assert_int(rv, ==, 0);
+
+    /* Skip the message header. */
+    buf2.len = buf1.len - 16;
+    buf2.base = munit_malloc(buf2.len);
+    memcpy(buf2.base, buf1.base + 16, buf2.len);
+
+    /* Copy the entry data, with a typo. */
+    buf3.len = 8;
+    buf3.base = munit_malloc(buf3.len);
+    strcpy(buf3.base, "hallo");
+
+    rv = raft_decode_append_entries(&buf2, &args);
+    munit_assert_int(rv, ==, 0);
+
+    rv = raft_verify_entries_batch(&args, &buf3);
+    munit_assert_int(rv, ==, RAFT_ERR_CHECKSUM);
+
+    raft_free(args.entries);
+    free(entry.buf.base);
+    raft_free(buf1.base);
+    free(buf2.base);
+    free(buf3.base);
+
+    return MUNIT_OK;
+}
+
+/* Batches encoded by older versions, with no checksums, are still decoded. */
+static MunitResult test_decode_append_entries_legacy(
+    const MunitParameter params[],
+    void *data)
+{
+    struct raft_append_entries_args args;
+    struct raft_buffer buf1;
+    struct raft_buffer buf2;
+    uint64_t body[8];
+    int rv;
+
+    (void)data;
+    (void)params;
+
+    body[0] = raft__flip64(3);   /* Term */
+    body[1] = raft__flip64(1);   /* Leader ID */
+    body[2] = raft__flip64(10);  /* Previous index */
+    body[3] = raft__flip64(2);   /* Previous term */
+    body[4] = raft__flip64(9);   /* Commit index */
+    body[5] = raft__flip64(1);   /* Number of entries, 64-bit */
+    body[6] = raft__flip64(2);   /* Term of the entry */
+    body[7] = raft__flip64((uint64_t)8 << 32 | RAFT_LOG_COMMAND);
+
+    buf1.base = body;
+    buf1.len = sizeof body;
+
+    rv = raft_decode_append_entries(&buf1, &args);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(args.term, ==, 3);
+    munit_assert_int(args.n, ==, 1);
+    munit_assert_false(args.has_checksum);
+    munit_assert_int(args.compressed, ==, 0);
+    munit_assert_int(args.entries[0].term, ==, 2);
+    munit_assert_int(args.entries[0].type, ==, RAFT_LOG_COMMAND);
+
+    buf2.len = 8;
+    buf2.base = raft_malloc(buf2.len);
+    munit_assert_ptr_not_null(buf2.base);
+    *(uint64_t *)buf2.base = 123456789;
+
+    rv = raft_verify_entries_batch(&args, &buf2);
+    munit_assert_int(rv, ==, 0);
+
+    rv = raft_decode_entries_batch(&buf2, args.entries, args.n);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(args.entries[0].buf.len, ==, 8);
+    munit_assert_int(*(uint64_t *)args.entries[0].buf.base, ==, 123456789);
+
+    raft_free(args.entries);
+    raft_free(buf2.base);
+
+    return MUNIT_OK;
+}
+
 static MunitTest decode_append_entries_tests[] = {
     {"/0", test_decode_append_entries_0, setup, tear_down, 0, NULL},
     {"/1", test_decode_append_entries_1, setup, tear_down, 0, NULL},
     {"/pad", test_decode_append_entries_pad, setup, tear_down, 0, NULL},
     {"/2", test_decode_append_entries_2, setup, tear_down, 0, NULL},
+    {"/corrupt-header", test_decode_append_entries_corrupt_header, setup,
+     tear_down, 0, NULL},
+    {"/corrupt-data", test_decode_append_entries_corrupt_data, setup,
+     tear_down, 0, NULL},
+    {"/legacy", test_decode_append_entries_legacy, setup, tear_down, 0, NULL},
+    {NULL, NULL, NULL, NULL, 0, NULL},
+};
+
+/**
+ * raft_encode_entries_batch
+ */
+
+/* Encode a batch with two entries, padding each of them to 8 bytes. */
+static MunitResult test_encode_entries_batch_packed(
+    const MunitParameter params[],
+    void *data)
+{
+    struct raft_entry entries[2];
+    struct raft_buffer buf;
+    int rv;
+
+    (void)data;
+    (void)params;
+
+    entries[0].buf.base = "hello";
+    entries[0].buf.len = 6;
+    entries[1].buf.base = "world!!!";
+    entries[1].buf.len = 8;
+
+    munit_assert_int(raft_entries_batch_size(entries, 2, 0), ==, 16);
+
+    rv = raft_encode_entries_batch(entries, 2, 0, &buf);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(buf.len, ==, 16);
+    munit_assert_string_equal(buf.base, "hello");
+    munit_assert_int(((uint8_t *)buf.base)[6], ==, 0);
+    munit_assert_int(((uint8_t *)buf.base)[7], ==, 0);
+    munit_assert_int(memcmp((uint8_t *)buf.base + 8, "world!!!", 8), ==, 0);
+
+    raft_free(buf.base);
+
+    return MUNIT_OK;
+}
+
+/* Encode a batch with the aligned layout: the buffer is aligned and padded
+ * with zeros to RAFT_BATCH_ALIGNMENT, and can be decoded as usual. */
+static MunitResult test_encode_entries_batch_aligned(
+    const MunitParameter params[],
+    void *data)
+{
+    struct raft_entry entries[2];
+    struct raft_buffer buf;
+    void *payload = munit_malloc(RAFT_BATCH_ALIGNMENT);
+    size_t i;
+    int rv;
+
+    (void)data;
+    (void)params;
+
+    memset(payload, 'x', RAFT_BATCH_ALIGNMENT);
+
+    entries[0].buf.base = "hello";
+    entries[0].buf.len = 6;
+    entries[1].buf.base = payload;
+    entries[1].buf.len = RAFT_BATCH_ALIGNMENT;
+
+    munit_assert_int(raft_entries_batch_size(entries, 2, RAFT_BATCH_ALIGNED),
+                     ==, 2 * RAFT_BATCH_ALIGNMENT);
+
+    rv = raft_encode_entries_batch(entries, 2, RAFT_BATCH_ALIGNED, &buf);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(buf.len, ==, 2 * RAFT_BATCH_ALIGNMENT);
+    munit_assert_int((uintptr_t)buf.base % RAFT_BATCH_ALIGNMENT, ==, 0);
+
+    for (i = 8 + RAFT_BATCH_ALIGNMENT; i < buf.len; i++) {
+        munit_assert_int(((uint8_t *)buf.base)[i], ==, 0);
+    }
+
+    rv = raft_decode_entries_batch(&buf, entries, 2);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_ptr_equal(entries[0].buf.base, buf.base);
+    munit_assert_string_equal(entries[0].buf.base, "hello");
+    munit_assert_ptr_equal(entries[1].buf.base, (uint8_t *)buf.base + 8);
+    munit_assert_int(((uint8_t *)entries[1].buf.base)[0], ==, 'x');
+
+    raft_free(buf.base);
+    free(payload);
+
+    return MUNIT_OK;
+}
+
+static MunitTest encode_entries_batch_tests[] = {
+    {"/packed", test_encode_entries_batch_packed, setup, tear_down, 0, NULL},
+    {"/aligned", test_encode_entries_batch_aligned, setup, tear_down, 0, NULL},
+    {NULL, NULL, NULL, NULL, 0, NULL},
+};
+
+/**
+ * raft_inflate_entries_batch
+ */
+
+/* Encode an AppendEntries request using a shared batch of the given entries,
+ * created with compression enabled, decode it back and return the payload as
+ * it would be received. */
+static void __encode_compressed(struct raft_entry *entries,
+                                unsigned n,
+                                struct raft_append_entries_batch **batch,
+                                struct raft_append_entries_args *args,
+                                struct raft_buffer *payload)
+{
+    struct raft_buffer buf1;
+    struct raft_buffer buf2;
+    void *cursor;
+    unsigned i;
+    int rv;
+
+    rv = raft_encode__append_entries_batch(1, entries, n, true, batch);
+    munit_assert_int(rv, ==, 0);
+
+    __fill_append_entries_args(args);
+    args->entries = entries;
+    args->n = n;
+    args->batch = *batch;
+
+    rv = raft_encode_append_entries(args, &buf1);
+    munit_assert_int(rv, ==, 0);
+
+    /* Skip the message header. */
+    buf2.len = buf1.len - 16;
+    buf2.base = buf1.base + 16;
+
+    rv = raft_decode_append_entries(&buf2, args);
+    munit_assert_int(rv, ==, 0);
+
+    payload->len = 0;
+    for (i = 1; i < (*batch)->n_iov; i++) {
+        payload->len += (*batch)->iov[i].iov_len;
+    }
+
+    payload->base = raft_malloc(payload->len);
+    munit_assert_ptr_not_null(payload->base);
+
+    cursor = payload->base;
+    for (i = 1; i < (*batch)->n_iov; i++) {
+        memcpy(cursor, (*batch)->iov[i].iov_base, (*batch)->iov[i].iov_len);
+        cursor += (*batch)->iov[i].iov_len;
+    }
+
+    raft_free(buf1.base);
+}
+
+/* The data of a batch of compressible entries is sent compressed, and gets
+ * back to its original form once inflated. */
+static MunitResult test_inflate_entries_batch_compressed(
+    const MunitParameter params[],
+    void *data)
+{
+    struct raft_append_entries_batch *batch;
+    struct raft_append_entries_args args;
+    struct raft_entry entries[3];
+    struct raft_buffer payload;
+    char text[3][300];
+    size_t size = 0;
+    unsigned i;
+    int rv;
+
+    (void)data;
+    (void)params;
+
+    for (i = 0; i < 3; i++) {
+        size_t len = 0;
+
+        while (len < sizeof text[i] - 40) {
+            len += sprintf(text[i] + len, "{\"key\":\"k%u\",\"value\":%zu}", i,
+                           len % 7);
+        }
+
+        entries[i].type = RAFT_LOG_COMMAND;
+        entries[i].term = 2;
+        entries[i].buf.base = text[i];
+        entries[i].buf.len = len;
+
+        size += raft_encode__align(len, 8);
+    }
+
+    __encode_compressed(entries, 3, &batch, &args, &payload);
+
+    /* The whole data section is sent as a single compressed buffer. */
+    munit_assert_int(batch->n_iov, ==, 2);
+    munit_assert_int(args.n, ==, 3);
+    munit_assert_int(args.compressed, >, 0);
+    munit_assert_int(payload.len, <, size / 2);
+
+    rv = raft_verify_entries_batch(&args, &payload);
+    munit_assert_int(rv, ==, 0);
+
+    rv = raft_inflate_entries_batch(&args, &payload, 0);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(args.compressed, ==, 0);
+    munit_assert_int(payload.len, ==, size);
+
+    rv = raft_decode_entries_batch(&payload, args.entries, args.n);
+    munit_assert_int(rv, ==, 0);
+
+    for (i = 0; i < 3; i++) {
+        munit_assert_int(args.entries[i].buf.len, ==, entries[i].buf.len);
+        munit_assert_memory_equal(entries[i].buf.len, args.entries[i].buf.base,
+                                  text[i]);
+    }
+
+    raft_free(args.entries);
+    raft_free(payload.base);
+    raft_free(batch);
+
+    return MUNIT_OK;
+}
+
+/* Data that doesn't shrink is sent uncompressed. */
+static MunitResult test_inflate_entries_batch_incompressible(
+    const MunitParameter params[],
+    void *data)
+{
+    struct raft_append_entries_batch *batch;
+    struct raft_append_entries_args args;
+    struct raft_entry entry;
+    struct raft_buffer payload;
+    uint8_t buf[256];
+    int rv;
+
+    (void)data;
+    (void)params;
+
+    munit_rand_memory(sizeof buf, buf);
+
+    entry.type = RAFT_LOG_COMMAND;
+    entry.term = 2;
+    entry.buf.base = buf;
+    entry.buf.len = sizeof buf;
+
+    __encode_compressed(&entry, 1, &batch, &args, &payload);
+
+    munit_assert_int(batch->n_iov, ==, 2);
+    munit_assert_ptr_equal(batch->iov[1].iov_base, buf);
+    munit_assert_int(args.compressed, ==, 0);
+
+    rv = raft_verify_entries_batch(&args, &payload);
+    munit_assert_int(rv, ==, 0);
+
+    /* Inflating uncompressed data is a no-op. */
+    rv = raft_inflate_entries_batch(&args, &payload, 0);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(payload.len, ==, sizeof buf);
+
+    raft_free(args.entries);
+    raft_free(payload.base);
+    raft_free(batch);
+
+    return MUNIT_OK;
+}
+
+static MunitTest inflate_entries_batch_tests[] = {
+    {"/compressed", test_inflate_entries_batch_compressed, setup, tear_down, 0,
+     NULL},
+    {"/incompressible", test_inflate_entries_batch_incompressible, setup,
+     tear_down, 0, NULL},
+    {NULL, NULL, NULL, NULL, 0, NULL},
+};
+
+/**
+ * raft_encode_message
+ */
+
+/* Fill an AppendEntries request with 3 small commands, the first two created
+ * in the same term. */
+static void __fill_append_entries_message(struct raft_message *message,
+                                          struct raft_entry entries[3])
+{
+    size_t i;
+
+    message->type = RAFT_IO_APPEND_ENTRIES;
+    __fill_append_entries_args(&message->append_entries);
+
+    for (i = 0; i < 3; i++) {
+        entries[i].type = RAFT_LOG_COMMAND;
+        entries[i].term = i < 2 ? 2 : 3;
+        entries[i].buf.base = "command";
+        entries[i].buf.len = 7;
+    }
+    entries[2].type = RAFT_LOG_CONFIGURATION;
+
+    message->append_entries.entries = entries;
+    message->append_entries.n = 3;
+}
+
+/* Version 1 messages encoded with raft_encode_message() are identical to the
+ * ones encoded with the per-message functions. */
+static MunitResult test_encode_message_v1(const MunitParameter params[],
+                                          void *data)
+{
+    struct raft_message message;
+    struct raft_entry entries[3];
+    struct raft_buffer buf1;
+    struct raft_buffer buf2;
+    int rv;
+
+    (void)data;
+    (void)params;
+
+    __fill_append_entries_message(&message, entries);
+    message.version = RAFT_ENCODING_V1;
+
+    rv = raft_encode_message(&message, &buf1);
+    munit_assert_int(rv, ==, 0);
+
+    rv = raft_encode_append_entries(&message.append_entries, &buf2);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(buf1.len, ==, buf2.len);
+    munit_assert_int(memcmp(buf1.base, buf2.base, buf1.len), ==, 0);
+
+    raft_free(buf1.base);
+    raft_free(buf2.base);
+
+    return MUNIT_OK;
+}
+
+/* An AppendEntries request encoded with version 2 is much smaller, and decodes
+ * to the same request. */
+static MunitResult test_encode_message_v2_append_entries(
+    const MunitParameter params[],
+    void *data)
+{
+    struct raft_message message;
+    struct raft_message decoded;
+    struct raft_entry entries[3];
+    struct raft_buffer buf;
+    struct raft_buffer payload;
+    size_t i;
+    int rv;
+
+    (void)data;
+    (void)params;
+
+    __fill_append_entries_message(&message, entries);
+    message.version = RAFT_ENCODING_V1;
+    munit_assert_int(raft_encode_message_size(&message), ==, 120);
+
+    message.version = RAFT_ENCODING_V2;
+
+    /* Header, 5 one-byte fields, the number of entries, 2 runs of 2 bytes
+     * each, 3 one-byte entries and the checksums. */
+    munit_assert_int(raft_encode_message_size(&message), ==,
+                     16 + 5 + 1 + 4 + 3 + 8);
+
+    rv = raft_encode_message(&message, &buf);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(raft__flip32(*(uint32_t *)buf.base), ==, 2);
+
+    rv = raft_decode_message(&buf, &decoded);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(decoded.version, ==, RAFT_ENCODING_V2);
+    munit_assert_int(decoded.type, ==, RAFT_IO_APPEND_ENTRIES);
+    munit_assert_int(decoded.append_entries.term, ==, 3);
+    munit_assert_int(decoded.append_entries.leader_id, ==, 123);
+    munit_assert_int(decoded.append_entries.prev_log_index, ==, 1);
+    munit_assert_int(decoded.append_entries.prev_log_term, ==, 2);
+    munit_assert_int(decoded.append_entries.leader_commit, ==, 0);
+    munit_assert_int(decoded.append_entries.n, ==, 3);
+
+    for (i = 0; i < 3; i++) {
+        struct raft_entry *entry = &decoded.append_entries.entries[i];
+        munit_assert_int(entry->term, ==, entries[i].term);
+        munit_assert_int(entry->type, ==, entries[i].type);
+        munit_assert_int(entry->buf.len, ==, 7);
+    }
+
+    /* The payload data is the same as version 1. */
+    rv = raft_encode_entries_batch(entries, 3, 0, &payload);
+    munit_assert_int(rv, ==, 0);
+
+    rv = raft_verify_entries_batch(&decoded.append_entries, &payload);
+    munit_assert_int(rv, ==, 0);
+
+    raft_free(payload.base);
+    raft_free(decoded.append_entries.entries);
+    raft_free(buf.base);
+
+    return MUNIT_OK;
+}
+
+/* Results and votes round trip through version 2. */
+static MunitResult test_encode_message_v2_results(
+    const MunitParameter params[],
+    void *data)
+{
+    struct raft_message message;
+    struct raft_message decoded;
+    struct raft_buffer buf;
+    int rv;
+
+    (void)data;
+    (void)params;
+
+    message.type = RAFT_IO_APPEND_ENTRIES_RESULT;
+    message.version = RAFT_ENCODING_V2;
+    message.append_entries_result.term = 300;
+    message.append_entries_result.success = true;
+    message.append_entries_result.last_log_index = 1ULL << 40;
+
+    munit_assert_int(raft_encode_message_size(&message), ==, 16 + 2 + 1 + 6);
+
+    rv = raft_encode_message(&message, &buf);
+    munit_assert_int(rv, ==, 0);
+
+    rv = raft_decode_message(&buf, &decoded);
+    munit_assert_int(rv, ==, 0);
+    raft_free(buf.base);
+
+    munit_assert_int(decoded.type, ==, RAFT_IO_APPEND_ENTRIES_RESULT);
+    munit_assert_int(decoded.append_entries_result.term, ==, 300);
+    munit_assert_true(decoded.append_entries_result.success);
+    munit_assert_uint64(decoded.append_entries_result.last_log_index, ==,
+                        1ULL << 40);
+
+    message.type = RAFT_IO_REQUEST_VOTE_RESULT;
+    message.request_vote_result.term = 5;
+    message.request_vote_result.vote_granted = false;
+    message.request_vote_result.pre_vote = false;
+
+    rv = raft_encode_message(&message, &buf);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(buf.len, ==, 16 + 2);
+
+    rv = raft_decode_message(&buf, &decoded);
+    munit_assert_int(rv, ==, 0);
+    raft_free(buf.base);
+
+    munit_assert_int(decoded.type, ==, RAFT_IO_REQUEST_VOTE_RESULT);
+    munit_assert_int(decoded.request_vote_result.term, ==, 5);
+    munit_assert_false(decoded.request_vote_result.vote_granted);
+
+    return MUNIT_OK;
+}
+
+/* The Pre-Vote flag is appended to RequestVote messages only when set, with
+ * both versions, so regular ones are encoded as before. */
+static MunitResult test_encode_message_pre_vote(const MunitParameter params[],
+                                                void *data)
+{
+    struct raft_message message;
+    struct raft_message decoded;
+    struct raft_buffer buf;
+    unsigned version;
+    int rv;
+
+    (void)data;
+    (void)params;
+
+    for (version = RAFT_ENCODING_V1; version <= RAFT_ENCODING_V2; version++) {
+        size_t size;
+
+        message.type = RAFT_IO_REQUEST_VOTE;
+        message.version = version;
+        message.request_vote.term = 3;
+        message.request_vote.candidate_id = 2;
+        message.request_vote.last_log_index = 10;
+        message.request_vote.last_log_term = 2;
+        message.request_vote.pre_vote = false;
+        message.request_vote.disrupt_leader = false;
+
+        size = raft_encode_message_size(&message);
+        message.request_vote.pre_vote = true;
+        munit_assert_int(raft_encode_message_size(&message), >, size);
+
+        rv = raft_encode_message(&message, &buf);
+        munit_assert_int(rv, ==, 0);
+
+        rv = raft_decode_message(&buf, &decoded);
+        munit_assert_int(rv, ==, 0);
+        raft_free(buf.base);
+
+        munit_assert_int(decoded.request_vote.term, ==, 3);
+        munit_assert_int(decoded.request_vote.last_log_term, ==, 2);
+        munit_assert_true(decoded.request_vote.pre_vote);
+
+        message.type = RAFT_IO_REQUEST_VOTE_RESULT;
+        message.request_vote_result.term = 3;
+        message.request_vote_result.vote_granted = true;
+        message.request_vote_result.pre_vote = true;
+
+        rv = raft_encode_message(&message, &buf);
+        munit_assert_int(rv, ==, 0);
+
+        rv = raft_decode_message(&buf, &decoded);
+        munit_assert_int(rv, ==, 0);
+        raft_free(buf.base);
+
+        munit_assert_int(decoded.request_vote_result.term, ==, 3);
+        munit_assert_true(decoded.request_vote_result.vote_granted);
+        munit_assert_true(decoded.request_vote_result.pre_vote);
+
+        message.request_vote_result.pre_vote = false;
+
+        rv = raft_encode_message(&message, &buf);
+        munit_assert_int(rv, ==, 0);
+
+        rv = raft_decode_message(&buf, &decoded);
+        munit_assert_int(rv, ==, 0);
+        raft_free(buf.base);
+
+        munit_assert_false(decoded.request_vote_result.pre_vote);
+    }
+
+    return MUNIT_OK;
+}
+
+/* TimeoutNow requests and the disrupt-leader flag of the RequestVote ones they
+ * trigger survive a round trip with both versions. */
+static MunitResult test_encode_message_timeout_now(
+    const MunitParameter params[],
+    void *data)
+{
+    struct raft_message message;
+    struct raft_message decoded;
+    struct raft_buffer buf;
+    unsigned version;
+    int rv;
+
+    (void)data;
+    (void)params;
+
+    for (version = RAFT_ENCODING_V1; version <= RAFT_ENCODING_V2; version++) {
+        message.type = RAFT_IO_TIMEOUT_NOW;
+        message.version = version;
+        message.timeout_now.term = 4;
+        message.timeout_now.leader_id = 1;
+        message.timeout_now.last_log_index = 300;
+        message.timeout_now.last_log_term = 3;
+
+        rv = raft_encode_message(&message, &buf);
+        munit_assert_int(rv, ==, 0);
+
+        rv = raft_decode_message(&buf, &decoded);
+        munit_assert_int(rv, ==, 0);
+        raft_free(buf.base);
+
+        munit_assert_int(decoded.type, ==, RAFT_IO_TIMEOUT_NOW);
+        munit_assert_int(decoded.timeout_now.term, ==, 4);
+        munit_assert_int(decoded.timeout_now.leader_id, ==, 1);
+        munit_assert_int(decoded.timeout_now.last_log_index, ==, 300);
+        munit_assert_int(decoded.timeout_now.last_log_term, ==, 3);
+
+        message.type = RAFT_IO_REQUEST_VOTE;
+        message.request_vote.term = 5;
+        message.request_vote.candidate_id = 2;
+        message.request_vote.last_log_index = 300;
+        message.request_vote.last_log_term = 3;
+        message.request_vote.pre_vote = false;
+        message.request_vote.disrupt_leader = true;
+
+        rv = raft_encode_message(&message, &buf);
+        munit_assert_int(rv, ==, 0);
+
+        rv = raft_decode_message(&buf, &decoded);
+        munit_assert_int(rv, ==, 0);
+        raft_free(buf.base);
+
+        munit_assert_false(decoded.request_vote.pre_vote);
+        munit_assert_true(decoded.request_vote.disrupt_leader);
+    }
+
+    return MUNIT_OK;
+}
+
+/* A truncated version 2 message is rejected. */
+static MunitResult test_encode_message_v2_truncated(
+    const MunitParameter params[],
+    void *data)
+{
+    struct raft_message message;
+    struct raft_message decoded;
+    struct raft_entry entries[3];
+    struct raft_buffer buf;
+    int rv;
+
+    (void)data;
+    (void)params;
+
+    __fill_append_entries_message(&message, entries);
+    message.version = RAFT_ENCODING_V2;
+
+    rv = raft_encode_message(&message, &buf);
+    munit_assert_int(rv, ==, 0);
+
+    /* Pretend the body is shorter: the checksums run past its end. */
+    buf.len = 16 + 15;
+    *(uint64_t *)((uint8_t *)buf.base + 8) = raft__flip64(15);
+
+    rv = raft_decode_message(&buf, &decoded);
+    munit_assert_int(rv, ==, RAFT_ERR_MALFORMED);
+
+    raft_free(buf.base);
+
+    return MUNIT_OK;
+}
+
+/* A corrupted version 2 batch header is detected. */
+static MunitResult test_encode_message_v2_corrupt(
+    const MunitParameter params[],
+    void *data)
+{
+    struct raft_message message;
+    struct raft_message decoded;
+    struct raft_entry entries[3];
+    struct raft_buffer buf;
+    int rv;
+
+    (void)data;
+    (void)params;
+
+    __fill_append_entries_message(&message, entries);
+    message.version = RAFT_ENCODING_V2;
+
+    rv = raft_encode_message(&message, &buf);
+    munit_assert_int(rv, ==, 0);
+
+    /* Change the size of the last entry. */
+    ((uint8_t *)buf.base)[buf.len - 9] = 9 << 1;
+
+    rv = raft_decode_message(&buf, &decoded);
+    munit_assert_int(rv, ==, RAFT_ERR_CHECKSUM);
+
+    raft_free(buf.base);
+
+    return MUNIT_OK;
+}
+
+/* AppendEntries requests are sent with a type of their own, while the one used
+ * by older servers is still accepted. */
+static MunitResult test_encode_message_legacy_type(
+    const MunitParameter params[],
+    void *data)
+{
+    struct raft_message message;
+    struct raft_message decoded;
+    struct raft_entry entries[3];
+    struct raft_buffer buf;
+    uint64_t heartbeat[8];
+    int rv;
+
+    (void)data;
+    (void)params;
+
+    __fill_append_entries_message(&message, entries);
+    message.version = RAFT_ENCODING_V1;
+
+    rv = raft_encode_message(&message, &buf);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(raft__flip32(*(uint32_t *)buf.base), ==, 1);
+    munit_assert_int(raft__flip32(*(uint32_t *)(buf.base + 4)), ==,
+                     RAFT_ENCODING_APPEND_ENTRIES);
+
+    rv = raft_decode_message(&buf, &decoded);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(decoded.type, ==, RAFT_IO_APPEND_ENTRIES);
+    munit_assert_int(decoded.version, ==, RAFT_ENCODING_V1);
+    munit_assert_int(decoded.append_entries.n, ==, 3);
+    raft_free(decoded.append_entries.entries);
+
+    /* The legacy type is accepted too, with any batch layout. */
+    *(uint32_t *)(buf.base + 4) = raft__flip32(RAFT_IO_APPEND_ENTRIES);
+
+    rv = raft_decode_message(&buf, &decoded);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(decoded.type, ==, RAFT_IO_APPEND_ENTRIES);
+    munit_assert_int(decoded.append_entries.n, ==, 3);
+    raft_free(decoded.append_entries.entries);
+
+    /* The new type is not part of version 2. */
+    *(uint32_t *)buf.base = raft__flip32(RAFT_ENCODING_V2);
+    *(uint32_t *)(buf.base + 4) = raft__flip32(RAFT_ENCODING_APPEND_ENTRIES);
+
+    rv = raft_decode_message(&buf, &decoded);
+    munit_assert_int(rv, ==, RAFT_ERR_MALFORMED);
+    raft_free(buf.base);
+
+    /* A heartbeat from an older server, whose empty batch is just the 64-bit
+     * number of entries. */
+    memset(heartbeat, 0, sizeof heartbeat);
+    heartbeat[0] = raft__flip64((uint64_t)RAFT_IO_APPEND_ENTRIES << 32 | 1);
+    heartbeat[1] = raft__flip64(48);
+    heartbeat[2] = raft__flip64(3); /* Term */
+
+    buf.base = heartbeat;
+    buf.len = sizeof heartbeat;
+
+    rv = raft_decode_message(&buf, &decoded);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(decoded.append_entries.term, ==, 3);
+    munit_assert_int(decoded.append_entries.n, ==, 0);
+
+    return MUNIT_OK;
+}
+
+static MunitTest encode_message_tests[] = {
+    {"/v1", test_encode_message_v1, setup, tear_down, 0, NULL},
+    {"/v2-append-entries", test_encode_message_v2_append_entries, setup,
+     tear_down, 0, NULL},
+    {"/v2-results", test_encode_message_v2_results, setup, tear_down, 0, NULL},
+    {"/pre-vote", test_encode_message_pre_vote, setup, tear_down, 0, NULL},
+    {"/timeout-now", test_encode_message_timeout_now, setup, tear_down, 0,
+     NULL},
+    {"/v2-truncated", test_encode_message_v2_truncated, setup, tear_down, 0,
+     NULL},
+    {"/v2-corrupt", test_encode_message_v2_corrupt, setup, tear_down, 0, NULL},
+    {"/legacy-type", test_encode_message_legacy_type, setup, tear_down, 0,
+     NULL},
     {NULL, NULL, NULL, NULL, 0, NULL},
 };
 
@@ -797,5 +1857,8 @@ MunitSuite raft_encoding_suites[] = {
     {"/decode-configuration", decode_configuration_tests, NULL, 1, 0},
     {"/encode-append_entries", encode_append_entries_tests, NULL, 1, 0},
     {"/decode-append-entries", decode_append_entries_tests, NULL, 1, 0},
+    {"/encode-entries-batch", encode_entries_batch_tests, NULL, 1, 0},
+    {"/inflate-entries-batch", inflate_entries_batch_tests, NULL, 1, 0},
+    {"/encode-message", encode_message_tests, NULL, 1, 0},
     {NULL, NULL, NULL, 0, 0},
 };
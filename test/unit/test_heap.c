@@ -0,0 +1,142 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "../../include/raft.h"
+
+#include "../lib/heap.h"
+#include "../lib/munit.h"
+
+/**
+ * Helpers
+ */
+
+struct fixture
+{
+    struct raft_heap heap;
+};
+
+/**
+ * Setup and tear down
+ */
+
+static void *setup(const MunitParameter params[], void *user_data)
+{
+    struct fixture *f = munit_malloc(sizeof *f);
+
+    (void)user_data;
+
+    test_heap_setup(params, &f->heap);
+
+    /* Exercise the fallback used by heaps with no aligned_alloc routine. */
+    f->heap.aligned_alloc = NULL;
+
+    return f;
+}
+
+static void tear_down(void *data)
+{
+    struct fixture *f = data;
+
+    test_heap_tear_down(&f->heap);
+
+    free(f);
+}
+
+/**
+ * raft_aligned_alloc
+ */
+
+/* The returned memory is aligned and usable, and raft_free() releases it. */
+static MunitResult test_aligned_alloc_fallback(const MunitParameter params[],
+                                               void *data)
+{
+    size_t alignments[] = {1, 8, 512, RAFT_BATCH_ALIGNMENT};
+    unsigned i;
+
+    (void)params;
+    (void)data;
+
+    for (i = 0; i < sizeof alignments / sizeof *alignments; i++) {
+        uint8_t *ptr = raft_aligned_alloc(alignments[i], 100);
+
+        munit_assert_ptr_not_null(ptr);
+        munit_assert_int((uintptr_t)ptr % alignments[i], ==, 0);
+
+        memset(ptr, 0xff, 100);
+
+        raft_free(ptr);
+    }
+
+    return MUNIT_OK;
+}
+
+/* Aligned and regular allocations can be outstanding at the same time, and be
+ * released in any order. */
+static MunitResult test_aligned_alloc_many(const MunitParameter params[],
+                                           void *data)
+{
+    void *ptrs[200];
+    unsigned i;
+
+    (void)params;
+    (void)data;
+
+    for (i = 0; i < 200; i++) {
+        if (i % 3 == 0) {
+            ptrs[i] = raft_malloc(16);
+        } else {
+            ptrs[i] = raft_aligned_alloc(64, 16);
+            munit_assert_int((uintptr_t)ptrs[i] % 64, ==, 0);
+        }
+        munit_assert_ptr_not_null(ptrs[i]);
+    }
+
+    for (i = 0; i < 200; i += 2) {
+        raft_free(ptrs[i]);
+    }
+
+    for (i = 200; i > 0; i -= 2) {
+        raft_free(ptrs[i - 1]);
+    }
+
+    return MUNIT_OK;
+}
+
+static char *oom_heap_fault_delay[] = {"0", NULL};
+static char *oom_heap_fault_repeat[] = {"1", NULL};
+
+static MunitParameterEnum oom_params[] = {
+    {TEST_HEAP_FAULT_DELAY, oom_heap_fault_delay},
+    {TEST_HEAP_FAULT_REPEAT, oom_heap_fault_repeat},
+    {NULL, NULL},
+};
+
+/* Out of memory failures are reported. */
+static MunitResult test_aligned_alloc_oom(const MunitParameter params[],
+                                          void *data)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    test_heap_fault_enable(&f->heap);
+
+    munit_assert_ptr_null(raft_aligned_alloc(RAFT_BATCH_ALIGNMENT, 100));
+
+    return MUNIT_OK;
+}
+
+static MunitTest aligned_alloc_tests[] = {
+    {"/fallback", test_aligned_alloc_fallback, setup, tear_down, 0, NULL},
+    {"/many", test_aligned_alloc_many, setup, tear_down, 0, NULL},
+    {"/oom", test_aligned_alloc_oom, setup, tear_down, 0, oom_params},
+    {NULL, NULL, NULL, NULL, 0, NULL},
+};
+
+/**
+ * Suite
+ */
+MunitSuite raft_heap_suites[] = {
+    {"/aligned-alloc", aligned_alloc_tests, NULL, 1, 0},
+    {NULL, NULL, NULL, 0, 0},
+};
@@ -72,7 +72,7 @@ static MunitResult test_queue_push_first(const MunitParameter params[],
                                          void *data)
 {
     struct fixture *f = data;
-    size_t id;
+    raft_request_id id;
     int rv;
 
     (void)params;
@@ -96,8 +96,8 @@ static MunitResult test_queue_push_second(const MunitParameter params[],
 {
     struct fixture *f = data;
     struct raft_io_request *request;
-    size_t id1;
-    size_t id2;
+    raft_request_id id1;
+    raft_request_id id2;
     int rv;
 
     (void)params;
@@ -138,9 +138,9 @@ static MunitResult test_queue_push_third(const MunitParameter params[],
 {
     struct fixture *f = data;
     struct raft_io_request *request;
-    size_t id1;
-    size_t id2;
-    size_t id3;
+    raft_request_id id1;
+    raft_request_id id2;
+    raft_request_id id3;
     int rv;
 
     (void)params;
@@ -177,7 +177,7 @@ static MunitResult test_queue_push_third(const MunitParameter params[],
 static MunitResult test_queue_oom(const MunitParameter params[], void *data)
 {
     struct fixture *f = data;
-    size_t id;
+    raft_request_id id;
     int rv;
 
     (void)params;
@@ -212,7 +212,7 @@ static MunitResult test_queue_pop(const MunitParameter params[], void *data)
 {
     struct fixture *f = data;
     struct raft_io_request *request;
-    size_t id;
+    raft_request_id id;
     int rv;
 
     (void)params;
@@ -235,8 +235,87 @@ static MunitResult test_queue_pop(const MunitParameter params[], void *data)
     return MUNIT_OK;
 }
 
+/* A popped slot is reused by the next push, with a different ID, and the old ID
+ * doesn't match any request anymore. */
+static MunitResult test_queue_pop_reuse(const MunitParameter params[],
+                                        void *data)
+{
+    struct fixture *f = data;
+    struct raft_io_request *request;
+    raft_request_id id1;
+    raft_request_id id2;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 2, 1, 2);
+
+    rv = raft_io__queue_push(&f->raft, &id1);
+    munit_assert_int(rv, ==, 0);
+
+    request = raft_io__queue_get(&f->raft, id1);
+    request->type = RAFT_IO_WRITE_LOG;
+    munit_assert_ptr_equal(raft_io__queue_lookup(&f->raft, id1), request);
+
+    raft_io__queue_pop(&f->raft, id1);
+    munit_assert_ptr_null(raft_io__queue_lookup(&f->raft, id1));
+
+    rv = raft_io__queue_push(&f->raft, &id2);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(id2, !=, id1);
+    munit_assert_ptr_equal(raft_io__queue_get(&f->raft, id2), request);
+
+    request->type = RAFT_IO_WRITE_LOG;
+    munit_assert_ptr_null(raft_io__queue_lookup(&f->raft, id1));
+    munit_assert_ptr_equal(raft_io__queue_lookup(&f->raft, id2), request);
+
+    raft_io__queue_pop(&f->raft, id2);
+
+    return MUNIT_OK;
+}
+
+/* An old ID still doesn't match the request in its slot after the slot has
+ * been reused many thousands of times. */
+static MunitResult test_queue_pop_reuse_many(const MunitParameter params[],
+                                             void *data)
+{
+    struct fixture *f = data;
+    struct raft_io_request *request;
+    raft_request_id id1;
+    raft_request_id id2;
+    unsigned i;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 2, 1, 2);
+
+    rv = raft_io__queue_push(&f->raft, &id1);
+    munit_assert_int(rv, ==, 0);
+
+    request = raft_io__queue_get(&f->raft, id1);
+    request->type = RAFT_IO_WRITE_LOG;
+    raft_io__queue_pop(&f->raft, id1);
+
+    for (i = 0; i < 65536; i++) {
+        rv = raft_io__queue_push(&f->raft, &id2);
+        munit_assert_int(rv, ==, 0);
+
+        request = raft_io__queue_get(&f->raft, id2);
+        request->type = RAFT_IO_WRITE_LOG;
+        munit_assert_ptr_null(raft_io__queue_lookup(&f->raft, id1));
+
+        raft_io__queue_pop(&f->raft, id2);
+    }
+
+    return MUNIT_OK;
+}
+
 static MunitTest queue_pop_tests[] = {
     {"/", test_queue_pop, setup, tear_down, 0, NULL},
+    {"/reuse", test_queue_pop_reuse, setup, tear_down, 0, NULL},
+    {"/reuse-many", test_queue_pop_reuse_many, setup, tear_down, 0, NULL},
     {NULL, NULL, NULL, NULL, 0, NULL},
 };
 
@@ -292,8 +371,182 @@ static MunitResult test_update_commit(const MunitParameter params[], void *data)
     return MUNIT_OK;
 }
 
+/* A completion for a request that was already completed is ignored. */
+static MunitResult test_stale_completion(const MunitParameter params[],
+                                         void *data)
+{
+    struct fixture *f = data;
+    struct test_io_request event;
+    struct raft_entry *entry = raft_malloc(sizeof *entry);
+    const struct raft_server *server;
+    struct raft_append_entries_args args;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 2, 1, 2);
+
+    entry->type = RAFT_LOG_COMMAND;
+    entry->term = 1;
+    entry->buf.base = NULL;
+    entry->buf.len = 0;
+    entry->batch = NULL;
+
+    server = raft_configuration__get(&f->raft.configuration, 2);
+
+    args.term = 1;
+    args.leader_id = server->id;
+    args.prev_log_index = 1;
+    args.prev_log_term = 1;
+    args.entries = entry;
+    args.n = 1;
+    args.leader_commit = 2;
+
+    rv = raft_handle_append_entries(&f->raft, server, &args);
+    munit_assert_int(rv, ==, 0);
+
+    test_io_get_one_request(f->raft.io, RAFT_IO_WRITE_LOG, &event);
+    test_io_flush(f->raft.io);
+
+    raft_handle_io(&f->raft, event.id, 0);
+    munit_assert_int(raft_log__n_entries(&f->raft.log), ==, 2);
+
+    raft_handle_io(&f->raft, event.id, 0);
+    munit_assert_int(raft_log__n_entries(&f->raft.log), ==, 2);
+
+    return MUNIT_OK;
+}
+
 static MunitTest handle_write_log_tests[] = {
     {"/update-commit", test_update_commit, setup, tear_down, 0, NULL},
+    {"/stale", test_stale_completion, setup, tear_down, 0, NULL},
+    {NULL, NULL, NULL, NULL, 0, NULL},
+};
+
+/**
+ *
+ * raft_handle_io_batch
+ *
+ */
+
+/* The completions of the leader's own write and of the AppendEntries RPCs sent
+ * to followers are processed together. */
+static MunitResult test_batch_leader(const MunitParameter params[], void *data)
+{
+    struct fixture *f = data;
+    struct test_io_request *requests;
+    raft_request_id ids[TEST_IO_REQUEST_QUEUE_SIZE];
+    int statuses[TEST_IO_REQUEST_QUEUE_SIZE];
+    struct raft_buffer buf;
+    size_t n;
+    size_t i;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 3, 1, 3);
+    test_become_leader(&f->raft);
+
+    buf.base = NULL;
+    buf.len = 0;
+
+    rv = raft_accept(&f->raft, &buf, 1);
+    munit_assert_int(rv, ==, 0);
+
+    test_io_get_requests(f->raft.io, RAFT_IO_APPEND_ENTRIES, &requests, &n);
+    munit_assert_int(n, ==, 2);
+    for (i = 0; i < n; i++) {
+        ids[i] = requests[i].id;
+        statuses[i] = 0;
+    }
+    free(requests);
+
+    test_io_get_requests(f->raft.io, RAFT_IO_WRITE_LOG, &requests, &n);
+    munit_assert_int(n, ==, 1);
+    ids[2] = requests[0].id;
+    statuses[2] = 0;
+    free(requests);
+
+    test_io_flush(f->raft.io);
+
+    raft_handle_io_batch(&f->raft, ids, statuses, 3);
+
+    /* Our own log is persisted up to the new entry, and all requests are
+     * done. */
+    munit_assert_int(f->raft.leader_state.match_index[0], ==, 2);
+
+    for (i = 0; i < 3; i++) {
+        munit_assert_ptr_null(raft_io__queue_lookup(&f->raft, ids[i]));
+    }
+
+    return MUNIT_OK;
+}
+
+/* A follower write is acknowledged to the leader once the batch is processed,
+ * and stale completions in the batch are skipped. */
+static MunitResult test_batch_follower(const MunitParameter params[],
+                                       void *data)
+{
+    struct fixture *f = data;
+    struct test_io_request event;
+    struct test_io_request *requests;
+    struct raft_entry *entry = raft_malloc(sizeof *entry);
+    const struct raft_server *server;
+    struct raft_append_entries_args args;
+    raft_request_id ids[2];
+    int statuses[2] = {0, 0};
+    size_t n;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 2, 1, 2);
+
+    entry->type = RAFT_LOG_COMMAND;
+    entry->term = 1;
+    entry->buf.base = NULL;
+    entry->buf.len = 0;
+    entry->batch = NULL;
+
+    server = raft_configuration__get(&f->raft.configuration, 2);
+
+    args.term = 1;
+    args.leader_id = server->id;
+    args.prev_log_index = 1;
+    args.prev_log_term = 1;
+    args.entries = entry;
+    args.n = 1;
+    args.leader_commit = 2;
+
+    rv = raft_handle_append_entries(&f->raft, server, &args);
+    munit_assert_int(rv, ==, 0);
+
+    test_io_get_one_request(f->raft.io, RAFT_IO_WRITE_LOG, &event);
+    test_io_flush(f->raft.io);
+
+    ids[0] = event.id;
+    ids[1] = event.id;
+
+    raft_handle_io_batch(&f->raft, ids, statuses, 2);
+
+    munit_assert_int(raft_log__n_entries(&f->raft.log), ==, 2);
+    munit_assert_int(f->raft.commit_index, ==, 2);
+
+    /* A single result was sent. */
+    test_io_get_requests(f->raft.io, RAFT_IO_APPEND_ENTRIES_RESULT, &requests,
+                         &n);
+    munit_assert_int(n, ==, 1);
+    munit_assert_true(requests[0].append_entries_response.result.success);
+    munit_assert_int(
+        requests[0].append_entries_response.result.last_log_index, ==, 2);
+    free(requests);
+
+    return MUNIT_OK;
+}
+
+static MunitTest handle_io_batch_tests[] = {
+    {"/leader", test_batch_leader, setup, tear_down, 0, NULL},
+    {"/follower", test_batch_follower, setup, tear_down, 0, NULL},
     {NULL, NULL, NULL, NULL, 0, NULL},
 };
 
@@ -305,5 +558,6 @@ MunitSuite raft_io_suites[] = {
     {"/queue-push", queue_push_tests, NULL, 1, 0},
     {"/queue-pop", queue_pop_tests, NULL, 1, 0},
     {"/write_log", handle_write_log_tests, NULL, 1, 0},
+    {"/handle-io-batch", handle_io_batch_tests, NULL, 1, 0},
     {NULL, NULL, NULL, 0, 0},
 };
@@ -0,0 +1,940 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "../../include/raft.h"
+
+#include "../../src/configuration.h"
+#include "../../src/io.h"
+#include "../../src/log.h"
+
+#include "../lib/heap.h"
+#include "../lib/io.h"
+#include "../lib/logger.h"
+#include "../lib/munit.h"
+
+/**
+ * Helpers
+ */
+
+struct fixture
+{
+    struct raft_heap heap;
+    struct raft_logger logger;
+    struct raft_io transport;
+    struct raft_io io;
+    struct raft raft;
+    char dir[64];
+    int flags;
+};
+
+/**
+ * Return true if there is any pending write log or metadata request.
+ */
+static bool __has_pending_writes(struct fixture *f)
+{
+    size_t i;
+
+    for (i = 0; i < f->raft.io_queue.size; i++) {
+        switch (f->raft.io_queue.requests[i].type) {
+            case RAFT_IO_WRITE_LOG:
+            case RAFT_IO_WRITE_METADATA:
+                return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Wait for all pending write log and metadata requests to complete.
+ */
+static void __wait(struct fixture *f)
+{
+    while (__has_pending_writes(f)) {
+        struct pollfd fds[1];
+        int rv;
+
+        fds[0].fd = raft_io_file_fd(&f->io);
+        fds[0].events = POLLIN;
+
+        rv = poll(fds, 1, 5000);
+        munit_assert_int(rv, ==, 1);
+
+        raft_io_file_poll(&f->io, &f->raft);
+    }
+}
+
+/**
+ * Close the file I/O instance and open it again against the same directory.
+ */
+static void __reopen(struct fixture *f)
+{
+    int rv;
+
+    raft_io_file_close(&f->io);
+
+    rv = raft_io_file_init(&f->io, &f->transport, f->dir, f->flags);
+    munit_assert_int(rv, ==, 0);
+}
+
+/**
+ * Load the persisted state and release it, returning the number of entries.
+ */
+static size_t __load(struct fixture *f, raft_term *term, unsigned *voted_for)
+{
+    struct raft_entry *entries;
+    void *batch = NULL;
+    size_t n;
+    size_t i;
+    int rv;
+
+    rv = raft_io_file_load(&f->io, term, voted_for, &entries, &n);
+    munit_assert_int(rv, ==, 0);
+
+    for (i = 0; i < n; i++) {
+        if (entries[i].batch != batch) {
+            batch = entries[i].batch;
+            raft_release_entries_batch(batch);
+        }
+    }
+
+    if (entries != NULL) {
+        raft_free(entries);
+    }
+
+    return n;
+}
+
+/**
+ * Write the given entries as if they were received from server 2 acting as
+ * leader, and wait for the write to complete.
+ */
+static void __receive(struct fixture *f,
+                      raft_index index,
+                      struct raft_entry *entries,
+                      unsigned n)
+{
+    struct raft_io_request *request;
+    raft_request_id request_id;
+    int rv;
+
+    rv = raft_io__queue_push(&f->raft, &request_id);
+    munit_assert_int(rv, ==, 0);
+
+    request = raft_io__queue_get(&f->raft, request_id);
+    request->type = RAFT_IO_WRITE_LOG;
+    request->index = index;
+    request->entries = entries;
+    request->n = n;
+    request->leader_id = 2;
+    request->leader_commit = index + n - 1;
+
+    rv = f->io.write_log(&f->io, request_id, entries, n);
+    munit_assert_int(rv, ==, 0);
+
+    __wait(f);
+}
+
+/**
+ * Write the initial term and configuration entry, as if they were received
+ * from server 2 acting as leader.
+ */
+static void __bootstrap(struct fixture *f)
+{
+    struct raft_configuration configuration;
+    struct raft_entry *entries;
+    struct raft_buffer buf;
+    int rv;
+
+    raft_configuration_init(&configuration);
+
+    rv = raft_configuration_add(&configuration, 1, "1", true);
+    munit_assert_int(rv, ==, 0);
+
+    rv = raft_configuration_add(&configuration, 2, "2", true);
+    munit_assert_int(rv, ==, 0);
+
+    rv = raft_encode_configuration(&configuration, &buf);
+    munit_assert_int(rv, ==, 0);
+
+    raft_configuration_close(&configuration);
+
+    rv = raft_decode_configuration(&buf, &f->raft.configuration);
+    munit_assert_int(rv, ==, 0);
+
+    rv = f->io.write_term(&f->io, 1);
+    munit_assert_int(rv, ==, 0);
+
+    f->raft.current_term = 1;
+
+    entries = raft_malloc(sizeof *entries);
+    munit_assert_ptr_not_null(entries);
+
+    entries[0].term = 1;
+    entries[0].type = RAFT_LOG_CONFIGURATION;
+    entries[0].buf = buf;
+    entries[0].batch = buf.base;
+
+    __receive(f, 1, entries, 1);
+
+    munit_assert_int(raft_log__n_entries(&f->raft.log), ==, 1);
+    munit_assert_int(f->raft.commit_index, ==, 1);
+}
+
+/**
+ * Convert to leader by winning an election against server 2. This is the same
+ * as test_become_leader(), except that network requests are flushed using the
+ * test transport.
+ */
+static void __become_leader(struct fixture *f)
+{
+    const struct raft_server *server;
+    struct raft_request_vote_result result;
+    int rv;
+
+    rv = raft_tick(&f->raft, f->raft.election_timeout_rand + 100);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->raft.state, ==, RAFT_STATE_CANDIDATE);
+
+    server = raft_configuration__get(&f->raft.configuration, 2);
+
+    result.term = f->raft.current_term;
+    result.vote_granted = 1;
+    result.pre_vote = false;
+
+    rv = raft_handle_request_vote_response(&f->raft, server, &result);
+    munit_assert_int(rv, ==, 0);
+
+    /* The vote for ourselves is counted once it's durable. */
+    munit_assert_int(f->raft.state, ==, RAFT_STATE_CANDIDATE);
+
+    __wait(f);
+
+    munit_assert_int(f->raft.state, ==, RAFT_STATE_LEADER);
+
+    test_io_flush(&f->transport);
+}
+
+/**
+ * Submit a new entry with the given payload size as leader.
+ */
+static void __accept(struct fixture *f, size_t len)
+{
+    struct raft_buffer buf;
+    int rv;
+
+    buf.len = len;
+    buf.base = raft_malloc(len);
+    munit_assert_ptr_not_null(buf.base);
+    memset(buf.base, 'x', len);
+
+    rv = raft_accept(&f->raft, &buf, 1);
+    munit_assert_int(rv, ==, 0);
+}
+
+/**
+ * Setup and tear down
+ */
+
+static void *setup(const MunitParameter params[], void *user_data)
+{
+    struct fixture *f = munit_malloc(sizeof *f);
+    const char *threads = munit_parameters_get(params, "threads");
+    const char *direct = munit_parameters_get(params, "direct");
+    uint64_t id = 1;
+    int rv;
+
+    (void)user_data;
+
+    strcpy(f->dir, "/tmp/raft-test-XXXXXX");
+    munit_assert_ptr_not_null(mkdtemp(f->dir));
+
+    f->flags = 0;
+    if (threads != NULL && strcmp(threads, "1") == 0) {
+        f->flags |= RAFT_IO_FILE_THREADS;
+    }
+    if (direct != NULL && strcmp(direct, "1") == 0) {
+        f->flags |= RAFT_IO_FILE_DIRECT;
+    }
+
+    test_heap_setup(params, &f->heap);
+
+    test_logger_setup(params, &f->logger, id);
+
+    test_io_setup(params, &f->transport);
+
+    rv = raft_io_file_init(&f->io, &f->transport, f->dir, f->flags);
+    munit_assert_int(rv, ==, 0);
+
+    raft_init(&f->raft, &f->io, f, id);
+
+    raft_set_logger(&f->raft, &f->logger);
+
+    return f;
+}
+
+static void tear_down(void *data)
+{
+    struct fixture *f = data;
+    struct dirent *entry;
+    DIR *dir;
+
+    raft_io_file_close(&f->io);
+
+    raft_close(&f->raft);
+
+    test_io_tear_down(&f->transport);
+
+    test_logger_tear_down(&f->logger);
+
+    test_heap_tear_down(&f->heap);
+
+    dir = opendir(f->dir);
+    munit_assert_ptr_not_null(dir);
+    while ((entry = readdir(dir)) != NULL) {
+        char path[sizeof f->dir + 256];
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        sprintf(path, "%s/%s", f->dir, entry->d_name);
+        unlink(path);
+    }
+    closedir(dir);
+    rmdir(f->dir);
+
+    free(f);
+}
+
+static char *threads_values[] = {"0", "1", NULL};
+static char *direct_values[] = {"0", "1", NULL};
+
+static MunitParameterEnum params[] = {
+    {"threads", threads_values},
+    {"direct", direct_values},
+    {NULL, NULL},
+};
+
+/**
+ *
+ * raft_io_file_init
+ *
+ */
+
+/* A pristine directory has no term, vote or entries. */
+static MunitResult test_init_pristine(const MunitParameter params[],
+                                      void *data)
+{
+    struct fixture *f = data;
+    raft_term term;
+    unsigned voted_for;
+
+    (void)params;
+
+    munit_assert_int(__load(f, &term, &voted_for), ==, 0);
+
+    munit_assert_int(term, ==, 0);
+    munit_assert_int(voted_for, ==, 0);
+
+    return MUNIT_OK;
+}
+
+/* The given directory does not exist. */
+static MunitResult test_init_no_dir(const MunitParameter params[], void *data)
+{
+    struct fixture *f = data;
+    struct raft_io io;
+    int rv;
+
+    (void)params;
+
+    rv = raft_io_file_init(&io, &f->transport, "/non/existing/dir", f->flags);
+    munit_assert_int(rv, ==, RAFT_ERR_IO);
+
+    return MUNIT_OK;
+}
+
+static MunitTest init_tests[] = {
+    {"/pristine", test_init_pristine, setup, tear_down, 0, params},
+    {"/no-dir", test_init_no_dir, setup, tear_down, 0, params},
+    {NULL, NULL, NULL, NULL, 0, NULL},
+};
+
+/**
+ *
+ * write_term and write_vote
+ *
+ */
+
+/* The term and vote are persisted. */
+static MunitResult test_write_term_and_vote(const MunitParameter params[],
+                                            void *data)
+{
+    struct fixture *f = data;
+    raft_term term;
+    unsigned voted_for;
+    int rv;
+
+    (void)params;
+
+    rv = f->io.write_term(&f->io, 3);
+    munit_assert_int(rv, ==, 0);
+
+    rv = f->io.write_vote(&f->io, 2);
+    munit_assert_int(rv, ==, 0);
+
+    __reopen(f);
+
+    __load(f, &term, &voted_for);
+
+    munit_assert_int(term, ==, 3);
+    munit_assert_int(voted_for, ==, 2);
+
+    return MUNIT_OK;
+}
+
+/* Writing a new term resets the vote. */
+static MunitResult test_write_term_reset_vote(const MunitParameter params[],
+                                              void *data)
+{
+    struct fixture *f = data;
+    raft_term term;
+    unsigned voted_for;
+    int rv;
+
+    (void)params;
+
+    rv = f->io.write_vote(&f->io, 2);
+    munit_assert_int(rv, ==, 0);
+
+    rv = f->io.write_term(&f->io, 4);
+    munit_assert_int(rv, ==, 0);
+
+    __load(f, &term, &voted_for);
+
+    munit_assert_int(term, ==, 4);
+    munit_assert_int(voted_for, ==, 0);
+
+    return MUNIT_OK;
+}
+
+/* The term and vote written as part of an election are persisted. */
+static MunitResult test_write_term_metadata(const MunitParameter params[],
+                                            void *data)
+{
+    struct fixture *f = data;
+    raft_term term;
+    unsigned voted_for;
+    int rv;
+
+    (void)params;
+
+    __bootstrap(f);
+
+    rv = raft_tick(&f->raft, f->raft.election_timeout_rand + 100);
+    munit_assert_int(rv, ==, 0);
+
+    __wait(f);
+
+    __reopen(f);
+
+    __load(f, &term, &voted_for);
+
+    munit_assert_int(term, ==, 2);
+    munit_assert_int(voted_for, ==, 1);
+
+    return MUNIT_OK;
+}
+
+/* If a synchronous write has to wait for an in-flight metadata write, the
+ * eventfd still becomes readable, so the completion gets reported. */
+static MunitResult test_write_term_in_flight(const MunitParameter params[],
+                                             void *data)
+{
+    struct fixture *f = data;
+    struct pollfd fds[1];
+    int rv;
+
+    (void)params;
+
+    __bootstrap(f);
+
+    rv = raft_tick(&f->raft, f->raft.election_timeout_rand + 100);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_true(__has_pending_writes(f));
+
+    rv = f->io.write_term(&f->io, 3);
+    munit_assert_int(rv, ==, 0);
+
+    fds[0].fd = raft_io_file_fd(&f->io);
+    fds[0].events = POLLIN;
+
+    rv = poll(fds, 1, 2000);
+    munit_assert_int(rv, ==, 1);
+
+    raft_io_file_poll(&f->io, &f->raft);
+
+    munit_assert_false(__has_pending_writes(f));
+
+    return MUNIT_OK;
+}
+
+static MunitTest write_term_tests[] = {
+    {"/and-vote", test_write_term_and_vote, setup, tear_down, 0, params},
+    {"/reset-vote", test_write_term_reset_vote, setup, tear_down, 0, params},
+    {"/metadata", test_write_term_metadata, setup, tear_down, 0, params},
+    {"/in-flight", test_write_term_in_flight, setup, tear_down, 0, params},
+    {NULL, NULL, NULL, NULL, 0, NULL},
+};
+
+/**
+ *
+ * write_log
+ *
+ */
+
+/* Entries received from a leader are persisted before being appended. */
+static MunitResult test_write_log_follower(const MunitParameter params[],
+                                           void *data)
+{
+    struct fixture *f = data;
+    struct raft_entry *entries;
+    raft_term term;
+    unsigned voted_for;
+    size_t n;
+    int rv;
+
+    (void)params;
+
+    __bootstrap(f);
+
+    __reopen(f);
+
+    rv = raft_io_file_load(&f->io, &term, &voted_for, &entries, &n);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(term, ==, 1);
+    munit_assert_int(n, ==, 1);
+    munit_assert_int(entries[0].term, ==, 1);
+    munit_assert_int(entries[0].type, ==, RAFT_LOG_CONFIGURATION);
+    munit_assert_int(entries[0].buf.len, ==,
+                     raft_log__get(&f->raft.log, 1)->buf.len);
+    munit_assert_int(memcmp(entries[0].buf.base,
+                            raft_log__get(&f->raft.log, 1)->buf.base,
+                            entries[0].buf.len),
+                     ==, 0);
+
+    raft_release_entries_batch(entries[0].batch);
+    raft_free(entries);
+
+    return MUNIT_OK;
+}
+
+/* Several writes can be in flight at the same time, and their completion is
+ * notified in order. */
+static MunitResult test_write_log_concurrent(const MunitParameter params[],
+                                             void *data)
+{
+    struct fixture *f = data;
+    raft_term term;
+    unsigned voted_for;
+    size_t i;
+
+    (void)params;
+
+    __bootstrap(f);
+    __become_leader(f);
+
+    __accept(f, 5);
+    __accept(f, 16);
+    __accept(f, 1);
+
+    __wait(f);
+
+    i = raft_configuration__index(&f->raft.configuration, 1);
+    munit_assert_int(f->raft.leader_state.match_index[i], ==, 4);
+
+    __reopen(f);
+
+    munit_assert_int(__load(f, &term, &voted_for), ==, 4);
+    munit_assert_int(term, ==, 2);
+    munit_assert_int(voted_for, ==, 1);
+
+    return MUNIT_OK;
+}
+
+/* Entries received in an aligned batch are persisted. */
+static MunitResult test_write_log_aligned_batch(const MunitParameter params[],
+                                                void *data)
+{
+    struct fixture *f = data;
+    struct raft_entry *entries;
+    struct raft_buffer buf;
+    raft_term term;
+    unsigned voted_for;
+    size_t n;
+    int rv;
+
+    (void)params;
+
+    __bootstrap(f);
+
+    entries = raft_malloc(2 * sizeof *entries);
+    munit_assert_ptr_not_null(entries);
+
+    entries[0].term = 1;
+    entries[0].type = RAFT_LOG_COMMAND;
+    entries[0].buf.base = "hello";
+    entries[0].buf.len = 6;
+    entries[1].term = 1;
+    entries[1].type = RAFT_LOG_COMMAND;
+    entries[1].buf.base = "world";
+    entries[1].buf.len = 6;
+
+    rv = raft_encode_entries_batch(entries, 2, RAFT_BATCH_ALIGNED, &buf);
+    munit_assert_int(rv, ==, 0);
+
+    rv = raft_decode_entries_batch(&buf, entries, 2);
+    munit_assert_int(rv, ==, 0);
+
+    __receive(f, 2, entries, 2);
+
+    munit_assert_int(raft_log__n_entries(&f->raft.log), ==, 3);
+
+    __reopen(f);
+
+    rv = raft_io_file_load(&f->io, &term, &voted_for, &entries, &n);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(n, ==, 3);
+    munit_assert_string_equal(entries[1].buf.base, "hello");
+    munit_assert_string_equal(entries[2].buf.base, "world");
+
+    raft_release_entries_batch(entries[0].batch);
+    raft_free(entries);
+
+    return MUNIT_OK;
+}
+
+static MunitTest write_log_tests[] = {
+    {"/follower", test_write_log_follower, setup, tear_down, 0, params},
+    {"/concurrent", test_write_log_concurrent, setup, tear_down, 0, params},
+    {"/aligned-batch", test_write_log_aligned_batch, setup, tear_down, 0,
+     params},
+    {NULL, NULL, NULL, NULL, 0, NULL},
+};
+
+/**
+ *
+ * truncate_log
+ *
+ */
+
+/* Entries from the given index onward are removed. */
+static MunitResult test_truncate_log_tail(const MunitParameter params[],
+                                          void *data)
+{
+    struct fixture *f = data;
+    raft_term term;
+    unsigned voted_for;
+    int rv;
+
+    (void)params;
+
+    __bootstrap(f);
+    __become_leader(f);
+
+    __accept(f, 8);
+    __accept(f, 8);
+    __accept(f, 8);
+
+    __wait(f);
+
+    rv = f->io.truncate_log(&f->io, 3);
+    munit_assert_int(rv, ==, 0);
+
+    __reopen(f);
+
+    munit_assert_int(__load(f, &term, &voted_for), ==, 2);
+
+    return MUNIT_OK;
+}
+
+/* If the given index is in the middle of a batch, the entries preceeding it
+ * are retained. */
+static MunitResult test_truncate_log_batch(const MunitParameter params[],
+                                           void *data)
+{
+    struct fixture *f = data;
+    struct raft_buffer bufs[3];
+    struct raft_entry *entries;
+    raft_term term;
+    unsigned voted_for;
+    size_t n;
+    size_t i;
+    int rv;
+
+    (void)params;
+
+    __bootstrap(f);
+    __become_leader(f);
+
+    for (i = 0; i < 3; i++) {
+        bufs[i].len = 3;
+        bufs[i].base = raft_malloc(bufs[i].len);
+        munit_assert_ptr_not_null(bufs[i].base);
+        memset(bufs[i].base, 'a' + i, bufs[i].len);
+    }
+
+    rv = raft_accept(&f->raft, bufs, 3);
+    munit_assert_int(rv, ==, 0);
+
+    __wait(f);
+
+    rv = f->io.truncate_log(&f->io, 3);
+    munit_assert_int(rv, ==, 0);
+
+    __reopen(f);
+
+    rv = raft_io_file_load(&f->io, &term, &voted_for, &entries, &n);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(n, ==, 2);
+    munit_assert_int(entries[1].term, ==, 2);
+    munit_assert_int(entries[1].buf.len, ==, 3);
+    munit_assert_int(memcmp(entries[1].buf.base, "aaa", 3), ==, 0);
+
+    raft_release_entries_batch(entries[0].batch);
+    raft_free(entries);
+
+    return MUNIT_OK;
+}
+
+static MunitTest truncate_log_tests[] = {
+    {"/tail", test_truncate_log_tail, setup, tear_down, 0, params},
+    {"/batch", test_truncate_log_batch, setup, tear_down, 0, params},
+    {NULL, NULL, NULL, NULL, 0, NULL},
+};
+
+/**
+ *
+ * raft_io_file_load
+ *
+ */
+
+/* Entries spanning several closed segments are recovered in order. */
+static MunitResult test_load_closed_segments(const MunitParameter params[],
+                                             void *data)
+{
+    struct fixture *f = data;
+    struct raft_entry *entries;
+    raft_term term;
+    unsigned voted_for;
+    size_t len = 3 * 1024 * 1024;
+    size_t n;
+    size_t i;
+    int rv;
+
+    (void)params;
+
+    __bootstrap(f);
+    __become_leader(f);
+
+    /* Each segment is closed after 8 megabytes, so this spans three of them. */
+    for (i = 0; i < 7; i++) {
+        __accept(f, len);
+        __wait(f);
+    }
+
+    __reopen(f);
+
+    rv = raft_io_file_load(&f->io, &term, &voted_for, &entries, &n);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(n, ==, 8);
+    munit_assert_int(entries[0].type, ==, RAFT_LOG_CONFIGURATION);
+
+    for (i = 1; i < n; i++) {
+        uint8_t *data = entries[i].buf.base;
+        munit_assert_int(entries[i].term, ==, 2);
+        munit_assert_int(entries[i].buf.len, ==, len);
+        munit_assert_int(data[0], ==, 'x');
+        munit_assert_int(data[len - 1], ==, 'x');
+    }
+
+    /* Entries in different segments have different batches. */
+    munit_assert_ptr_not_equal(entries[0].batch, entries[4].batch);
+    munit_assert_ptr_not_equal(entries[4].batch, entries[7].batch);
+
+    for (i = 0; i < n; i++) {
+        if (i == 0 || entries[i].batch != entries[i - 1].batch) {
+            raft_release_entries_batch(entries[i].batch);
+        }
+    }
+    raft_free(entries);
+
+    return MUNIT_OK;
+}
+
+/* The mapping of a closed segment is released along with the batch of its
+ * entries, while the other segments stay mapped. */
+static MunitResult test_load_unmap(const MunitParameter params[], void *data)
+{
+    struct fixture *f = data;
+    struct raft_entry *entries;
+    raft_term term;
+    unsigned voted_for;
+    long page_size = sysconf(_SC_PAGESIZE);
+    void *page1;
+    void *page2;
+    size_t n;
+    size_t i;
+    int rv;
+
+    (void)params;
+
+    __bootstrap(f);
+    __become_leader(f);
+
+    /* Fill the first segment and start a second one. */
+    for (i = 0; i < 4; i++) {
+        __accept(f, 3 * 1024 * 1024);
+        __wait(f);
+    }
+
+    __reopen(f);
+
+    rv = raft_io_file_load(&f->io, &term, &voted_for, &entries, &n);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(n, ==, 5);
+
+    page1 = (void *)((uintptr_t)entries[1].buf.base & ~(page_size - 1));
+    page2 = (void *)((uintptr_t)entries[4].buf.base & ~(page_size - 1));
+    munit_assert_ptr_not_equal(entries[1].batch, entries[4].batch);
+
+    munit_assert_int(msync(page1, page_size, MS_ASYNC), ==, 0);
+
+    raft_release_entries_batch(entries[0].batch);
+
+    munit_assert_int(msync(page1, page_size, MS_ASYNC), ==, -1);
+    munit_assert_int(errno, ==, ENOMEM);
+    munit_assert_int(msync(page2, page_size, MS_ASYNC), ==, 0);
+
+    raft_release_entries_batch(entries[4].batch);
+    raft_free(entries);
+
+    return MUNIT_OK;
+}
+
+/* Corrupted data in a closed segment is detected. */
+static MunitResult test_load_corrupt(const MunitParameter params[], void *data)
+{
+    struct fixture *f = data;
+    struct raft_entry *entries;
+    raft_term term;
+    unsigned voted_for;
+    char path[sizeof f->dir + 32];
+    size_t n;
+    size_t i;
+    int fd;
+    int rv;
+
+    (void)params;
+
+    __bootstrap(f);
+    __become_leader(f);
+
+    /* Fill the first segment and start a second one. */
+    for (i = 0; i < 4; i++) {
+        __accept(f, 3 * 1024 * 1024);
+        __wait(f);
+    }
+
+    sprintf(path, "%s/%020d", f->dir, 1);
+    fd = open(path, O_WRONLY);
+    munit_assert_int(fd, >=, 0);
+    munit_assert_int(pwrite(fd, "?", 1, 5 * 1024 * 1024), ==, 1);
+    close(fd);
+
+    __reopen(f);
+
+    rv = raft_io_file_load(&f->io, &term, &voted_for, &entries, &n);
+    munit_assert_int(rv, ==, RAFT_ERR_CHECKSUM);
+
+    return MUNIT_OK;
+}
+
+/* Segments never hold compressed batches, so one flagged as such is reported
+ * as malformed. */
+static MunitResult test_load_compressed(const MunitParameter params[],
+                                        void *data)
+{
+    struct fixture *f = data;
+    struct raft_entry *entries;
+    raft_term term;
+    unsigned voted_for;
+    char path[sizeof f->dir + 32];
+    off_t offset;
+    uint8_t flags = 1;
+    size_t n;
+    size_t i;
+    int fd;
+    int rv;
+
+    (void)params;
+
+    __bootstrap(f);
+    __become_leader(f);
+
+    /* Fill the first segment and start a second one. */
+    for (i = 0; i < 4; i++) {
+        __accept(f, 3 * 1024 * 1024);
+        __wait(f);
+    }
+
+    /* Set the flags byte in the header of the first batch. */
+    offset = f->flags & RAFT_IO_FILE_DIRECT ? RAFT_BATCH_ALIGNMENT : 16;
+
+    sprintf(path, "%s/%020d", f->dir, 1);
+    fd = open(path, O_WRONLY);
+    munit_assert_int(fd, >=, 0);
+    munit_assert_int(pwrite(fd, &flags, 1, offset + 5), ==, 1);
+    close(fd);
+
+    __reopen(f);
+
+    rv = raft_io_file_load(&f->io, &term, &voted_for, &entries, &n);
+    munit_assert_int(rv, ==, RAFT_ERR_MALFORMED);
+
+    return MUNIT_OK;
+}
+
+static MunitTest load_tests[] = {
+    {"/closed-segments", test_load_closed_segments, setup, tear_down, 0,
+     params},
+    {"/corrupt", test_load_corrupt, setup, tear_down, 0, params},
+    {"/compressed", test_load_compressed, setup, tear_down, 0, params},
+    {"/unmap", test_load_unmap, setup, tear_down, 0, params},
+    {NULL, NULL, NULL, NULL, 0, NULL},
+};
+
+/**
+ * Test suite
+ */
+
+MunitSuite raft_io_file_suites[] = {
+    {"/init", init_tests, NULL, 1, 0},
+    {"/write-term", write_term_tests, NULL, 1, 0},
+    {"/write-log", write_log_tests, NULL, 1, 0},
+    {"/truncate-log", truncate_log_tests, NULL, 1, 0},
+    {"/load", load_tests, NULL, 1, 0},
+    {NULL, NULL, NULL, 0, 0},
+};
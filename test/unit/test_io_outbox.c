@@ -0,0 +1,304 @@
+#include "../../include/raft.h"
+
+#include "../../src/configuration.h"
+#include "../../src/log.h"
+
+#include "../lib/heap.h"
+#include "../lib/logger.h"
+#include "../lib/munit.h"
+
+/**
+ * Helpers
+ */
+
+struct fixture
+{
+    struct raft_heap heap;
+    struct raft_logger logger;
+    struct raft_io io;
+    struct raft raft;
+    struct raft_ready ready;
+};
+
+/**
+ * Load the state of a fresh two-servers cluster, as the user would do from its
+ * own storage: term 1 and a log with the configuration entry.
+ */
+static void __load(struct fixture *f)
+{
+    struct raft_buffer buf;
+    int rv;
+
+    rv = raft_configuration_add(&f->raft.configuration, 1, "1", true);
+    munit_assert_int(rv, ==, 0);
+
+    rv = raft_configuration_add(&f->raft.configuration, 2, "2", true);
+    munit_assert_int(rv, ==, 0);
+
+    rv = raft_encode_configuration(&f->raft.configuration, &buf);
+    munit_assert_int(rv, ==, 0);
+
+    rv = raft_log__append(&f->raft.log, 1, RAFT_LOG_CONFIGURATION, &buf, NULL);
+    munit_assert_int(rv, ==, 0);
+
+    f->raft.current_term = 1;
+    f->raft.commit_index = 1;
+    f->raft.last_applied = 1;
+}
+
+/**
+ * Collect the outbox, asserting that it contains the given number of writes
+ * and messages.
+ */
+static void __ready(struct fixture *f, unsigned n_writes, unsigned n_messages)
+{
+    raft_io_outbox_ready(&f->io, &f->raft, &f->ready);
+
+    munit_assert_int(f->ready.n_writes, ==, n_writes);
+    munit_assert_int(f->ready.n_messages, ==, n_messages);
+}
+
+/**
+ * Acknowledge the outbox last collected.
+ */
+static void __advance(struct fixture *f)
+{
+    raft_io_outbox_advance(&f->io, &f->raft, 0);
+}
+
+/**
+ * Make the server win an election.
+ */
+static void __become_leader(struct fixture *f)
+{
+    const struct raft_server *server;
+    struct raft_request_vote_result result;
+    int rv;
+
+    rv = raft_tick(&f->raft, f->raft.election_timeout_rand + 100);
+    munit_assert_int(rv, ==, 0);
+
+    __ready(f, 0, 1);
+    __advance(f);
+
+    server = raft_configuration__get(&f->raft.configuration, 2);
+
+    result.term = 2;
+    result.vote_granted = true;
+    result.pre_vote = false;
+
+    rv = raft_handle_request_vote_response(&f->raft, server, &result);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->raft.state, ==, RAFT_STATE_LEADER);
+}
+
+/**
+ * Setup and tear down
+ */
+
+static void *setup(const MunitParameter params[], void *user_data)
+{
+    struct fixture *f = munit_malloc(sizeof *f);
+    uint64_t id = 1;
+    int rv;
+
+    (void)user_data;
+
+    test_heap_setup(params, &f->heap);
+
+    test_logger_setup(params, &f->logger, id);
+
+    rv = raft_io_outbox_init(&f->io);
+    munit_assert_int(rv, ==, 0);
+
+    raft_init(&f->raft, &f->io, f, id);
+
+    raft_set_logger(&f->raft, &f->logger);
+
+    __load(f);
+
+    return f;
+}
+
+static void tear_down(void *data)
+{
+    struct fixture *f = data;
+
+    raft_close(&f->raft);
+
+    raft_io_outbox_close(&f->io);
+
+    test_logger_tear_down(&f->logger);
+
+    test_heap_tear_down(&f->heap);
+
+    free(f);
+}
+
+/**
+ * raft_io_outbox_ready
+ */
+
+/* Starting an election queues the new term and vote, to be saved before the
+ * RequestVote requests are sent. */
+static MunitResult test_ready_election(const MunitParameter params[],
+                                       void *data)
+{
+    struct fixture *f = data;
+    const struct raft_ready_message *message;
+    int rv;
+
+    (void)params;
+
+    rv = raft_tick(&f->raft, f->raft.election_timeout_rand + 100);
+    munit_assert_int(rv, ==, 0);
+
+    __ready(f, 0, 1);
+
+    munit_assert_true(f->ready.save_term_and_vote);
+    munit_assert_int(f->ready.term, ==, 2);
+    munit_assert_int(f->ready.voted_for, ==, 1);
+
+    message = &f->ready.messages[0];
+    munit_assert_int(message->server->id, ==, 2);
+    munit_assert_int(message->message.type, ==, RAFT_IO_REQUEST_VOTE);
+    munit_assert_int(message->message.request_vote.term, ==, 2);
+
+    __advance(f);
+
+    /* Nothing else happened. */
+    __ready(f, 0, 0);
+    munit_assert_false(f->ready.save_term_and_vote);
+    __advance(f);
+
+    return MUNIT_OK;
+}
+
+/* Entries appended by a follower are acknowledged to the leader once the
+ * outbox holding their write is advanced. */
+static MunitResult test_ready_follower(const MunitParameter params[],
+                                       void *data)
+{
+    struct fixture *f = data;
+    const struct raft_server *server;
+    struct raft_append_entries_args args;
+    const struct raft_ready_message *message;
+    int rv;
+
+    (void)params;
+
+    server = raft_configuration__get(&f->raft.configuration, 2);
+
+    args.term = 1;
+    args.leader_id = 2;
+    args.prev_log_index = 1;
+    args.prev_log_term = 1;
+    args.leader_commit = 2;
+    args.entries = raft_malloc(sizeof *args.entries);
+    args.n = 1;
+    args.checksum = 0;
+    args.compressed = 0;
+    args.batch = NULL;
+
+    args.entries[0].term = 1;
+    args.entries[0].type = RAFT_LOG_COMMAND;
+    args.entries[0].buf.base = raft_malloc(8);
+    args.entries[0].buf.len = 8;
+    args.entries[0].batch = NULL;
+
+    rv = raft_handle_append_entries(&f->raft, server, &args);
+    munit_assert_int(rv, ==, 0);
+
+    __ready(f, 1, 0);
+    munit_assert_int(f->ready.writes[0].truncate, ==, 0);
+    munit_assert_int(f->ready.writes[0].n, ==, 1);
+    munit_assert_int(f->ready.n_committed, ==, 0);
+    __advance(f);
+
+    /* The reply lands in the new outbox, along with the entry committed by
+     * the leader. */
+    __ready(f, 0, 1);
+
+    message = &f->ready.messages[0];
+    munit_assert_int(message->message.type, ==, RAFT_IO_APPEND_ENTRIES_RESULT);
+    munit_assert_true(message->message.append_entries_result.success);
+    munit_assert_int(message->message.append_entries_result.last_log_index,
+                     ==, 2);
+
+    munit_assert_int(f->ready.n_committed, ==, 1);
+    munit_assert_int(f->ready.committed[0].type, ==, RAFT_LOG_COMMAND);
+
+    __advance(f);
+
+    munit_assert_int(f->raft.last_applied, ==, 2);
+
+    return MUNIT_OK;
+}
+
+/* A leader writes new entries to its log while sending them to followers, and
+ * commits them once both are acknowledged. */
+static MunitResult test_ready_leader(const MunitParameter params[], void *data)
+{
+    struct fixture *f = data;
+    const struct raft_server *server;
+    struct raft_append_entries_result result;
+    struct raft_buffer buf;
+    int rv;
+
+    (void)params;
+
+    __become_leader(f);
+
+    /* Heartbeats sent upon election. */
+    __ready(f, 0, 1);
+    __advance(f);
+
+    buf.base = raft_malloc(8);
+    buf.len = 8;
+
+    rv = raft_accept(&f->raft, &buf, 1);
+    munit_assert_int(rv, ==, 0);
+
+    __ready(f, 1, 1);
+    munit_assert_int(f->ready.writes[0].n, ==, 1);
+    munit_assert_int(f->ready.messages[0].message.type, ==,
+                     RAFT_IO_APPEND_ENTRIES);
+    munit_assert_int(f->ready.messages[0].message.append_entries.n, ==, 1);
+    __advance(f);
+
+    server = raft_configuration__get(&f->raft.configuration, 2);
+
+    result.term = 2;
+    result.success = true;
+    result.last_log_index = 2;
+
+    rv = raft_handle_append_entries_response(&f->raft, server, &result);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->raft.commit_index, ==, 2);
+
+    __ready(f, 0, 0);
+    munit_assert_int(f->ready.n_committed, ==, 1);
+    __advance(f);
+
+    munit_assert_int(f->raft.last_applied, ==, 2);
+
+    return MUNIT_OK;
+}
+
+static MunitTest ready_tests[] = {
+    {"/election", test_ready_election, setup, tear_down, 0, NULL},
+    {"/follower", test_ready_follower, setup, tear_down, 0, NULL},
+    {"/leader", test_ready_leader, setup, tear_down, 0, NULL},
+    {NULL, NULL, NULL, NULL, 0, NULL},
+};
+
+/**
+ * Test suite
+ */
+
+MunitSuite raft_io_outbox_suites[] = {
+    {"/ready", ready_tests, NULL, 1, 0},
+    {NULL, NULL, NULL, 0, 0},
+};
@@ -1,3 +1,4 @@
+#include "../../src/batch.h"
 #include "../../src/log.h"
 
 #include "../lib/heap.h"
@@ -931,6 +932,59 @@ static MunitResult test_truncate_acquired_oom(const MunitParameter params[],
     return MUNIT_OK;
 }
 
+/**
+ * Batch released with a custom function, counting its calls.
+ */
+struct __owner
+{
+    struct raft_batch__owner owner;
+    unsigned released;
+};
+
+static void __owner_release(struct raft_batch__owner *owner)
+{
+    ((struct __owner *)owner)->released++;
+}
+
+/* Truncate entries sharing a batch with a custom release function, while they
+ * are still referenced. The function is called once, when the last reference
+ * goes away. */
+static MunitResult test_truncate_owner(const MunitParameter params[],
+                                       void *data)
+{
+    struct fixture *f = data;
+    struct __owner owner = {{__owner_release}, 0};
+    struct raft_entry *entries;
+    struct raft_buffer buf;
+    void *batch = raft_batch__tag(&owner.owner);
+    unsigned n;
+    int i;
+    int rv;
+
+    (void)params;
+
+    __append_entry(f, 1);
+
+    for (i = 0; i < 2; i++) {
+        buf.base = NULL;
+        buf.len = 0;
+        rv = raft_log__append(&f->log, 1, RAFT_LOG_COMMAND, &buf, batch);
+        munit_assert_int(rv, ==, 0);
+    }
+
+    rv = raft_log__acquire(&f->log, 2, &entries, &n);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(n, ==, 2);
+
+    raft_log__truncate(&f->log, 2);
+    munit_assert_int(owner.released, ==, 0);
+
+    raft_log__release(&f->log, 2, entries, n);
+    munit_assert_int(owner.released, ==, 1);
+
+    return MUNIT_OK;
+}
+
 static MunitTest truncate_tests[] = {
     {"/1-last", test_truncate_1_last, setup, tear_down, 0, NULL},
     {"/2-last", test_truncate_2_last, setup, tear_down, 0, NULL},
@@ -941,6 +995,7 @@ static MunitTest truncate_tests[] = {
     {"/acquired", test_truncate_acquired, setup, tear_down, 0, NULL},
     {"/acquired-oom", test_truncate_acquired_oom, setup, tear_down, 0,
      truncate_acquired_oom_params},
+    {"/owner", test_truncate_owner, setup, tear_down, 0, NULL},
     {NULL, NULL, NULL, NULL, 0, NULL},
 };
 
@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "../../include/raft.h"
+
+#include "../../src/lz.h"
+
+#include "../lib/munit.h"
+
+/**
+ * Helpers
+ */
+
+/* Compress the given data, decompress it back and check that it matches,
+ * returning the compressed size. */
+static size_t __roundtrip(const void *src, size_t len)
+{
+    size_t cap = len + len / 255 + 16;
+    uint8_t *compressed = munit_malloc(cap);
+    uint8_t *decompressed = munit_malloc(len + 1);
+    size_t size;
+    int rv;
+
+    size = raft_lz__compress(src, len, compressed, cap);
+    munit_assert_int(size, >, 0);
+
+    rv = raft_lz__decompress(compressed, size, decompressed, len);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_memory_equal(len, decompressed, src);
+
+    free(compressed);
+    free(decompressed);
+
+    return size;
+}
+
+/**
+ *
+ * raft_lz__compress
+ *
+ */
+
+/* Repetitive text such as JSON commands shrinks considerably. */
+static MunitResult test_compress_text(const MunitParameter params[], void *data)
+{
+    char text[4096];
+    size_t len = 0;
+    size_t size;
+
+    (void)params;
+    (void)data;
+
+    while (len < sizeof text - 64) {
+        len += sprintf(text + len, "{\"op\":\"set\",\"key\":\"k%04zu\"}",
+                       len % 97);
+    }
+
+    size = __roundtrip(text, len);
+    munit_assert_int(size, <, len / 4);
+
+    return MUNIT_OK;
+}
+
+/* Long runs of the same byte are encoded with overlapping matches. */
+static MunitResult test_compress_run(const MunitParameter params[], void *data)
+{
+    uint8_t buf[1000];
+    size_t size;
+
+    (void)params;
+    (void)data;
+
+    memset(buf, 'x', sizeof buf);
+
+    size = __roundtrip(buf, sizeof buf);
+    munit_assert_int(size, <, 16);
+
+    return MUNIT_OK;
+}
+
+/* Inputs too small to have any match are stored as literals. */
+static MunitResult test_compress_small(const MunitParameter params[],
+                                       void *data)
+{
+    uint8_t buf[16];
+    size_t len;
+
+    (void)params;
+    (void)data;
+
+    memset(buf, 'a', sizeof buf);
+
+    for (len = 0; len <= sizeof buf; len++) {
+        __roundtrip(buf, len);
+    }
+
+    return MUNIT_OK;
+}
+
+/* Random data doesn't shrink, and doesn't fit in a buffer of its own size. */
+static MunitResult test_compress_random(const MunitParameter params[],
+                                        void *data)
+{
+    uint8_t buf[1024];
+    uint8_t compressed[1024];
+    size_t size;
+
+    (void)params;
+    (void)data;
+
+    munit_rand_memory(sizeof buf, buf);
+
+    size = raft_lz__compress(buf, sizeof buf, compressed, sizeof compressed);
+    munit_assert_int(size, ==, 0);
+
+    size = __roundtrip(buf, sizeof buf);
+    munit_assert_int(size, >=, sizeof buf);
+
+    return MUNIT_OK;
+}
+
+static MunitTest compress_tests[] = {
+    {"/text", test_compress_text, NULL, NULL, 0, NULL},
+    {"/run", test_compress_run, NULL, NULL, 0, NULL},
+    {"/small", test_compress_small, NULL, NULL, 0, NULL},
+    {"/random", test_compress_random, NULL, NULL, 0, NULL},
+    {NULL, NULL, NULL, NULL, 0, NULL},
+};
+
+/**
+ *
+ * raft_lz__decompress
+ *
+ */
+
+/* Malformed input is detected without reading or writing out of bounds. */
+static MunitResult test_decompress_malformed(const MunitParameter params[],
+                                             void *data)
+{
+    uint8_t buf[256];
+    uint8_t compressed[64];
+    uint8_t out[256];
+    size_t size;
+    size_t i;
+    int rv;
+
+    (void)params;
+    (void)data;
+
+    memset(buf, 'z', sizeof buf);
+
+    size = raft_lz__compress(buf, sizeof buf, compressed, sizeof compressed);
+    munit_assert_int(size, >, 0);
+
+    /* Wrong decompressed size. */
+    rv = raft_lz__decompress(compressed, size, out, sizeof out - 1);
+    munit_assert_int(rv, ==, RAFT_ERR_MALFORMED);
+
+    /* Truncated input. */
+    for (i = 1; i < size; i++) {
+        rv = raft_lz__decompress(compressed, i, out, sizeof out);
+        munit_assert_int(rv, ==, RAFT_ERR_MALFORMED);
+    }
+
+    /* Match before the start of the output. */
+    compressed[0] = 0x04; /* No literals, match of 8 bytes */
+    compressed[1] = 1;
+    compressed[2] = 0;
+    rv = raft_lz__decompress(compressed, 3, out, 8);
+    munit_assert_int(rv, ==, RAFT_ERR_MALFORMED);
+
+    return MUNIT_OK;
+}
+
+static MunitTest decompress_tests[] = {
+    {"/malformed", test_decompress_malformed, NULL, NULL, 0, NULL},
+    {NULL, NULL, NULL, NULL, 0, NULL},
+};
+
+/**
+ *
+ * Test suite
+ *
+ */
+
+MunitSuite raft_lz_suites[] = {
+    {"/compress", compress_tests, NULL, 1, 0},
+    {"/decompress", decompress_tests, NULL, 1, 0},
+    {NULL, NULL, NULL, 0, 0},
+};
@@ -31,7 +31,7 @@ static void __convert_to_leader(struct fixture *f)
 {
     int rv;
 
-    rv = raft_state__convert_to_candidate(&f->raft);
+    rv = raft_state__convert_to_candidate(&f->raft, false);
     munit_assert_int(rv, ==, 0);
 
     rv = raft_state__convert_to_leader(&f->raft);
@@ -61,14 +61,18 @@ static void __append_entry(struct fixture *f)
  * Complete an I/O request by popping it from the queue and releasing the
  * associated log entries.
  */
-static void __io_completed(struct fixture *f, size_t request_id)
+static void __io_completed(struct fixture *f, raft_request_id request_id)
 {
     struct raft_io_request *request;
 
     request = raft_io__queue_get(&f->raft, request_id);
 
-    raft_log__release(&f->raft.log, request->index, request->entries,
-                      request->n);
+    if (request->batch != NULL) {
+        raft_replication__release_batch(&f->raft, request->batch);
+    } else {
+        raft_log__release(&f->raft.log, request->index, request->entries,
+                          request->n);
+    }
 
     raft_io__queue_pop(&f->raft, request_id);
 
@@ -115,7 +119,7 @@ static void tear_down(void *data)
  * raft_replication__send_append_entries
  */
 
-static char *send_ae_oom_heap_fault_delay[] = {"0", "1", NULL};
+static char *send_ae_oom_heap_fault_delay[] = {"0", "1", "2", NULL};
 static char *send_ae_oom_heap_fault_repeat[] = {"1", NULL};
 
 static MunitParameterEnum send_ae_oom_params[] = {
@@ -140,7 +144,7 @@ static MunitResult test_send_ae_oom(const MunitParameter params[], void *data)
 
     /* Reset the request queue, to trigger a failure when attempting to grow
      * it. */
-    raft_free(f->raft.io_queue.requests);
+    raft_io__queue_close(&f->raft);
     f->raft.io_queue.requests = NULL;
     f->raft.io_queue.size = 0;
 
@@ -248,8 +252,111 @@ static MunitResult test_send_heartbeat_io_err(const MunitParameter params[],
     return MUNIT_OK;
 }
 
+/* Followers with the same next index share the same entries batch. */
+static MunitResult test_send_heartbeat_shared_batch(
+    const MunitParameter params[],
+    void *data)
+{
+    struct fixture *f = data;
+    struct raft_append_entries_batch *batch = NULL;
+    raft_request_id ids[2];
+    unsigned n = 0;
+    size_t i;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 3, 1, 3);
+
+    __convert_to_leader(f);
+    __append_entry(f);
+
+    raft_replication__send_heartbeat(&f->raft);
+
+    for (i = 0; i < f->raft.io_queue.size; i++) {
+        struct raft_io_request *request = &f->raft.io_queue.requests[i];
+
+        /* Skip the empty heartbeats sent upon becoming leader. */
+        if (request->type != RAFT_IO_APPEND_ENTRIES || request->n == 0) {
+            continue;
+        }
+
+        munit_assert_ptr_not_null(request->batch);
+        if (batch == NULL) {
+            batch = request->batch;
+        }
+        munit_assert_ptr_equal(request->batch, batch);
+
+        munit_assert_int(n, <, 2);
+        ids[n] = i;
+        n++;
+    }
+
+    munit_assert_int(n, ==, 2);
+    munit_assert_int(batch->refs, ==, 2);
+    munit_assert_int(batch->n, ==, 1);
+
+    __io_completed(f, ids[0]);
+    munit_assert_int(batch->refs, ==, 1);
+
+    __io_completed(f, ids[1]);
+
+    return MUNIT_OK;
+}
+
+/* If compression is enabled, the data of the shared batch is compressed. */
+static MunitResult test_send_heartbeat_compressed(const MunitParameter params[],
+                                                  void *data)
+{
+    struct fixture *f = data;
+    struct raft_append_entries_batch *batch = NULL;
+    struct raft_buffer buf;
+    size_t i;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 2, 1, 2);
+    raft_set_compression(&f->raft, true);
+
+    __convert_to_leader(f);
+
+    buf.len = 512;
+    buf.base = raft_malloc(buf.len);
+    munit_assert_ptr_not_null(buf.base);
+    memset(buf.base, 'x', buf.len);
+
+    rv = raft_log__append(&f->raft.log, 1, RAFT_LOG_COMMAND, &buf, NULL);
+    munit_assert_int(rv, ==, 0);
+
+    raft_replication__send_heartbeat(&f->raft);
+
+    for (i = 0; i < f->raft.io_queue.size; i++) {
+        struct raft_io_request *request = &f->raft.io_queue.requests[i];
+
+        if (request->type == RAFT_IO_APPEND_ENTRIES && request->n == 1) {
+            batch = request->batch;
+            break;
+        }
+    }
+
+    munit_assert_ptr_not_null(batch);
+
+    /* The batch header has the compressed flag set, and is followed by the
+     * compressed data. */
+    munit_assert_int(batch->n_iov, ==, 2);
+    munit_assert_int(((uint8_t *)batch->iov[0].iov_base)[5], ==, 1);
+    munit_assert_int(batch->iov[1].iov_len, <, buf.len / 4);
+
+    __io_completed(f, i);
+
+    return MUNIT_OK;
+}
+
 static MunitTest send_heartbeat_tests[] = {
     {"/io-err", test_send_heartbeat_io_err, setup, tear_down, 0, NULL},
+    {"/shared-batch", test_send_heartbeat_shared_batch, setup, tear_down, 0,
+     NULL},
+    {"/compressed", test_send_heartbeat_compressed, setup, tear_down, 0, NULL},
     {NULL, NULL, NULL, NULL, 0, NULL},
 };
 
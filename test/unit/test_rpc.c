@@ -114,6 +114,8 @@ static MunitResult test_refuse_vote_if_higher_term(
     args.candidate_id = server->id;
     args.last_log_index = 1;
     args.last_log_term = 1;
+    args.pre_vote = false;
+    args.disrupt_leader = false;
 
     rv = raft_handle_request_vote(&f->raft, server, &args);
     munit_assert_int(rv, ==, 0);
@@ -155,6 +157,8 @@ static MunitResult test_refuse_if_has_leader(const MunitParameter params[],
     args.candidate_id = 3;
     args.last_log_index = 1;
     args.last_log_term = 1;
+    args.pre_vote = false;
+    args.disrupt_leader = false;
 
     rv = raft_handle_request_vote(&f->raft, server, &args);
     munit_assert_int(rv, ==, 0);
@@ -168,6 +172,125 @@ static MunitResult test_refuse_if_has_leader(const MunitParameter params[],
     return MUNIT_OK;
 }
 
+/* A vote request sent upon a leadership transfer is processed even if the
+ * server has a leader. */
+static MunitResult test_grant_if_disrupt_leader(const MunitParameter params[],
+                                                void *data)
+{
+    struct fixture *f = data;
+    const struct raft_server *server;
+    struct raft_request_vote_args args;
+    struct test_io_request event;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 3, 1, 3);
+
+    server = raft_configuration__get(&f->raft.configuration, 3);
+
+    test_receive_heartbeat(&f->raft, 2);
+    munit_assert_ptr_not_null(f->raft.follower_state.current_leader);
+
+    args.term = f->raft.current_term + 1;
+    args.candidate_id = 3;
+    args.last_log_index = 1;
+    args.last_log_term = 1;
+    args.pre_vote = false;
+    args.disrupt_leader = true;
+
+    rv = raft_handle_request_vote(&f->raft, server, &args);
+    munit_assert_int(rv, ==, 0);
+
+    test_io_get_one_request(&f->io, RAFT_IO_REQUEST_VOTE_RESULT, &event);
+    munit_assert_int(event.request_vote_response.result.term, ==, 2);
+    munit_assert_true(event.request_vote_response.result.vote_granted);
+
+    munit_assert_int(f->raft.current_term, ==, 2);
+    munit_assert_int(f->raft.voted_for, ==, 3);
+
+    return MUNIT_OK;
+}
+
+/* A pre-vote is granted without changing our term or vote. */
+static MunitResult test_grant_pre_vote(const MunitParameter params[],
+                                       void *data)
+{
+    struct fixture *f = data;
+    const struct raft_server *server;
+    struct raft_request_vote_args args;
+    struct test_io_request event;
+    unsigned n;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 2, 1, 2);
+
+    n = test_io_get_n_metadata_writes(&f->io);
+
+    server = raft_configuration__get(&f->raft.configuration, 2);
+
+    args.term = 2;
+    args.candidate_id = 2;
+    args.last_log_index = 1;
+    args.last_log_term = 1;
+    args.pre_vote = true;
+    args.disrupt_leader = false;
+
+    rv = raft_handle_request_vote(&f->raft, server, &args);
+    munit_assert_int(rv, ==, 0);
+
+    test_io_get_one_request(&f->io, RAFT_IO_REQUEST_VOTE_RESULT, &event);
+    munit_assert_int(event.request_vote_response.result.term, ==, 2);
+    munit_assert_true(event.request_vote_response.result.vote_granted);
+    munit_assert_true(event.request_vote_response.result.pre_vote);
+
+    munit_assert_int(test_io_get_n_metadata_writes(&f->io), ==, n);
+    munit_assert_int(f->raft.current_term, ==, 1);
+    munit_assert_int(f->raft.voted_for, ==, 0);
+
+    return MUNIT_OK;
+}
+
+/* A leader rejects pre-votes and doesn't step down. */
+static MunitResult test_refuse_pre_vote_if_leader(const MunitParameter params[],
+                                                  void *data)
+{
+    struct fixture *f = data;
+    const struct raft_server *server;
+    struct raft_request_vote_args args;
+    struct test_io_request event;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 3, 1, 3);
+    test_become_leader(&f->raft);
+    test_io_flush(&f->io);
+
+    server = raft_configuration__get(&f->raft.configuration, 3);
+
+    args.term = f->raft.current_term + 1;
+    args.candidate_id = 3;
+    args.last_log_index = 1;
+    args.last_log_term = 1;
+    args.pre_vote = true;
+    args.disrupt_leader = false;
+
+    rv = raft_handle_request_vote(&f->raft, server, &args);
+    munit_assert_int(rv, ==, 0);
+
+    test_io_get_one_request(&f->io, RAFT_IO_REQUEST_VOTE_RESULT, &event);
+    munit_assert_int(event.request_vote_response.result.term, ==, 2);
+    munit_assert_false(event.request_vote_response.result.vote_granted);
+
+    munit_assert_int(f->raft.state, ==, RAFT_STATE_LEADER);
+    munit_assert_int(f->raft.current_term, ==, 2);
+
+    return MUNIT_OK;
+}
+
 /* If we are not a voting server, the vote is not granted. */
 static MunitResult test_refuse_if_non_voting(const MunitParameter params[],
                                              void *data)
@@ -188,6 +311,8 @@ static MunitResult test_refuse_if_non_voting(const MunitParameter params[],
     args.candidate_id = server->id;
     args.last_log_index = raft_log__last_index(&f->raft.log);
     args.last_log_term = raft_log__last_term(&f->raft.log);
+    args.pre_vote = false;
+    args.disrupt_leader = false;
 
     rv = raft_handle_request_vote(&f->raft, server, &args);
     munit_assert_int(rv, ==, 0);
@@ -225,6 +350,8 @@ static MunitResult test_refuse_if_already_voted(const MunitParameter params[],
     args1.candidate_id = server1->id;
     args1.last_log_index = raft_log__last_index(&f->raft.log);
     args1.last_log_term = raft_log__last_term(&f->raft.log);
+    args1.pre_vote = false;
+    args1.disrupt_leader = false;
 
     rv = raft_handle_request_vote(&f->raft, server1, &args1);
     munit_assert_int(rv, ==, 0);
@@ -238,6 +365,8 @@ static MunitResult test_refuse_if_already_voted(const MunitParameter params[],
     args2.candidate_id = server2->id;
     args1.last_log_index = raft_log__last_index(&f->raft.log);
     args1.last_log_term = raft_log__last_term(&f->raft.log);
+    args2.pre_vote = false;
+    args2.disrupt_leader = false;
 
     rv = raft_handle_request_vote(&f->raft, server2, &args2);
     munit_assert_int(rv, ==, 0);
@@ -273,6 +402,8 @@ static MunitResult test_duplicate_vote(const MunitParameter params[],
     args.candidate_id = server->id;
     args.last_log_index = raft_log__last_index(&f->raft.log);
     args.last_log_term = raft_log__last_term(&f->raft.log);
+    args.pre_vote = false;
+    args.disrupt_leader = false;
 
     rv = raft_handle_request_vote(&f->raft, server, &args);
     munit_assert_int(rv, ==, 0);
@@ -286,6 +417,8 @@ static MunitResult test_duplicate_vote(const MunitParameter params[],
     args.candidate_id = server->id;
     args.last_log_index = raft_log__last_index(&f->raft.log);
     args.last_log_term = raft_log__last_term(&f->raft.log);
+    args.pre_vote = false;
+    args.disrupt_leader = false;
 
     rv = raft_handle_request_vote(&f->raft, server, &args);
     munit_assert_int(rv, ==, 0);
@@ -323,6 +456,8 @@ static MunitResult test_grant_if_empty_log(const MunitParameter params[],
     args.candidate_id = server->id;
     args.last_log_index = 1;
     args.last_log_term = 1;
+    args.pre_vote = false;
+    args.disrupt_leader = false;
 
     rv = raft_handle_request_vote(&f->raft, server, &args);
     munit_assert_int(rv, ==, 0);
@@ -336,6 +471,106 @@ static MunitResult test_grant_if_empty_log(const MunitParameter params[],
     return MUNIT_OK;
 }
 
+/* If the request has a higher term and the vote is granted, the new term and
+ * the vote are persisted with a single write. */
+static MunitResult test_higher_term_single_write(const MunitParameter params[],
+                                                 void *data)
+{
+    struct fixture *f = data;
+    const struct raft_server *server;
+    struct raft_request_vote_args args;
+    struct test_io_request event;
+    unsigned n;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 2, 1, 2);
+
+    n = test_io_get_n_metadata_writes(&f->io);
+
+    server = raft_configuration__get(&f->raft.configuration, 2);
+
+    args.term = 2;
+    args.candidate_id = server->id;
+    args.last_log_index = 1;
+    args.last_log_term = 1;
+    args.pre_vote = false;
+    args.disrupt_leader = false;
+
+    rv = raft_handle_request_vote(&f->raft, server, &args);
+    munit_assert_int(rv, ==, 0);
+
+    test_io_get_one_request(&f->io, RAFT_IO_REQUEST_VOTE_RESULT, &event);
+    munit_assert_int(event.request_vote_response.result.term, ==, 2);
+    munit_assert_true(event.request_vote_response.result.vote_granted);
+
+    munit_assert_int(test_io_get_n_metadata_writes(&f->io), ==, n + 1);
+    munit_assert_int(test_io_get_term(&f->io), ==, 2);
+    munit_assert_int(test_io_get_vote(&f->io), ==, 2);
+
+    munit_assert_int(f->raft.current_term, ==, 2);
+    munit_assert_int(f->raft.voted_for, ==, 2);
+
+    return MUNIT_OK;
+}
+
+/* With I/O implementations of version 3, the vote is granted only once the
+ * asynchronous write of the new term and vote has completed. */
+static MunitResult test_higher_term_async_write(const MunitParameter params[],
+                                                void *data)
+{
+    struct fixture *f = data;
+    const struct raft_server *server;
+    struct raft_request_vote_args args;
+    struct test_io_request *requests;
+    struct test_io_request event;
+    size_t n;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 2, 1, 2);
+
+    f->io.version = 3;
+
+    server = raft_configuration__get(&f->raft.configuration, 2);
+
+    args.term = 2;
+    args.candidate_id = server->id;
+    args.last_log_index = 1;
+    args.last_log_term = 1;
+    args.pre_vote = false;
+    args.disrupt_leader = false;
+
+    rv = raft_handle_request_vote(&f->raft, server, &args);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->raft.current_term, ==, 2);
+    munit_assert_int(f->raft.voted_for, ==, 2);
+
+    /* No reply is sent yet. */
+    test_io_get_requests(&f->io, RAFT_IO_REQUEST_VOTE_RESULT, &requests, &n);
+    munit_assert_int(n, ==, 0);
+    if (requests != NULL) {
+        free(requests);
+    }
+
+    test_io_get_one_request(&f->io, RAFT_IO_WRITE_METADATA, &event);
+    munit_assert_int(event.write_metadata.term, ==, 2);
+    munit_assert_int(event.write_metadata.voted_for, ==, 2);
+
+    test_io_flush(&f->io);
+
+    raft_handle_io(&f->raft, event.id, 0);
+
+    test_io_get_one_request(&f->io, RAFT_IO_REQUEST_VOTE_RESULT, &event);
+    munit_assert_int(event.request_vote_response.result.term, ==, 2);
+    munit_assert_true(event.request_vote_response.result.vote_granted);
+
+    return MUNIT_OK;
+}
+
 /* If the requester last log entry term is lower than ours, the vote is not
    granted. */
 static MunitResult test_last_term_lower(const MunitParameter params[],
@@ -357,6 +592,8 @@ static MunitResult test_last_term_lower(const MunitParameter params[],
     args.candidate_id = 2;
     args.last_log_index = 0;
     args.last_log_term = 0;
+    args.pre_vote = false;
+    args.disrupt_leader = false;
 
     rv = raft_handle_request_vote(&f->raft, server, &args);
     munit_assert_int(rv, ==, 0);
@@ -400,6 +637,8 @@ static MunitResult test_last_term_higher(const MunitParameter params[],
     args.candidate_id = 2;
     args.last_log_index = 2;
     args.last_log_term = 2;
+    args.pre_vote = false;
+    args.disrupt_leader = false;
 
     rv = raft_handle_request_vote(&f->raft, server, &args);
     munit_assert_int(rv, ==, 0);
@@ -444,6 +683,8 @@ static MunitResult test_last_idx_higher(const MunitParameter params[],
     args.candidate_id = 2;
     args.last_log_index = 2;
     args.last_log_term = 1;
+    args.pre_vote = false;
+    args.disrupt_leader = false;
 
     rv = raft_handle_request_vote(&f->raft, server, &args);
     munit_assert_int(rv, ==, 0);
@@ -478,6 +719,8 @@ static MunitResult test_last_idx_same_index(const MunitParameter params[],
     args.candidate_id = 2;
     args.last_log_index = 1;
     args.last_log_term = 1;
+    args.pre_vote = false;
+    args.disrupt_leader = false;
 
     rv = raft_handle_request_vote(&f->raft, server, &args);
     munit_assert_int(rv, ==, 0);
@@ -535,6 +778,8 @@ static MunitResult test_last_idx_lower_index(const MunitParameter params[],
     args.candidate_id = 2;
     args.last_log_index = 1;
     args.last_log_term = 1;
+    args.pre_vote = false;
+    args.disrupt_leader = false;
 
     rv = raft_handle_request_vote(&f->raft, server, &args);
     munit_assert_int(rv, ==, 0);
@@ -551,7 +796,14 @@ static MunitResult test_last_idx_lower_index(const MunitParameter params[],
 static MunitTest request_vote_tests[] = {
     {"/higher", test_refuse_vote_if_higher_term, setup, tear_down, 0, NULL},
     {"/has-leader", test_refuse_if_has_leader, setup, tear_down, 0, NULL},
+    {"/disrupt-leader", test_grant_if_disrupt_leader, setup, tear_down, 0,
+     NULL},
     {"/empty-log", test_grant_if_empty_log, setup, tear_down, 0, NULL},
+    {"/single-write", test_higher_term_single_write, setup, tear_down, 0, NULL},
+    {"/async-write", test_higher_term_async_write, setup, tear_down, 0, NULL},
+    {"/pre-vote", test_grant_pre_vote, setup, tear_down, 0, NULL},
+    {"/pre-vote-leader", test_refuse_pre_vote_if_leader, setup, tear_down, 0,
+     NULL},
     {"/non-voting", test_refuse_if_non_voting, setup, tear_down, 0, NULL},
     {"/already-voted", test_refuse_if_already_voted, setup, tear_down, 0, NULL},
     {"/duplicate-vote", test_duplicate_vote, setup, tear_down, 0, NULL},
@@ -589,6 +841,7 @@ static MunitResult test_votes_quorum_reached(const MunitParameter params[],
     server = raft_configuration__get(&f->raft.configuration, 2);
     result.term = 2;
     result.vote_granted = 1;
+    result.pre_vote = false;
 
     rv = raft_handle_request_vote_response(&f->raft, server, &result);
     munit_assert_int(rv, ==, 0);
@@ -641,6 +894,7 @@ static MunitResult test_votes_quorum_not_reached(const MunitParameter params[],
     server = raft_configuration__get(&f->raft.configuration, 2);
     result.term = 2;
     result.vote_granted = 1;
+    result.pre_vote = false;
 
     rv = raft_handle_request_vote_response(&f->raft, server, &result);
     munit_assert_int(rv, ==, 0);
@@ -667,6 +921,7 @@ static MunitResult test_not_candidate(const MunitParameter params[], void *data)
     server = raft_configuration__get(&f->raft.configuration, 2);
     result.term = 2;
     result.vote_granted = 1;
+    result.pre_vote = false;
 
     rv = raft_handle_request_vote_response(&f->raft, server, &result);
     munit_assert_int(rv, ==, 0);
@@ -695,6 +950,7 @@ static MunitResult test_rv_response_step_down(const MunitParameter params[],
     server = raft_configuration__get(&f->raft.configuration, 2);
     result.term = 3;
     result.vote_granted = 0;
+    result.pre_vote = false;
 
     rv = raft_handle_request_vote_response(&f->raft, server, &result);
     munit_assert_int(rv, ==, 0);
@@ -742,6 +998,7 @@ static MunitResult test_vote_not_granted(const MunitParameter params[],
     server = raft_configuration__get(&f->raft.configuration, 2);
     result.term = 2;
     result.vote_granted = 0;
+    result.pre_vote = false;
 
     rv = raft_handle_request_vote_response(&f->raft, server, &result);
     munit_assert_int(rv, ==, 0);
@@ -761,6 +1018,98 @@ static MunitTest request_vote_response_tests[] = {
     {NULL, NULL, NULL, NULL, 0, NULL},
 };
 
+/**
+ * raft_handle_timeout_now
+ */
+
+/* A follower whose log matches the leader's starts an election right away,
+ * skipping the Pre-Vote phase, and asks the other servers to disregard the
+ * current leader. */
+static MunitResult test_timeout_now_start_election(
+    const MunitParameter params[],
+    void *data)
+{
+    struct fixture *f = data;
+    const struct raft_server *server;
+    struct raft_timeout_now_args args;
+    struct test_io_request *requests;
+    size_t n;
+    size_t i;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 3, 1, 3);
+    raft_set_pre_vote(&f->raft, true);
+
+    test_receive_heartbeat(&f->raft, 2);
+    test_io_flush(&f->io);
+
+    server = raft_configuration__get(&f->raft.configuration, 2);
+
+    args.term = 1;
+    args.leader_id = 2;
+    args.last_log_index = 1;
+    args.last_log_term = 1;
+
+    rv = raft_handle_timeout_now(&f->raft, server, &args);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->raft.state, ==, RAFT_STATE_CANDIDATE);
+    munit_assert_int(f->raft.current_term, ==, 2);
+
+    test_io_get_requests(&f->io, RAFT_IO_REQUEST_VOTE, &requests, &n);
+    munit_assert_int(n, ==, 2);
+
+    for (i = 0; i < n; i++) {
+        munit_assert_int(requests[i].request_vote.args.term, ==, 2);
+        munit_assert_false(requests[i].request_vote.args.pre_vote);
+        munit_assert_true(requests[i].request_vote.args.disrupt_leader);
+    }
+
+    free(requests);
+
+    return MUNIT_OK;
+}
+
+/* A follower whose log doesn't match the leader's ignores the request. */
+static MunitResult test_timeout_now_log_mismatch(
+    const MunitParameter params[],
+    void *data)
+{
+    struct fixture *f = data;
+    const struct raft_server *server;
+    struct raft_timeout_now_args args;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 3, 1, 3);
+
+    server = raft_configuration__get(&f->raft.configuration, 2);
+
+    args.term = 1;
+    args.leader_id = 2;
+    args.last_log_index = 2;
+    args.last_log_term = 1;
+
+    rv = raft_handle_timeout_now(&f->raft, server, &args);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->raft.state, ==, RAFT_STATE_FOLLOWER);
+    munit_assert_int(f->raft.current_term, ==, 1);
+
+    return MUNIT_OK;
+}
+
+static MunitTest timeout_now_tests[] = {
+    {"/start-election", test_timeout_now_start_election, setup, tear_down, 0,
+     NULL},
+    {"/log-mismatch", test_timeout_now_log_mismatch, setup, tear_down, 0,
+     NULL},
+    {NULL, NULL, NULL, NULL, 0, NULL},
+};
+
 /**
  * raft_handle_append_entries
  */
@@ -889,26 +1238,35 @@ static MunitResult test_ae_candidate_step_down(const MunitParameter params[],
     return MUNIT_OK;
 }
 
-/* If server's log is shorter than prevLogIndex, the request is rejected . */
-static MunitResult test_missing_log_entries(const MunitParameter params[],
-                                            void *data)
+/* A candidate in the Pre-Vote phase stepping down keeps the vote it cast in
+ * the current term. */
+static MunitResult test_ae_pre_vote_step_down(const MunitParameter params[],
+                                              void *data)
 {
     struct fixture *f = data;
     const struct raft_server *server;
     struct raft_append_entries_args args;
-    struct raft_append_entries_result result;
-    struct test_io_request event;
     int rv;
 
     (void)params;
 
-    test_bootstrap_and_load(&f->raft, 2, 1, 2);
+    test_io_bootstrap(&f->io, 3, 1, 3);
+    test_io_write_term_and_vote(&f->io, 2, 3);
+    test_load(&f->raft);
+    raft_set_pre_vote(&f->raft, true);
 
-    server = raft_configuration__get(&f->raft.configuration, 2);
+    /* Start the Pre-Vote phase, which doesn't touch the term or the vote. */
+    rv = raft_tick(&f->raft, f->raft.election_timeout_rand + 100);
+    munit_assert_int(rv, ==, 0);
 
-    args.term = 1;
+    munit_assert_int(f->raft.state, ==, RAFT_STATE_CANDIDATE);
+    munit_assert_true(f->raft.candidate_state.in_pre_vote);
+
+    server = raft_configuration__get(&f->raft.configuration, 3);
+
+    args.term = 2;
     args.leader_id = server->id;
-    args.prev_log_index = 2;
+    args.prev_log_index = 1;
     args.prev_log_term = 1;
     args.entries = NULL;
     args.n = 0;
@@ -917,23 +1275,18 @@ static MunitResult test_missing_log_entries(const MunitParameter params[],
     rv = raft_handle_append_entries(&f->raft, server, &args);
     munit_assert_int(rv, ==, 0);
 
-    /* The request is unsuccessful */
-    test_io_get_one_request(&f->io, RAFT_IO_APPEND_ENTRIES_RESULT,
-                            &event);
+    munit_assert_int(f->raft.state, ==, RAFT_STATE_FOLLOWER);
 
-    result = event.append_entries_response.result;
-    munit_assert_int(result.term, ==, 1);
-    munit_assert_false(result.success);
-    munit_assert_int(result.last_log_index, ==, 1);
+    munit_assert_int(f->raft.voted_for, ==, 3);
+    munit_assert_int(test_io_get_term(&f->io), ==, 2);
+    munit_assert_int(test_io_get_vote(&f->io), ==, 3);
 
     return MUNIT_OK;
 }
 
-/* If the term of the last log entry on the server is different from the one
- * prevLogTerm, and value of prevLogIndex is lower or equal than server's commit
- * index, then an error is returned . */
-static MunitResult test_prev_index_conflict(const MunitParameter params[],
-                                            void *data)
+/* A candidate stepping down keeps its vote for itself. */
+static MunitResult test_ae_candidate_keep_vote(const MunitParameter params[],
+                                               void *data)
 {
     struct fixture *f = data;
     const struct raft_server *server;
@@ -942,7 +1295,91 @@ static MunitResult test_prev_index_conflict(const MunitParameter params[],
 
     (void)params;
 
-    test_bootstrap_and_load(&f->raft, 2, 1, 2);
+    test_bootstrap_and_load(&f->raft, 3, 1, 3);
+
+    /* Become candidate in term 2, voting for ourselves. */
+    rv = raft_tick(&f->raft, f->raft.election_timeout_rand + 100);
+    munit_assert_int(rv, ==, 0);
+    test_io_flush(&f->io);
+
+    munit_assert_int(test_io_get_vote(&f->io), ==, 1);
+
+    server = raft_configuration__get(&f->raft.configuration, 2);
+
+    args.term = 2;
+    args.leader_id = server->id;
+    args.prev_log_index = 1;
+    args.prev_log_term = 1;
+    args.entries = NULL;
+    args.n = 0;
+    args.leader_commit = 1;
+
+    rv = raft_handle_append_entries(&f->raft, server, &args);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->raft.state, ==, RAFT_STATE_FOLLOWER);
+
+    munit_assert_int(f->raft.voted_for, ==, 1);
+    munit_assert_int(test_io_get_term(&f->io), ==, 2);
+    munit_assert_int(test_io_get_vote(&f->io), ==, 1);
+
+    return MUNIT_OK;
+}
+
+/* If server's log is shorter than prevLogIndex, the request is rejected . */
+static MunitResult test_missing_log_entries(const MunitParameter params[],
+                                            void *data)
+{
+    struct fixture *f = data;
+    const struct raft_server *server;
+    struct raft_append_entries_args args;
+    struct raft_append_entries_result result;
+    struct test_io_request event;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 2, 1, 2);
+
+    server = raft_configuration__get(&f->raft.configuration, 2);
+
+    args.term = 1;
+    args.leader_id = server->id;
+    args.prev_log_index = 2;
+    args.prev_log_term = 1;
+    args.entries = NULL;
+    args.n = 0;
+    args.leader_commit = 1;
+
+    rv = raft_handle_append_entries(&f->raft, server, &args);
+    munit_assert_int(rv, ==, 0);
+
+    /* The request is unsuccessful */
+    test_io_get_one_request(&f->io, RAFT_IO_APPEND_ENTRIES_RESULT,
+                            &event);
+
+    result = event.append_entries_response.result;
+    munit_assert_int(result.term, ==, 1);
+    munit_assert_false(result.success);
+    munit_assert_int(result.last_log_index, ==, 1);
+
+    return MUNIT_OK;
+}
+
+/* If the term of the last log entry on the server is different from the one
+ * prevLogTerm, and value of prevLogIndex is lower or equal than server's commit
+ * index, then an error is returned . */
+static MunitResult test_prev_index_conflict(const MunitParameter params[],
+                                            void *data)
+{
+    struct fixture *f = data;
+    const struct raft_server *server;
+    struct raft_append_entries_args args;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 2, 1, 2);
 
     server = raft_configuration__get(&f->raft.configuration, 2);
 
@@ -1138,6 +1575,76 @@ static MunitResult test_skip_entries_already_appended(
     return MUNIT_OK;
 }
 
+/* When the entries array lives at the start of the batch memory, entries that
+ * are already in the log are skipped in place, and the array is released along
+ * with the batch. */
+static MunitResult test_skip_entries_inline(const MunitParameter params[],
+                                           void *data)
+{
+    struct fixture *f = data;
+    struct raft_entry *entries = raft_malloc(2 * sizeof *entries + 16);
+    uint8_t *buf1 = raft_malloc(1);
+    const struct raft_server *leader;
+    struct raft_append_entries_args args;
+    struct test_io_request request;
+    uint8_t *batch = (uint8_t *)entries;
+    unsigned i;
+    int rv;
+
+    (void)params;
+
+    munit_assert_ptr_not_null(entries);
+    munit_assert_ptr_not_null(buf1);
+
+    *buf1 = 1;
+
+    test_bootstrap_and_load(&f->raft, 2, 1, 2);
+
+    for (i = 0; i < 2; i++) {
+        entries[i].type = RAFT_LOG_COMMAND;
+        entries[i].term = 1;
+        entries[i].buf.base = batch + 2 * sizeof *entries + 8 * i;
+        entries[i].buf.len = 1;
+        entries[i].batch = batch;
+        *(uint8_t *)entries[i].buf.base = i + 1;
+    }
+
+    /* Append the first entry to our log, with its own buffer. */
+    entries[0].buf.base = buf1;
+    test_io_write_entry(f->raft.io, &entries[0]);
+    rv = raft_log__append(&f->raft.log, 1, RAFT_LOG_COMMAND, &entries[0].buf,
+                          NULL);
+    munit_assert_int(rv, ==, 0);
+
+    leader = raft_configuration__get(&f->raft.configuration, 2);
+
+    args.term = 1;
+    args.leader_id = leader->id;
+    args.prev_log_index = 1;
+    args.prev_log_term = 1;
+    args.entries = entries;
+    args.n = 2;
+    args.leader_commit = 1;
+
+    rv = raft_handle_append_entries(&f->raft, leader, &args);
+    munit_assert_int(rv, ==, 0);
+
+    /* The write request uses the received array, shifted. */
+    test_io_get_one_request(&f->io, RAFT_IO_WRITE_LOG, &request);
+
+    munit_assert_int(request.write_log.n, ==, 1);
+    munit_assert_int(*(uint8_t *)request.write_log.entries[0].buf.base, ==, 2);
+    munit_assert_ptr_equal(f->raft.io_queue.requests[0].entries, entries);
+    munit_assert_ptr_equal(entries[0].batch, batch);
+
+    test_io_flush(f->raft.io);
+    raft_handle_io(&f->raft, 0, 0);
+
+    munit_assert_int(raft_log__n_entries(&f->raft.log), ==, 3);
+
+    return MUNIT_OK;
+}
+
 /* A write log request is submitted for outstanding log entries. If some entries
  * are already existing in the log but they have a different term, they will be
  * replaced. */
@@ -1252,12 +1759,14 @@ static MunitResult test_committed_index_conflict(const MunitParameter params[],
     /* Include two new entries with a different term in the request */
     entries[0].type = RAFT_LOG_COMMAND;
     entries[0].term = 2;
-    entries[0].buf.base = &buf2;
+    entries[0].buf.base = buf2;
     entries[0].buf.len = 1;
+    entries[0].batch = buf2;
     entries[1].type = RAFT_LOG_COMMAND;
     entries[1].term = 2;
-    entries[1].buf.base = &buf3;
+    entries[1].buf.base = buf3;
     entries[1].buf.len = 1;
+    entries[1].batch = buf3;
 
     server = raft_configuration__get(&f->raft.configuration, 2);
 
@@ -1269,14 +1778,241 @@ static MunitResult test_committed_index_conflict(const MunitParameter params[],
     args.n = 2;
     args.leader_commit = 1;
 
-    /* We return a shutdown error. */
+    /* We return a shutdown error, releasing the entries anyway. */
     rv = raft_handle_append_entries(&f->raft, server, &args);
     munit_assert_int(rv, ==, RAFT_ERR_SHUTDOWN);
 
-    /* TODO: should the code itself perform this cleanup? */
-    raft_free(buf2);
-    raft_free(buf3);
-    raft_free(entries);
+    return MUNIT_OK;
+}
+
+/* Receive from server 2 a configuration entry at index 2 that adds server 3 as
+ * learner, and complete its write. */
+static void __receive_configuration(struct fixture *f)
+{
+    struct raft_configuration configuration;
+    const struct raft_server *leader;
+    struct raft_append_entries_args args;
+    struct test_io_request request;
+    int rv;
+
+    raft_configuration_init(&configuration);
+
+    rv = raft_configuration_add(&configuration, 1, "1", true);
+    munit_assert_int(rv, ==, 0);
+    rv = raft_configuration_add(&configuration, 2, "2", true);
+    munit_assert_int(rv, ==, 0);
+    rv = raft_configuration_add(&configuration, 3, "3", false);
+    munit_assert_int(rv, ==, 0);
+
+    args.entries = raft_malloc(sizeof *args.entries);
+    args.entries[0].type = RAFT_LOG_CONFIGURATION;
+    args.entries[0].term = 1;
+    args.entries[0].batch = NULL;
+
+    rv = raft_encode_configuration(&configuration, &args.entries[0].buf);
+    munit_assert_int(rv, ==, 0);
+
+    raft_configuration_close(&configuration);
+
+    leader = raft_configuration__get(&f->raft.configuration, 2);
+
+    args.term = 1;
+    args.leader_id = 2;
+    args.prev_log_index = 1;
+    args.prev_log_term = 1;
+    args.n = 1;
+    args.leader_commit = 1;
+    args.checksum = 0;
+    args.compressed = 0;
+    args.batch = NULL;
+
+    rv = raft_handle_append_entries(&f->raft, leader, &args);
+    munit_assert_int(rv, ==, 0);
+
+    test_io_get_one_request(&f->io, RAFT_IO_WRITE_LOG, &request);
+    test_io_flush(f->raft.io);
+    raft_handle_io(&f->raft, request.id, 0);
+    test_io_flush(f->raft.io);
+}
+
+/* A configuration entry takes effect as soon as it's appended to the log. */
+static MunitResult test_apply_configuration(const MunitParameter params[],
+                                            void *data)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 2, 1, 2);
+
+    __receive_configuration(f);
+
+    munit_assert_int(f->raft.configuration.n, ==, 3);
+    munit_assert_int(f->raft.configuration.servers[2].id, ==, 3);
+    munit_assert_false(f->raft.configuration.servers[2].voting);
+    munit_assert_int(f->raft.configuration_index, ==, 2);
+
+    munit_assert_int(f->raft.configuration_prev.n, ==, 2);
+
+    munit_assert_int(f->raft.follower_state.current_leader->id, ==, 2);
+    munit_assert_ptr_equal(f->raft.follower_state.current_leader,
+                           &f->raft.configuration.servers[1]);
+
+    return MUNIT_OK;
+}
+
+/* If the entry of the configuration in use gets truncated, the configuration
+ * of the last entry left in the log is used again. */
+static MunitResult test_truncate_configuration(const MunitParameter params[],
+                                               void *data)
+{
+    struct fixture *f = data;
+    struct raft_entry *entries = raft_malloc(sizeof *entries);
+    const struct raft_server *leader;
+    struct raft_append_entries_args args;
+    struct test_io_request request;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 2, 1, 2);
+
+    __receive_configuration(f);
+
+    entries[0].type = RAFT_LOG_COMMAND;
+    entries[0].term = 2;
+    entries[0].buf.base = raft_malloc(1);
+    entries[0].buf.len = 1;
+    entries[0].batch = NULL;
+
+    leader = raft_configuration__get(&f->raft.configuration, 2);
+
+    args.term = 2;
+    args.leader_id = 2;
+    args.prev_log_index = 1;
+    args.prev_log_term = 1;
+    args.entries = entries;
+    args.n = 1;
+    args.leader_commit = 1;
+    args.checksum = 0;
+    args.compressed = 0;
+    args.batch = NULL;
+
+    rv = raft_handle_append_entries(&f->raft, leader, &args);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->raft.configuration.n, ==, 2);
+    munit_assert_int(f->raft.configuration_index, ==, 1);
+
+    test_io_get_one_request(&f->io, RAFT_IO_WRITE_LOG, &request);
+    test_io_flush(f->raft.io);
+    raft_handle_io(&f->raft, request.id, 0);
+
+    return MUNIT_OK;
+}
+
+/* Followers adapt their election and heartbeat timeouts to the interval
+ * between consecutive heartbeats from the same leader. */
+static MunitResult test_ae_adaptive_timeouts(const MunitParameter params[],
+                                             void *data)
+{
+    struct fixture *f = data;
+    struct test_io_request request;
+    const struct raft_server *server;
+    struct raft_append_entries_args args;
+    struct raft_entry *entries;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 3, 1, 3);
+
+    /* Enabling adaptation clamps the current timeouts into the bounds. */
+    raft_set_adaptive_timeouts(&f->raft, 100, 500);
+
+    munit_assert_int(f->raft.election_timeout, ==, 500);
+    munit_assert_int(f->raft.heartbeat_timeout, ==, 50);
+    munit_assert_int(f->raft.election_timeout_rand, <, 1000);
+
+    server = raft_configuration__get(&f->raft.configuration, 2);
+
+    args.term = 2;
+    args.leader_id = server->id;
+    args.prev_log_index = 1;
+    args.prev_log_term = 1;
+    args.entries = NULL;
+    args.n = 0;
+    args.leader_commit = 1;
+
+    /* The first heartbeat from a new leader is not measured. */
+    rv = raft_tick(&f->raft, 5);
+    munit_assert_int(rv, ==, 0);
+
+    rv = raft_handle_append_entries(&f->raft, server, &args);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->raft.election_timeout, ==, 500);
+
+    /* The next one arrives 30 milliseconds later, and the randomized election
+     * timeout is drawn again from the new one. */
+    rv = raft_tick(&f->raft, 30);
+    munit_assert_int(rv, ==, 0);
+
+    rv = raft_handle_append_entries(&f->raft, server, &args);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->raft.election_timeout, ==, 300);
+    munit_assert_int(f->raft.heartbeat_timeout, ==, 30);
+    munit_assert_int(f->raft.election_timeout_rand, <, 600);
+
+    /* A heartbeat following a request carrying entries is not measured. */
+    entries = raft_malloc(sizeof *entries);
+    munit_assert_ptr_not_null(entries);
+
+    entries[0].term = 2;
+    entries[0].type = RAFT_LOG_COMMAND;
+    entries[0].buf.base = NULL;
+    entries[0].buf.len = 0;
+    entries[0].batch = entries;
+
+    args.entries = entries;
+    args.n = 1;
+
+    rv = raft_tick(&f->raft, 2);
+    munit_assert_int(rv, ==, 0);
+
+    rv = raft_handle_append_entries(&f->raft, server, &args);
+    munit_assert_int(rv, ==, 0);
+
+    test_io_get_one_request(&f->io, RAFT_IO_WRITE_LOG, &request);
+    test_io_flush(f->raft.io);
+    raft_handle_io(&f->raft, request.id, 0);
+
+    args.prev_log_index = 2;
+    args.prev_log_term = 2;
+    args.entries = NULL;
+    args.n = 0;
+
+    rv = raft_tick(&f->raft, 2);
+    munit_assert_int(rv, ==, 0);
+
+    rv = raft_handle_append_entries(&f->raft, server, &args);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->raft.election_timeout, ==, 300);
+
+    /* A leader change is not measured either. */
+    server = raft_configuration__get(&f->raft.configuration, 3);
+    args.term = 3;
+    args.leader_id = server->id;
+
+    rv = raft_tick(&f->raft, 2);
+    munit_assert_int(rv, ==, 0);
+
+    rv = raft_handle_append_entries(&f->raft, server, &args);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->raft.election_timeout, ==, 300);
 
     return MUNIT_OK;
 }
@@ -1285,13 +2021,23 @@ static MunitTest append_entries_tests[] = {
     {"/stale-term", test_ae_stale_term, setup, tear_down, 0, NULL},
     {"/higher-term", test_ae_higher_term, setup, tear_down, 0, NULL},
     {"/same-term", test_ae_candidate_step_down, setup, tear_down, 0, NULL},
+    {"/pre-vote-step-down", test_ae_pre_vote_step_down, setup, tear_down, 0,
+     NULL},
+    {"/candidate-keep-vote", test_ae_candidate_keep_vote, setup, tear_down, 0,
+     NULL},
     {"/missing-entries", test_missing_log_entries, setup, tear_down, 0, NULL},
     {"/prev-conflict", test_prev_index_conflict, setup, tear_down, 0, NULL},
     {"/mismatch", test_prev_log_term_mismatch, setup, tear_down, 0, NULL},
     {"/write-log", test_submit_write_log_io_request, setup, tear_down, 0, NULL},
     {"/skip", test_skip_entries_already_appended, setup, tear_down, 0, NULL},
+    {"/skip-inline", test_skip_entries_inline, setup, tear_down, 0, NULL},
     {"/truncate", test_truncate_local_log, setup, tear_down, 0, NULL},
     {"/conflict", test_committed_index_conflict, setup, tear_down, 0, NULL},
+    {"/configuration", test_apply_configuration, setup, tear_down, 0, NULL},
+    {"/truncate-configuration", test_truncate_configuration, setup, tear_down,
+     0, NULL},
+    {"/adaptive-timeouts", test_ae_adaptive_timeouts, setup, tear_down, 0,
+     NULL},
     {NULL, NULL, NULL, NULL, 0, NULL},
 };
 
@@ -1348,6 +2094,7 @@ static MunitResult test_ae_response_ignore(const MunitParameter params[],
     server = raft_configuration__get(&f->raft.configuration, 2);
     request_vote_result.term = 2;
     request_vote_result.vote_granted = 1;
+    request_vote_result.pre_vote = false;
 
     rv = raft_handle_request_vote_response(&f->raft, server,
                                            &request_vote_result);
@@ -1392,6 +2139,7 @@ static MunitResult test_ae_response_step_down(const MunitParameter params[],
     server = raft_configuration__get(&f->raft.configuration, 2);
     request_vote_result.term = 2;
     request_vote_result.vote_granted = 1;
+    request_vote_result.pre_vote = false;
 
     rv = raft_handle_request_vote_response(&f->raft, server,
                                            &request_vote_result);
@@ -1439,6 +2187,7 @@ static MunitResult test_retry_upon_log_mismatch(const MunitParameter params[],
     server = raft_configuration__get(&f->raft.configuration, 2);
     request_vote_result.term = 2;
     request_vote_result.vote_granted = 1;
+    request_vote_result.pre_vote = false;
 
     rv = raft_handle_request_vote_response(&f->raft, server,
                                            &request_vote_result);
@@ -1474,6 +2223,9 @@ static MunitResult test_commit_if_quorum_replicated(
 {
     struct fixture *f = data;
     struct test_io_request request;
+    struct test_io_request *requests;
+    size_t n;
+    size_t i;
     struct raft_buffer buf;
     const struct raft_server *server;
     struct raft_request_vote_result request_vote_result;
@@ -1493,6 +2245,7 @@ static MunitResult test_commit_if_quorum_replicated(
     server = raft_configuration__get(&f->raft.configuration, 2);
     request_vote_result.term = 2;
     request_vote_result.vote_granted = 1;
+    request_vote_result.pre_vote = false;
 
     rv = raft_handle_request_vote_response(&f->raft, server,
                                            &request_vote_result);
@@ -1513,11 +2266,15 @@ static MunitResult test_commit_if_quorum_replicated(
     munit_assert_int(rv, ==, 0);
 
     test_io_get_one_request(f->raft.io, RAFT_IO_WRITE_LOG, &request);
+    test_io_get_requests(f->raft.io, RAFT_IO_APPEND_ENTRIES, &requests, &n);
     test_io_flush(f->raft.io);
 
-    raft_handle_io(&f->raft, 0, 0);
-    raft_handle_io(&f->raft, 1, 0);
-    raft_handle_io(&f->raft, 2, 0);
+    /* Request slots have been reused, so their IDs changed. */
+    raft_handle_io(&f->raft, request.id, 0);
+    for (i = 0; i < n; i++) {
+        raft_handle_io(&f->raft, requests[i].id, 0);
+    }
+    free(requests);
 
     /* Receive a successful append entries response reporting that the peer
      * has replicated that entry. */
@@ -1534,12 +2291,368 @@ static MunitResult test_commit_if_quorum_replicated(
     return MUNIT_OK;
 }
 
+/* Accept a new entry as leader, completing the write and the sends. */
+static void __accept_entry(struct fixture *f)
+{
+    struct test_io_request request;
+    struct test_io_request *requests;
+    struct raft_buffer buf;
+    size_t n;
+    size_t i;
+    int rv;
+
+    buf.base = NULL;
+    buf.len = 0;
+
+    rv = raft_accept(&f->raft, &buf, 1);
+    munit_assert_int(rv, ==, 0);
+
+    test_io_get_one_request(f->raft.io, RAFT_IO_WRITE_LOG, &request);
+    test_io_get_requests(f->raft.io, RAFT_IO_APPEND_ENTRIES, &requests, &n);
+    test_io_flush(f->raft.io);
+
+    raft_handle_io(&f->raft, request.id, 0);
+    for (i = 0; i < n; i++) {
+        raft_handle_io(&f->raft, requests[i].id, 0);
+    }
+    free(requests);
+}
+
+/* The round-trip time of AppendEntries requests carrying new entries drives the
+ * election and heartbeat timeouts, within the configured bounds. */
+static MunitResult test_ae_response_adaptive_timeouts(
+    const MunitParameter params[],
+    void *data)
+{
+    struct fixture *f = data;
+    const struct raft_server *server;
+    struct raft_append_entries_result result;
+    size_t i;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+
+    raft_set_adaptive_timeouts(&f->raft, 100, 2000);
+
+    server = raft_configuration__get(&f->raft.configuration, 2);
+    i = raft_configuration__index(&f->raft.configuration, 2);
+
+    result.term = 2;
+    result.success = true;
+    result.last_log_index = 1;
+
+    /* The heartbeats sent upon election are the first requests of this leader,
+     * so they are timed. Get a result 30 milliseconds later. */
+    rv = raft_tick(&f->raft, 30);
+    munit_assert_int(rv, ==, 0);
+
+    rv = raft_handle_append_entries_response(&f->raft, server, &result);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->raft.leader_state.rtt[i].rtt8, ==, 240);
+    munit_assert_int(f->raft.election_timeout, ==, 300);
+    munit_assert_int(f->raft.heartbeat_timeout, ==, 30);
+
+    /* Further results are not measured, nor are the ones of heartbeats that
+     * could answer any of the earlier requests. */
+    rv = raft_handle_append_entries_response(&f->raft, server, &result);
+    munit_assert_int(rv, ==, 0);
+
+    rv = raft_tick(&f->raft, f->raft.heartbeat_timeout + 1);
+    munit_assert_int(rv, ==, 0);
+    test_io_flush(&f->io);
+
+    rv = raft_tick(&f->raft, 2);
+    munit_assert_int(rv, ==, 0);
+
+    rv = raft_handle_append_entries_response(&f->raft, server, &result);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->raft.leader_state.rtt[i].rtt8, ==, 240);
+
+    /* A request carrying a new entry is timed, and a much faster round trip
+     * only moves the average by an eighth. */
+    __accept_entry(f);
+
+    rv = raft_tick(&f->raft, 2);
+    munit_assert_int(rv, ==, 0);
+
+    result.last_log_index = 2;
+    rv = raft_handle_append_entries_response(&f->raft, server, &result);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->raft.leader_state.rtt[i].rtt8, ==, 240 - 30 + 2);
+    munit_assert_int(f->raft.election_timeout, ==, 265);
+
+    /* The election timeout doesn't go below its lower bound. */
+    raft_set_adaptive_timeouts(&f->raft, 500, 2000);
+
+    munit_assert_int(f->raft.election_timeout, ==, 500);
+    munit_assert_int(f->raft.heartbeat_timeout, ==, 50);
+
+    __accept_entry(f);
+
+    rv = raft_tick(&f->raft, 2);
+    munit_assert_int(rv, ==, 0);
+
+    result.last_log_index = 3;
+    rv = raft_handle_append_entries_response(&f->raft, server, &result);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->raft.election_timeout, ==, 500);
+    munit_assert_int(f->raft.heartbeat_timeout, ==, 50);
+
+    return MUNIT_OK;
+}
+
 static MunitTest append_entries_response_tests[] = {
     {"/not-leader", test_not_leader, setup, tear_down, 0, NULL},
     {"/ignore", test_ae_response_ignore, setup, tear_down, 0, NULL},
     {"/step-down", test_ae_response_step_down, setup, tear_down, 0, NULL},
     {"/retry", test_retry_upon_log_mismatch, setup, tear_down, 0, NULL},
     {"/commit", test_commit_if_quorum_replicated, setup, tear_down, 0, NULL},
+    {"/adaptive-timeouts", test_ae_response_adaptive_timeouts, setup,
+     tear_down, 0, NULL},
+    {NULL, NULL, NULL, NULL, 0, NULL},
+};
+
+/**
+ * raft_handle_messages
+ */
+
+/* Fill the given message with an AppendEntries request from server 2 carrying
+ * @n entries of term 1 after the given index, whose data lives in a single
+ * batch as if it had been decoded. */
+static void __fill_append_entries(struct raft_message *message,
+                                  raft_index prev_log_index,
+                                  unsigned n)
+{
+    struct raft_append_entries_args *args = &message->append_entries;
+    uint8_t *batch;
+    unsigned i;
+
+    message->type = RAFT_IO_APPEND_ENTRIES;
+    message->version = RAFT_ENCODING_V1;
+
+    args->term = 1;
+    args->leader_id = 2;
+    args->prev_log_index = prev_log_index;
+    args->prev_log_term = 1;
+    args->leader_commit = 1;
+    args->entries = NULL;
+    args->n = n;
+    args->checksum = 0;
+    args->compressed = 0;
+    args->batch = NULL;
+
+    if (n == 0) {
+        return;
+    }
+
+    args->entries = raft_malloc(n * sizeof *args->entries);
+    munit_assert_ptr_not_null(args->entries);
+
+    batch = raft_malloc(n * 8);
+    munit_assert_ptr_not_null(batch);
+
+    for (i = 0; i < n; i++) {
+        struct raft_entry *entry = &args->entries[i];
+
+        entry->term = 1;
+        entry->type = RAFT_LOG_COMMAND;
+        entry->buf.base = batch + i * 8;
+        entry->buf.len = 8;
+        entry->batch = batch;
+    }
+}
+
+/* Contiguous AppendEntries requests from the leader are appended with a single
+ * write, and acknowledged with a single result. */
+static MunitResult test_handle_messages_merge(const MunitParameter params[],
+                                              void *data)
+{
+    struct fixture *f = data;
+    const struct raft_server *servers[3];
+    struct raft_message messages[3];
+    struct test_io_request *requests;
+    size_t n;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 2, 1, 2);
+
+    servers[0] = raft_configuration__get(&f->raft.configuration, 2);
+    servers[1] = servers[0];
+    servers[2] = servers[0];
+
+    __fill_append_entries(&messages[0], 1, 2);
+    __fill_append_entries(&messages[1], 3, 1);
+    __fill_append_entries(&messages[2], 4, 0);
+
+    rv = raft_handle_messages(&f->raft, servers, messages, 3);
+    munit_assert_int(rv, ==, 0);
+
+    /* A single write request has been submitted, with all entries. */
+    test_io_get_requests(&f->io, RAFT_IO_WRITE_LOG, &requests, &n);
+    munit_assert_int(n, ==, 1);
+    munit_assert_int(requests[0].write_log.n, ==, 3);
+
+    test_io_flush(f->raft.io);
+    raft_handle_io(&f->raft, requests[0].id, 0);
+    free(requests);
+
+    munit_assert_int(raft_log__last_index(&f->raft.log), ==, 4);
+
+    /* The leader gets a single result, covering all entries. */
+    test_io_get_requests(&f->io, RAFT_IO_APPEND_ENTRIES_RESULT, &requests, &n);
+    munit_assert_int(n, ==, 1);
+    munit_assert_true(requests[0].append_entries_response.result.success);
+    munit_assert_int(
+        requests[0].append_entries_response.result.last_log_index, ==, 4);
+    free(requests);
+
+    return MUNIT_OK;
+}
+
+/* If a run of contiguous AppendEntries requests starts with one whose entries
+ * are all in the log already, only the remaining ones are written, and the
+ * batch of the skipped entries is released. */
+static MunitResult test_handle_messages_merge_skip(
+    const MunitParameter params[],
+    void *data)
+{
+    struct fixture *f = data;
+    const struct raft_server *servers[2];
+    struct raft_message messages[2];
+    struct test_io_request request;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 2, 1, 2);
+
+    servers[0] = raft_configuration__get(&f->raft.configuration, 2);
+    servers[1] = servers[0];
+
+    __fill_append_entries(&messages[0], 1, 2);
+
+    rv = raft_handle_messages(&f->raft, servers, messages, 1);
+    munit_assert_int(rv, ==, 0);
+
+    test_io_get_one_request(&f->io, RAFT_IO_WRITE_LOG, &request);
+    test_io_flush(f->raft.io);
+    raft_handle_io(&f->raft, request.id, 0);
+
+    /* The leader retransmits the same entries, followed by a new one. */
+    __fill_append_entries(&messages[0], 1, 2);
+    __fill_append_entries(&messages[1], 3, 1);
+
+    rv = raft_handle_messages(&f->raft, servers, messages, 2);
+    munit_assert_int(rv, ==, 0);
+
+    test_io_get_one_request(&f->io, RAFT_IO_WRITE_LOG, &request);
+    munit_assert_int(request.write_log.n, ==, 1);
+
+    test_io_flush(f->raft.io);
+    raft_handle_io(&f->raft, request.id, 0);
+
+    munit_assert_int(raft_log__last_index(&f->raft.log), ==, 4);
+
+    return MUNIT_OK;
+}
+
+/* Only the result of the last of a run of heartbeats from the same leader is
+ * sent. */
+static MunitResult test_handle_messages_heartbeats(
+    const MunitParameter params[],
+    void *data)
+{
+    struct fixture *f = data;
+    const struct raft_server *servers[3];
+    struct raft_message messages[3];
+    struct test_io_request request;
+    unsigned i;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 2, 1, 2);
+
+    for (i = 0; i < 3; i++) {
+        servers[i] = raft_configuration__get(&f->raft.configuration, 2);
+        __fill_append_entries(&messages[i], 1, 0);
+    }
+    messages[2].append_entries.term = 2;
+
+    rv = raft_handle_messages(&f->raft, servers, messages, 3);
+    munit_assert_int(rv, ==, 0);
+
+    test_io_get_one_request(&f->io, RAFT_IO_APPEND_ENTRIES_RESULT, &request);
+    munit_assert_true(request.append_entries_response.result.success);
+    munit_assert_int(request.append_entries_response.result.term, ==, 2);
+
+    return MUNIT_OK;
+}
+
+/* If the write of a run of merged AppendEntries requests fails, the entries of
+ * the whole run and of the requests following it are released, including the
+ * ones already in the log. */
+static MunitResult test_handle_messages_merge_io_error(
+    const MunitParameter params[],
+    void *data)
+{
+    struct fixture *f = data;
+    const struct raft_server *servers[4];
+    struct raft_message messages[4];
+    struct test_io_request request;
+    unsigned i;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 2, 1, 2);
+
+    for (i = 0; i < 4; i++) {
+        servers[i] = raft_configuration__get(&f->raft.configuration, 2);
+    }
+
+    __fill_append_entries(&messages[0], 1, 2);
+
+    rv = raft_handle_messages(&f->raft, servers, messages, 1);
+    munit_assert_int(rv, ==, 0);
+
+    test_io_get_one_request(&f->io, RAFT_IO_WRITE_LOG, &request);
+    test_io_flush(f->raft.io);
+    raft_handle_io(&f->raft, request.id, 0);
+
+    /* The first request of the run has a batch holding both entries that we
+     * have already and a new one, and the last request can't be merged. */
+    __fill_append_entries(&messages[0], 1, 3);
+    __fill_append_entries(&messages[1], 4, 1);
+    __fill_append_entries(&messages[2], 5, 1);
+    __fill_append_entries(&messages[3], 10, 1);
+
+    test_io_fault(&f->io, 0, 1);
+
+    rv = raft_handle_messages(&f->raft, servers, messages, 4);
+    munit_assert_int(rv, ==, RAFT_ERR_SHUTDOWN);
+
+    munit_assert_int(raft_log__last_index(&f->raft.log), ==, 3);
+
+    return MUNIT_OK;
+}
+
+static MunitTest handle_messages_tests[] = {
+    {"/merge", test_handle_messages_merge, setup, tear_down, 0, NULL},
+    {"/merge-skip", test_handle_messages_merge_skip, setup, tear_down, 0,
+     NULL},
+    {"/merge-io-error", test_handle_messages_merge_io_error, setup, tear_down,
+     0, NULL},
+    {"/heartbeats", test_handle_messages_heartbeats, setup, tear_down, 0, NULL},
     {NULL, NULL, NULL, NULL, 0, NULL},
 };
 
@@ -1549,7 +2662,9 @@ static MunitTest append_entries_response_tests[] = {
 MunitSuite raft_rpc_suites[] = {
     {"/request-vote", request_vote_tests, NULL, 1, 0},
     {"/request-vote-response", request_vote_response_tests, NULL, 1, 0},
+    {"/timeout-now", timeout_now_tests, NULL, 1, 0},
     {"/append-entries", append_entries_tests, NULL, 1, 0},
     {"/append_entries_response", append_entries_response_tests, NULL, 1, 0},
+    {"/handle-messages", handle_messages_tests, NULL, 1, 0},
     {NULL, NULL, NULL, 0, 0},
 };
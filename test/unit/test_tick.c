@@ -283,6 +283,7 @@ static MunitResult test_heartbeat_timeout_elapsed(const MunitParameter params[],
     server = raft_configuration__get(&f->raft.configuration, 2);
     result.term = 2;
     result.vote_granted = 1;
+    result.pre_vote = false;
 
     rv = raft_handle_request_vote_response(&f->raft, server, &result);
     munit_assert_int(rv, ==, 0);
@@ -335,6 +336,7 @@ static MunitResult test_heartbeat_timeout_not_elapsed(
     server = raft_configuration__get(&f->raft.configuration, 2);
     result.term = 2;
     result.vote_granted = 1;
+    result.pre_vote = false;
 
     rv = raft_handle_request_vote_response(&f->raft, server, &result);
     munit_assert_int(rv, ==, 0);
@@ -355,6 +357,77 @@ static MunitResult test_heartbeat_timeout_not_elapsed(
     return MUNIT_OK;
 }
 
+/* With CheckQuorum enabled, a leader that doesn't hear from a majority of the
+ * cluster within an election timeout steps down, without changing its term. */
+static MunitResult test_leader_check_quorum_lost(const MunitParameter params[],
+                                                 void *data)
+{
+    struct fixture *f = data;
+    unsigned n;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 3, 1, 3);
+    raft_set_check_quorum(&f->raft, true);
+    test_become_leader(&f->raft);
+    test_io_flush(f->raft.io);
+
+    n = test_io_get_n_metadata_writes(&f->io);
+
+    rv = raft_tick(&f->raft, f->raft.election_timeout);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(f->raft.state, ==, RAFT_STATE_LEADER);
+    test_io_flush(f->raft.io);
+
+    rv = raft_tick(&f->raft, 1);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(f->raft.state, ==, RAFT_STATE_FOLLOWER);
+
+    munit_assert_int(f->raft.current_term, ==, 2);
+    munit_assert_int(test_io_get_n_metadata_writes(&f->io), ==, n);
+
+    return MUNIT_OK;
+}
+
+/* A leader that keeps hearing from a majority stays in charge. */
+static MunitResult test_leader_check_quorum_kept(const MunitParameter params[],
+                                                 void *data)
+{
+    struct fixture *f = data;
+    const struct raft_server *server;
+    struct raft_append_entries_result result;
+    int i;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_load(&f->raft, 3, 1, 3);
+    raft_set_check_quorum(&f->raft, true);
+    test_become_leader(&f->raft);
+    test_io_flush(f->raft.io);
+
+    server = raft_configuration__get(&f->raft.configuration, 2);
+
+    result.term = f->raft.current_term;
+    result.success = true;
+    result.last_log_index = 1;
+
+    for (i = 0; i < 5; i++) {
+        rv = raft_tick(&f->raft, f->raft.election_timeout / 2);
+        munit_assert_int(rv, ==, 0);
+        test_io_flush(f->raft.io);
+
+        rv = raft_handle_append_entries_response(&f->raft, server, &result);
+        munit_assert_int(rv, ==, 0);
+        test_io_flush(f->raft.io);
+    }
+
+    munit_assert_int(f->raft.state, ==, RAFT_STATE_LEADER);
+
+    return MUNIT_OK;
+}
+
 /* If we're candidate and the election timeout has elapsed, start a new
  * election. */
 static MunitResult test_candidate_new_election(const MunitParameter params[],
@@ -498,6 +571,10 @@ static MunitTest tick_tests[] = {
      tear_down, 0, NULL},
     {"/leader-heartbeat-timeout-not-elapsed",
      test_heartbeat_timeout_not_elapsed, setup, tear_down, 0, NULL},
+    {"/leader-check-quorum-lost", test_leader_check_quorum_lost, setup,
+     tear_down, 0, NULL},
+    {"/leader-check-quorum-kept", test_leader_check_quorum_kept, setup,
+     tear_down, 0, NULL},
     {"/candidate-new-election", test_candidate_new_election, setup, tear_down,
      0, NULL},
     {"/candidate_election-timer-not-expired",